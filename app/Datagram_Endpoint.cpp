@@ -0,0 +1,238 @@
+#include "Datagram_Endpoint.h"
+#include <iostream>
+#include <array>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+const size_t Datagram_Endpoint::MAX_BATCH_SIZE;
+
+static const int SOCKET_BUFFER_SIZE = 1024 * 1024;
+
+//////////////////////////////////////////////////////////////////////////////
+
+static bool resolve_udp_address(std::string const& address, bool passive, sockaddr_storage& dst, socklen_t& dst_size)
+{
+    std::string host;
+    std::string port = address;
+    size_t colon = address.rfind(':');
+    if (colon != std::string::npos)
+    {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    if (host.empty() && !passive)
+    {
+        host = "127.0.0.1";
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    addrinfo* result = nullptr;
+    int res = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+    if (res != 0 || !result)
+    {
+        std::cerr << "Cannot resolve '" << address << "': " << gai_strerror(res) << "\n";
+        return false;
+    }
+    memcpy(&dst, result->ai_addr, result->ai_addrlen);
+    dst_size = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static bool make_unix_address(std::string const& path, sockaddr_storage& dst, socklen_t& dst_size)
+{
+    sockaddr_un& addr = *reinterpret_cast<sockaddr_un*>(&dst);
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Invalid unix socket path '" << path << "'\n";
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    dst_size = sizeof(addr);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Datagram_Endpoint::~Datagram_Endpoint()
+{
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        if (m_type == Type::UNIX && m_direction == Direction::IN)
+        {
+            ::unlink(m_address.c_str());
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Datagram_Endpoint::init(Type type, Direction direction, std::string const& address)
+{
+    if (m_fd >= 0)
+    {
+        std::cerr << "Already initialized\n";
+        return false;
+    }
+
+    m_type = type;
+    m_direction = direction;
+    m_address = address;
+
+    sockaddr_storage addr;
+    socklen_t addr_size = 0;
+    memset(&addr, 0, sizeof(addr));
+    if (type == Type::UDP)
+    {
+        if (!resolve_udp_address(address, direction == Direction::IN, addr, addr_size))
+        {
+            return false;
+        }
+    }
+    else if (!make_unix_address(address, addr, addr_size))
+    {
+        return false;
+    }
+
+    int fd = ::socket(type == Type::UDP ? AF_INET : AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        std::cerr << "Cannot create socket for '" << address << "': " << strerror(errno) << "\n";
+        return false;
+    }
+
+    //bigger buffers absorb the bursts, best effort
+    int buffer_size = SOCKET_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, direction == Direction::IN ? SO_RCVBUF : SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    if (direction == Direction::IN)
+    {
+        if (type == Type::UNIX)
+        {
+            ::unlink(address.c_str()); //left over from a previous run
+        }
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), addr_size) < 0)
+        {
+            std::cerr << "Cannot bind to '" << address << "': " << strerror(errno) << "\n";
+            ::close(fd);
+            return false;
+        }
+    }
+    else
+    {
+        //not connected so the receiver can come and go
+        m_destination = addr;
+        m_destination_size = addr_size;
+    }
+
+    m_fd = fd;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+int Datagram_Endpoint::get_fd() const
+{
+    return m_fd;
+}
+
+std::string const& Datagram_Endpoint::get_address() const
+{
+    return m_address;
+}
+
+size_t Datagram_Endpoint::get_dropped_count() const
+{
+    return m_dropped_count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Datagram_Endpoint::receive_batch(iovec* packets, size_t count)
+{
+    if (m_fd < 0 || !packets)
+    {
+        return 0;
+    }
+
+    std::array<mmsghdr, MAX_BATCH_SIZE> msgs;
+    count = std::min(count, MAX_BATCH_SIZE);
+    for (size_t i = 0; i < count; i++)
+    {
+        memset(&msgs[i], 0, sizeof(mmsghdr));
+        msgs[i].msg_hdr.msg_iov = &packets[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int res = recvmmsg(m_fd, msgs.data(), count, MSG_DONTWAIT, nullptr);
+    if (res <= 0)
+    {
+        if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            std::cerr << "Cannot receive from '" << m_address << "': " << strerror(errno) << "\n";
+        }
+        return 0;
+    }
+
+    //keep only the good packets, at the front
+    size_t valid = 0;
+    for (size_t i = 0; i < static_cast<size_t>(res); i++)
+    {
+        if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || msgs[i].msg_len == 0)
+        {
+            m_dropped_count++;
+            continue;
+        }
+        std::swap(packets[valid].iov_base, packets[i].iov_base);
+        packets[valid].iov_len = msgs[i].msg_len;
+        valid++;
+    }
+    return valid;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Datagram_Endpoint::send_batch(iovec const* packets, size_t count)
+{
+    if (m_fd < 0 || !packets)
+    {
+        return 0;
+    }
+
+    std::array<mmsghdr, MAX_BATCH_SIZE> msgs;
+    size_t sent = 0;
+    while (sent < count)
+    {
+        size_t batch = std::min(count - sent, MAX_BATCH_SIZE);
+        for (size_t i = 0; i < batch; i++)
+        {
+            memset(&msgs[i], 0, sizeof(mmsghdr));
+            msgs[i].msg_hdr.msg_name = &m_destination;
+            msgs[i].msg_hdr.msg_namelen = m_destination_size;
+            msgs[i].msg_hdr.msg_iov = const_cast<iovec*>(&packets[sent + i]);
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int res = sendmmsg(m_fd, msgs.data(), batch, MSG_DONTWAIT);
+        if (res <= 0)
+        {
+            //full socket, or nobody listening (ECONNREFUSED, ENOENT for unix sockets). Datagrams are dropped in both cases
+            break;
+        }
+        sent += res;
+    }
+    m_dropped_count += count - sent;
+    return sent;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+//UDP or unix datagram socket used to get packets in and out of the app while keeping the packet boundaries.
+//Packets are moved in batches with recvmmsg/sendmmsg and the socket is non blocking, so it can go in an epoll loop.
+class Datagram_Endpoint
+{
+public:
+    Datagram_Endpoint() = default;
+    ~Datagram_Endpoint();
+
+    Datagram_Endpoint(Datagram_Endpoint const&) = delete;
+    Datagram_Endpoint& operator=(Datagram_Endpoint const&) = delete;
+
+    enum class Type
+    {
+        UDP,
+        UNIX,
+    };
+    enum class Direction
+    {
+        IN,  //receives from other local processes
+        OUT, //sends to another local process
+    };
+
+    //UDP in: "PORT" or "ADDRESS:PORT" to bind to
+    //UDP out: "ADDRESS:PORT" to send to
+    //Unix in: the socket path to create. It's removed when the endpoint is destroyed
+    //Unix out: the socket path to send to. It doesn't have to exist yet, packets are dropped until it does
+    bool init(Type type, Direction direction, std::string const& address);
+
+    int get_fd() const;
+    std::string const& get_address() const;
+
+    static const size_t MAX_BATCH_SIZE = 16;
+
+    //Receives up to count datagrams in the caller buffers. The iov_len fields are the buffer sizes on input and the
+    // packet sizes on output. Returns the number of packets received. Truncated and empty datagrams are skipped.
+    size_t receive_batch(iovec* packets, size_t count);
+
+    //Sends the packets and returns how many were sent. The rest are dropped as the socket is full or the
+    // receiver is not there.
+    size_t send_batch(iovec const* packets, size_t count);
+
+    size_t get_dropped_count() const;
+
+private:
+    Type m_type = Type::UDP;
+    Direction m_direction = Direction::IN;
+    std::string m_address;
+    int m_fd = -1;
+
+    sockaddr_storage m_destination;
+    socklen_t m_destination_size = 0;
+
+    size_t m_dropped_count = 0;
+};
@@ -0,0 +1,306 @@
+#include "Phy_Benchmark.h"
+#include "Histogram.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <array>
+#include <memory>
+#include <poll.h>
+
+typedef std::chrono::steady_clock Clock;
+
+namespace
+{
+
+struct Link_Result
+{
+    size_t spi_speed = 0;
+    size_t spi_delay = 0;
+    uint32_t transfer_p50 = 0;
+    uint32_t transfer_p99 = 0;
+    uint32_t transfer_max = 0;
+    uint32_t command_p50 = 0;
+    uint32_t command_p99 = 0;
+    uint32_t command_max = 0;
+    size_t command_failures = 0;
+};
+
+struct Throughput_Result
+{
+    size_t spi_speed = 0;
+    size_t spi_delay = 0;
+    Phy::Rate rate = Phy::Rate::RATE_B_1M_CCK;
+    bool use_fec = false;
+    bool rate_set = false;
+    double tx_mbps = 0;
+    double tx_pps = 0;
+    double rx_mbps = 0;
+    double rx_pps = 0;
+    size_t rx_dropped = 0;
+};
+
+static const size_t BATCH_SIZE = 16;
+
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void measure_commands(Phy& phy, Phy_Benchmark_Config const& config, Link_Result& result)
+{
+    Histogram histogram;
+    for (size_t i = 0; i < config.command_samples; i++)
+    {
+        Phy::Rate rate;
+        Clock::time_point start_tp = Clock::now();
+        if (!phy.get_rate(rate))
+        {
+            result.command_failures++;
+            continue;
+        }
+        histogram.add(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start_tp).count()));
+    }
+    result.command_p50 = histogram.get_percentile(0.5f);
+    result.command_p99 = histogram.get_percentile(0.99f);
+    result.command_max = histogram.get_max();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void measure_throughput(Phy& phy, Phy_Benchmark_Config const& config, Throughput_Result& result)
+{
+    std::vector<uint8_t> tx_data(config.mtu);
+    for (size_t i = 0; i < tx_data.size(); i++)
+    {
+        tx_data[i] = static_cast<uint8_t>(i);
+    }
+    std::array<iovec, BATCH_SIZE> tx_packets;
+    for (iovec& packet: tx_packets)
+    {
+        packet.iov_base = tx_data.data();
+        packet.iov_len = tx_data.size();
+    }
+
+    std::vector<std::array<uint8_t, Phy::MAX_PAYLOAD_SIZE>> rx_data(BATCH_SIZE);
+    std::array<Phy::RX_Batch_Packet, BATCH_SIZE> rx_packets;
+    for (size_t i = 0; i < BATCH_SIZE; i++)
+    {
+        rx_packets[i].data = rx_data[i].data();
+    }
+
+    //fill the TX ring first so what's measured is how fast it drains, not how fast it fills up
+    while (phy.send_batch(tx_packets.data(), tx_packets.size(), result.use_fec) > 0)
+    {
+    }
+    while (phy.receive_batch(rx_packets.data(), rx_packets.size()) > 0)
+    {
+    }
+
+    size_t rx_dropped_start = phy.get_rx_packets_dropped();
+    size_t tx_count = 0;
+    size_t rx_count = 0;
+    size_t rx_bytes = 0;
+
+    pollfd tx_event;
+    tx_event.fd = phy.get_tx_event_fd();
+    tx_event.events = POLLIN;
+
+    Clock::time_point start_tp = Clock::now();
+    Clock::time_point now = start_tp;
+    while (now - start_tp < config.duration)
+    {
+        phy.clear_tx_event();
+        size_t sent = phy.send_batch(tx_packets.data(), tx_packets.size(), result.use_fec);
+        tx_count += sent;
+
+        size_t received = 0;
+        do
+        {
+            received = phy.receive_batch(rx_packets.data(), rx_packets.size());
+            rx_count += received;
+            for (size_t i = 0; i < received; i++)
+            {
+                rx_bytes += rx_packets[i].size;
+            }
+        } while (received > 0);
+
+        if (sent == 0)
+        {
+            poll(&tx_event, 1, 1);
+        }
+        now = Clock::now();
+    }
+
+    double seconds = std::chrono::duration<double>(now - start_tp).count();
+    result.tx_pps = tx_count / seconds;
+    result.tx_mbps = tx_count * config.mtu * 8.0 / seconds / 1000000.0;
+    result.rx_pps = rx_count / seconds;
+    result.rx_mbps = rx_bytes * 8.0 / seconds / 1000000.0;
+    result.rx_dropped = phy.get_rx_packets_dropped() - rx_dropped_start;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void print_table(std::vector<Link_Result> const& links, std::vector<Throughput_Result> const& throughputs)
+{
+    std::cout << "\nSPI link (us)\n";
+    std::cout << std::setw(10) << "speed" << std::setw(7) << "delay"
+              << std::setw(10) << "xfer p50" << std::setw(10) << "xfer p99" << std::setw(10) << "xfer max"
+              << std::setw(10) << "cmd p50" << std::setw(10) << "cmd p99" << std::setw(10) << "cmd max"
+              << std::setw(10) << "cmd fail" << "\n";
+    for (Link_Result const& r: links)
+    {
+        std::cout << std::setw(10) << r.spi_speed << std::setw(7) << r.spi_delay
+                  << std::setw(10) << r.transfer_p50 << std::setw(10) << r.transfer_p99 << std::setw(10) << r.transfer_max
+                  << std::setw(10) << r.command_p50 << std::setw(10) << r.command_p99 << std::setw(10) << r.command_max
+                  << std::setw(10) << r.command_failures << "\n";
+    }
+
+    std::cout << "\nThroughput\n";
+    std::cout << std::setw(10) << "speed" << std::setw(7) << "delay" << std::setw(6) << "rate" << std::setw(5) << "fec"
+              << std::setw(10) << "TX Mbps" << std::setw(10) << "TX pps"
+              << std::setw(10) << "RX Mbps" << std::setw(10) << "RX pps" << std::setw(10) << "RX drop" << "\n";
+    std::cout << std::fixed << std::setprecision(2);
+    for (Throughput_Result const& r: throughputs)
+    {
+        std::cout << std::setw(10) << r.spi_speed << std::setw(7) << r.spi_delay
+                  << std::setw(6) << static_cast<int>(r.rate) << std::setw(5) << (r.use_fec ? "yes" : "no");
+        if (!r.rate_set)
+        {
+            std::cout << "  cannot set the rate\n";
+            continue;
+        }
+        std::cout << std::setw(10) << r.tx_mbps << std::setw(10) << r.tx_pps
+                  << std::setw(10) << r.rx_mbps << std::setw(10) << r.rx_pps << std::setw(10) << r.rx_dropped << "\n";
+    }
+    std::cout.unsetf(std::ios_base::floatfield);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static std::string to_json(Phy_Benchmark_Config const& config, std::vector<Link_Result> const& links, std::vector<Throughput_Result> const& throughputs)
+{
+    std::ostringstream json;
+    json << "{\n  \"mtu\": " << config.mtu
+         << ",\n  \"duration_ms\": " << config.duration.count()
+         << ",\n  \"fec_coding_k\": " << config.fec_coding_k
+         << ",\n  \"fec_coding_n\": " << config.fec_coding_n
+         << ",\n  \"links\": [";
+    for (size_t i = 0; i < links.size(); i++)
+    {
+        Link_Result const& r = links[i];
+        json << (i > 0 ? "," : "") << "\n    {"
+             << "\"spi_speed\": " << r.spi_speed
+             << ", \"spi_delay\": " << r.spi_delay
+             << ", \"transfer_us\": {\"p50\": " << r.transfer_p50 << ", \"p99\": " << r.transfer_p99 << ", \"max\": " << r.transfer_max << "}"
+             << ", \"command_us\": {\"p50\": " << r.command_p50 << ", \"p99\": " << r.command_p99 << ", \"max\": " << r.command_max << "}"
+             << ", \"command_failures\": " << r.command_failures
+             << "}";
+    }
+    json << "\n  ],\n  \"throughput\": [";
+    for (size_t i = 0; i < throughputs.size(); i++)
+    {
+        Throughput_Result const& r = throughputs[i];
+        json << (i > 0 ? "," : "") << "\n    {"
+             << "\"spi_speed\": " << r.spi_speed
+             << ", \"spi_delay\": " << r.spi_delay
+             << ", \"rate\": " << static_cast<int>(r.rate)
+             << ", \"fec\": " << (r.use_fec ? "true" : "false")
+             << ", \"rate_set\": " << (r.rate_set ? "true" : "false")
+             << ", \"tx_mbps\": " << r.tx_mbps
+             << ", \"tx_pps\": " << r.tx_pps
+             << ", \"rx_mbps\": " << r.rx_mbps
+             << ", \"rx_pps\": " << r.rx_pps
+             << ", \"rx_dropped\": " << r.rx_dropped
+             << "}";
+    }
+    json << "\n  ]\n}\n";
+    return json.str();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+int run_phy_benchmark(Phy_Benchmark_Config const& config, Phy_Init_Function const& init)
+{
+    if (config.spi_speeds.empty() || config.spi_delays.empty() || config.rates.empty() || config.mtu == 0 || config.mtu > Phy::MAX_PAYLOAD_SIZE)
+    {
+        std::cerr << "Invalid benchmark config\n";
+        return -1;
+    }
+
+    std::vector<Link_Result> links;
+    std::vector<Throughput_Result> throughputs;
+
+    for (size_t spi_speed: config.spi_speeds)
+    {
+        for (size_t spi_delay: config.spi_delays)
+        {
+            std::cerr << "Benchmarking SPI speed " << spi_speed << " Hz, delay " << spi_delay << " us\n";
+
+            //a new phy for every SPI setting as they can only be set at init
+            std::unique_ptr<Phy> phy(new Phy());
+            if (!init(*phy, spi_speed, spi_delay))
+            {
+                std::cerr << "Cannot initialize the phy\n";
+                return -1;
+            }
+            if (!phy->set_power(config.power) ||
+                    !phy->set_channel(config.channel) ||
+                    !phy->setup_fec_channel(config.fec_coding_k, config.fec_coding_n, config.mtu))
+            {
+                std::cerr << "Cannot setup the phy, is the module connected?\n";
+                return -1;
+            }
+
+            Link_Result link;
+            link.spi_speed = spi_speed;
+            link.spi_delay = spi_delay;
+            measure_commands(*phy, config, link);
+
+            for (Phy::Rate rate: config.rates)
+            {
+                bool rate_set = phy->set_rate(rate);
+                for (bool use_fec: { false, true })
+                {
+                    Throughput_Result result;
+                    result.spi_speed = spi_speed;
+                    result.spi_delay = spi_delay;
+                    result.rate = rate;
+                    result.use_fec = use_fec;
+                    result.rate_set = rate_set;
+                    if (rate_set)
+                    {
+                        measure_throughput(*phy, config, result);
+                    }
+                    throughputs.push_back(result);
+                }
+            }
+
+            //the transfers of all the measurements above
+            Histogram const& transfer_histogram = phy->get_transfer_histogram();
+            link.transfer_p50 = transfer_histogram.get_percentile(0.5f);
+            link.transfer_p99 = transfer_histogram.get_percentile(0.99f);
+            link.transfer_max = transfer_histogram.get_max();
+            links.push_back(link);
+        }
+    }
+
+    print_table(links, throughputs);
+
+    std::string json = to_json(config, links, throughputs);
+    if (config.json_path.empty())
+    {
+        std::cout << "\n" << json;
+    }
+    else
+    {
+        std::ofstream file(config.json_path);
+        file << json;
+        if (!file)
+        {
+            std::cerr << "Cannot write '" << config.json_path << "'\n";
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Phy.h"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+
+//Measures the link through the Phy, for every combination of SPI speed, SPI delay, PHY rate and FEC:
+// - SPI transfer time and control command latency, for each SPI speed & delay
+// - max sustained TX payload throughput and the RX throughput seen at the same time, for each rate with and without FEC
+//The results are printed as a table and as JSON.
+struct Phy_Benchmark_Config
+{
+    std::vector<size_t> spi_speeds;
+    std::vector<size_t> spi_delays;
+    std::vector<Phy::Rate> rates;
+    std::chrono::milliseconds duration = std::chrono::milliseconds(1000); //of each throughput measurement
+    size_t command_samples = 100;
+    size_t mtu = Phy::MAX_PAYLOAD_SIZE;
+    size_t fec_coding_k = 4;
+    size_t fec_coding_n = 6;
+    uint8_t channel = 1;
+    float power = 20.5f;
+    std::string json_path; //the JSON goes to stdout after the table if empty
+};
+
+//Initializes a new phy with the SPI speed & delay, on real hardware or not
+typedef std::function<bool(Phy& phy, size_t spi_speed, size_t spi_delay)> Phy_Init_Function;
+
+int run_phy_benchmark(Phy_Benchmark_Config const& config, Phy_Init_Function const& init);
@@ -0,0 +1,293 @@
+#include "Queue_Benchmark.h"
+#include "../firmware/spsc_queue.h"
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+typedef std::chrono::high_resolution_clock Clock;
+
+namespace
+{
+
+//same size as the firmware WLAN queues
+constexpr size_t QUEUE_SIZE = 20000;
+
+//The portMUX spinlock the firmware queues used before
+struct Spin_Lock
+{
+    void lock()
+    {
+        while (flag.test_and_set(std::memory_order_acquire)) {}
+    }
+    void unlock()
+    {
+        flag.clear(std::memory_order_release);
+    }
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+};
+
+struct No_Lock
+{
+    void lock() {}
+    void unlock() {}
+};
+
+struct Run_Result
+{
+    size_t packets = 0;
+    size_t bytes = 0;
+    size_t errors = 0;
+    size_t full = 0;   //times the producer found the queue full
+    size_t empty = 0;  //times the consumer found it empty
+    double duration_s = 0;
+    std::string first_error;
+};
+
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+//The size and content of every packet are a function of its index, so the consumer can check them without sharing anything
+static inline uint32_t get_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static size_t get_packet_size(uint32_t index, size_t max_packet_size)
+{
+    return sizeof(uint32_t) + get_hash(index) % (max_packet_size - sizeof(uint32_t) + 1);
+}
+
+static void fill_packet(uint8_t* data, size_t size, uint32_t index)
+{
+    memcpy(data, &index, sizeof(index));
+    uint8_t value = static_cast<uint8_t>(get_hash(index));
+    for (size_t i = sizeof(index); i < size; i++)
+    {
+        data[i] = value++;
+    }
+}
+
+//Checks the size and content against the index in the packet and returns the index
+static bool check_packet(uint8_t const* data, size_t size, size_t max_packet_size, uint32_t& index, std::string& error)
+{
+    if (size < sizeof(index))
+    {
+        error = "packet of " + std::to_string(size) + " bytes";
+        return false;
+    }
+    memcpy(&index, data, sizeof(index));
+    size_t expected_size = get_packet_size(index, max_packet_size);
+    if (size != expected_size)
+    {
+        error = "packet " + std::to_string(index) + ": size " + std::to_string(size) + " instead of " + std::to_string(expected_size);
+        return false;
+    }
+    uint8_t value = static_cast<uint8_t>(get_hash(index));
+    for (size_t i = sizeof(index); i < size; i++)
+    {
+        if (data[i] != value++)
+        {
+            error = "packet " + std::to_string(index) + ": wrong byte at offset " + std::to_string(i);
+            return false;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+template<typename Lock>
+static Run_Result run(Queue_Benchmark_Config const& config)
+{
+    std::vector<uint8_t> buffer(QUEUE_SIZE);
+    SPSC_Queue queue(buffer.data(), QUEUE_SIZE);
+    Lock lock;
+    std::atomic_bool done{false};
+
+    Run_Result result;
+    size_t produced = 0;
+
+    Clock::time_point start = Clock::now();
+
+    //Keeps up to MAX_OPEN packets being written and ends them in random order. 1 in 32 is canceled, so its index
+    // never comes out
+    std::thread producer([&]
+    {
+        constexpr size_t MAX_OPEN = 8;
+        std::vector<uint8_t*> open_packets;
+        uint32_t index = 0;
+        uint32_t random = 1;
+        bool stop = false;
+        while (!stop || !open_packets.empty())
+        {
+            //check the clock only every few packets
+            for (size_t i = 0; i < 64; i++)
+            {
+                random = get_hash(random);
+                if (!stop && open_packets.size() < 1 + random % MAX_OPEN)
+                {
+                    size_t size = get_packet_size(index, config.max_packet_size);
+                    lock.lock();
+                    uint8_t* data = queue.start_writing(size);
+                    lock.unlock();
+                    if (data)
+                    {
+                        fill_packet(data, size, index);
+                        open_packets.push_back(data);
+                        index++;
+                        continue;
+                    }
+                    result.full++;
+                    if (open_packets.empty())
+                    {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                }
+                if (open_packets.empty())
+                {
+                    break;
+                }
+
+                random = get_hash(random);
+                size_t which = random % open_packets.size();
+                lock.lock();
+                if ((random >> 8) % 32 == 0)
+                {
+                    queue.cancel_writing(open_packets[which]);
+                }
+                else
+                {
+                    queue.end_writing(open_packets[which]);
+                    produced++;
+                }
+                lock.unlock();
+                open_packets.erase(open_packets.begin() + which);
+            }
+            stop = Clock::now() - start >= config.duration;
+        }
+        done = true;
+    });
+
+    //The indices have to go up. 1 in 32 is canceled, so the same packet has to come out again
+    std::thread consumer([&]
+    {
+        uint32_t last_index = 0;
+        bool has_last_index = false;
+        bool canceled = false;
+        uint32_t random = 2;
+        while (true)
+        {
+            size_t size = 0;
+            lock.lock();
+            uint8_t* data = queue.start_reading(size);
+            lock.unlock();
+            if (!data)
+            {
+                if (done && queue.count() == 0)
+                {
+                    break;
+                }
+                result.empty++;
+                std::this_thread::yield();
+                continue;
+            }
+            std::string error;
+            uint32_t index = 0;
+            bool ok = check_packet(data, size, config.max_packet_size, index, error);
+            if (ok && has_last_index && (canceled ? index != last_index : index <= last_index))
+            {
+                error = "packet " + std::to_string(index) + " after packet " + std::to_string(last_index);
+                ok = false;
+            }
+            if (!ok && result.errors++ == 0)
+            {
+                result.first_error = error;
+            }
+            last_index = index;
+            has_last_index = true;
+
+            random = get_hash(random);
+            lock.lock();
+            canceled = random % 32 == 0;
+            if (canceled)
+            {
+                queue.cancel_reading();
+            }
+            else
+            {
+                queue.end_reading();
+                result.packets++;
+                result.bytes += size;
+            }
+            lock.unlock();
+        }
+    });
+
+    producer.join();
+    consumer.join();
+
+    result.duration_s = std::chrono::duration<double>(Clock::now() - start).count();
+    if (result.packets != produced && result.errors++ == 0)
+    {
+        result.first_error = std::to_string(produced) + " packets produced but " + std::to_string(result.packets) + " consumed";
+    }
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void print_result(std::string const& name, Run_Result const& result)
+{
+    std::cout << std::left << std::setw(12) << name << std::right
+              << std::setw(12) << result.packets
+              << std::setw(12) << std::fixed << std::setprecision(0) << result.packets / result.duration_s
+              << std::setw(10) << std::setprecision(1) << result.bytes / result.duration_s / (1024.0 * 1024.0)
+              << std::setw(12) << result.full
+              << std::setw(12) << result.empty
+              << std::setw(8) << result.errors << "\n";
+    if (result.errors > 0)
+    {
+        std::cout << "\tfirst error: " << result.first_error << "\n";
+    }
+}
+
+int run_queue_benchmark(Queue_Benchmark_Config const& config)
+{
+    if (config.max_packet_size < sizeof(uint32_t) || config.max_packet_size > QUEUE_SIZE / 2)
+    {
+        std::cerr << "The max packet size has to be between " << sizeof(uint32_t) << " and " << QUEUE_SIZE / 2 << "\n";
+        return -1;
+    }
+
+    std::cout << "Queue of " << QUEUE_SIZE << " bytes, packets of " << sizeof(uint32_t) << " to " << config.max_packet_size
+              << " bytes, " << config.duration.count() << "ms per run\n";
+    std::cout << std::left << std::setw(12) << "queue" << std::right
+              << std::setw(12) << "packets"
+              << std::setw(12) << "packets/s"
+              << std::setw(10) << "MB/s"
+              << std::setw(12) << "full"
+              << std::setw(12) << "empty"
+              << std::setw(8) << "errors" << "\n";
+
+    Run_Result lock_free = run<No_Lock>(config);
+    print_result("lock-free", lock_free);
+    Run_Result locked = run<Spin_Lock>(config);
+    print_result("spinlock", locked);
+
+    if (locked.packets > 0)
+    {
+        std::cout << "lock-free / spinlock: " << std::setprecision(2) << double(lock_free.packets) / locked.packets * locked.duration_s / lock_free.duration_s << "x\n";
+    }
+    return (lock_free.errors == 0 && locked.errors == 0) ? 0 : -1;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+//Stress test and benchmark of the firmware packet queue (see SPSC_Queue) on the host:
+// a producer and a consumer thread move random size packets through a queue as fast as they can, the consumer checks
+// the order, size and content of each one and both sides randomly cancel some of their packets. The producer writes
+// several packets at once and ends them out of order.
+//It runs once lock-free and once with every queue call under a spinlock, the way the firmware queues were guarded by
+// their portMUX before, and prints the throughput of both.
+struct Queue_Benchmark_Config
+{
+    std::chrono::milliseconds duration = std::chrono::milliseconds(2000); //of each run
+    size_t max_packet_size = 1500;
+};
+
+//Returns 0 if all the packets came out intact and in order
+int run_queue_benchmark(Queue_Benchmark_Config const& config);
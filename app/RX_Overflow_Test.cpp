@@ -0,0 +1,100 @@
+#include "RX_Overflow_Test.h"
+#include "Phy.h"
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <cstring>
+
+typedef std::chrono::steady_clock Clock;
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void fill_packet(std::vector<uint8_t>& packet, uint32_t index)
+{
+    memcpy(packet.data(), &index, sizeof(index));
+    for (size_t i = sizeof(index); i < packet.size(); i++)
+    {
+        packet[i] = static_cast<uint8_t>(index + i);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+int run_rx_overflow_test(RX_Overflow_Test_Config const& config)
+{
+    if (config.packet_count == 0 || config.packet_size < sizeof(uint32_t) || config.packet_size > Phy::MAX_PAYLOAD_SIZE)
+    {
+        std::cerr << "Invalid RX overflow test config\n";
+        return -1;
+    }
+
+    Phy phy;
+    if (phy.init_sim(config.sim_descriptor, config.spi_speed, config.spi_delay) != Phy::Init_Result::OK ||
+            !phy.set_rate(Phy::Rate::RATE_G_54M_ODFM))
+    {
+        std::cerr << "Cannot initialize the simulated module\n";
+        return -1;
+    }
+    phy.set_rx_overflow_policy(Phy::RX_Overflow_Policy::KEEP_ON_MODULE);
+
+    Phy::Stats stats_before;
+    if (!phy.get_stats(stats_before))
+    {
+        std::cerr << "Cannot get the module stats\n";
+        return -1;
+    }
+
+    //paced so that neither the TX queues nor the radio drop anything, nothing is read meanwhile
+    std::vector<uint8_t> packet(config.packet_size);
+    for (size_t i = 0; i < config.packet_count; i++)
+    {
+        fill_packet(packet, static_cast<uint32_t>(i));
+        while (!phy.send_data(packet.data(), packet.size(), false))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(config.settle_time);
+
+    size_t dropped_while_full = phy.get_rx_packets_dropped();
+
+    std::vector<uint8_t> expected(config.packet_size);
+    std::vector<uint8_t> received(Phy::MAX_PAYLOAD_SIZE);
+    size_t received_count = 0;
+    size_t bad_count = 0;
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(5);
+    while (received_count < config.packet_count && Clock::now() < deadline)
+    {
+        size_t size = received.size();
+        Phy::RX_Info info;
+        if (!phy.receive_data(received.data(), size, info))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        fill_packet(expected, static_cast<uint32_t>(received_count));
+        if (size != expected.size() || memcmp(received.data(), expected.data(), size) != 0)
+        {
+            bad_count++;
+        }
+        received_count++;
+    }
+
+    Phy::Stats stats_after;
+    if (!phy.get_stats(stats_after))
+    {
+        std::cerr << "Cannot get the module stats\n";
+        return -1;
+    }
+    size_t module_dropped = stats_after.wlan_received_packets_dropped - stats_before.wlan_received_packets_dropped;
+    size_t dropped = phy.get_rx_packets_dropped();
+
+    std::cout << "Sent " << config.packet_count << ", received " << received_count << " (" << bad_count << " out of order or corrupted)"
+              << ", dropped by the phy " << dropped << " (" << dropped_while_full << " while the RX slots were full)"
+              << ", dropped by the module " << module_dropped << "\n";
+
+    bool ok = received_count == config.packet_count && bad_count == 0 && dropped == 0 && module_dropped == 0;
+    std::cout << (ok ? "PASSED" : "FAILED") << "\n";
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "../firmware/host/sim_module.h"
+#include <chrono>
+#include <cstddef>
+
+//Checks that the KEEP_ON_MODULE RX overflow policy (see Phy::set_rx_overflow_policy) loses nothing, on the simulated
+// module with the loopback radio: more packets than the Phy has RX slots for are sent without reading any, so the
+// slots fill up and the rest waits on the module. Then they are all read and each one has to be there, intact and
+// in order, with no packet dropped by the Phy or by the module.
+struct RX_Overflow_Test_Config
+{
+    Sim_Module::Descriptor sim_descriptor;
+    size_t spi_speed = 8000000;
+    size_t spi_delay = 20;
+    size_t packet_count = 128;  //more than the Phy RX slots, less than the module incoming queue holds
+    size_t packet_size = 100;
+    std::chrono::milliseconds settle_time = std::chrono::milliseconds(500); //before reading, for the slots to fill up
+};
+
+//Returns 0 if all the packets came through
+int run_rx_overflow_test(RX_Overflow_Test_Config const& config);
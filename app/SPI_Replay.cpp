@@ -0,0 +1,197 @@
+#include "SPI_Replay.h"
+#include "Phy.h"
+#include "Histogram.h"
+#include "Deadline_Scheduler.h"
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+typedef Deadline_Scheduler::Clock Clock;
+
+namespace
+{
+
+struct Session_Stats
+{
+    size_t transfers = 0;
+    std::array<size_t, 4> results = {}; //indexed by SPI_Recorder::Result
+    size_t tx_packets = 0;
+    size_t tx_bytes = 0;
+    size_t rx_packets = 0;
+    size_t rx_bytes = 0;
+    size_t command_transfers = 0;
+    size_t failure_run = 0;
+    size_t longest_failure_run = 0;
+    uint64_t first_start_ns = 0;
+    uint64_t last_start_ns = 0;
+    Histogram transfer_histogram;
+    Histogram gap_histogram; //between the starts of consecutive transfers
+};
+
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void add_record(Session_Stats& stats, SPI_Recorder::Record const& record)
+{
+    if (stats.transfers == 0)
+    {
+        stats.first_start_ns = record.start_ns;
+    }
+    else if (record.start_ns >= stats.last_start_ns)
+    {
+        stats.gap_histogram.add(static_cast<uint32_t>((record.start_ns - stats.last_start_ns) / 1000));
+    }
+    stats.last_start_ns = record.start_ns;
+    stats.transfers++;
+    stats.transfer_histogram.add(record.duration_ns / 1000);
+
+    size_t result = static_cast<size_t>(record.result);
+    if (result < stats.results.size())
+    {
+        stats.results[result]++;
+    }
+    if (record.request.packet_size > 0)
+    {
+        stats.tx_packets++;
+        stats.tx_bytes += record.request.packet_size;
+    }
+    if (record.request.command_size > 0)
+    {
+        stats.command_transfers++;
+    }
+
+    if (record.result == SPI_Recorder::Result::OK)
+    {
+        if (record.response.packet_size > 0)
+        {
+            stats.rx_packets++;
+            stats.rx_bytes += record.response.packet_size;
+        }
+        stats.failure_run = 0;
+    }
+    else
+    {
+        stats.failure_run++;
+        stats.longest_failure_run = std::max(stats.longest_failure_run, stats.failure_run);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void print_line(char const* name, size_t recording, size_t replay)
+{
+    std::cout << std::setw(22) << name << std::setw(14) << recording << std::setw(14) << replay << "\n";
+}
+
+static void print_stats(Session_Stats const& recording, Session_Stats const& replay, Histogram const& lateness, size_t missed_transfers)
+{
+    std::cout << "\n" << std::setw(22) << "" << std::setw(14) << "recording" << std::setw(14) << "replay" << "\n";
+    print_line("transfers", recording.transfers, replay.transfers);
+    for (size_t i = 0; i < recording.results.size(); i++)
+    {
+        print_line(SPI_Recorder::get_result_name(static_cast<SPI_Recorder::Result>(i)), recording.results[i], replay.results[i]);
+    }
+    print_line("longest failure run", recording.longest_failure_run, replay.longest_failure_run);
+    print_line("with commands", recording.command_transfers, replay.command_transfers);
+    print_line("TX packets", recording.tx_packets, replay.tx_packets);
+    print_line("TX bytes", recording.tx_bytes, replay.tx_bytes);
+    print_line("RX packets", recording.rx_packets, replay.rx_packets);
+    print_line("RX bytes", recording.rx_bytes, replay.rx_bytes);
+    print_line("duration (ms)", (recording.last_start_ns - recording.first_start_ns) / 1000000, (replay.last_start_ns - replay.first_start_ns) / 1000000);
+
+    std::cout << "\nTransfer time\n\trecording: " << recording.transfer_histogram.to_string()
+              << "\n\treplay:    " << replay.transfer_histogram.to_string() << "\n";
+    std::cout << "Gap between transfers\n\trecording: " << recording.gap_histogram.to_string()
+              << "\n\treplay:    " << replay.gap_histogram.to_string() << "\n";
+    std::cout << "Replay lateness\n\t" << lateness.to_string() << "\n";
+    std::cout << "Transfers the module was not ready for: " << missed_transfers << "\n";
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+int run_spi_replay(SPI_Replay_Config const& config)
+{
+    std::vector<SPI_Recorder::Record> records;
+    if (!SPI_Recorder::load(config.path, records))
+    {
+        return -1;
+    }
+    if (records.empty())
+    {
+        std::cerr << "The SPI recording '" << config.path << "' is empty\n";
+        return -1;
+    }
+    if (config.spi_speed == 0)
+    {
+        std::cerr << "Invalid SPI speed\n";
+        return -1;
+    }
+
+    SPI_Recorder recorder;
+    if (!config.record_path.empty() && !recorder.open(config.record_path, records.size()))
+    {
+        return -1;
+    }
+
+    Sim_Module& sim = Sim_Module::get_instance();
+    if (!sim.start(config.sim_descriptor))
+    {
+        return -1;
+    }
+    size_t missed_transfers_start = sim.get_missed_transfer_count();
+
+    std::cout << "Replaying " << records.size() << " transfers from '" << config.path << "'\n";
+
+    Session_Stats recording;
+    Session_Stats replay;
+    Histogram lateness;
+    Deadline_Scheduler scheduler;
+    std::vector<uint8_t> tx_buffer(MAX_SPI_BUFFER_SIZE);
+    std::vector<uint8_t> rx_buffer(MAX_SPI_BUFFER_SIZE);
+    size_t skipped = 0;
+
+    Clock::time_point start_tp = Clock::now();
+    uint64_t first_ns = records.front().start_ns;
+    for (SPI_Recorder::Record const& record: records)
+    {
+        add_record(recording, record);
+
+        size_t transfer_size = record.transfer_size;
+        size_t data_size = sizeof(SPI_Req_Packet_Header) + record.request.packet_size + record.request.command_size;
+        if (transfer_size == 0 || transfer_size > MAX_SPI_BUFFER_SIZE || data_size > transfer_size ||
+            record.request.command_size > MAX_SPI_COMMAND_SECTION_SIZE || record.start_ns < first_ns)
+        {
+            skipped++;
+            continue;
+        }
+
+        Clock::time_point target_tp = start_tp + std::chrono::nanoseconds(record.start_ns - first_ns);
+        scheduler.sleep_until(target_tp);
+
+        //the header and commands as recorded, zeros for the packet data
+        memset(tx_buffer.data(), 0, transfer_size);
+        memcpy(tx_buffer.data(), &record.request, sizeof(SPI_Req_Packet_Header));
+        memcpy(tx_buffer.data() + sizeof(SPI_Req_Packet_Header) + record.request.packet_size, record.commands, record.request.command_size);
+
+        Clock::time_point transfer_start_tp = Clock::now();
+        lateness.add(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(transfer_start_tp - target_tp).count()));
+        bool transfer_ok = sim.spi_transfer(tx_buffer.data(), rx_buffer.data(), transfer_size, config.spi_speed);
+        Clock::time_point transfer_end_tp = Clock::now();
+
+        SPI_Recorder::Record replayed = SPI_Recorder::make_record(tx_buffer.data(), rx_buffer.data(), transfer_size,
+                                                                  transfer_start_tp, transfer_end_tp, transfer_ok, Phy::MAX_PAYLOAD_SIZE);
+        add_record(replay, replayed);
+        recorder.add(replayed);
+    }
+
+    if (skipped > 0)
+    {
+        std::cout << "Skipped " << skipped << " invalid records\n";
+    }
+    print_stats(recording, replay, lateness, sim.get_missed_transfer_count() - missed_transfers_start);
+    return 0;
+}
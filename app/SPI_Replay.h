@@ -0,0 +1,20 @@
+#pragma once
+
+#include "SPI_Recorder.h"
+#include "../firmware/host/sim_module.h"
+#include <string>
+
+//Plays a recording made with Phy::start_recording back into the simulated module (see Sim_Module): every transfer
+// goes out at its original time with its original size, header and commands. The packet data is not recorded so it's
+// sent as zeros.
+//The recording and the replay are summarized side by side (results, packets, transfer times, gaps between transfers)
+// and the replay can be recorded too, to compare it with the original or with a replay after a change.
+struct SPI_Replay_Config
+{
+    std::string path;
+    size_t spi_speed = 8000000;
+    Sim_Module::Descriptor sim_descriptor;
+    std::string record_path; //where to record the replay, if not empty
+};
+
+int run_spi_replay(SPI_Replay_Config const& config);
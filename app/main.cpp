@@ -1,35 +1,88 @@
 #include "Phy.h"
+#include "Histogram.h"
+#include "Datagram_Endpoint.h"
+#include "Phy_Benchmark.h"
+#include "SPI_Replay.h"
+#include "Queue_Benchmark.h"
+#include "RX_Overflow_Test.h"
+#include "../firmware/host/sim_module.h"
 #include "utils/pigpio.h"
 #include <iostream>
 #include <string>
+#include <array>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include <cstdio>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <cstring>
 
 bool s_verbose = false;
 bool s_flush = false;
+bool s_latency_trace = false;
 
 bool s_phy_benchmark = false;
+Phy_Benchmark_Config s_benchmark_config;
+bool s_queue_benchmark = false;
+bool s_rx_overflow_test = false;
 uint32_t s_fec_coding_k = 4;
 uint32_t s_fec_coding_n = 6;
 
 const size_t MAX_MTU = Phy::MAX_PAYLOAD_SIZE;
 size_t s_mtu = MAX_MTU;
 
-bool s_use_spi_dev = true;
+enum class SPI_Backend
+{
+    DEV,
+    PIGPIO,
+    SIM,
+};
+SPI_Backend s_spi_backend = SPI_Backend::DEV;
 std::string s_spi_dev = "/dev/spidev0.0";
 size_t s_pigpio_spi_port = 0;
 size_t s_pigpio_spi_channel = 0;
 size_t s_spi_speed = 12000000;
 size_t s_spi_delay = 10;
+Sim_Module::Descriptor s_sim_descriptor;
+std::string s_spi_record_path;
+size_t s_spi_record_capacity = SPI_Recorder::DEFAULT_CAPACITY;
+std::string s_spi_replay_path;
 Phy::Rate s_phy_rate = Phy::Rate::RATE_G_54M_ODFM;
+Phy::TX_Class_Rates s_tx_class_rates;
+uint16_t s_tx_link_id = Phy::DEFAULT_LINK_ID;
+std::vector<uint16_t> s_rx_link_ids; //empty for the TX one
 float s_phy_power = 20.5f;
 uint8_t s_phy_channel = 1;
+Phy::TX_Queue_Policy s_tx_queue_policy = Phy::TX_Queue_Policy::DROP_NEWEST;
+std::chrono::milliseconds s_tx_queue_max_age(0);
+bool s_packing = true;
+std::chrono::milliseconds s_packing_max_delay(0);
+
+bool s_realtime = false;
+int s_realtime_priority = 50;
+int s_realtime_cpu = -1;
 
-typedef std::chrono::high_resolution_clock Clock;
+static const std::chrono::seconds JITTER_REPORT_PERIOD(10);
+
+struct Endpoint_Config
+{
+    Datagram_Endpoint::Type type;
+    Datagram_Endpoint::Direction direction;
+    std::string address;
+};
+std::vector<Endpoint_Config> s_endpoint_configs;
+bool s_streams = false;
+static const size_t MAX_STREAMS = 256;
+std::vector<size_t> s_control_inputs; //indices of the inputs sent without FEC, with high priority
+
+typedef std::chrono::steady_clock Clock;
 
 /* This prints an "Assertion failed" message and aborts.  */
 void __assert_fail(const char *__assertion, const char *__file, unsigned int __line, const char *__function)
@@ -44,14 +97,53 @@ void show_help()
     std::cout << "Esp32 Broadcast with FEC support\n";
     std::cout << "Usage:\n";
     std::cout << "\t--hrlp\tShows this help message\n";
-    std::cout << "\t--phy-benchmark\tRuns a PHY bandwidth benchmark\n";
-    std::cout << "\t--verbose\tPrint out the settings\n";
-    std::cout << "\t--flush\tFlush stdout when writing to it. This can reduce latency\n";
+    std::cout << "\t--phy-benchmark\tRuns a PHY benchmark: SPI transfer time, command latency and TX/RX throughput for each rate, with and\n";
+    std::cout << "\t\twithout FEC. Prints a table and JSON. The other settings (--mtu, --fec, --spi-*, --phy-*) are used as well\n";
+    std::cout << "\t--benchmark-spi-speeds A,B,...\tThe SPI speeds (Hz) to sweep. Default is --spi-speed\n";
+    std::cout << "\t--benchmark-spi-delays A,B,...\tThe SPI delays (us) to sweep. Default is --spi-delay\n";
+    std::cout << "\t--benchmark-rates A,B,...\tThe PHY rates to measure (see --phy-rate). Default is all of them\n";
+    std::cout << "\t--benchmark-duration MS\tHow long each throughput measurement takes. Default is " << std::to_string(s_benchmark_config.duration.count()) << "ms\n";
+    std::cout << "\t--benchmark-json PATH\tWrite the JSON results to PATH instead of stdout\n";
+    std::cout << "\t--queue-benchmark\tStress test the firmware packet queue with a producer and a consumer thread and compare its throughput\n";
+    std::cout << "\t\tlock-free and under a spinlock. Each run takes --benchmark-duration\n";
+    std::cout << "\t--rx-overflow-test\tCheck on the simulated module that no received packet is lost when they are not read\n";
+    std::cout << "\t\tquickly enough for the RX slots and have to wait on the module\n";
+    std::cout << "\t--verbose\tPrint out the settings, and the jitter histograms and module stats to stderr every " << std::to_string(JITTER_REPORT_PERIOD.count()) << "s\n";
+    std::cout << "\t--latency-trace\tAdd a " << std::to_string(Phy::LATENCY_TRACE_SIZE) << " bytes trace to every packet and print the latency between the\n";
+    std::cout << "\t\tstages it goes through to stderr every " << std::to_string(JITTER_REPORT_PERIOD.count()) << "s. Both sides have to use it. With FEC, the\n";
+    std::cout << "\t\tpackets have to fill the mtu for the traces to make it through\n";
+    std::cout << "\t--realtime PRIORITY CPU\tLock the memory and run the SPI I/O thread with SCHED_FIFO PRIORITY (1 - 99), pinned to CPU (-1 for any)\n";
+    std::cout << "\t\tWorks best with an isolated CPU (isolcpus=). Needs root\n";
+    std::cout << "\t--flush\tKept for compatibility, stdout is not buffered anymore\n";
+    std::cout << "\t--udp-in [ADDRESS:]PORT\tSend the UDP datagrams received on PORT instead of stdin. Can be repeated\n";
+    std::cout << "\t--udp-out ADDRESS:PORT\tSend the received packets as UDP datagrams instead of stdout. Can be repeated\n";
+    std::cout << "\t--unix-in PATH\tSend the datagrams received on the unix socket PATH instead of stdin. Can be repeated\n";
+    std::cout << "\t--unix-out PATH\tSend the received packets to the unix datagram socket PATH instead of stdout. Can be repeated\n";
+    std::cout << "\t\tThe packet boundaries are kept, one datagram per packet. Without --streams, all inputs are merged and\n";
+    std::cout << "\t\tall outputs get every packet\n";
+    std::cout << "\t--streams\tTag each packet with its stream, which is the index of the input in the order they were given.\n";
+    std::cout << "\t\tThe received packets go to the output with the same index. Both sides have to use it. Costs 1 byte per packet\n";
+    std::cout << "\t--control-inputs A,B,...\tSend the packets of these inputs (indices in the order they were given) without FEC,\n";
+    std::cout << "\t\tahead of the other packets queued on the module. For small control & telemetry packets\n";
     std::cout << "\t--fec K N\tUse FEC (Forward Error Correction) for transmission and reception\n";
     std::cout << "\t\tK and N are the coding constants. Every K packets, N are produced (N > K)\n";
     std::cout << "\t--mtu " << std::to_string(s_mtu) << "\tUse the specified packet size. Max is " << std::to_string(MAX_MTU) << "\n";
     std::cout << "\t--spi-dev \"/dev/spidev0.0\"\tUse the specified device for SPI\n";
     std::cout << "\t--spi-pigpio PORT CHANNEL\tUse PIGPIO on the specified port & channel for SPI\n";
+    std::cout << "\t--spi-sim\tUse the module firmware running in this process, with simulated SPI & radio, instead of the hardware.\n";
+    std::cout << "\t\tThe radio echoes the sent packets back unless linked with --sim-radio-link. --spi-speed and --spi-delay apply to the simulated bus\n";
+    std::cout << "\t--sim-turnaround US\tHow long the simulated module needs between SPI transactions. Default is " << std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(s_sim_descriptor.spi_turnaround).count()) << "us\n";
+    std::cout << "\t--sim-radio-loss P\tProbability of losing a frame over the simulated radio, 0 to 1\n";
+    std::cout << "\t--sim-radio-latency US\tLatency of the simulated radio, on top of the airtime\n";
+    std::cout << "\t--sim-uart\tPrint the UART output of the simulated module to stderr\n";
+    std::cout << "\t--sim-radio-link BIND PEER\tLink the simulated radio to the one of another process instead of echoing the packets.\n";
+    std::cout << "\t\tBIND is the unix socket path created for this radio, PEER the BIND path of the other one. For example:\n";
+    std::cout << "\t\t  esp32_app --spi-sim --sim-radio-link /tmp/tx.radio /tmp/rx.radio < input\n";
+    std::cout << "\t\t  esp32_app --spi-sim --sim-radio-link /tmp/rx.radio /tmp/tx.radio > output\n";
+    std::cout << "\t--spi-record PATH\tRecord every SPI transaction (timing, headers, commands, result) in the ring file PATH\n";
+    std::cout << "\t--spi-record-capacity N\tHow many transactions the recording keeps, the oldest ones are overwritten. Default is " << std::to_string(s_spi_record_capacity) << "\n";
+    std::cout << "\t--spi-replay PATH\tReplay a recording into the simulated module with its original timing and print how it compares.\n";
+    std::cout << "\t\tThe --spi-speed and --sim-* settings apply, and --spi-record records the replay\n";
     std::cout << "\t--spi-speed 8000000 \tUse the specified SPI speed (Hz)\n";
     std::cout << "\t--spi-delay 20\tUse the specified delay in microseconds for SPI transactions\n";
     std::cout << "\t--phy-rate X\tThe PHY rate index, out of these values:\n";
@@ -88,6 +180,41 @@ void show_help()
     std::cout << "\t\t30: 802.11n 72Mbps, MCS7, Short Guart Interval\n";
     std::cout << "\t--phy-power X\tThe PHY power in dBm between 0dBm to 20.5dBm\n";
     std::cout << "\t--phy-channel X\tThe PHY channel between 1 and 11\n";
+    std::cout << "\t--tx-class-rate CLASS X\tSend the packets of CLASS at the PHY rate index X instead of --phy-rate. Can be repeated\n";
+    std::cout << "\t\tThe classes are control (--control-inputs), normal, fec-data and fec-parity\n";
+    std::cout << "\t--link-id ID\tSend with link ID (0 - 0xFFFF), so several links can share a channel. Default is " << std::to_string(Phy::DEFAULT_LINK_ID) << "\n";
+    std::cout << "\t--rx-link-ids A,B,...\tReceive only the packets of these links, up to " << std::to_string(Phy::MAX_RX_LINK_IDS) << ". Default is the --link-id one\n";
+    std::cout << "\t--tx-queue-policy X\tWhat the module drops when it can't send the packets as fast as they come:\n";
+    std::cout << "\t\tnewest: the new packets once its queue is full (default)\n";
+    std::cout << "\t\toldest: the oldest queued packets, to keep room for the new ones\n";
+    std::cout << "\t\tfec-block: like oldest, but whole FEC blocks\n";
+    std::cout << "\t--tx-queue-max-age MS\tThe module drops the packets queued for longer than this. Default is 0, no limit\n";
+    std::cout << "\t--no-packing\tThe module sends every packet in its own frame instead of packing the small ones without FEC\n";
+    std::cout << "\t--packing-delay MS\tHow long the module waits for more small packets to pack with a queued one. Default is 0, no wait\n";
+}
+
+bool parse_list(std::string const& str, std::vector<size_t>& list, int base = 10)
+{
+    list.clear();
+    std::string::size_type start = 0;
+    while (start <= str.size())
+    {
+        std::string::size_type end = str.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = str.size();
+        }
+        try
+        {
+            list.push_back(std::stoul(str.substr(start, end - start), nullptr, base));
+        }
+        catch (...)
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    return !list.empty();
 }
 
 int parse_arguments(int argc, const char* argv[])
@@ -106,10 +233,117 @@ int parse_arguments(int argc, const char* argv[])
         {
             s_phy_benchmark = true;
         }
+        else if (arg == "--queue-benchmark")
+        {
+            s_queue_benchmark = true;
+        }
+        else if (arg == "--rx-overflow-test")
+        {
+            s_rx_overflow_test = true;
+        }
+        else if (arg == "--benchmark-spi-speeds" || arg == "--benchmark-spi-delays" || arg == "--benchmark-rates")
+        {
+            std::vector<size_t> list;
+            if (remanining == 0 || !parse_list(argv[i + 1], list))
+            {
+                std::cerr << arg << " has to be followed by a comma separated list of numeric values\n";
+                return -1;
+            }
+            if (arg == "--benchmark-spi-speeds")
+            {
+                s_benchmark_config.spi_speeds = list;
+            }
+            else if (arg == "--benchmark-spi-delays")
+            {
+                s_benchmark_config.spi_delays = list;
+            }
+            else
+            {
+                s_benchmark_config.rates.clear();
+                for (size_t rate: list)
+                {
+                    if (rate >= size_t(Phy::Rate::COUNT))
+                    {
+                        std::cerr << "Invalid rate: " << std::to_string(rate) << "\n";
+                        return -1;
+                    }
+                    s_benchmark_config.rates.push_back(static_cast<Phy::Rate>(rate));
+                }
+            }
+            i++;
+        }
+        else if (arg == "--benchmark-duration")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value\n";
+                return -1;
+            }
+            s_benchmark_config.duration = std::chrono::milliseconds(std::stoul(argv[i + 1]));
+            i++;
+        }
+        else if (arg == "--benchmark-json")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a path\n";
+                return -1;
+            }
+            s_benchmark_config.json_path = argv[i + 1];
+            i++;
+        }
         else if (arg == "--verbose")
         {
             s_verbose = true;
         }
+        else if (arg == "--latency-trace")
+        {
+            s_latency_trace = true;
+        }
+        else if (arg == "--realtime")
+        {
+            if (remanining < 2)
+            {
+                std::cerr << arg << " has to be followed by the priority and cpu\n";
+                return -1;
+            }
+            s_realtime = true;
+            s_realtime_priority = std::stoi(argv[i + 1]);
+            s_realtime_cpu = std::stoi(argv[i + 2]);
+            if (s_realtime_priority < 1 || s_realtime_priority > 99)
+            {
+                std::cerr << "Invalid priority: " << std::to_string(s_realtime_priority) << "\n";
+                return -1;
+            }
+            i += 2;
+        }
+        else if (arg == "--udp-in" || arg == "--udp-out" || arg == "--unix-in" || arg == "--unix-out")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by an address\n";
+                return -1;
+            }
+            Endpoint_Config config;
+            config.type = (arg == "--udp-in" || arg == "--udp-out") ? Datagram_Endpoint::Type::UDP : Datagram_Endpoint::Type::UNIX;
+            config.direction = (arg == "--udp-in" || arg == "--unix-in") ? Datagram_Endpoint::Direction::IN : Datagram_Endpoint::Direction::OUT;
+            config.address = argv[i + 1];
+            s_endpoint_configs.push_back(config);
+            i++;
+        }
+        else if (arg == "--streams")
+        {
+            s_streams = true;
+        }
+        else if (arg == "--control-inputs")
+        {
+            if (remanining == 0 || !parse_list(argv[i + 1], s_control_inputs))
+            {
+                std::cerr << arg << " has to be followed by a comma separated list of numeric values\n";
+                return -1;
+            }
+            i++;
+        }
         else if (arg == "--flush")
         {
             s_flush = true;
@@ -152,7 +386,7 @@ int parse_arguments(int argc, const char* argv[])
                 std::cerr << arg << " has to be followed by a device name\n";
                 return -1;
             }
-            s_use_spi_dev = true;
+            s_spi_backend = SPI_Backend::DEV;
             s_spi_dev = argv[i + 1];
             i++;
         }
@@ -163,11 +397,90 @@ int parse_arguments(int argc, const char* argv[])
                 std::cerr << arg << " has to be followed by a numeric port and channel\n";
                 return -1;
             }
-            s_use_spi_dev = false;
+            s_spi_backend = SPI_Backend::PIGPIO;
             s_pigpio_spi_port = std::stoul(argv[i + 1]);
             s_pigpio_spi_channel = std::stoul(argv[i + 2]);
             i += 2;
         }
+        else if (arg == "--spi-sim")
+        {
+            s_spi_backend = SPI_Backend::SIM;
+        }
+        else if (arg == "--sim-turnaround" || arg == "--sim-radio-latency")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value\n";
+                return -1;
+            }
+            std::chrono::microseconds value(std::stoul(argv[i + 1]));
+            if (arg == "--sim-turnaround")
+            {
+                s_sim_descriptor.spi_turnaround = value;
+            }
+            else
+            {
+                s_sim_descriptor.radio_latency = value;
+            }
+            i++;
+        }
+        else if (arg == "--sim-radio-loss")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value between 0 and 1\n";
+                return -1;
+            }
+            s_sim_descriptor.radio_loss = std::stof(argv[i + 1]);
+            i++;
+        }
+        else if (arg == "--sim-uart")
+        {
+            s_sim_descriptor.uart_output = true;
+        }
+        else if (arg == "--sim-radio-link")
+        {
+            if (remanining < 2)
+            {
+                std::cerr << arg << " has to be followed by the bind and peer socket paths\n";
+                return -1;
+            }
+            s_sim_descriptor.radio_bind = argv[i + 1];
+            s_sim_descriptor.radio_peer = argv[i + 2];
+            i += 2;
+        }
+        else if (arg == "--spi-record" || arg == "--spi-replay")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a path\n";
+                return -1;
+            }
+            if (arg == "--spi-record")
+            {
+                s_spi_record_path = argv[i + 1];
+            }
+            else
+            {
+                s_spi_replay_path = argv[i + 1];
+            }
+            i++;
+        }
+        else if (arg == "--spi-record-capacity")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value > 0\n";
+                return -1;
+            }
+            s_spi_record_capacity = std::stoul(argv[i + 1]);
+            if (s_spi_record_capacity == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value > 0\n";
+                return -1;
+            }
+            i++;
+        }
         else if (arg == "--spi-speed")
         {
             if (remanining == 0)
@@ -204,6 +517,87 @@ int parse_arguments(int argc, const char* argv[])
             s_phy_rate = static_cast<Phy::Rate>(rate);
             i++;
         }
+        else if (arg == "--link-id")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value\n";
+                return -1;
+            }
+            size_t link_id = std::stoul(argv[i + 1], nullptr, 0);
+            if (link_id > 0xFFFF)
+            {
+                std::cerr << "Invalid link ID: " << std::to_string(link_id) << "\n";
+                return -1;
+            }
+            s_tx_link_id = static_cast<uint16_t>(link_id);
+            i++;
+        }
+        else if (arg == "--rx-link-ids")
+        {
+            std::vector<size_t> list;
+            if (remanining == 0 || !parse_list(argv[i + 1], list, 0))
+            {
+                std::cerr << arg << " has to be followed by a comma separated list of numeric values\n";
+                return -1;
+            }
+            if (list.size() > Phy::MAX_RX_LINK_IDS)
+            {
+                std::cerr << "There can be at most " << std::to_string(Phy::MAX_RX_LINK_IDS) << " RX link IDs\n";
+                return -1;
+            }
+            s_rx_link_ids.clear();
+            for (size_t link_id: list)
+            {
+                if (link_id > 0xFFFF)
+                {
+                    std::cerr << "Invalid link ID: " << std::to_string(link_id) << "\n";
+                    return -1;
+                }
+                s_rx_link_ids.push_back(static_cast<uint16_t>(link_id));
+            }
+            i++;
+        }
+        else if (arg == "--tx-class-rate")
+        {
+            if (remanining < 2)
+            {
+                std::cerr << arg << " has to be followed by a class and a numeric value\n";
+                return -1;
+            }
+            std::string tx_class = argv[i + 1];
+            Phy::TX_Class_Rate* class_rate = nullptr;
+            if (tx_class == "control")
+            {
+                class_rate = &s_tx_class_rates[size_t(Phy::TX_Class::CONTROL)];
+            }
+            else if (tx_class == "normal")
+            {
+                class_rate = &s_tx_class_rates[size_t(Phy::TX_Class::NORMAL)];
+            }
+            else if (tx_class == "fec-data")
+            {
+                class_rate = &s_tx_class_rates[size_t(Phy::TX_Class::FEC_DATA)];
+            }
+            else if (tx_class == "fec-parity")
+            {
+                class_rate = &s_tx_class_rates[size_t(Phy::TX_Class::FEC_PARITY)];
+            }
+            else
+            {
+                std::cerr << "Invalid class: " << tx_class << ", it has to be control, normal, fec-data or fec-parity\n";
+                return -1;
+            }
+            size_t rate = std::stoul(argv[i + 2]);
+            if (rate >= size_t(Phy::Rate::COUNT))
+            {
+                std::cerr << "Invalid rate: " << std::to_string(rate) << "\n";
+                return -1;
+            }
+            class_rate->is_set = true;
+            class_rate->rate = static_cast<Phy::Rate>(rate);
+            i += 2;
+        }
         else if (arg == "--phy-power")
         {
             if (remanining == 0)
@@ -224,6 +618,62 @@ int parse_arguments(int argc, const char* argv[])
             s_phy_channel = std::stoul(argv[i + 1]);
             i++;
         }
+        else if (arg == "--tx-queue-policy")
+        {
+            std::string policy = remanining > 0 ? argv[i + 1] : "";
+            if (policy == "newest")
+            {
+                s_tx_queue_policy = Phy::TX_Queue_Policy::DROP_NEWEST;
+            }
+            else if (policy == "oldest")
+            {
+                s_tx_queue_policy = Phy::TX_Queue_Policy::DROP_OLDEST;
+            }
+            else if (policy == "fec-block")
+            {
+                s_tx_queue_policy = Phy::TX_Queue_Policy::DROP_FEC_BLOCK;
+            }
+            else
+            {
+                std::cerr << arg << " has to be followed by newest, oldest or fec-block\n";
+                return -1;
+            }
+            i++;
+        }
+        else if (arg == "--tx-queue-max-age")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value\n";
+                return -1;
+            }
+            s_tx_queue_max_age = std::chrono::milliseconds(std::stoul(argv[i + 1]));
+            if (s_tx_queue_max_age > Phy::MAX_TX_QUEUE_MAX_AGE)
+            {
+                std::cerr << "The max age can be at most " << std::to_string(Phy::MAX_TX_QUEUE_MAX_AGE.count()) << "ms\n";
+                return -1;
+            }
+            i++;
+        }
+        else if (arg == "--no-packing")
+        {
+            s_packing = false;
+        }
+        else if (arg == "--packing-delay")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value\n";
+                return -1;
+            }
+            s_packing_max_delay = std::chrono::milliseconds(std::stoul(argv[i + 1]));
+            if (s_packing_max_delay > Phy::MAX_PACKING_MAX_DELAY)
+            {
+                std::cerr << "The packing delay can be at most " << std::to_string(Phy::MAX_PACKING_MAX_DELAY.count()) << "ms\n";
+                return -1;
+            }
+            i++;
+        }
         else
         {
             std::cerr << "Unknown argument: " << arg << "\n";
@@ -235,50 +685,560 @@ int parse_arguments(int argc, const char* argv[])
 }
 
 
+bool setup_realtime()
+{
+    //lock everything allocated so far and everything allocated later so the I/O path never page faults
+    //Only the phy I/O thread gets SCHED_FIFO (see Phy::set_realtime), the main thread stays SCHED_OTHER. It sleeps in
+    // epoll and just moves data between the fds and the phy rings, which the I/O thread buffers
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        std::cerr << "Cannot lock memory: " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+void report_jitter(Phy const& phy)
+{
+    std::cerr << "Jitter:"
+              << "\n\tphy I/O wakeup delay: " << phy.get_io_wakeup_histogram().to_string()
+              << "\n" << phy.get_io_wakeup_histogram().to_bucket_string()
+              << "\tphy SPI transfer: " << phy.get_transfer_histogram().to_string()
+              << "\n" << phy.get_transfer_histogram().to_bucket_string();
+}
+
+void report_stats(Phy& phy, Phy::Stats& last_stats)
+{
+    Phy::Stats stats;
+    if (!phy.get_stats(stats))
+    {
+        std::cerr << "Cannot get the module stats\n";
+        return;
+    }
+    std::cerr << "Module:"
+              << "\n\tWLAN sent: " << stats.wlan_data_sent << " bytes, " << stats.wlan_packets_sent << " packets, "
+              << stats.wlan_tx_failures << " TX failures, " << stats.wlan_outgoing_packets_dropped << " dropped"
+              << "\n\tWLAN received: " << stats.wlan_data_received << " bytes, " << stats.wlan_packets_received << " packets, "
+              << stats.wlan_error_count << " errors, " << stats.wlan_received_packets_dropped << " dropped"
+              << "\n\tSPI: " << stats.spi_data_sent << " bytes / " << stats.spi_packets_sent << " packets to the host, "
+              << stats.spi_data_received << " bytes / " << stats.spi_packets_received << " packets from the host, "
+              << stats.spi_error_count << " errors (" << stats.spi_crc_error_count << " CRC)"
+              << "\n\tFEC: " << stats.fec_encoder_packets_dropped << " dropped by the encoder, "
+              << stats.fec_blocks_recovered << " blocks recovered, " << stats.fec_blocks_lost << " lost"
+              << "\n\tqueue high water: " << stats.wlan_outgoing_queue_high_water << " bytes outgoing, "
+              << stats.wlan_incoming_queue_high_water << " bytes incoming"
+              << "\n\tTX queue policy: " << stats.wlan_outgoing_packets_expired << " expired, " << stats.wlan_outgoing_packets_evicted << " evicted"
+              << "\n\tpacking: " << stats.wlan_packets_packed << " packets packed"
+              << "\n\tTX rate switches: " << stats.wlan_tx_rate_switches
+              << "\n\tframes of other links: " << stats.wlan_frames_filtered << "\n";
+
+    Phy::Stats_Rates rates;
+    if (Phy::compute_stats_rates(last_stats, stats, rates))
+    {
+        std::cerr << "\tper second: WLAN " << static_cast<uint64_t>(rates.wlan_data_sent) << " bytes / " << static_cast<uint64_t>(rates.wlan_packets_sent) << " packets sent, "
+                  << static_cast<uint64_t>(rates.wlan_data_received) << " bytes / " << static_cast<uint64_t>(rates.wlan_packets_received) << " packets received, "
+                  << "SPI " << static_cast<uint64_t>(rates.spi_data_sent) << " bytes to / " << static_cast<uint64_t>(rates.spi_data_received) << " bytes from the host, "
+                  << rates.packets_dropped << " dropped, " << rates.errors << " errors, FEC "
+                  << rates.fec_blocks_recovered << " blocks recovered / " << rates.fec_blocks_lost << " lost\n";
+    }
+    last_stats = stats;
+}
+
+void report_latency(Phy const& phy)
+{
+    std::cerr << "Latency:\n" << phy.get_latency_tracer().to_string();
+}
+
+void report_endpoints(std::vector<std::unique_ptr<Datagram_Endpoint>> const& endpoints)
+{
+    for (std::unique_ptr<Datagram_Endpoint> const& endpoint: endpoints)
+    {
+        std::cerr << "Endpoint " << endpoint->get_address() << ": dropped " << std::to_string(endpoint->get_dropped_count()) << " packets\n";
+    }
+}
+
+bool set_non_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+//Keeps track of what an fd is registered for so epoll is touched only when it changes
+struct Epoll_Interest
+{
+    int fd = -1;
+    uint32_t events = 0;
+};
+
+bool set_epoll_interest(int epoll_fd, Epoll_Interest& interest, uint32_t events)
+{
+    if (interest.fd < 0 || interest.events == events)
+    {
+        return true;
+    }
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = interest.fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, interest.fd, &ev) < 0)
+    {
+        std::cerr << "Cannot modify epoll interest: " << strerror(errno) << "\n";
+        return false;
+    }
+    interest.events = events;
+    return true;
+}
+
+bool add_epoll_interest(int epoll_fd, Epoll_Interest& interest, int fd)
+{
+    interest.fd = fd;
+    interest.events = 0;
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        if (errno == EPERM)
+        {
+            //regular files can't be polled, but they are always ready anyway
+            interest.fd = -1;
+            return true;
+        }
+        std::cerr << "Cannot add fd to epoll: " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
 int run(Phy& phy)
 {
-    std::array<uint8_t, Phy::MAX_PAYLOAD_SIZE> rx_data;
-    size_t rx_data_size = 0;
-    int rx_rssi = 0;
+    //stdout is written directly from now on
+    std::flush(std::cout);
+
+    //the endpoints replace stdin/stdout for their direction
+    std::vector<std::unique_ptr<Datagram_Endpoint>> inputs;
+    std::vector<std::unique_ptr<Datagram_Endpoint>> outputs;
+    for (Endpoint_Config const& config: s_endpoint_configs)
+    {
+        std::unique_ptr<Datagram_Endpoint> endpoint(new Datagram_Endpoint());
+        if (!endpoint->init(config.type, config.direction, config.address))
+        {
+            return -1;
+        }
+        if (config.direction == Datagram_Endpoint::Direction::IN)
+        {
+            inputs.push_back(std::move(endpoint));
+        }
+        else
+        {
+            outputs.push_back(std::move(endpoint));
+        }
+    }
+    bool use_stdin = inputs.empty();
+    bool use_stdout = outputs.empty();
+
+    //with streams, the first byte of each packet is the index of the endpoint it came from / goes to
+    size_t stream_header_size = s_streams ? 1 : 0;
+    if (s_streams && (inputs.size() > MAX_STREAMS || outputs.size() > MAX_STREAMS))
+    {
+        std::cerr << "Too many streams, max is " << std::to_string(MAX_STREAMS) << "\n";
+        return -1;
+    }
+    //the latency trace is added by the phy, at the end of the packet
+    size_t trace_size = s_latency_trace ? Phy::LATENCY_TRACE_SIZE : 0;
+    if (s_mtu <= stream_header_size + trace_size)
+    {
+        std::cerr << "The mtu is too small for streams and latency traces\n";
+        return -1;
+    }
+    size_t max_data_size = s_mtu - stream_header_size - trace_size;
+
+    //packets read from the inputs that don't fit in the TX ring yet. The inputs are not read until they are queued.
+    //The control inputs have their own, so they don't wait behind the others
+    static const size_t TX_BATCH_SIZE = Datagram_Endpoint::MAX_BATCH_SIZE;
+    struct TX_Pending
+    {
+        std::vector<std::array<uint8_t, Phy::MAX_PAYLOAD_SIZE>> data;
+        std::array<iovec, TX_BATCH_SIZE> packets;
+        size_t start = 0;
+        size_t count = 0;
+        bool control = false; //sent without FEC, with high priority
+    };
+    std::vector<char> control_inputs(inputs.size(), 0);
+    for (size_t index: s_control_inputs)
+    {
+        if (index >= inputs.size())
+        {
+            std::cerr << "No input " << std::to_string(index) << " for --control-inputs\n";
+            return -1;
+        }
+        control_inputs[index] = 1;
+    }
+    std::array<TX_Pending, 2> tx_pendings;
+    TX_Pending& tx = tx_pendings[0];
+    TX_Pending& control_tx = tx_pendings[1];
+    tx.data.resize(TX_BATCH_SIZE);
+    control_tx.data.resize(s_control_inputs.empty() ? 0 : TX_BATCH_SIZE);
+    control_tx.control = true;
+    bool stdin_eof = false;
 
-    std::array<uint8_t, Phy::MAX_PAYLOAD_SIZE> tx_data;
+    //the received packet being written to stdout. It stays in the RX ring (peeked) until stdout took all of it,
+    // so a slow reader pushes back all the way to the module
+    uint8_t const* rx_data = nullptr;
+    size_t rx_size = 0;
+    size_t rx_offset = 0;
 
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(STDIN_FILENO, &fds);
+    //received packets going to the output endpoints. These don't push back, a full socket drops them
+    static const size_t RX_BATCH_SIZE = Datagram_Endpoint::MAX_BATCH_SIZE;
+    std::vector<std::array<uint8_t, Phy::MAX_PAYLOAD_SIZE>> rx_batch_data(use_stdout ? 0 : RX_BATCH_SIZE);
+    std::array<Phy::RX_Batch_Packet, RX_BATCH_SIZE> rx_batch;
+    std::array<iovec, RX_BATCH_SIZE> rx_batch_iovecs;
+    for (size_t i = 0; i < rx_batch_data.size(); i++)
+    {
+        rx_batch[i].data = rx_batch_data[i].data();
+    }
 
-    int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+    if ((use_stdin && !set_non_blocking(STDIN_FILENO)) || (use_stdout && !set_non_blocking(STDOUT_FILENO)))
+    {
+        std::cerr << "Cannot make stdin/stdout non blocking: " << strerror(errno) << "\n";
+        return -1;
+    }
 
-    Clock::time_point last_receive_tp = Clock::now();
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        std::cerr << "Cannot create epoll: " << strerror(errno) << "\n";
+        return -1;
+    }
+
+    Epoll_Interest stdin_interest;
+    Epoll_Interest stdout_interest;
+    Epoll_Interest rx_event_interest;
+    Epoll_Interest tx_event_interest;
+    std::vector<Epoll_Interest> input_interests(inputs.size());
+    bool ok = add_epoll_interest(epoll_fd, rx_event_interest, phy.get_rx_event_fd()) &&
+            add_epoll_interest(epoll_fd, tx_event_interest, phy.get_tx_event_fd()) &&
+            (!use_stdin || add_epoll_interest(epoll_fd, stdin_interest, STDIN_FILENO)) &&
+            (!use_stdout || add_epoll_interest(epoll_fd, stdout_interest, STDOUT_FILENO));
+    for (size_t i = 0; ok && i < inputs.size(); i++)
+    {
+        ok = add_epoll_interest(epoll_fd, input_interests[i], inputs[i]->get_fd());
+    }
+    if (!ok)
+    {
+        ::close(epoll_fd);
+        return -1;
+    }
+
+    static const size_t MAX_EVENTS = 16;
+    std::array<epoll_event, MAX_EVENTS> events;
+
+    Clock::time_point last_report_tp = Clock::now();
+    Phy::Stats last_stats;
+    bool stdin_ready = false;
+    std::vector<char> input_ready(inputs.size(), 0);
+    bool stdout_ready = true;
+    bool rx_ready = true;
+    bool tx_ready = false;
     while (true)
     {
-        if (Clock::now() - last_receive_tp >= std::chrono::microseconds(500))
+        //outputs first so received packets are not held up by a burst on the inputs
+        if (use_stdout && (stdout_ready || rx_ready))
+        {
+            if (rx_ready)
+            {
+                phy.clear_rx_event();
+            }
+            rx_ready = false;
+            while (stdout_ready)
+            {
+                if (!rx_data)
+                {
+                    Phy::RX_Info rx_info;
+                    rx_data = reinterpret_cast<uint8_t const*>(phy.peek_rx(rx_size, rx_info));
+                    rx_offset = stream_header_size;
+                    if (!rx_data)
+                    {
+                        break;
+                    }
+                    if (s_streams && (rx_size < stream_header_size || rx_data[0] != 0))
+                    {
+                        //stdout is stream 0
+                        phy.release_rx();
+                        rx_data = nullptr;
+                        continue;
+                    }
+                }
+                if (rx_offset < rx_size)
+                {
+                    ssize_t res = ::write(STDOUT_FILENO, rx_data + rx_offset, rx_size - rx_offset);
+                    if (res < 0)
+                    {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        {
+                            std::cerr << "Cannot write to stdout: " << strerror(errno) << "\n";
+                            ::close(epoll_fd);
+                            return -1;
+                        }
+                        stdout_ready = false;
+                        break;
+                    }
+                    rx_offset += res;
+                }
+                if (rx_offset >= rx_size)
+                {
+                    phy.release_rx();
+                    rx_data = nullptr;
+                }
+            }
+        }
+        else if (!use_stdout && rx_ready)
         {
-            last_receive_tp = Clock::now();
-            if (phy.receive_data(rx_data.data(), rx_data_size, rx_rssi))
+            rx_ready = false;
+            phy.clear_rx_event();
+            size_t count = 0;
+            do
             {
-                std::cout.write(reinterpret_cast<const char*>(rx_data.data()), rx_data_size);
-                if (s_flush)
+                count = phy.receive_batch(rx_batch.data(), rx_batch.size());
+                for (size_t o = 0; o < outputs.size(); o++)
                 {
-                    std::flush(std::cout);
+                    size_t out_count = 0;
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        Phy::RX_Batch_Packet const& packet = rx_batch[i];
+                        uint8_t const* data = reinterpret_cast<uint8_t const*>(packet.data);
+                        if (packet.size <= stream_header_size || (s_streams && data[0] != o))
+                        {
+                            continue;
+                        }
+                        rx_batch_iovecs[out_count].iov_base = const_cast<uint8_t*>(data + stream_header_size);
+                        rx_batch_iovecs[out_count].iov_len = packet.size - stream_header_size;
+                        out_count++;
+                    }
+                    if (out_count > 0)
+                    {
+                        outputs[o]->send_batch(rx_batch_iovecs.data(), out_count);
+                    }
                 }
+            } while (count == rx_batch.size());
+        }
+
+        if (tx_ready)
+        {
+            tx_ready = false;
+            phy.clear_tx_event();
+        }
+        for (TX_Pending& pending: tx_pendings)
+        {
+            if (pending.count > 0)
+            {
+                size_t queued = phy.send_batch(&pending.packets[pending.start], pending.count, !pending.control,
+                                               pending.control ? Phy::Priority::HIGH : Phy::Priority::NORMAL);
+                pending.start += queued;
+                pending.count -= queued;
             }
         }
 
+        if (use_stdin && stdin_ready && tx.count == 0)
         {
-            int res = read(STDIN_FILENO, tx_data.data(), s_mtu);
+            stdin_ready = false;
+            ssize_t res = ::read(STDIN_FILENO, tx.data[0].data() + stream_header_size, max_data_size);
             if (res > 0)
             {
-                phy.send_data(tx_data.data(), res);
+                stdin_ready = true; //there might be more, keep reading until EAGAIN
+                if (s_streams)
+                {
+                    tx.data[0][0] = 0; //stdin is stream 0
+                }
+                tx.packets[0].iov_base = tx.data[0].data();
+                tx.packets[0].iov_len = res + stream_header_size;
+                tx.start = 0;
+                tx.count = phy.send_batch(tx.packets.data(), 1, true) == 1 ? 0 : 1;
+            }
+            else if (res == 0)
+            {
+                stdin_eof = true;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                std::cerr << "Cannot read from stdin: " << strerror(errno) << "\n";
+                ::close(epoll_fd);
+                return -1;
+            }
+        }
+
+        for (size_t e = 0; e < inputs.size(); e++)
+        {
+            TX_Pending& pending = control_inputs[e] ? control_tx : tx;
+            if (!input_ready[e] || pending.count > 0)
+            {
+                continue;
+            }
+            for (size_t i = 0; i < TX_BATCH_SIZE; i++)
+            {
+                pending.packets[i].iov_base = pending.data[i].data() + stream_header_size;
+                pending.packets[i].iov_len = max_data_size;
+            }
+            size_t count = inputs[e]->receive_batch(pending.packets.data(), TX_BATCH_SIZE);
+            input_ready[e] = count > 0; //there might be more, keep reading until there's nothing
+            for (size_t i = 0; i < count; i++)
+            {
+                uint8_t* data = reinterpret_cast<uint8_t*>(pending.packets[i].iov_base) - stream_header_size;
+                if (s_streams)
+                {
+                    data[0] = static_cast<uint8_t>(e);
+                }
+                pending.packets[i].iov_base = data;
+                pending.packets[i].iov_len += stream_header_size;
+            }
+            size_t queued = phy.send_batch(pending.packets.data(), count, !pending.control, pending.control ? Phy::Priority::HIGH : Phy::Priority::NORMAL);
+            pending.start = queued;
+            pending.count = count - queued;
+        }
+
+        if ((s_verbose || s_latency_trace) && Clock::now() - last_report_tp >= JITTER_REPORT_PERIOD)
+        {
+            last_report_tp = Clock::now();
+            if (s_verbose)
+            {
+                report_jitter(phy);
+                report_stats(phy, last_stats);
+                report_endpoints(inputs);
+                report_endpoints(outputs);
+            }
+            if (s_latency_trace)
+            {
+                report_latency(phy);
+            }
+        }
+
+        //something is still ready, go around again without waiting
+        if (use_stdin && stdin_interest.fd < 0 && !stdin_eof)
+        {
+            stdin_ready = true;
+        }
+        bool inputs_ready = use_stdin && stdin_ready && tx.count == 0;
+        for (size_t e = 0; e < inputs.size(); e++)
+        {
+            inputs_ready |= input_ready[e] && (control_inputs[e] ? control_tx.count : tx.count) == 0;
+        }
+        if (inputs_ready)
+        {
+            continue;
+        }
+
+        const uint32_t readable = EPOLLIN;
+        const uint32_t writable = EPOLLOUT;
+        ok = set_epoll_interest(epoll_fd, stdin_interest, (tx.count == 0 && !stdin_eof) ? readable : 0) &&
+                set_epoll_interest(epoll_fd, tx_event_interest, (tx.count > 0 || control_tx.count > 0) ? readable : 0) &&
+                set_epoll_interest(epoll_fd, stdout_interest, rx_data ? writable : 0) &&
+                set_epoll_interest(epoll_fd, rx_event_interest, rx_data ? 0 : readable);
+        for (size_t i = 0; ok && i < inputs.size(); i++)
+        {
+            ok = set_epoll_interest(epoll_fd, input_interests[i], (control_inputs[i] ? control_tx.count : tx.count) == 0 ? readable : 0);
+        }
+        if (!ok)
+        {
+            ::close(epoll_fd);
+            return -1;
+        }
+
+        int timeout_ms = -1;
+        if (s_verbose || s_latency_trace)
+        {
+            Clock::duration remaining = JITTER_REPORT_PERIOD - (Clock::now() - last_report_tp);
+            timeout_ms = static_cast<int>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count(), 0));
+        }
+
+        int count = epoll_wait(epoll_fd, events.data(), events.size(), timeout_ms);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "epoll_wait failed: " << strerror(errno) << "\n";
+            ::close(epoll_fd);
+            return -1;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            int fd = events[i].data.fd;
+            if (use_stdin && fd == STDIN_FILENO)
+            {
+                stdin_ready = true;
+            }
+            else if (use_stdout && fd == STDOUT_FILENO)
+            {
+                stdout_ready = true;
+            }
+            else if (fd == phy.get_rx_event_fd())
+            {
+                rx_ready = true;
+            }
+            else if (fd == phy.get_tx_event_fd())
+            {
+                tx_ready = true;
+            }
+            else
+            {
+                for (size_t e = 0; e < inputs.size(); e++)
+                {
+                    if (fd == inputs[e]->get_fd())
+                    {
+                        input_ready[e] = 1;
+                    }
+                }
             }
         }
     }
 
+    ::close(epoll_fd);
     return 0;
 }
 
 
+bool init_phy(Phy& phy, size_t spi_speed, size_t spi_delay)
+{
+    if (s_realtime)
+    {
+        if (s_verbose)
+        {
+            std::cout << "Realtime\n\tpriority " << std::to_string(s_realtime_priority) <<
+                         "\n\tcpu " << std::to_string(s_realtime_cpu) << "\n";
+        }
+        phy.set_realtime(s_realtime_priority, s_realtime_cpu);
+    }
+    if (s_spi_backend == SPI_Backend::SIM)
+    {
+        if (s_verbose)
+        {
+            std::cout << "SPI\n\tsimulated module" <<
+                         "\n\tspeed " << std::to_string(spi_speed) <<
+                         " Hz\n\tdelay " << std::to_string(spi_delay) << "us\n";
+        }
+        return phy.init_sim(s_sim_descriptor, spi_speed, spi_delay) == Phy::Init_Result::OK;
+    }
+    if (s_spi_backend == SPI_Backend::DEV)
+    {
+        if (s_verbose)
+        {
+            std::cout << "SPI\n\tdev " << s_spi_dev <<
+                         "\n\tspeed " << std::to_string(spi_speed) <<
+                         " Hz\n\tdelay " << std::to_string(spi_delay) << "us\n";
+        }
+        return phy.init_dev(s_spi_dev.c_str(), spi_speed, spi_delay) == Phy::Init_Result::OK;
+    }
+
+    if (s_verbose)
+    {
+        std::cout << "SPI\n\tpigpio, port " << std::to_string(s_pigpio_spi_port) << ", channel " << std::to_string(s_pigpio_spi_channel) <<
+                     "\n\tspeed " << std::to_string(spi_speed) <<
+                     " Hz\n\tdelay " << std::to_string(spi_delay) << "us\n";
+    }
+    return phy.init_pigpio(s_pigpio_spi_port, s_pigpio_spi_channel, spi_speed, spi_delay) == Phy::Init_Result::OK;
+}
+
 int main(int argc, const char* argv[])
 {
     int result = parse_arguments(argc, argv);
@@ -297,56 +1257,110 @@ int main(int argc, const char* argv[])
         s_fec_coding_n = 20;
     }
 
-    if (gpioCfgClock(5, PI_CLOCK_PCM, 0) < 0 || gpioCfgPermissions(static_cast<uint64_t>(-1)))
+    if (s_queue_benchmark)
     {
-        std::cerr << "Cannot configure pigpio\n";
-        return -1;
+        Queue_Benchmark_Config config;
+        config.duration = s_benchmark_config.duration;
+        return run_queue_benchmark(config);
     }
-    if (gpioInitialise() < 0)
+
+    if (s_rx_overflow_test)
     {
-        std::cerr << "Cannot initialize pigpio\n";
-        return -1;
+        RX_Overflow_Test_Config config;
+        config.sim_descriptor = s_sim_descriptor;
+        config.spi_speed = s_spi_speed;
+        config.spi_delay = s_spi_delay;
+        return run_rx_overflow_test(config);
     }
 
-    if (s_phy_benchmark)
+    if (!s_spi_replay_path.empty())
     {
-        //return run_phy_benchmark();
+        SPI_Replay_Config config;
+        config.path = s_spi_replay_path;
+        config.spi_speed = s_spi_speed;
+        config.sim_descriptor = s_sim_descriptor;
+        config.record_path = s_spi_record_path;
+        return run_spi_replay(config);
     }
 
-    Phy phy;
-    if (s_use_spi_dev)
+    //the simulated module runs without any hardware
+    if (s_spi_backend != SPI_Backend::SIM)
     {
-        if (s_verbose)
+        if (gpioCfgClock(5, PI_CLOCK_PCM, 0) < 0 || gpioCfgPermissions(static_cast<uint64_t>(-1)))
         {
-            std::cout << "SPI\n\tdev " << s_spi_dev <<
-                         "\n\tspeed " << std::to_string(s_spi_speed) <<
-                         " Hz\n\tdelay " << std::to_string(s_spi_delay) << "us\n";
+            std::cerr << "Cannot configure pigpio\n";
+            return -1;
         }
-        if (phy.init_dev(s_spi_dev.c_str(), s_spi_speed, s_spi_delay) != Phy::Init_Result::OK)
+        if (gpioInitialise() < 0)
         {
+            std::cerr << "Cannot initialize pigpio\n";
             return -1;
         }
     }
-    else
+
+    if (s_realtime && !setup_realtime())
+    {
+        return -1;
+    }
+
+    if (s_phy_benchmark)
     {
-        if (s_verbose)
+        s_benchmark_config.mtu = s_mtu;
+        s_benchmark_config.fec_coding_k = s_fec_coding_k;
+        s_benchmark_config.fec_coding_n = s_fec_coding_n;
+        s_benchmark_config.channel = s_phy_channel;
+        s_benchmark_config.power = s_phy_power;
+        if (s_benchmark_config.spi_speeds.empty())
         {
-            std::cout << "SPI\n\tpigpio, port " << std::to_string(s_pigpio_spi_port) << ", channel " << std::to_string(s_pigpio_spi_channel) <<
-                         "\n\tspeed " << std::to_string(s_spi_speed) <<
-                         " Hz\n\tdelay " << std::to_string(s_spi_delay) << "us\n";
+            s_benchmark_config.spi_speeds.push_back(s_spi_speed);
         }
-        if (phy.init_pigpio(s_pigpio_spi_port, s_pigpio_spi_channel, s_spi_speed, s_spi_delay) != Phy::Init_Result::OK)
+        if (s_benchmark_config.spi_delays.empty())
         {
-            return -1;
+            s_benchmark_config.spi_delays.push_back(s_spi_delay);
         }
+        if (s_benchmark_config.rates.empty())
+        {
+            for (size_t i = 0; i < size_t(Phy::Rate::COUNT); i++)
+            {
+                s_benchmark_config.rates.push_back(static_cast<Phy::Rate>(i));
+            }
+        }
+        result = run_phy_benchmark(s_benchmark_config, init_phy);
+        gpioTerminate();
+        return result;
     }
 
-    phy.process();
+    Phy phy;
+    if (!s_spi_record_path.empty() && !phy.start_recording(s_spi_record_path, s_spi_record_capacity))
+    {
+        return -1;
+    }
+    phy.set_latency_tracing(s_latency_trace);
+    if (!init_phy(phy, s_spi_speed, s_spi_delay))
+    {
+        return -1;
+    }
 
     phy.set_rate(s_phy_rate);
     phy.set_power(s_phy_power);
     phy.set_channel(s_phy_channel);
     phy.setup_fec_channel(s_fec_coding_k, s_fec_coding_n, s_mtu);
+    if (!phy.set_tx_queue_policy(s_tx_queue_policy, s_tx_queue_max_age))
+    {
+        std::cerr << "Cannot set the TX queue policy\n";
+    }
+    if (!phy.set_packing(s_packing, s_packing_max_delay))
+    {
+        std::cerr << "Cannot set the packing\n";
+    }
+    if (!phy.set_tx_class_rates(s_tx_class_rates))
+    {
+        std::cerr << "Cannot set the TX class rates\n";
+    }
+    if (!phy.set_link_ids(s_tx_link_id, s_rx_link_ids.empty() ? std::vector<uint16_t>{ s_tx_link_id } : s_rx_link_ids))
+    {
+        std::cerr << "Cannot set the link IDs\n";
+    }
     int actual_rate = -1;
     float actual_power = -1;
     int actual_channel = -1;
@@ -17,6 +17,7 @@ INCLUDEPATH += =/usr/local/include
 INCLUDEPATH += ../../
 INCLUDEPATH += ../../../lib
 INCLUDEPATH += ../../../lib/utils
+INCLUDEPATH += ../../../firmware/host
 
 
 QMAKE_CXXFLAGS += -Wno-unused-variable -Wno-unused-parameter
@@ -56,14 +57,45 @@ UI_DIR = ./.ui/$${DEST_FOLDER}
 DESTDIR = ../../bin
 
 HEADERS += \
+    ../../Datagram_Endpoint.h \
+    ../../Phy_Benchmark.h \
+    ../../SPI_Replay.h \
+    ../../Queue_Benchmark.h \
+    ../../RX_Overflow_Test.h \
     ../../../lib/Phy.h \
+    ../../../lib/SPSC_Ring.h \
+    ../../../lib/Histogram.h \
+    ../../../lib/Deadline_Scheduler.h \
+    ../../../lib/SPI_Recorder.h \
+    ../../../lib/Latency_Tracer.h \
+    ../../../lib/CRC8.h \
     ../../../lib/utils/pigpio.h \
     ../../../lib/utils/command.h \
-    ../../../firmware/spi_comms.h
+    ../../../firmware/spi_comms.h \
+    ../../../firmware/latency_trace.h \
+    ../../../firmware/structures.h \
+    ../../../firmware/spsc_queue.h \
+    ../../../firmware/fec_codec.h \
+    ../../../firmware/fec.h \
+    ../../../firmware/host/sim_module.h \
+    ../../../firmware/host/host_shim.h
 
 SOURCES += \
     ../../main.cpp \
+    ../../Datagram_Endpoint.cpp \
+    ../../Phy_Benchmark.cpp \
+    ../../SPI_Replay.cpp \
+    ../../Queue_Benchmark.cpp \
+    ../../RX_Overflow_Test.cpp \
     ../../../lib/Phy.cpp \
+    ../../../lib/Deadline_Scheduler.cpp \
+    ../../../lib/SPI_Recorder.cpp \
+    ../../../lib/Latency_Tracer.cpp \
     ../../../lib/utils/pigpio.c \
-    ../../../lib/utils/command.c
+    ../../../lib/utils/command.c \
+    ../../../firmware/fec_codec.cpp \
+    ../../../firmware/fec.cpp \
+    ../../../firmware/host/firmware_host.cpp \
+    ../../../firmware/host/host_shim.cpp \
+    ../../../firmware/host/sim_module.cpp
 
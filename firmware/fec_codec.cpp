@@ -110,6 +110,35 @@ void Fec_Codec::set_data_encoded_cb(void (*cb)(void* data, size_t size))
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
+IRAM_ATTR bool Fec_Codec::is_data_packet(const void* data, size_t size) const
+{
+    if (size < sizeof(Packet_Header))
+    {
+        return false;
+    }
+    Packet_Header header;
+    memcpy(&header, data, sizeof(header));
+    return header.packet_index < m_descriptor.coding_k;
+}
+
+IRAM_ATTR uint32_t Fec_Codec::get_block_index(const void* data, size_t size) const
+{
+    if (size < sizeof(Packet_Header))
+    {
+        return 0;
+    }
+    Packet_Header header;
+    memcpy(&header, data, sizeof(header));
+    return header.block_index;
+}
+
+IRAM_ATTR uint32_t Fec_Codec::get_decoded_block_index() const
+{
+    return m_decoder.crt_block_index;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
 void Fec_Codec::set_data_decoded_cb(void (*cb)(void* data, size_t size))
 {
     m_decoder.cb = cb;
@@ -666,8 +695,14 @@ void Fec_Codec::decoder_task_proc()
             if (block_index > m_decoder.crt_block_index)
             {
                 DECODER_LOG("1: Abandoned block %d due to %d: packets %d, fec packets %d\n", m_decoder.crt_block_index, block_index, m_decoder.block_packets.size(), m_decoder.block_fec_packets.size());
+                if (m_decoder.received_any)
+                {
+                    //the current block and all the ones skipped
+                    m_stats.blocks_lost += block_index - m_decoder.crt_block_index;
+                }
                 reset_block = true;
             }
+            m_decoder.received_any = true;
 
             if (reset_block)
             {
@@ -832,6 +867,7 @@ void Fec_Codec::decoder_task_proc()
                 }
 
                 fec_decode(m_fec, m_decoder.fec_src_ptrs.data(), m_decoder.fec_dst_ptrs.data(), indices.data(), m_descriptor.mtu);
+                m_stats.blocks_recovered++;
 
                 //release these as soon as they are not needed
                 for (Decoder::Packet& packet: m_decoder.block_fec_packets)
@@ -909,6 +945,13 @@ const Fec_Codec::Descriptor& Fec_Codec::get_descriptor() const
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
+const Fec_Codec::Stats& Fec_Codec::get_stats() const
+{
+    return m_stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
 /*Fec_Codec s_fec_codec;
 size_t s_fec_encoded_data_size = 0;
 size_t s_fec_decoded_data_size = 0;
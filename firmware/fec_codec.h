@@ -43,10 +43,25 @@ public:
 
     const Descriptor& get_descriptor() const;
 
+    //Decoder counters since the codec was created, updated by the decoder task
+    struct Stats
+    {
+        uint64_t blocks_recovered = 0; //completed with FEC packets
+        uint64_t blocks_lost = 0;      //abandoned for a newer block before they could be completed
+    };
+    const Stats& get_stats() const;
+
     //Callback for when an encoded packet is available
     //NOTE: this is called form another thread!!!
     void set_data_encoded_cb(void (*cb)(void* data, size_t size));
 
+    //True if the encoded packet passed to the encoded cb carries data, false for the FEC packets.
+    //The data packets are passed to the cb before the FEC packets are computed from them.
+    IRAM_ATTR bool is_data_packet(const void* data, size_t size) const;
+
+    //The block of an encoded packet passed to the encoded cb. Consecutive blocks have consecutive indices, modulo 2^24
+    IRAM_ATTR uint32_t get_block_index(const void* data, size_t size) const;
+
     //Add here data that will be encoded.
     //Size dosn't have to be a full packet. Can be anything > 0, even bigger than a packet
     //NOTE: This has to be called from a single thread only (any thread, as long as it's just one)
@@ -56,6 +71,9 @@ public:
     //NOTE: this is called form another thread!!!
     void set_data_decoded_cb(void (*cb)(void* data, size_t size));
 
+    //The block of the packet being passed to the decoded cb, only valid inside it. Same indices as get_block_index
+    IRAM_ATTR uint32_t get_decoded_block_index() const;
+
     //Add here data that will be decoded.
     //Size dosn't have to be a full packet. Can be anything > 0, even bigger than a packet
     //NOTE: This has to be called from a single thread only (any thread, as long as it's just one)
@@ -123,6 +141,7 @@ private:
         TaskHandle_t task = nullptr;
 
         uint32_t crt_block_index = 0;
+        bool received_any = false; //the block indices before the first received packet are not lost
         std::vector<Packet> block_packets;
         std::vector<Packet> block_fec_packets;
 
@@ -137,6 +156,8 @@ private:
         void (*cb)(void* data, size_t size);
     } m_decoder;
 
+    Stats m_stats;
+
     Encoder::Packet* pop_encoder_packet_from_pool();
     void push_encoder_packet_to_pool(Encoder::Packet* packet);
     Decoder::Packet* pop_decoder_packet_from_pool();
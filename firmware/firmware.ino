@@ -1,5 +1,6 @@
 #include <Arduino.h>
 #include <algorithm>
+#include <atomic>
 
 #include "driver/spi_slave.h"
 #include "EEPROM.h"
@@ -16,10 +17,12 @@
 #include "wifi_raw.h"
 #include "fec_codec.h"
 #include "esp_task_wdt.h"
+#include "esp_timer.h"
 #include "bt.h"
 
 #include "structures.h"
 #include "spi_comms.h"
+#include "latency_trace.h"
 
 static int s_stats_last_tp = 0;
 
@@ -60,6 +63,22 @@ static constexpr uint8_t s_rate_mapping[31] =
     31, //30 - N 72M   MCS7 Short Guard Interval
 };
 
+//Bit rate & preamble of each rate above, for the airtime of the frames handed to the driver
+struct Wlan_Rate_Timing
+{
+    uint32_t kbps;
+    uint32_t preamble_us;
+};
+static constexpr Wlan_Rate_Timing s_rate_timings[31] =
+{
+    { 1000, 192 }, { 2000, 192 }, { 2000, 96 }, { 5500, 192 }, { 5500, 96 }, { 11000, 192 }, { 11000, 96 },   //0 - 6: B
+    { 6000, 20 }, { 9000, 20 }, { 12000, 20 }, { 18000, 20 }, { 24000, 20 }, { 36000, 20 }, { 48000, 20 },  //7 - 13: G
+    { 54000, 20 },                                                                                            //14: G
+    { 6500, 36 }, { 7200, 36 }, { 13000, 36 }, { 14400, 36 }, { 19500, 36 }, { 21700, 36 }, { 26000, 36 },   //15 - 21: N
+    { 28900, 36 }, { 39000, 36 }, { 43300, 36 }, { 52000, 36 }, { 57800, 36 }, { 58500, 36 }, { 65000, 36 }, //22 - 28: N
+    { 65000, 36 }, { 72200, 36 },                                                                             //29 - 30: N
+};
+
 static constexpr gpio_num_t GPIO_MOSI = gpio_num_t(13);
 static constexpr gpio_num_t GPIO_MISO = gpio_num_t(12);
 static constexpr gpio_num_t GPIO_SCLK = gpio_num_t(14);
@@ -161,8 +180,11 @@ IRAM_ATTR static uint8_t crc8(uint8_t crc, const void *c_ptr, size_t len)
 
 /////////////////////////////////////////////////////////////////////////
 
-portMUX_TYPE s_fec_codec_mux = portMUX_INITIALIZER_UNLOCKED;
+portMUX_TYPE s_fec_codec_mux = portMUX_INITIALIZER_UNLOCKED; //the WLAN RX task decoding vs the main loop setting up the codec
 Fec_Codec s_fec_codec;
+//whether the packets the main loop gives to the FEC encoder are latency traced, for the encoded packets. The Phy traces
+// all of its packets or none, so the FEC blocks are traced as a whole
+std::atomic_bool s_fec_encoder_latency_traced{false};
 
 /////////////////////////////////////////////////////////////////////////
 
@@ -184,19 +206,14 @@ float get_wlan_power_dBm()
     return s_wlan_power_dBm;
 }
 
-uint8_t s_wlan_rate = 0;
+//The rate of the traffic classes without one of their own, see SPI_Req_Set_Tx_Class_Rates. The radio is switched to it
+// by the WLAN TX task before the next frame, it's the only one changing the radio rate
+std::atomic<uint8_t> s_wlan_rate{0};
 esp_err_t set_wifi_fixed_rate(uint8_t value)
 {
-    //https://github.com/espressif/esp-idf/issues/833
     uint8_t clamped_value = value <= 30 ? value : 30;
-    wifi_internal_rate_t rate;
-    rate.fix_rate = s_rate_mapping[clamped_value];
-    esp_err_t err = esp_wifi_internal_set_rate(100, 1, 4, &rate);
-    if (err == ESP_OK)
-    {
-        s_wlan_rate = clamped_value;
-    }
-    return err;
+    s_wlan_rate = clamped_value;
+    return ESP_OK;
 }
 
 uint8_t get_wifi_fixed_rate()
@@ -209,30 +226,117 @@ IRAM_ATTR esp_err_t event_handler(void *ctx, system_event_t *event)
     return ESP_OK;
 }
 
-int16_t s_wlan_incoming_rssi = 0; //this is protected by the s_wlan_incoming_mux
+//The outgoing queue policy, see SPI_Req_Set_Outgoing_Queue_Policy
+std::atomic<uint8_t> s_wlan_outgoing_policy{static_cast<uint8_t>(SPI_Outgoing_Queue_Policy::DROP_NEWEST)};
+std::atomic<uint32_t> s_wlan_outgoing_max_age_us{0};
 
-///////////////////////////////////////////////////////////////////////////////////////////
+//With DROP_OLDEST & DROP_FEC_BLOCK, the WLAN TX task drops the oldest packets of a queue until a quarter of it is free,
+// so the new packets don't find it full
+IRAM_ATTR inline size_t get_wlan_outgoing_headroom(const Wlan_Outgoing_Queue& queue)
+{
+    return queue.capacity() / 4;
+}
 
-IRAM_ATTR void add_to_wlan_outgoing_queue(const Wlan_Packet_Header& packet_header, const void* data, size_t size, bool isr)
+//With DROP_FEC_BLOCK, the block being dropped: the encoder task sets it when a packet doesn't fit and the WLAN TX task
+// when it drops one. The other packets of the block are dropped too, wherever they are
+constexpr uint32_t NO_FEC_BLOCK = 0xFFFFFFFF;
+std::atomic<uint32_t> s_wlan_outgoing_dropped_fec_block{NO_FEC_BLOCK};
+
+//Packing of the small packets, see SPI_Req_Set_Packing
+std::atomic_bool s_wlan_packing{true};
+std::atomic<uint32_t> s_wlan_packing_max_delay_us{0};
+
+//The rates of the traffic classes, see SPI_Req_Set_Tx_Class_Rates
+std::atomic<uint8_t> s_wlan_tx_class_rates[SPI_TX_CLASS_COUNT] = 
 {
-    Wlan_Outgoing_Packet packet;
+    {SPI_TX_CLASS_RATE_DEFAULT}, {SPI_TX_CLASS_RATE_DEFAULT}, {SPI_TX_CLASS_RATE_DEFAULT}, {SPI_TX_CLASS_RATE_DEFAULT}
+};
 
-    if (isr)
+//The link IDs, see SPI_Req_Set_Link_Ids. The RX filter has them as get_wlan_link_id_key and the source address prefix as
+// a 32 bit load gives it, so a frame costs one 32 bit compare and a 16 bit one per ID. Both are set up in setup()
+std::atomic<uint16_t> s_wlan_tx_link_id{SPI_DEFAULT_LINK_ID};
+std::atomic<uint16_t> s_wlan_rx_link_id_keys[SPI_MAX_RX_LINK_IDS];
+std::atomic<uint8_t> s_wlan_rx_link_id_count{0};
+uint32_t s_wlan_link_prefix = 0;
+uint16_t s_wlan_rx_link_ids[SPI_MAX_RX_LINK_IDS] = {}; //as they were set, for the SET_LINK_IDS response
+
+//Called from loop(). The RX filter drops all the frames while the IDs change
+void set_wlan_rx_link_ids(const uint16_t* link_ids, size_t count)
+{
+    s_wlan_rx_link_id_count = 0;
+    for (size_t i = 0; i < count; i++)
     {
-      portENTER_CRITICAL_ISR(&s_wlan_outgoing_mux);
-      start_writing_wlan_outgoing_packet(packet, size + sizeof(Wlan_Packet_Header));
-      portEXIT_CRITICAL_ISR(&s_wlan_outgoing_mux);
+        s_wlan_rx_link_ids[i] = link_ids[i];
+        s_wlan_rx_link_id_keys[i] = get_wlan_link_id_key(link_ids[i]);
     }
-    else
+    s_wlan_rx_link_id_count = count;
+}
+
+IRAM_ATTR inline bool is_wlan_rx_frame_of_link(const uint8_t* ieee_header)
+{
+    uint32_t prefix;
+    memcpy(&prefix, ieee_header + WLAN_LINK_PREFIX_OFFSET, sizeof(prefix));
+    if (prefix != s_wlan_link_prefix)
     {
-      portENTER_CRITICAL(&s_wlan_outgoing_mux);
-      start_writing_wlan_outgoing_packet(packet, size + sizeof(Wlan_Packet_Header));
-      portEXIT_CRITICAL(&s_wlan_outgoing_mux);
+        return false;
     }
-    
+    uint16_t key;
+    memcpy(&key, ieee_header + WLAN_LINK_ID_OFFSET, sizeof(key));
+    size_t count = s_wlan_rx_link_id_count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (key == s_wlan_rx_link_id_keys[i].load(std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//With the TX link ID
+IRAM_ATTR inline void write_wlan_ieee_header(uint8_t* dst)
+{
+    memcpy(dst, s_wlan_ieee_header, WLAN_IEEE_HEADER_SIZE);
+    set_wlan_link_id(dst, s_wlan_tx_link_id.load(std::memory_order_relaxed));
+}
+
+//Sends the outgoing packets, see wlan_tx_task_proc
+TaskHandle_t s_wlan_tx_task = nullptr;
+std::atomic_bool s_wlan_tx_activity{false}; //a packet was sent, for the status LED which belongs to loop()
+
+//Called by the producers of the outgoing queues after they queued a packet
+IRAM_ATTR inline void notify_wlan_tx_task()
+{
+    if (s_wlan_tx_task)
+    {
+        xTaskNotifyGive(s_wlan_tx_task);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+
+//The FEC packets come from the encoder task and the others from the main loop, in the queue of their priority
+IRAM_ATTR void add_to_wlan_outgoing_queue(Stats_Block& stats, Wlan_Outgoing_Queue& queue, const Wlan_Packet_Header& packet_header, const void* data, size_t size)
+{
+    bool drop_fec_block = packet_header.uses_fec && 
+                          s_wlan_outgoing_policy.load(std::memory_order_relaxed) == static_cast<uint8_t>(SPI_Outgoing_Queue_Policy::DROP_FEC_BLOCK);
+    uint32_t block_index = drop_fec_block ? s_fec_codec.get_block_index(data, size) : NO_FEC_BLOCK;
+    if (drop_fec_block && block_index == s_wlan_outgoing_dropped_fec_block.load(std::memory_order_relaxed))
+    {
+        add_stat(stats.wlan_outgoing_packets_evicted);
+        return;
+    }
+
+    Wlan_Outgoing_Packet packet;
+    start_writing_wlan_outgoing_packet(queue, packet, size + sizeof(Wlan_Packet_Header), esp_timer_get_time());
     if (!packet.ptr)
     {
-        //LOG("Sending failed: previous packet still in flight\n");
+        //LOG("Sending failed: queue full\n");
+        add_stat(stats.wlan_outgoing_packets_dropped);
+        if (drop_fec_block)
+        {
+            s_wlan_outgoing_dropped_fec_block = block_index;
+        }
         return;
     }
     //LOG("Sending %d\n", size);
@@ -243,149 +347,271 @@ IRAM_ATTR void add_to_wlan_outgoing_queue(const Wlan_Packet_Header& packet_heade
     
     //LOG("Sending packet of size %d\n", packet.size);
 
-    if (isr)
-    {
-      portENTER_CRITICAL_ISR(&s_wlan_outgoing_mux);
-      end_writing_wlan_outgoing_packet(packet);
-      portEXIT_CRITICAL_ISR(&s_wlan_outgoing_mux);  
-    }
-    else
-    {
-      portENTER_CRITICAL(&s_wlan_outgoing_mux);
-      end_writing_wlan_outgoing_packet(packet);
-      portEXIT_CRITICAL(&s_wlan_outgoing_mux);  
-    }
+    end_writing_wlan_outgoing_packet(packet);
+    update_high_water(stats.wlan_outgoing_queue_high_water, get_wlan_outgoing_size());
+    notify_wlan_tx_task();
 }
 
-IRAM_ATTR void add_to_wlan_incoming_queue(const void* data, size_t size, bool isr)
+//Called by the WLAN TX task for the packet about to be sent. Applies the outgoing queue policy and returns true if the
+// packet was dropped instead
+IRAM_ATTR bool drop_wlan_outgoing_packet(Wlan_Outgoing_Packet& packet)
 {
-    Wlan_Incoming_Packet packet;
+    SPI_Outgoing_Queue_Policy policy = static_cast<SPI_Outgoing_Queue_Policy>(s_wlan_outgoing_policy.load(std::memory_order_relaxed));
+    uint32_t max_age_us = s_wlan_outgoing_max_age_us.load(std::memory_order_relaxed);
+
+    bool expired = max_age_us > 0 && static_cast<uint32_t>(esp_timer_get_time()) - packet.time_us > max_age_us;
+    bool evicted = !expired && policy != SPI_Outgoing_Queue_Policy::DROP_NEWEST && 
+                   packet.queue->size() + get_wlan_outgoing_headroom(*packet.queue) > packet.queue->capacity();
+
+    const Wlan_Packet_Header& packet_header = *((const Wlan_Packet_Header*)packet.payload_ptr);
+    if (policy == SPI_Outgoing_Queue_Policy::DROP_FEC_BLOCK && packet_header.uses_fec)
+    {
+        uint32_t block_index = s_fec_codec.get_block_index(packet.payload_ptr + sizeof(Wlan_Packet_Header), packet.size - sizeof(Wlan_Packet_Header));
+        if (expired || evicted)
+        {
+            s_wlan_outgoing_dropped_fec_block = block_index;
+        }
+        else if (block_index == s_wlan_outgoing_dropped_fec_block.load(std::memory_order_relaxed))
+        {
+            evicted = true;
+        }
+    }
 
-    if (isr)
+    if (!expired && !evicted)
+    {
+        return false;
+    }
+    if (expired)
     {
-      portENTER_CRITICAL_ISR(&s_wlan_incoming_mux);
-      start_writing_wlan_incoming_packet(packet, size);
-      portEXIT_CRITICAL_ISR(&s_wlan_incoming_mux);
+        add_stat(s_wlan_tx_stats.wlan_outgoing_packets_expired);
     }
     else
     {
-      portENTER_CRITICAL(&s_wlan_incoming_mux);
-      start_writing_wlan_incoming_packet(packet, size);
-      portEXIT_CRITICAL(&s_wlan_incoming_mux);
+        add_stat(s_wlan_tx_stats.wlan_outgoing_packets_evicted);
     }
-    
+    end_reading_wlan_outgoing_packet(packet);
+    return true;
+}
+
+//The FEC packets come from the decoder task and the others from the WLAN RX task, each has its own queue
+IRAM_ATTR void add_to_wlan_incoming_queue(Stats_Block& stats, Wlan_Incoming_Queue& queue, const SPI_Rx_Info& info, const void* data, size_t size)
+{
+    Wlan_Incoming_Packet packet;
+    start_writing_wlan_incoming_packet(queue, packet, size, info);
     if (!packet.ptr)
     {
-        //LOG("Sending failed: previous packet still in flight\n");
+        //LOG("Sending failed: queue full\n");
+        add_stat(stats.wlan_received_packets_dropped);
         return;
     }
     //LOG("decoded %d\n", size);
     
-    memcpy(packet.ptr, data, size);
+    memcpy(packet.payload_ptr, data, size);
     
     //LOG("Sending packet of size %d\n", packet.size);
 
-    if (isr)
+    end_writing_wlan_incoming_packet(packet);
+    update_high_water(stats.wlan_incoming_queue_high_water, get_wlan_incoming_size());
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+
+//The WLAN RX task does the filtering, the FEC decoding and the queueing of the received frames, off the core of the
+// WiFi stack so the driver never waits for it
+constexpr UBaseType_t WLAN_RX_TASK_PRIORITY = configMAX_PRIORITIES - 2; //below the FEC codec
+constexpr BaseType_t WLAN_RX_TASK_CORE = 1;
+constexpr TickType_t WLAN_RX_IDLE_TIMEOUT = 10 / portTICK_PERIOD_MS; //in case a notification is missed
+TaskHandle_t s_wlan_rx_task = nullptr;
+
+//The radio info of the last FEC blocks received, by block index. The WLAN RX task adds the packets of a block and the
+// decoder task takes it for the decoded ones (see fec_decoded_cb), which can be a few blocks behind
+struct Wlan_Rx_Fec_Block
+{
+    uint32_t block_index = NO_FEC_BLOCK;
+    SPI_Rx_Info info = {};
+};
+constexpr size_t WLAN_RX_FEC_BLOCK_COUNT = 8;
+Wlan_Rx_Fec_Block s_wlan_rx_fec_blocks[WLAN_RX_FEC_BLOCK_COUNT];
+portMUX_TYPE s_wlan_rx_fec_blocks_mux = portMUX_INITIALIZER_UNLOCKED;
+
+//The rate codes of SPI_Rx_Info are not in bitrate order, so they are compared through their bitrates (kbps)
+static constexpr uint32_t s_wlan_rx_legacy_rate_kbps[16] =
+{
+    1000, 2000, 5500, 11000, 1000, 2000, 5500, 11000,     //0 - 7: B, long then short preamble
+    48000, 24000, 12000, 6000, 54000, 36000, 18000, 9000, //8 - 15: G
+};
+static constexpr uint32_t s_wlan_rx_mcs_rate_kbps[8] = { 6500, 13000, 19500, 26000, 39000, 52000, 58500, 65000 };
+
+IRAM_ATTR inline uint32_t get_wlan_rx_rate_kbps(uint8_t rate)
+{
+    return (rate & SPI_RX_RATE_MCS) ? s_wlan_rx_mcs_rate_kbps[rate & 7] : s_wlan_rx_legacy_rate_kbps[rate & 15];
+}
+
+IRAM_ATTR void add_to_wlan_rx_fec_block(uint32_t block_index, const SPI_Rx_Info& info)
+{
+    portENTER_CRITICAL(&s_wlan_rx_fec_blocks_mux);
+    Wlan_Rx_Fec_Block& block = s_wlan_rx_fec_blocks[block_index % WLAN_RX_FEC_BLOCK_COUNT];
+    if (block.block_index != block_index)
     {
-      portENTER_CRITICAL_ISR(&s_wlan_incoming_mux);
-      end_writing_wlan_incoming_packet(packet);
-      portEXIT_CRITICAL_ISR(&s_wlan_incoming_mux);
+        block.block_index = block_index;
+        block.info = info;
     }
     else
     {
-      portENTER_CRITICAL(&s_wlan_incoming_mux);
-      end_writing_wlan_incoming_packet(packet);
-      portEXIT_CRITICAL(&s_wlan_incoming_mux);
+        block.info.rssi = std::min(block.info.rssi, info.rssi);
+        block.info.noise_floor = std::max(block.info.noise_floor, info.noise_floor);
+        if (get_wlan_rx_rate_kbps(info.rate) < get_wlan_rx_rate_kbps(block.info.rate))
+        {
+            block.info.rate = info.rate;
+        }
+        block.info.packet_count++;
+        block.info.latency_traced |= info.latency_traced;
     }
+    portEXIT_CRITICAL(&s_wlan_rx_fec_blocks_mux);
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////
+IRAM_ATTR SPI_Rx_Info get_wlan_rx_fec_block_info(uint32_t block_index)
+{
+    SPI_Rx_Info info = {};
+    portENTER_CRITICAL(&s_wlan_rx_fec_blocks_mux);
+    const Wlan_Rx_Fec_Block& block = s_wlan_rx_fec_blocks[block_index % WLAN_RX_FEC_BLOCK_COUNT];
+    if (block.block_index == block_index)
+    {
+        info = block.info;
+    }
+    portEXIT_CRITICAL(&s_wlan_rx_fec_blocks_mux);
+    return info;
+}
 
+//Runs in the WiFi driver task. It drops the frames of the other links and only copies the others to the RX frame queue
+// and wakes up the WLAN RX task. The driver filter already passes only the data frames
 IRAM_ATTR void packet_received_cb(void* buf, wifi_promiscuous_pkt_type_t type)
 {
-    if (type == WIFI_PKT_MGMT)
+    if (type != WIFI_PKT_DATA)
     {
-        //Serial.printf("management packet\n");
         return;
     }
-    else if (type == WIFI_PKT_DATA)
+
+    const wifi_promiscuous_pkt_t* pkt = reinterpret_cast<const wifi_promiscuous_pkt_t*>(buf);
+    if (pkt->rx_ctrl.sig_len <= WLAN_IEEE_HEADER_SIZE + sizeof(Wlan_Packet_Header) + 4)
     {
-        //Serial.printf("data packet\n");
+        //LOG("WLAN receive header error");
+        add_stat(s_wlan_rx_cb_stats.wlan_error_count);
+        return;
     }
-    else if (type == WIFI_PKT_MISC)
+    if (!is_wlan_rx_frame_of_link(pkt->payload))
     {
-        //Serial.printf("misc packet\n");
+        add_stat(s_wlan_rx_cb_stats.wlan_frames_filtered);
         return;
     }
 
-    wifi_promiscuous_pkt_t* pkt = reinterpret_cast<wifi_promiscuous_pkt_t*>(buf);
-
-    uint16_t len = pkt->rx_ctrl.sig_len;
-    //s_stats.wlan_data_received += len;
-    //s_stats.wlan_data_sent += 1;
+    Wlan_Rx_Frame frame;
+    frame.info.rssi = pkt->rx_ctrl.rssi;
+    frame.info.noise_floor = pkt->rx_ctrl.noise_floor;
+    frame.info.rate = pkt->rx_ctrl.sig_mode ? (SPI_RX_RATE_MCS | pkt->rx_ctrl.mcs) : pkt->rx_ctrl.rate;
+    frame.info.channel = pkt->rx_ctrl.channel;
+    frame.info.time_us = esp_timer_get_time();
+    frame.info.packet_count = 1;
+    frame.len = pkt->rx_ctrl.sig_len;
+    size_t size = std::min<size_t>(frame.len, WLAN_MAX_RX_FRAME_SIZE);
 
-    if (len <= WLAN_IEEE_HEADER_SIZE + sizeof(Wlan_Packet_Header))
+    uint8_t* buffer = s_wlan_rx_frame_queue.start_writing(sizeof(frame) + size);
+    if (!buffer)
     {
-        //LOG("WLAN receive header error");
-        s_stats.wlan_error_count++;
+        add_stat(s_wlan_rx_cb_stats.wlan_received_packets_dropped);
         return;
     }
+    memcpy(buffer, &frame, sizeof(frame));
+    memcpy(buffer + sizeof(frame), pkt->payload, size);
+    s_wlan_rx_frame_queue.end_writing(buffer);
 
-    //Serial.printf("Recv callback #%d: %d bytes\n", counter++, len);
-    //Serial.printf("Channel: %d PHY: %d\n", pkt->rx_ctl.channel, wifi_get_phy_mode());
-
-    //uint8_t broadcast_mac[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-    //Serial.printf("MAC: %02x:%02x:%02x:%02x:%02x:%02x\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-    uint8_t* data = pkt->payload;
-    if (memcmp(data + 10, s_wlan_ieee_header + 10, 6) != 0)
+    if (s_wlan_rx_task)
     {
-        return;
+        xTaskNotifyGive(s_wlan_rx_task);
     }
+}
+
+IRAM_ATTR void process_wlan_rx_frame(const Wlan_Rx_Frame& frame, uint8_t* data, size_t size)
+{
+    uint16_t len = frame.len;
+    //s_stats.wlan_data_received += len;
+    //s_stats.wlan_data_sent += 1;
 
+    //the length and the link were checked in packet_received_cb
     data += WLAN_IEEE_HEADER_SIZE;
     len -= WLAN_IEEE_HEADER_SIZE; //skip the 802.11 header
 
     len -= 4;//the received length has 4 more bytes at the end for some reason.
 
-    int16_t rssi = pkt->rx_ctrl.rssi;
-    /*  if (s_uart_verbose >= 1)
-  {
-    Serial.printf("RSSI: %d, CH: %d, SZ: %d\n", rssi, pkt->rx_ctrl.channel, len);
-    if (s_uart_verbose >= 2)
-    {
-      Serial.printf("---->\n");
-      Serial.write(data, len);
-      Serial.printf("\n<----\n");
-    }
-  }
-*/
-
-
-    size_t size = std::min<size_t>(len, WLAN_MAX_PAYLOAD_SIZE);
+    size = std::min<size_t>(len, WLAN_MAX_PAYLOAD_SIZE);
 
     Wlan_Packet_Header& packet_header = *((Wlan_Packet_Header*)data);
     data += sizeof(Wlan_Packet_Header);
     size -= sizeof(Wlan_Packet_Header);
 
-    portENTER_CRITICAL_ISR(&s_wlan_incoming_mux);
-    s_wlan_incoming_rssi = rssi;
-    portEXIT_CRITICAL_ISR(&s_wlan_incoming_mux);
+    SPI_Rx_Info info = frame.info;
+    info.latency_traced = packet_header.latency_traced;
 
-    if (packet_header.uses_fec)
+    if (packet_header.packed)
+    {
+      while (size > 0)
+      {
+        Wlan_Packed_Header packed_header;
+        if (size < sizeof(packed_header))
+        {
+          add_stat(s_wlan_rx_stats.wlan_error_count);
+          break;
+        }
+        memcpy(&packed_header, data, sizeof(packed_header));
+        data += sizeof(packed_header);
+        size -= sizeof(packed_header);
+        if (packed_header.size > size)
+        {
+          add_stat(s_wlan_rx_stats.wlan_error_count);
+          break;
+        }
+        stamp_latency_trace(data, packed_header.size, info.latency_traced, Latency_Trace_Stage::MODULE_WLAN_RX, info.time_us);
+        add_to_wlan_incoming_queue(s_wlan_rx_stats, s_wlan_incoming_queue, info, data, packed_header.size);
+        data += packed_header.size;
+        size -= packed_header.size;
+      }
+    }
+    else if (packet_header.uses_fec)
     {
-      portENTER_CRITICAL_ISR(&s_fec_codec_mux);
+      add_to_wlan_rx_fec_block(s_fec_codec.get_block_index(data, size), info);
+      portENTER_CRITICAL(&s_fec_codec_mux);
       if (!s_fec_codec.decode_data(data, size, true, false))
       {
-          s_stats.wlan_received_packets_dropped++;
+          add_stat(s_wlan_rx_stats.wlan_received_packets_dropped);
       }
-      portEXIT_CRITICAL_ISR(&s_fec_codec_mux);
+      portEXIT_CRITICAL(&s_fec_codec_mux);
     }
     else
     {
-      add_to_wlan_incoming_queue(data, size, true);
+      stamp_latency_trace(data, size, info.latency_traced, Latency_Trace_Stage::MODULE_WLAN_RX, info.time_us);
+      add_to_wlan_incoming_queue(s_wlan_rx_stats, s_wlan_incoming_queue, info, data, size);
     }
     
-    s_stats.wlan_data_received += len;
+    add_stat(s_wlan_rx_stats.wlan_data_received, len);
+    add_stat(s_wlan_rx_stats.wlan_packets_received);
+}
+
+//Takes all the frames queued since the last wakeup
+IRAM_ATTR void wlan_rx_task_proc(void*)
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, WLAN_RX_IDLE_TIMEOUT);
+
+        size_t size = 0;
+        while (uint8_t* buffer = s_wlan_rx_frame_queue.start_reading(size))
+        {
+            Wlan_Rx_Frame frame;
+            memcpy(&frame, buffer, sizeof(frame));
+            process_wlan_rx_frame(frame, buffer + sizeof(frame), size - sizeof(frame));
+            s_wlan_rx_frame_queue.end_reading();
+        }
+    }
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -414,7 +640,8 @@ void read_adc()
     s_adc_last_read_tp_ms = now;
 
     portENTER_CRITICAL_ISR(&s_adc_data_mux);
-    ADC_Data data[MAX_ADC] = s_adc_data;
+    ADC_Data data[MAX_ADC];
+    memcpy(data, s_adc_data, sizeof(ADC_Data) * MAX_ADC);
     portEXIT_CRITICAL_ISR(&s_adc_data_mux);
     
     for (size_t i = 0; i < MAX_ADC; i++)
@@ -482,13 +709,11 @@ void parse_command()
             {
                 Wlan_Outgoing_Packet packet;
                 
-                portENTER_CRITICAL(&s_wlan_outgoing_mux);
-                start_writing_wlan_outgoing_packet(packet, s_uart_offset);
-                portEXIT_CRITICAL(&s_wlan_outgoing_mux);
+                start_writing_wlan_outgoing_packet(s_wlan_outgoing_queue, packet, s_uart_offset, esp_timer_get_time());
                 
                 if (!packet.ptr)
                 {
-                    LOG("Sending failed: previous packet still in flight\n");
+                    LOG("Sending failed: queue full\n");
                     s_uart_command = 0;
                     s_uart_offset = 0;
                     s_uart_error_count++;
@@ -499,9 +724,8 @@ void parse_command()
 
                 LOG("Sending packet of size %d\n", packet.size);
                 
-                portENTER_CRITICAL(&s_wlan_outgoing_mux);
                 end_writing_wlan_outgoing_packet(packet);
-                portEXIT_CRITICAL(&s_wlan_outgoing_mux);
+                notify_wlan_tx_task();
                 
                 s_uart_command = 0;
                 s_uart_offset = 0;
@@ -618,14 +842,25 @@ void parse_command()
 
 IRAM_ATTR void fec_encoded_cb(void* data, size_t size)
 {
-    Wlan_Packet_Header packet_header;
+    bool latency_traced = s_fec_encoder_latency_traced.load(std::memory_order_relaxed);
+
+    //only the data packets, before the FEC packets are computed from them
+    if (s_fec_codec.is_data_packet(data, size))
+    {
+        stamp_latency_trace(data, size, latency_traced, Latency_Trace_Stage::MODULE_FEC_ENCODED, esp_timer_get_time());
+    }
+
+    Wlan_Packet_Header packet_header = {};
     packet_header.uses_fec = 1;
-    add_to_wlan_outgoing_queue(packet_header, data, size, false);
+    packet_header.latency_traced = latency_traced ? 1 : 0;
+    add_to_wlan_outgoing_queue(s_fec_encoder_stats, s_wlan_outgoing_fec_queue, packet_header, data, size);
 }
 
 IRAM_ATTR void fec_decoded_cb(void* data, size_t size)
 {
-    add_to_wlan_incoming_queue(data, size, false);
+    SPI_Rx_Info info = get_wlan_rx_fec_block_info(s_fec_codec.get_decoded_block_index());
+    stamp_latency_trace(data, size, info.latency_traced, Latency_Trace_Stage::MODULE_FEC_DECODED, esp_timer_get_time());
+    add_to_wlan_incoming_queue(s_fec_decoder_stats, s_wlan_incoming_fec_queue, info, data, size);
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -637,6 +872,12 @@ Wlan_Incoming_Packet s_spi_last_packet;
 uint8_t s_spi_packet_id = 0;
 int s_spi_transaction_id = 0;
 
+//command responses waiting to be sent to the host, in the TLV format of the command section
+uint8_t s_spi_command_responses[MAX_SPI_COMMAND_SECTION_SIZE];
+size_t s_spi_command_responses_size = 0;
+size_t s_spi_sent_command_responses_size = 0; //how many bytes went out with the last response
+size_t s_spi_sent_command_responses_end = 0; //the transfer size needed for them to reach the host
+
 IRAM_ATTR void spi_post_setup_cb(spi_slave_transaction_t* trans)
 {
     //    LOG("SPI armed %d: %d\n", (int)trans->user, trans->length / 8);
@@ -692,20 +933,19 @@ esp_err_t init_spi()
     return spi_slave_initialize(VSPI_HOST, &bus_config, &slave_config, 1);
 }
 
-IRAM_ATTR void setup_spi_packet_response(size_t transfer_size, uint8_t seq)
+IRAM_ATTR void setup_spi_packet_response(size_t transfer_size, bool hold_packet, uint8_t seq)
 {
     SPI_Res_Packet_Header& header = *reinterpret_cast<SPI_Res_Packet_Header*>(s_spi_tx_buffer);
     header.res = static_cast<uint8_t>(SPI_Res::PACKET);
     header.seq = seq & 0x7F;
 
     ///////////////////////////////////////////////////////
-    portENTER_CRITICAL_ISR(&s_wlan_incoming_mux);
-    int16_t rssi = s_wlan_incoming_rssi;
-
-    //did the transfer push the last packet out? finish it
-    if (s_spi_last_packet.ptr != nullptr && transfer_size >= s_spi_last_packet.size + sizeof(SPI_Res_Packet_Header))
+    //did the transfer push the last packet out? finish it, unless the host had no room for it
+    if (s_spi_last_packet.ptr != nullptr && !hold_packet && transfer_size >= s_spi_last_packet.size + sizeof(SPI_Res_Packet_Header))
     {
         //LOG("Ending packet\n");
+        add_stat(s_loop_stats.spi_data_sent, s_spi_last_packet.size);
+        add_stat(s_loop_stats.spi_packets_sent);
         end_reading_wlan_incoming_packet(s_spi_last_packet);
         s_spi_packet_id++;
     }
@@ -720,18 +960,21 @@ IRAM_ATTR void setup_spi_packet_response(size_t transfer_size, uint8_t seq)
     {
         //LOG("Same packet\n");
     }
-    header.pending_packets = s_wlan_incoming_queue.count();
-    portEXIT_CRITICAL_ISR(&s_wlan_incoming_mux);
+    header.pending_packets = get_wlan_incoming_count();
 
     ///////////////////////////////////////////////////////
 
+    size_t packet_size = 0;
     if (s_spi_last_packet.ptr)
     {
         //LOG("Yes packet\n");
-        header.rssi = rssi;
+        packet_size = s_spi_last_packet.size;
+        header.rx_info = s_spi_last_packet.info;
         header.next_packet_size = s_spi_last_packet.size;
         header.packet_size = s_spi_last_packet.size;
-        memcpy(s_spi_tx_buffer + sizeof(header), s_spi_last_packet.ptr, s_spi_last_packet.size);
+        memcpy(s_spi_tx_buffer + sizeof(header), s_spi_last_packet.payload_ptr, s_spi_last_packet.size);
+        stamp_latency_trace(s_spi_tx_buffer + sizeof(header), s_spi_last_packet.size, s_spi_last_packet.info.latency_traced, 
+                            Latency_Trace_Stage::MODULE_SPI_TX, esp_timer_get_time());
     }
     else
     {
@@ -740,28 +983,30 @@ IRAM_ATTR void setup_spi_packet_response(size_t transfer_size, uint8_t seq)
         header.packet_size = 0;
     }
 
-    header.packet_id = s_spi_packet_id;
-    header.crc = 0;
-    header.crc = crc8(0, s_spi_tx_buffer, sizeof(header));
-
-    s_spi_transaction.length = MAX_SPI_BUFFER_SIZE * 8;//(size + payload_size) * 8;
-    s_spi_transaction.tx_buffer = s_spi_tx_buffer;
-    s_spi_transaction.rx_buffer = s_spi_rx_buffer;
-    esp_err_t err = spi_slave_queue_trans(VSPI_HOST, &s_spi_transaction, 0);
-    ESP_ERROR_CHECK(err);
-}
+    ///////////////////////////////////////////////////////
+    //command responses go after the packet. They stay queued until a transfer is big enough to carry them
 
-IRAM_ATTR void setup_spi_base_response(size_t header_size)
-{
-    SPI_Res_Base_Header& header = *reinterpret_cast<SPI_Res_Base_Header*>(s_spi_tx_buffer);
+    //did the transfer push the last responses out? drop them
+    if (s_spi_sent_command_responses_size > 0 && transfer_size >= s_spi_sent_command_responses_end)
+    {
+        s_spi_command_responses_size -= s_spi_sent_command_responses_size;
+        memmove(s_spi_command_responses, s_spi_command_responses + s_spi_sent_command_responses_size, s_spi_command_responses_size);
+    }
 
-    portENTER_CRITICAL_ISR(&s_wlan_incoming_mux);
-    header.pending_packets = s_wlan_incoming_queue.count();
-    header.next_packet_size = s_wlan_incoming_queue.size();
-    portEXIT_CRITICAL_ISR(&s_wlan_incoming_mux);
+    header.command_size = s_spi_command_responses_size;
+    header.command_crc = 0;
+    if (s_spi_command_responses_size > 0)
+    {
+        uint8_t* ptr = s_spi_tx_buffer + sizeof(header) + packet_size;
+        memcpy(ptr, s_spi_command_responses, s_spi_command_responses_size);
+        header.command_crc = crc8(0, ptr, s_spi_command_responses_size);
+    }
+    s_spi_sent_command_responses_size = s_spi_command_responses_size;
+    s_spi_sent_command_responses_end = sizeof(header) + packet_size + s_spi_command_responses_size;
 
+    header.packet_id = s_spi_packet_id;
     header.crc = 0;
-    header.crc = crc8(0, s_spi_tx_buffer, header_size);
+    header.crc = crc8(0, s_spi_tx_buffer, sizeof(header));
 
     s_spi_transaction.length = MAX_SPI_BUFFER_SIZE * 8;//(size + payload_size) * 8;
     s_spi_transaction.tx_buffer = s_spi_tx_buffer;
@@ -791,117 +1036,52 @@ IRAM_ATTR size_t get_header_size(const uint8_t* ptr)
     switch (req)
     {
     case SPI_Req::PACKET: return sizeof(SPI_Req_Packet_Header);
-    case SPI_Req::SETUP_FEC_CODEC: return sizeof(SPI_Req_Setup_Fec_Codec_Header);
-    case SPI_Req::SET_RATE: return sizeof(SPI_Req_Set_Rate_Header);
-    case SPI_Req::GET_RATE: return sizeof(SPI_Req_Get_Rate_Header);
-    case SPI_Req::SET_CHANNEL: return sizeof(SPI_Req_Set_Channel_Header);
-    case SPI_Req::GET_CHANNEL: return sizeof(SPI_Req_Get_Channel_Header);
-    case SPI_Req::SET_POWER: return sizeof(SPI_Req_Set_Power_Header);
-    case SPI_Req::GET_POWER: return sizeof(SPI_Req_Get_Power_Header);
-    case SPI_Req::SETUP_ADC: return sizeof(SPI_Req_Setup_ADC_Header);
-    case SPI_Req::GET_ADC: return sizeof(SPI_Req_Get_ADC_Header);
+    default: break;
     }  
     return 0;
 }
 
-IRAM_ATTR void process_spi_transaction(spi_slave_transaction_t* trans)
-{
-    //LOG("SPI done %d: %d / %d\n", (int)trans->user, trans->length / 8, trans->trans_len / 8);
-
-    size_t transfer_size = trans->trans_len >> 3;
-    if (transfer_size < sizeof(SPI_Req_Base_Header))
-    {
-        LOG("SPI error: transfer too small: %d\n", transfer_size);
-        s_stats.spi_error_count++;
-        setup_spi_packet_response(0, 0);
-        return;
-    }
-
-    s_stats.spi_data_received += transfer_size;
-
-    size_t header_size = get_header_size(s_spi_rx_buffer);
-    if (header_size == 0)
-    {
-        LOG("SPI error: unknown header\n");
-        s_stats.spi_error_count++;
-        setup_spi_packet_response(0, 0);
-        return;
-    }
-
-    SPI_Req_Base_Header& base_header = *reinterpret_cast<SPI_Req_Base_Header*>(s_spi_rx_buffer);
-    SPI_Req req = static_cast<SPI_Req>(base_header.req);
-    uint8_t crc = base_header.crc;
+/////////////////////////////////////////////////////////////////////////
 
-    base_header.crc = 0;
-    uint8_t computed_crc = crc8(0, s_spi_rx_buffer, header_size);
-    if (crc != computed_crc)
+//Reserves space for a command response. Returns nullptr if there is no more room, the host will retry the command
+IRAM_ATTR uint8_t* add_spi_command_response(SPI_Res res, uint8_t seq, size_t size)
+{
+    if (s_spi_command_responses_size + sizeof(SPI_Command_Header) + size > MAX_SPI_COMMAND_SECTION_SIZE)
     {
-        LOG("Crc error: %d != %d\n", crc, computed_crc);
-        s_stats.spi_error_count++;
-        setup_spi_packet_response(0, 0);
-        return;
+        LOG("No room for command response %d\n", (int)res);
+        add_stat(s_loop_stats.spi_error_count);
+        return nullptr;
     }
 
-    //LOG("spi header received: %d\n", transfer_size);
-    if (req == SPI_Req::PACKET)
-    {
-        //LOG("PACKET\n");
-        SPI_Req_Packet_Header& req_header = *reinterpret_cast<SPI_Req_Packet_Header*>(s_spi_rx_buffer);
-        if (req_header.packet_size > 0)
-        {
-            //LOG("packet %d", req_header.packet_size);
-            if (transfer_size < req_header.packet_size + sizeof(req_header))
-            {
-                LOG("Not enough data: %d < %d\n", transfer_size, req_header.packet_size + sizeof(req_header));
-                s_stats.spi_error_count++;
-            }
-            else if (req_header.packet_size > WLAN_MAX_PAYLOAD_SIZE)
-            {
-                LOG("Too much data: %d, %d\n", req_header.packet_size, WLAN_MAX_PAYLOAD_SIZE);
-                s_stats.spi_error_count++;
-            }
-            else
-            {
-                if (req_header.use_fec)
-                {
-                    if (!s_fec_codec.is_initialized())
-                    {
-                        LOG("Uninitialized fec codec\n");
-                        s_stats.spi_error_count++;
-                    }
-                    else 
-                    {
-                        portENTER_CRITICAL_ISR(&s_fec_codec_mux);
-                        if (!s_fec_codec.encode_data(s_spi_rx_buffer + sizeof(req_header), req_header.packet_size, true, false))
-                        {
-                            LOG("Fec codec busy\n");
-                            s_stats.spi_error_count++;
-                        }
-                        portEXIT_CRITICAL_ISR(&s_fec_codec_mux);
-                    }
-                }
-                else
-                {
-                    Wlan_Packet_Header packet_header;
-                    packet_header.uses_fec = 0;
-                    add_to_wlan_outgoing_queue(packet_header, s_spi_rx_buffer + sizeof(req_header), req_header.packet_size, true);
-                }
-            }
-        }
-        setup_spi_packet_response(transfer_size, req_header.seq);
-        return;
-    }
+    SPI_Command_Header& header = *reinterpret_cast<SPI_Command_Header*>(s_spi_command_responses + s_spi_command_responses_size);
+    header.type = static_cast<uint8_t>(res);
+    header.seq = seq;
+    header.size = size;
+    uint8_t* data = s_spi_command_responses + s_spi_command_responses_size + sizeof(SPI_Command_Header);
+    memset(data, 0, size);
+    s_spi_command_responses_size += sizeof(SPI_Command_Header) + size;
+    return data;
+}
 
+IRAM_ATTR void process_spi_command(const SPI_Command_Header& command, const uint8_t* data)
+{
+    SPI_Req req = static_cast<SPI_Req>(command.type);
     if (req == SPI_Req::SETUP_FEC_CODEC)
     {
         LOG("SETUP_FEC_CODEC\n");
+        if (command.size < sizeof(SPI_Req_Setup_Fec_Codec))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
 
-        SPI_Req_Setup_Fec_Codec_Header& req_header = *reinterpret_cast<SPI_Req_Setup_Fec_Codec_Header*>(s_spi_rx_buffer);
+        const SPI_Req_Setup_Fec_Codec& req_data = *reinterpret_cast<const SPI_Req_Setup_Fec_Codec*>(data);
 
         Fec_Codec::Descriptor descriptor;
-        descriptor.coding_k = req_header.fec_coding_k;
-        descriptor.coding_n = req_header.fec_coding_n;
-        descriptor.mtu = req_header.fec_mtu;
+        descriptor.coding_k = req_data.fec_coding_k;
+        descriptor.coding_n = req_data.fec_coding_n;
+        descriptor.mtu = req_data.fec_mtu;
         descriptor.encoder_core = Fec_Codec::Core::Core_0;
         descriptor.decoder_core = Fec_Codec::Core::Core_0;
         descriptor.encoder_priority = 1;
@@ -910,7 +1090,7 @@ IRAM_ATTR void process_spi_transaction(spi_slave_transaction_t* trans)
         if (descriptor.coding_k > descriptor.coding_n || descriptor.mtu < 32)
         {
             LOG("Bad fec params");
-            s_stats.spi_error_count++;
+            add_stat(s_loop_stats.spi_error_count);
         }
         else 
         {
@@ -918,7 +1098,7 @@ IRAM_ATTR void process_spi_transaction(spi_slave_transaction_t* trans)
             if (!s_fec_codec.init(descriptor))
             {
                 LOG("Failed to init fec codec");
-                s_stats.spi_error_count++;
+                add_stat(s_loop_stats.spi_error_count);
             }
             else
             {
@@ -928,140 +1108,159 @@ IRAM_ATTR void process_spi_transaction(spi_slave_transaction_t* trans)
             portEXIT_CRITICAL_ISR(&s_fec_codec_mux);
         }
 
-        SPI_Res_Setup_Fec_Codec_Header& res_header = *reinterpret_cast<SPI_Res_Setup_Fec_Codec_Header*>(s_spi_tx_buffer);
-        res_header.res = static_cast<uint8_t>(SPI_Res::SETUP_FEC_CODEC);
-        res_header.seq = req_header.seq & 0x7F;
-        descriptor = s_fec_codec.get_descriptor();
-        res_header.fec_coding_k = descriptor.coding_k;
-        res_header.fec_coding_n = descriptor.coding_n;
-        res_header.fec_mtu = descriptor.mtu;
-
-        setup_spi_base_response(sizeof(SPI_Res_Setup_Fec_Codec_Header));
+        SPI_Res_Setup_Fec_Codec* res_data = reinterpret_cast<SPI_Res_Setup_Fec_Codec*>(add_spi_command_response(SPI_Res::SETUP_FEC_CODEC, command.seq, sizeof(SPI_Res_Setup_Fec_Codec)));
+        if (res_data)
+        {
+            descriptor = s_fec_codec.get_descriptor();
+            res_data->fec_coding_k = descriptor.coding_k;
+            res_data->fec_coding_n = descriptor.coding_n;
+            res_data->fec_mtu = descriptor.mtu;
+        }
         return;
     }
     if (req == SPI_Req::SET_RATE)
     {
         LOG("SET_RATE\n");
+        if (command.size < sizeof(SPI_Req_Set_Rate))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
 
-        SPI_Req_Set_Rate_Header& req_header = *reinterpret_cast<SPI_Req_Set_Rate_Header*>(s_spi_rx_buffer);
+        const SPI_Req_Set_Rate& req_data = *reinterpret_cast<const SPI_Req_Set_Rate*>(data);
 
-        LOG("Setting rate: %d\n", (int)req_header.rate);
-        if (set_wifi_fixed_rate(req_header.rate) != ESP_OK)
+        LOG("Setting rate: %d\n", (int)req_data.rate);
+        if (set_wifi_fixed_rate(req_data.rate) != ESP_OK)
         {
-            LOG("Failed to set rate %d", (int)req_header.rate);
-            s_stats.spi_error_count++;
+            LOG("Failed to set rate %d", (int)req_data.rate);
+            add_stat(s_loop_stats.spi_error_count);
         }
 
-        SPI_Res_Set_Rate_Header& res_header = *reinterpret_cast<SPI_Res_Set_Rate_Header*>(s_spi_tx_buffer);
-        res_header.res = static_cast<uint8_t>(SPI_Res::SET_RATE);
-        res_header.seq = req_header.seq & 0x7F;
-        res_header.rate = get_wifi_fixed_rate();
-
-        setup_spi_base_response(sizeof(SPI_Res_Set_Rate_Header));
+        SPI_Res_Set_Rate* res_data = reinterpret_cast<SPI_Res_Set_Rate*>(add_spi_command_response(SPI_Res::SET_RATE, command.seq, sizeof(SPI_Res_Set_Rate)));
+        if (res_data)
+        {
+            res_data->rate = get_wifi_fixed_rate();
+        }
         return;
     }
     if (req == SPI_Req::GET_RATE)
     {
         LOG("GET_RATE\n");
 
-        SPI_Res_Get_Rate_Header& res_header = *reinterpret_cast<SPI_Res_Get_Rate_Header*>(s_spi_tx_buffer);
-        res_header.res = static_cast<uint8_t>(SPI_Res::GET_RATE);
-        res_header.seq = base_header.seq & 0x7F;
-        res_header.rate = get_wifi_fixed_rate();
-
-        setup_spi_base_response(sizeof(SPI_Res_Get_Rate_Header));
+        SPI_Res_Get_Rate* res_data = reinterpret_cast<SPI_Res_Get_Rate*>(add_spi_command_response(SPI_Res::GET_RATE, command.seq, sizeof(SPI_Res_Get_Rate)));
+        if (res_data)
+        {
+            res_data->rate = get_wifi_fixed_rate();
+        }
         return;
     }
     if (req == SPI_Req::SET_CHANNEL)
     {
         LOG("SET_CHANNEL\n");
+        if (command.size < sizeof(SPI_Req_Set_Channel))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
 
-        SPI_Req_Set_Channel_Header& req_header = *reinterpret_cast<SPI_Req_Set_Channel_Header*>(s_spi_rx_buffer);
-
-        SPI_Res_Set_Channel_Header& res_header = *reinterpret_cast<SPI_Res_Set_Channel_Header*>(s_spi_tx_buffer);
-        res_header.res = static_cast<uint8_t>(SPI_Res::SET_CHANNEL);
-        res_header.seq = req_header.seq & 0x7F;
+        const SPI_Req_Set_Channel& req_data = *reinterpret_cast<const SPI_Req_Set_Channel*>(data);
 
-        LOG("Setting channel: %d\n", (int)req_header.channel);
-        if (esp_wifi_set_channel(req_header.channel, WIFI_SECOND_CHAN_NONE) != ESP_OK)
+        uint8_t channel = 0;
+        LOG("Setting channel: %d\n", (int)req_data.channel);
+        if (esp_wifi_set_channel(req_data.channel, WIFI_SECOND_CHAN_NONE) != ESP_OK)
         {
-            LOG("Failed to set channel %d", (int)req_header.channel);
-            res_header.channel = 0;
-            s_stats.spi_error_count++;
+            LOG("Failed to set channel %d", (int)req_data.channel);
+            add_stat(s_loop_stats.spi_error_count);
         }
         else
         {
-            res_header.channel = req_header.channel;
+            channel = req_data.channel;
         }
 
-        setup_spi_base_response(sizeof(SPI_Res_Set_Channel_Header));
+        SPI_Res_Set_Channel* res_data = reinterpret_cast<SPI_Res_Set_Channel*>(add_spi_command_response(SPI_Res::SET_CHANNEL, command.seq, sizeof(SPI_Res_Set_Channel)));
+        if (res_data)
+        {
+            res_data->channel = channel;
+        }
         return;
     }
     if (req == SPI_Req::GET_CHANNEL)
     {
-        LOG("GET_RATE\n");
+        LOG("GET_CHANNEL\n");
 
-        SPI_Res_Get_Channel_Header& res_header = *reinterpret_cast<SPI_Res_Get_Channel_Header*>(s_spi_tx_buffer);
-        res_header.res = static_cast<uint8_t>(SPI_Res::GET_CHANNEL);
-        res_header.seq = base_header.seq & 0x7F;
-        res_header.channel = 0;
-        setup_spi_base_response(sizeof(SPI_Res_Set_Channel_Header));
+        SPI_Res_Get_Channel* res_data = reinterpret_cast<SPI_Res_Get_Channel*>(add_spi_command_response(SPI_Res::GET_CHANNEL, command.seq, sizeof(SPI_Res_Get_Channel)));
+        if (res_data)
+        {
+            res_data->channel = 0;
+        }
         return;
     }
     if (req == SPI_Req::SET_POWER)
     {
         LOG("SET_POWER\n");
+        if (command.size < sizeof(SPI_Req_Set_Power))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
 
-        SPI_Req_Set_Power_Header& req_header = *reinterpret_cast<SPI_Req_Set_Power_Header*>(s_spi_rx_buffer);
+        const SPI_Req_Set_Power& req_data = *reinterpret_cast<const SPI_Req_Set_Power*>(data);
 
-        float power = static_cast<float>(req_header.power) / 10.f;
+        float power = static_cast<float>(req_data.power) / 10.f;
         if (set_wlan_power_dBm(power) != ESP_OK)
         {
             LOG("Failed to set power %f", power);
-            s_stats.spi_error_count++;
+            add_stat(s_loop_stats.spi_error_count);
         }
         else
         {
             LOG("Setting power: %f (real %f)\n", power, get_wlan_power_dBm());
         }
 
-        SPI_Res_Set_Power_Header& res_header = *reinterpret_cast<SPI_Res_Set_Power_Header*>(s_spi_tx_buffer);
-        res_header.res = static_cast<uint8_t>(SPI_Res::SET_POWER);
-        res_header.seq = req_header.seq & 0x7F;
-        res_header.power = static_cast<int16_t>(get_wlan_power_dBm() * 10.f);
-
-        setup_spi_base_response(sizeof(SPI_Res_Set_Power_Header));
+        SPI_Res_Set_Power* res_data = reinterpret_cast<SPI_Res_Set_Power*>(add_spi_command_response(SPI_Res::SET_POWER, command.seq, sizeof(SPI_Res_Set_Power)));
+        if (res_data)
+        {
+            res_data->power = static_cast<int16_t>(get_wlan_power_dBm() * 10.f);
+        }
         return;
     }
     if (req == SPI_Req::GET_POWER)
     {
         LOG("GET_POWER\n");
 
-        SPI_Res_Get_Power_Header& res_header = *reinterpret_cast<SPI_Res_Get_Power_Header*>(s_spi_tx_buffer);
-        res_header.res = static_cast<uint8_t>(SPI_Res::GET_POWER);
-        res_header.seq = base_header.seq & 0x7F;
-        res_header.power = static_cast<int16_t>(get_wlan_power_dBm() * 10.f);
-
-        setup_spi_base_response(sizeof(SPI_Res_Get_Power_Header));
-        return;
+        SPI_Res_Get_Power* res_data = reinterpret_cast<SPI_Res_Get_Power*>(add_spi_command_response(SPI_Res::GET_POWER, command.seq, sizeof(SPI_Res_Get_Power)));
+        if (res_data)
+        {
+            res_data->power = static_cast<int16_t>(get_wlan_power_dBm() * 10.f);
+        }
+        return;
     }
     if (req == SPI_Req::SETUP_ADC)
     {
         LOG("SETUP_ADC\n");
+        if (command.size < sizeof(SPI_Req_Setup_ADC))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
 
-        SPI_Req_Setup_ADC_Header& req_header = *reinterpret_cast<SPI_Req_Setup_ADC_Header*>(s_spi_rx_buffer);
+        const SPI_Req_Setup_ADC& req_data = *reinterpret_cast<const SPI_Req_Setup_ADC*>(data);
 
-        s_adc_enabled = req_header.adc_enabled;
-        uint32_t rate = req_header.adc_rate;
+        s_adc_enabled = req_data.adc_enabled;
+        uint32_t rate = req_data.adc_rate;
         rate = std::min(std::max(rate, 1u), 100u);
         s_adc_read_duration_ms = 1000 / rate;
         
         adc_bits_width_t widths[] = { ADC_WIDTH_BIT_9, ADC_WIDTH_BIT_10, ADC_WIDTH_BIT_11, ADC_WIDTH_BIT_12 };
-        s_adc_width = widths[req_header.adc_width & 0x3];
+        s_adc_width = widths[req_data.adc_width & 0x3];
         adc1_config_width(s_adc_width);
         
         adc_atten_t attens[] = { ADC_ATTEN_DB_0, ADC_ATTEN_DB_2_5, ADC_ATTEN_DB_6, ADC_ATTEN_DB_11 }; 
-        adc_atten_t atten = attens[req_header.adc_attenuation & 0x3];
+        adc_atten_t atten = attens[req_data.adc_attenuation & 0x3];
         adc1_config_channel_atten(ADC1_CHANNEL_0, atten);
         adc1_config_channel_atten(ADC1_CHANNEL_1, atten);
         adc1_config_channel_atten(ADC1_CHANNEL_2, atten);
@@ -1073,85 +1272,383 @@ IRAM_ATTR void process_spi_transaction(spi_slave_transaction_t* trans)
 
         esp_adc_cal_characterize(ADC_UNIT_1, atten, s_adc_width, s_adc_vref, &s_adc_characteristics);
 
-        SPI_Res_Setup_ADC_Header& res_header = *reinterpret_cast<SPI_Res_Setup_ADC_Header*>(s_spi_tx_buffer);
-        res_header.res = static_cast<uint8_t>(SPI_Res::SETUP_ADC);
-        res_header.seq = req_header.seq & 0x7F;
-
-        setup_spi_base_response(sizeof(SPI_Res_Setup_ADC_Header));
+        add_spi_command_response(SPI_Res::SETUP_ADC, command.seq, 0);
         return;
     }
     if (req == SPI_Req::GET_ADC)
     {
         LOG("GET_ADC\n");
 
-        SPI_Req_Get_ADC_Header& req_header = *reinterpret_cast<SPI_Req_Get_ADC_Header*>(s_spi_rx_buffer);
-
-        SPI_Res_Get_ADC_Header& res_header = *reinterpret_cast<SPI_Res_Get_ADC_Header*>(s_spi_tx_buffer);
-        res_header.res = static_cast<uint8_t>(SPI_Res::GET_ADC);
-        res_header.seq = req_header.seq & 0x7F;
+        SPI_Res_Get_ADC* res_data = reinterpret_cast<SPI_Res_Get_ADC*>(add_spi_command_response(SPI_Res::GET_ADC, command.seq, sizeof(SPI_Res_Get_ADC)));
+        if (!res_data)
+        {
+            return; //keep the samples for the retry
+        }
 
+        SPI_Res_Get_ADC& res = *res_data;
         portENTER_CRITICAL_ISR(&s_adc_data_mux);
         {
             ADC_Data& data = s_adc_data[0];
-            res_header.adc0_sample_count = data.sample_count;
-            res_header.adc0_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
+            res.adc0_sample_count = data.sample_count;
+            res.adc0_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
             data.sample_count = 0;
             data.accumulated_data = 0;
         }
         {
             ADC_Data& data = s_adc_data[1];
-            res_header.adc1_sample_count = data.sample_count;
-            res_header.adc1_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
+            res.adc1_sample_count = data.sample_count;
+            res.adc1_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
             data.sample_count = 0;
             data.accumulated_data = 0;
         }
         {
             ADC_Data& data = s_adc_data[2];
-            res_header.adc2_sample_count = data.sample_count;
-            res_header.adc2_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
+            res.adc2_sample_count = data.sample_count;
+            res.adc2_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
             data.sample_count = 0;
             data.accumulated_data = 0;
         }
         {
             ADC_Data& data = s_adc_data[3];
-            res_header.adc3_sample_count = data.sample_count;
-            res_header.adc3_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
+            res.adc3_sample_count = data.sample_count;
+            res.adc3_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
             data.sample_count = 0;
             data.accumulated_data = 0;
         }
         {
             ADC_Data& data = s_adc_data[4];
-            res_header.adc4_sample_count = data.sample_count;
-            res_header.adc4_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
+            res.adc4_sample_count = data.sample_count;
+            res.adc4_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
             data.sample_count = 0;
             data.accumulated_data = 0;
         }
         {
             ADC_Data& data = s_adc_data[5];
-            res_header.adc5_sample_count = data.sample_count;
-            res_header.adc5_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
+            res.adc5_sample_count = data.sample_count;
+            res.adc5_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
             data.sample_count = 0;
             data.accumulated_data = 0;
         }
         {
             ADC_Data& data = s_adc_data[6];
-            res_header.adc6_sample_count = data.sample_count;
-            res_header.adc6_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
+            res.adc6_sample_count = data.sample_count;
+            res.adc6_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
             data.sample_count = 0;
             data.accumulated_data = 0;
         }
         {
             ADC_Data& data = s_adc_data[7];
-            res_header.adc7_sample_count = data.sample_count;
-            res_header.adc7_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
+            res.adc7_sample_count = data.sample_count;
+            res.adc7_average = data.sample_count == 0 ? 0 : data.accumulated_data / data.sample_count;
             data.sample_count = 0;
             data.accumulated_data = 0;
         }
         portEXIT_CRITICAL_ISR(&s_adc_data_mux);
+        return;
+    }
+    if (req == SPI_Req::GET_STATS)
+    {
+        LOG("GET_STATS\n");
+        if (command.size < sizeof(SPI_Req_Get_Stats))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
+
+        const SPI_Req_Get_Stats& req_data = *reinterpret_cast<const SPI_Req_Get_Stats*>(data);
+        if (req_data.page >= SPI_STATS_PAGE_COUNT)
+        {
+            LOG("Bad stats page %d\n", (int)req_data.page);
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
+
+        SPI_Res_Get_Stats* res_data = reinterpret_cast<SPI_Res_Get_Stats*>(add_spi_command_response(SPI_Res::GET_STATS, command.seq, sizeof(SPI_Res_Get_Stats)));
+        if (!res_data)
+        {
+            return; //the snapshot is taken on the retry
+        }
+
+        if (req_data.page == 0)
+        {
+            s_stats_snapshot = get_stats();
+            const Fec_Codec::Stats& fec_stats = s_fec_codec.get_stats();
+            s_stats_snapshot.fec_blocks_recovered = fec_stats.blocks_recovered;
+            s_stats_snapshot.fec_blocks_lost = fec_stats.blocks_lost;
+            s_stats_snapshot_time_us = esp_timer_get_time();
+        }
+
+        SPI_Res_Get_Stats& res = *res_data;
+        res.page = req_data.page;
+        res.page_count = SPI_STATS_PAGE_COUNT;
+        res.time_us = s_stats_snapshot_time_us;
+        size_t offset = req_data.page * SPI_STATS_PAGE_SIZE;
+        memcpy(res.data, reinterpret_cast<const uint8_t*>(&s_stats_snapshot) + offset, std::min(SPI_STATS_PAGE_SIZE, sizeof(SPI_Stats) - offset));
+        return;
+    }
+    if (req == SPI_Req::SET_OUTGOING_QUEUE_POLICY)
+    {
+        LOG("SET_OUTGOING_QUEUE_POLICY\n");
+        if (command.size < sizeof(SPI_Req_Set_Outgoing_Queue_Policy))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
+
+        const SPI_Req_Set_Outgoing_Queue_Policy& req_data = *reinterpret_cast<const SPI_Req_Set_Outgoing_Queue_Policy*>(data);
+        if (req_data.policy > static_cast<uint8_t>(SPI_Outgoing_Queue_Policy::DROP_FEC_BLOCK))
+        {
+            LOG("Bad outgoing queue policy: %d\n", (int)req_data.policy);
+            add_stat(s_loop_stats.spi_error_count);
+        }
+        else
+        {
+            LOG("Setting outgoing queue policy: %d, max age %dms\n", (int)req_data.policy, (int)req_data.max_age_ms);
+            s_wlan_outgoing_policy = req_data.policy;
+            s_wlan_outgoing_max_age_us = static_cast<uint32_t>(req_data.max_age_ms) * 1000;
+            s_wlan_outgoing_dropped_fec_block = NO_FEC_BLOCK;
+        }
+
+        SPI_Res_Set_Outgoing_Queue_Policy* res_data = reinterpret_cast<SPI_Res_Set_Outgoing_Queue_Policy*>(add_spi_command_response(SPI_Res::SET_OUTGOING_QUEUE_POLICY, command.seq, sizeof(SPI_Res_Set_Outgoing_Queue_Policy)));
+        if (res_data)
+        {
+            res_data->policy = s_wlan_outgoing_policy;
+            res_data->max_age_ms = s_wlan_outgoing_max_age_us / 1000;
+        }
+        return;
+    }
+    if (req == SPI_Req::SET_PACKING)
+    {
+        LOG("SET_PACKING\n");
+        if (command.size < sizeof(SPI_Req_Set_Packing))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
+
+        const SPI_Req_Set_Packing& req_data = *reinterpret_cast<const SPI_Req_Set_Packing*>(data);
+        LOG("Setting packing: %d, max delay %dms\n", (int)req_data.enabled, (int)req_data.max_delay_ms);
+        s_wlan_packing = req_data.enabled != 0;
+        s_wlan_packing_max_delay_us = static_cast<uint32_t>(req_data.max_delay_ms) * 1000;
+
+        SPI_Res_Set_Packing* res_data = reinterpret_cast<SPI_Res_Set_Packing*>(add_spi_command_response(SPI_Res::SET_PACKING, command.seq, sizeof(SPI_Res_Set_Packing)));
+        if (res_data)
+        {
+            res_data->enabled = s_wlan_packing ? 1 : 0;
+            res_data->max_delay_ms = s_wlan_packing_max_delay_us / 1000;
+        }
+        return;
+    }
+    if (req == SPI_Req::SET_TX_CLASS_RATES)
+    {
+        LOG("SET_TX_CLASS_RATES\n");
+        if (command.size < sizeof(SPI_Req_Set_Tx_Class_Rates))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
+
+        const SPI_Req_Set_Tx_Class_Rates& req_data = *reinterpret_cast<const SPI_Req_Set_Tx_Class_Rates*>(data);
+        for (size_t i = 0; i < SPI_TX_CLASS_COUNT; i++)
+        {
+            uint8_t rate = req_data.rates[i];
+            LOG("Setting the rate of class %d: %d\n", (int)i, (int)rate);
+            if (rate != SPI_TX_CLASS_RATE_DEFAULT && rate > 30)
+            {
+                LOG("Bad rate %d\n", (int)rate);
+                add_stat(s_loop_stats.spi_error_count);
+                continue;
+            }
+            s_wlan_tx_class_rates[i] = rate;
+        }
+
+        SPI_Res_Set_Tx_Class_Rates* res_data = reinterpret_cast<SPI_Res_Set_Tx_Class_Rates*>(add_spi_command_response(SPI_Res::SET_TX_CLASS_RATES, command.seq, sizeof(SPI_Res_Set_Tx_Class_Rates)));
+        if (res_data)
+        {
+            for (size_t i = 0; i < SPI_TX_CLASS_COUNT; i++)
+            {
+                res_data->rates[i] = s_wlan_tx_class_rates[i];
+            }
+        }
+        return;
+    }
+    if (req == SPI_Req::SET_LINK_IDS)
+    {
+        LOG("SET_LINK_IDS\n");
+        if (command.size < sizeof(SPI_Req_Set_Link_Ids))
+        {
+            LOG("Bad command size\n");
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
+
+        const SPI_Req_Set_Link_Ids& req_data = *reinterpret_cast<const SPI_Req_Set_Link_Ids*>(data);
+        if (req_data.rx_link_id_count == 0 || req_data.rx_link_id_count > SPI_MAX_RX_LINK_IDS)
+        {
+            LOG("Bad RX link ID count: %d\n", (int)req_data.rx_link_id_count);
+            add_stat(s_loop_stats.spi_error_count);
+        }
+        else
+        {
+            LOG("Setting link IDs: TX %d, %d RX\n", (int)req_data.tx_link_id, (int)req_data.rx_link_id_count);
+            uint16_t rx_link_ids[SPI_MAX_RX_LINK_IDS];
+            memcpy(rx_link_ids, req_data.rx_link_ids, sizeof(rx_link_ids)); //the request is packed
+            s_wlan_tx_link_id = req_data.tx_link_id;
+            set_wlan_rx_link_ids(rx_link_ids, req_data.rx_link_id_count);
+        }
+
+        SPI_Res_Set_Link_Ids* res_data = reinterpret_cast<SPI_Res_Set_Link_Ids*>(add_spi_command_response(SPI_Res::SET_LINK_IDS, command.seq, sizeof(SPI_Res_Set_Link_Ids)));
+        if (res_data)
+        {
+            uint16_t rx_link_ids[SPI_MAX_RX_LINK_IDS] = {};
+            size_t count = s_wlan_rx_link_id_count;
+            memcpy(rx_link_ids, s_wlan_rx_link_ids, count * sizeof(uint16_t));
+            res_data->tx_link_id = s_wlan_tx_link_id;
+            res_data->rx_link_id_count = count;
+            memcpy(res_data->rx_link_ids, rx_link_ids, sizeof(rx_link_ids));
+        }
+        return;
+    }
+    LOG("Unknown command: %d\n", (int)req);
+    add_stat(s_loop_stats.spi_error_count);
+}
+
+IRAM_ATTR void process_spi_commands(const uint8_t* ptr, size_t size)
+{
+    while (size >= sizeof(SPI_Command_Header))
+    {
+        const SPI_Command_Header& command = *reinterpret_cast<const SPI_Command_Header*>(ptr);
+        if (sizeof(SPI_Command_Header) + command.size > size)
+        {
+            LOG("Truncated command: %d > %d\n", sizeof(SPI_Command_Header) + command.size, size);
+            add_stat(s_loop_stats.spi_error_count);
+            return;
+        }
+        process_spi_command(command, ptr + sizeof(SPI_Command_Header));
+        ptr += sizeof(SPI_Command_Header) + command.size;
+        size -= sizeof(SPI_Command_Header) + command.size;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+IRAM_ATTR void process_spi_transaction(spi_slave_transaction_t* trans)
+{
+    //LOG("SPI done %d: %d / %d\n", (int)trans->user, trans->length / 8, trans->trans_len / 8);
+
+    size_t transfer_size = trans->trans_len >> 3;
+    if (transfer_size < sizeof(SPI_Req_Base_Header))
+    {
+        LOG("SPI error: transfer too small: %d\n", transfer_size);
+        add_stat(s_loop_stats.spi_error_count);
+        setup_spi_packet_response(0, false, 0);
+        return;
+    }
+
+    size_t header_size = get_header_size(s_spi_rx_buffer);
+    if (header_size == 0)
+    {
+        LOG("SPI error: unknown header\n");
+        add_stat(s_loop_stats.spi_error_count);
+        setup_spi_packet_response(0, false, 0);
+        return;
+    }
 
-        setup_spi_base_response(sizeof(SPI_Res_Get_ADC_Header));
+    SPI_Req_Base_Header& base_header = *reinterpret_cast<SPI_Req_Base_Header*>(s_spi_rx_buffer);
+    SPI_Req req = static_cast<SPI_Req>(base_header.req);
+    uint8_t crc = base_header.crc;
+
+    base_header.crc = 0;
+    uint8_t computed_crc = crc8(0, s_spi_rx_buffer, header_size);
+    if (crc != computed_crc)
+    {
+        LOG("Crc error: %d != %d\n", crc, computed_crc);
+        add_stat(s_loop_stats.spi_error_count);
+        add_stat(s_loop_stats.spi_crc_error_count);
+        setup_spi_packet_response(0, false, 0);
+        return;
+    }
+
+    //LOG("spi header received: %d\n", transfer_size);
+    if (req == SPI_Req::PACKET)
+    {
+        //LOG("PACKET\n");
+        SPI_Req_Packet_Header& req_header = *reinterpret_cast<SPI_Req_Packet_Header*>(s_spi_rx_buffer);
+        if (req_header.packet_size > 0)
+        {
+            //LOG("packet %d", req_header.packet_size);
+            if (transfer_size < req_header.packet_size + sizeof(req_header))
+            {
+                LOG("Not enough data: %d < %d\n", transfer_size, req_header.packet_size + sizeof(req_header));
+                add_stat(s_loop_stats.spi_error_count);
+            }
+            else if (req_header.packet_size > WLAN_MAX_PAYLOAD_SIZE)
+            {
+                LOG("Too much data: %d, %d\n", req_header.packet_size, WLAN_MAX_PAYLOAD_SIZE);
+                add_stat(s_loop_stats.spi_error_count);
+            }
+            else
+            {
+                stamp_latency_trace(s_spi_rx_buffer + sizeof(req_header), req_header.packet_size, req_header.latency_traced, 
+                                    Latency_Trace_Stage::MODULE_SPI_RX, esp_timer_get_time());
+                add_stat(s_loop_stats.spi_data_received, req_header.packet_size);
+                add_stat(s_loop_stats.spi_packets_received);
+                if (req_header.use_fec)
+                {
+                    if (!s_fec_codec.is_initialized())
+                    {
+                        LOG("Uninitialized fec codec\n");
+                        add_stat(s_loop_stats.spi_error_count);
+                    }
+                    else 
+                    {
+                        //the codec is set up from this task too, so the mux is only needed by the decoder side
+                        s_fec_encoder_latency_traced.store(req_header.latency_traced != 0, std::memory_order_relaxed);
+                        if (!s_fec_codec.encode_data(s_spi_rx_buffer + sizeof(req_header), req_header.packet_size, false, false))
+                        {
+                            LOG("Fec codec busy\n");
+                            add_stat(s_loop_stats.fec_encoder_packets_dropped);
+                        }
+                    }
+                }
+                else
+                {
+                    Wlan_Packet_Header packet_header = {};
+                    packet_header.uses_fec = 0;
+                    packet_header.latency_traced = req_header.latency_traced;
+                    Wlan_Outgoing_Queue& queue = req_header.priority == static_cast<uint8_t>(SPI_Packet_Priority::CONTROL) ? 
+                                                 s_wlan_outgoing_high_priority_queue : s_wlan_outgoing_queue;
+                    add_to_wlan_outgoing_queue(s_loop_stats, queue, packet_header, s_spi_rx_buffer + sizeof(req_header), req_header.packet_size);
+                }
+            }
+        }
+        if (req_header.command_size > 0)
+        {
+            const uint8_t* commands = s_spi_rx_buffer + sizeof(req_header) + req_header.packet_size;
+            if (transfer_size < sizeof(req_header) + req_header.packet_size + req_header.command_size)
+            {
+                LOG("Not enough command data: %d < %d\n", transfer_size, sizeof(req_header) + req_header.packet_size + req_header.command_size);
+                add_stat(s_loop_stats.spi_error_count);
+            }
+            else if (crc8(0, commands, req_header.command_size) != req_header.command_crc)
+            {
+                LOG("Command crc error\n");
+                add_stat(s_loop_stats.spi_error_count);
+                add_stat(s_loop_stats.spi_crc_error_count);
+            }
+            else
+            {
+                process_spi_commands(commands, req_header.command_size);
+            }
+        }
+        setup_spi_packet_response(transfer_size, req_header.hold_rx_packet != 0, req_header.seq);
         return;
     }
+
     LOG("Unknown req: %d\n", (int)req);
 }
 
@@ -1165,6 +1662,309 @@ IRAM_ATTR void process_spi_transaction(spi_slave_transaction_t* trans)
 #define ESP_WIFI_IF   ESP_IF_WIFI_AP
 #endif
 
+/////////////////////////////////////////////////////////////////////////
+//The WLAN TX task sends the outgoing packets as soon as they are queued instead of one per loop() iteration, in
+// between the SPI, UART & ADC work. It's pinned to the core of loop() (the WiFi stack and the FEC codec are on the
+// other one) with a higher priority, so loop() runs while it waits for packets or for the WiFi driver.
+
+constexpr UBaseType_t WLAN_TX_TASK_PRIORITY = configMAX_PRIORITIES - 2; //below the FEC codec
+constexpr BaseType_t WLAN_TX_TASK_CORE = 1;
+constexpr size_t WLAN_TX_BURST_SIZE = 16; //packets sent per wakeup, then loop() gets a tick
+constexpr TickType_t WLAN_TX_IDLE_TIMEOUT = 10 / portTICK_PERIOD_MS; //in case a notification is missed
+constexpr TickType_t WLAN_TX_MAX_BACKOFF = 4; //ticks
+constexpr int64_t WLAN_TX_CHANNEL_ACCESS_US = 100; //DIFS + average backoff on an idle channel, per frame
+constexpr size_t WLAN_FCS_SIZE = 4;
+
+//The next packet of a queue, or of all of them with no queue, past the ones the outgoing queue policy drops
+IRAM_ATTR bool start_reading_next_wlan_outgoing_packet(Wlan_Outgoing_Packet& packet, Wlan_Outgoing_Queue* queue)
+{
+    while (queue ? start_reading_wlan_outgoing_packet(*queue, packet) : start_reading_wlan_outgoing_packet(packet))
+    {
+        if (!drop_wlan_outgoing_packet(packet))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Small packets without FEC share a frame when there are more of them in their queue, or with a max delay in the normal
+// one. Each goes without its Wlan_Packet_Header, after a Wlan_Packed_Header, and the frame has one with packed = 1
+constexpr size_t WLAN_PACK_START_SIZE = 512; //bigger packets start a frame of their own, they can still join one
+
+IRAM_ATTR SPI_Tx_Class get_wlan_tx_class(const Wlan_Outgoing_Packet& packet)
+{
+    const Wlan_Packet_Header& packet_header = *((const Wlan_Packet_Header*)packet.payload_ptr);
+    if (packet_header.uses_fec)
+    {
+        return s_fec_codec.is_data_packet(packet.payload_ptr + sizeof(Wlan_Packet_Header), packet.size - sizeof(Wlan_Packet_Header)) ? 
+               SPI_Tx_Class::FEC_DATA : SPI_Tx_Class::FEC_PARITY;
+    }
+    return packet.queue == &s_wlan_outgoing_high_priority_queue ? SPI_Tx_Class::CONTROL : SPI_Tx_Class::NORMAL;
+}
+
+struct Wlan_Tx_Pack
+{
+    Wlan_Outgoing_Queue* queue = nullptr; //of all its packets
+    SPI_Tx_Class tx_class = SPI_Tx_Class::NORMAL;
+    size_t size = 0; //of the payload, from the Wlan_Packet_Header
+    size_t count = 0;
+    uint32_t start_time_us = 0;
+    alignas(uint32_t) uint8_t frame[WLAN_MAX_PACKET_SIZE];
+};
+Wlan_Tx_Pack s_wlan_tx_pack; //belongs to the WLAN TX task
+
+IRAM_ATTR bool can_start_wlan_tx_pack(const Wlan_Outgoing_Packet& packet)
+{
+    const Wlan_Packet_Header& packet_header = *((const Wlan_Packet_Header*)packet.payload_ptr);
+    if (!s_wlan_packing || packet_header.uses_fec || packet.size > WLAN_PACK_START_SIZE)
+    {
+        return false;
+    }
+    return packet.queue->count() > 1 || 
+           (packet.queue == &s_wlan_outgoing_queue && s_wlan_packing_max_delay_us.load(std::memory_order_relaxed) > 0);
+}
+
+//The packed packets share the latency_traced bit of the Wlan_Packet_Header
+IRAM_ATTR bool can_add_to_wlan_tx_pack(const Wlan_Tx_Pack& pack, const Wlan_Outgoing_Packet& packet)
+{
+    const Wlan_Packet_Header& packet_header = *((const Wlan_Packet_Header*)packet.payload_ptr);
+    const Wlan_Packet_Header& pack_header = *((const Wlan_Packet_Header*)(pack.frame + WLAN_IEEE_HEADER_SIZE));
+    if (packet_header.latency_traced != pack_header.latency_traced)
+    {
+        return false;
+    }
+    return pack.size + sizeof(Wlan_Packed_Header) + packet.size - sizeof(Wlan_Packet_Header) <= WLAN_MAX_PAYLOAD_SIZE;
+}
+
+//Takes the packet out of its queue
+IRAM_ATTR void add_to_wlan_tx_pack(Wlan_Tx_Pack& pack, Wlan_Outgoing_Packet& packet)
+{
+    if (pack.count == 0)
+    {
+        write_wlan_ieee_header(pack.frame);
+        Wlan_Packet_Header packet_header = {};
+        packet_header.packed = 1;
+        packet_header.latency_traced = ((const Wlan_Packet_Header*)packet.payload_ptr)->latency_traced;
+        *((Wlan_Packet_Header*)(pack.frame + WLAN_IEEE_HEADER_SIZE)) = packet_header;
+        pack.queue = packet.queue;
+        pack.tx_class = get_wlan_tx_class(packet);
+        pack.size = sizeof(Wlan_Packet_Header);
+        pack.start_time_us = esp_timer_get_time();
+    }
+
+    Wlan_Packed_Header packed_header;
+    packed_header.size = packet.size - sizeof(Wlan_Packet_Header);
+    uint8_t* dst = pack.frame + WLAN_IEEE_HEADER_SIZE + pack.size;
+    memcpy(dst, &packed_header, sizeof(packed_header));
+    dst += sizeof(packed_header);
+    memcpy(dst, packet.payload_ptr + sizeof(Wlan_Packet_Header), packed_header.size);
+    const Wlan_Packet_Header& pack_header = *((const Wlan_Packet_Header*)(pack.frame + WLAN_IEEE_HEADER_SIZE));
+    stamp_latency_trace(dst, packed_header.size, pack_header.latency_traced, Latency_Trace_Stage::MODULE_WLAN_TX, esp_timer_get_time());
+
+    pack.size += sizeof(packed_header) + packed_header.size;
+    pack.count++;
+    end_reading_wlan_outgoing_packet(packet);
+}
+
+//Adds the next packets of the pack queue while they fit. Returns true when the pack is ready to be sent: it's full, or
+// its queue is empty and it can't wait any longer. Only the normal queue waits for the max delay and only while the
+// other queues have nothing to send
+IRAM_ATTR bool fill_wlan_tx_pack(Wlan_Tx_Pack& pack)
+{
+    Wlan_Outgoing_Packet packet;
+    while (start_reading_next_wlan_outgoing_packet(packet, pack.queue))
+    {
+        if (!can_add_to_wlan_tx_pack(pack, packet))
+        {
+            cancel_reading_wlan_outgoing_packet(packet);
+            return true;
+        }
+        charge_wlan_outgoing_packet(packet);
+        add_to_wlan_tx_pack(pack, packet);
+    }
+
+    if (pack.queue != &s_wlan_outgoing_queue || 
+        s_wlan_outgoing_high_priority_queue.count() > 0 || s_wlan_outgoing_fec_queue.count() > 0)
+    {
+        return true;
+    }
+    uint32_t max_delay_us = s_wlan_packing_max_delay_us.load(std::memory_order_relaxed);
+    return static_cast<uint32_t>(esp_timer_get_time()) - pack.start_time_us >= max_delay_us;
+}
+
+uint8_t s_wlan_radio_rate = SPI_TX_CLASS_RATE_DEFAULT; //the rate the radio is at, none until the first frame
+int64_t s_wlan_tx_air_end_us = 0; //when the frames handed to the driver are estimated to be all sent
+
+//The driver doesn't tell when it sent a frame, so the end of its queue is estimated from the airtime of every frame
+// handed to it
+IRAM_ATTR void add_wlan_tx_airtime(size_t frame_size)
+{
+    uint8_t rate = s_wlan_radio_rate != SPI_TX_CLASS_RATE_DEFAULT ? s_wlan_radio_rate : s_wlan_rate.load(std::memory_order_relaxed);
+    const Wlan_Rate_Timing& timing = s_rate_timings[rate];
+    int64_t airtime_us = WLAN_TX_CHANNEL_ACCESS_US + timing.preamble_us + (frame_size + WLAN_FCS_SIZE) * 8 * 1000 / timing.kbps;
+    s_wlan_tx_air_end_us = std::max(esp_timer_get_time(), s_wlan_tx_air_end_us) + airtime_us;
+}
+
+//The radio keeps its rate until it's switched again, so only the frames of a class with another rate than the previous
+// frame pay for a driver call
+IRAM_ATTR void switch_wlan_radio_rate(SPI_Tx_Class tx_class)
+{
+    uint8_t rate = s_wlan_tx_class_rates[static_cast<size_t>(tx_class)].load(std::memory_order_relaxed);
+    if (rate == SPI_TX_CLASS_RATE_DEFAULT)
+    {
+        rate = s_wlan_rate.load(std::memory_order_relaxed);
+    }
+    if (rate == s_wlan_radio_rate)
+    {
+        return;
+    }
+
+    //It's not verified on hardware whether the driver applies a new rate to the frames it already has (when they go on
+    // air) or only to the next ones, so it's drained first and the frames of the previous class keep their rate.
+    //The wait is the estimated airtime left. On a busy channel the last frames can still take the new rate, they are
+    // received all the same
+    const int64_t tick_us = 1000 * portTICK_PERIOD_MS;
+    int64_t wait_us = 0;
+    while ((wait_us = s_wlan_tx_air_end_us - esp_timer_get_time()) > 0)
+    {
+        if (wait_us >= tick_us)
+        {
+            vTaskDelay(static_cast<TickType_t>(wait_us / tick_us)); //loop() runs meanwhile
+        }
+        else
+        {
+            delayMicroseconds(static_cast<uint32_t>(wait_us));
+        }
+    }
+
+    //https://github.com/espressif/esp-idf/issues/833
+    wifi_internal_rate_t internal_rate;
+    internal_rate.fix_rate = s_rate_mapping[rate];
+    if (esp_wifi_internal_set_rate(100, 1, 4, &internal_rate) != ESP_OK)
+    {
+        LOG("Failed to set rate %d\n", (int)rate); //the frame goes at the previous rate, the next one tries again
+        return;
+    }
+    s_wlan_radio_rate = rate;
+    add_stat(s_wlan_tx_stats.wlan_tx_rate_switches);
+}
+
+IRAM_ATTR void wlan_tx_task_proc(void*)
+{
+    Wlan_Outgoing_Packet packet;
+    TickType_t backoff = 0;
+    while (true)
+    {
+        size_t sent = 0;
+        bool pack_waiting = false;
+        while (sent < WLAN_TX_BURST_SIZE)
+        {
+            //a packet or a pack the driver had no room for (ESP_ERR_NO_MEM) stays and is tried again. A pack keeps taking packets
+            if (!packet.ptr && s_wlan_tx_pack.count == 0)
+            {
+                if (!start_reading_next_wlan_outgoing_packet(packet, nullptr))
+                {
+                    break;
+                }
+                if (can_start_wlan_tx_pack(packet))
+                {
+                    add_to_wlan_tx_pack(s_wlan_tx_pack, packet);
+                }
+                else
+                {
+                    write_wlan_ieee_header(packet.ptr);
+                }
+            }
+
+            esp_err_t res = ESP_OK;
+            size_t size = 0;
+            if (s_wlan_tx_pack.count > 0)
+            {
+                if (!fill_wlan_tx_pack(s_wlan_tx_pack))
+                {
+                    pack_waiting = true;
+                    break;
+                }
+                size = s_wlan_tx_pack.size;
+                switch_wlan_radio_rate(s_wlan_tx_pack.tx_class);
+                res = esp_wifi_80211_tx(ESP_WIFI_IF, s_wlan_tx_pack.frame, WLAN_IEEE_HEADER_SIZE + size, false);
+            }
+            else
+            {
+                const Wlan_Packet_Header& packet_header = *((const Wlan_Packet_Header*)packet.payload_ptr);
+                if (!packet_header.uses_fec)
+                {
+                    stamp_latency_trace(packet.payload_ptr + sizeof(Wlan_Packet_Header), packet.size - sizeof(Wlan_Packet_Header), 
+                                        packet_header.latency_traced, Latency_Trace_Stage::MODULE_WLAN_TX, esp_timer_get_time());
+                }
+                size = packet.size;
+                switch_wlan_radio_rate(get_wlan_tx_class(packet));
+                res = esp_wifi_80211_tx(ESP_WIFI_IF, packet.ptr, WLAN_IEEE_HEADER_SIZE + size, false);
+            }
+
+            if (res == ESP_ERR_NO_MEM)
+            {
+                add_stat(s_wlan_tx_stats.wlan_tx_failures);
+                break;
+            }
+            if (res != ESP_OK)
+            {
+                //the frame itself is rejected, trying it again would block the queue forever
+                LOG("WLAN inject error: %d\n", res);
+                add_stat(s_wlan_tx_stats.wlan_tx_failures);
+                if (s_wlan_tx_pack.count > 0)
+                {
+                    s_wlan_tx_pack.count = 0;
+                }
+                else
+                {
+                    end_reading_wlan_outgoing_packet(packet);
+                }
+                continue;
+            }
+            add_wlan_tx_airtime(WLAN_IEEE_HEADER_SIZE + size);
+            add_stat(s_wlan_tx_stats.wlan_data_sent, size);
+            add_stat(s_wlan_tx_stats.wlan_packets_sent);
+            if (s_wlan_tx_pack.count > 0)
+            {
+                add_stat(s_wlan_tx_stats.wlan_packets_packed, s_wlan_tx_pack.count);
+                s_wlan_tx_pack.count = 0;
+            }
+            else
+            {
+                end_reading_wlan_outgoing_packet(packet);
+            }
+            sent++;
+            backoff = 0;
+        }
+
+        if (sent > 0)
+        {
+            s_wlan_tx_activity = true;
+        }
+
+        if (pack_waiting)
+        {
+            ulTaskNotifyTake(pdTRUE, 1); //for more packets, so the max delay is rounded up to a tick
+        }
+        else if (packet.ptr || s_wlan_tx_pack.count > 0)
+        {
+            //the driver is out of buffers (ESP_ERR_NO_MEM), give it time to send some. Longer every time it's still full
+            backoff = std::min<TickType_t>(std::max<TickType_t>(backoff * 2, 1), WLAN_TX_MAX_BACKOFF);
+            vTaskDelay(backoff);
+        }
+        else if (sent < WLAN_TX_BURST_SIZE)
+        {
+            ulTaskNotifyTake(pdTRUE, WLAN_TX_IDLE_TIMEOUT);
+        }
+        else
+        {
+            vTaskDelay(1); //there's more but the driver has a burst queued, let loop() run
+        }
+    }
+}
+
 void setup() 
 {
     init_crc8_table();
@@ -1286,6 +2086,12 @@ void setup()
         .filter_mask = WIFI_PROMIS_FILTER_MASK_DATA
     };
     ESP_ERROR_CHECK(esp_wifi_set_promiscuous_filter(&filter));
+    memcpy(&s_wlan_link_prefix, s_wlan_ieee_header + WLAN_LINK_PREFIX_OFFSET, sizeof(s_wlan_link_prefix));
+    set_wlan_rx_link_ids(&SPI_DEFAULT_LINK_ID, 1);
+    if (xTaskCreatePinnedToCore(&wlan_rx_task_proc, "WLAN RX", 4096, nullptr, WLAN_RX_TASK_PRIORITY, &s_wlan_rx_task, WLAN_RX_TASK_CORE) != pdPASS)
+    {
+        Serial.printf("Failed to create the WLAN RX task\n");
+    }
     ESP_ERROR_CHECK(esp_wifi_set_promiscuous_rx_cb(packet_received_cb));
     ESP_ERROR_CHECK(esp_wifi_set_promiscuous(true));
 
@@ -1295,6 +2101,11 @@ void setup()
 
     set_wifi_fixed_rate(30);
 
+    if (xTaskCreatePinnedToCore(&wlan_tx_task_proc, "WLAN TX", 4096, nullptr, WLAN_TX_TASK_PRIORITY, &s_wlan_tx_task, WLAN_TX_TASK_CORE) != pdPASS)
+    {
+        Serial.printf("Failed to create the WLAN TX task\n");
+    }
+
     //S012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789cacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacacaca
 
     heap_caps_print_heap_info(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
@@ -1302,7 +2113,6 @@ void setup()
     Serial.printf("Initialized\n");
 }
 
-Wlan_Outgoing_Packet s_outgoing_wlan_packet;
 IRAM_ATTR void loop() 
 {
   /*
@@ -1322,38 +2132,9 @@ IRAM_ATTR void loop()
     parse_command();
     read_adc();
 
-    //send pending wlan packets
-    if (!s_outgoing_wlan_packet.ptr)
+    if (s_wlan_tx_activity.exchange(false))
     {
-        portENTER_CRITICAL(&s_wlan_outgoing_mux);
-        start_reading_wlan_outgoing_packet(s_outgoing_wlan_packet);
-        portEXIT_CRITICAL(&s_wlan_outgoing_mux);
-        
-        if (s_outgoing_wlan_packet.ptr)
-        {
-            memcpy(s_outgoing_wlan_packet.ptr, s_wlan_ieee_header, WLAN_IEEE_HEADER_SIZE);
-        }
-    }
-
-    if (s_outgoing_wlan_packet.ptr)
-    {
-        //LOG("packet %d", p.size);
-        esp_err_t res = esp_wifi_80211_tx(ESP_WIFI_IF, s_outgoing_wlan_packet.ptr, WLAN_IEEE_HEADER_SIZE + s_outgoing_wlan_packet.size, false);
-        if (res == ESP_OK)
-        {
-            //delay(15);
-            s_stats.wlan_data_sent += s_outgoing_wlan_packet.size;
-            set_status_led_on();
-            //LOG("WLAN inject OKKK\n");
-            portENTER_CRITICAL(&s_wlan_outgoing_mux);
-            end_reading_wlan_outgoing_packet(s_outgoing_wlan_packet);
-            portEXIT_CRITICAL(&s_wlan_outgoing_mux);
-        }
-        else
-        {
-            //LOG("WLAN inject error: %d\n", res);
-            s_stats.wlan_error_count++;
-        }
+        set_status_led_on();
     }
 
     update_status_led();
@@ -1393,15 +2174,26 @@ IRAM_ATTR void loop()
   }
 */
 
+    if (millis() - s_stats_fold_tp >= STATS_FOLD_PERIOD_MS)
+    {
+        get_stats(); //folds the stats blocks before any of their 32 bit counters can go all the way around
+    }
+
     if (s_uart_verbose > 0 && millis() - s_stats_last_tp >= 1000)
     {
         s_stats_last_tp = millis();
         //    Serial.printf("Sent: %d bytes ec:%d, Received: %d bytes, SPI SS: %d, SPI SR: %d, SPI DS: %d, SPI DR: %d, SPI ERR: %d, SPI PD: %d\n", s_sent, s_send_error_count, s_received, s_spi_status_sent, s_spi_status_received, s_spi_data_sent, s_spi_data_received, s_spi_error_count, s_spi_packets_dropped);
+        const SPI_Stats& stats = get_stats();
+        SPI_Stats& last = s_stats_last_report;
         Serial.printf("WLAN S: %d, R: %d, E: %d, D: %d, %%: %d  SPI S: %d, R: %d, E: %d, D: %d, %%: %d\n",
-                      s_stats.wlan_data_sent, s_stats.wlan_data_received, s_stats.wlan_error_count, s_stats.wlan_received_packets_dropped, s_wlan_outgoing_queue.size() * 100 / s_wlan_outgoing_queue.capacity(),
-                      s_stats.spi_data_sent, s_stats.spi_data_received, s_stats.spi_error_count, s_stats.spi_received_packets_dropped, s_wlan_incoming_queue.size() * 100 / s_wlan_incoming_queue.capacity());
-
-        s_stats = Stats();
+                      (int)(stats.wlan_data_sent - last.wlan_data_sent), (int)(stats.wlan_data_received - last.wlan_data_received),
+                      (int)(stats.wlan_error_count + stats.wlan_tx_failures - last.wlan_error_count - last.wlan_tx_failures),
+                      (int)(stats.wlan_received_packets_dropped - last.wlan_received_packets_dropped), get_wlan_outgoing_size() * 100 / get_wlan_outgoing_capacity(),
+                      (int)(stats.spi_data_sent - last.spi_data_sent), (int)(stats.spi_data_received - last.spi_data_received), (int)(stats.spi_error_count - last.spi_error_count),
+                      (int)(stats.wlan_outgoing_packets_dropped + stats.fec_encoder_packets_dropped + stats.wlan_outgoing_packets_expired + stats.wlan_outgoing_packets_evicted - 
+                            last.wlan_outgoing_packets_dropped - last.fec_encoder_packets_dropped - last.wlan_outgoing_packets_expired - last.wlan_outgoing_packets_evicted),
+                      get_wlan_incoming_size() * 100 / get_wlan_incoming_capacity());
+        last = stats;
 
         //Serial.printf("Sent: %d bytes, min %dms, max %dms, ec: %d\n", s_sent, s_send_min_time, s_send_max_time, s_send_error_count);
         //s_sent = 0;
@@ -0,0 +1,41 @@
+#pragma once
+
+//Host shim for the Arduino core, implemented in host_shim.cpp.
+//There is no UART input and the output goes to stderr only if enabled with host_set_uart_output.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#define LOW 0x0
+#define HIGH 0x1
+#define INPUT 0x01
+#define OUTPUT 0x02
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+class HardwareSerial
+{
+public:
+    void begin(unsigned long baud);
+    void setTimeout(unsigned long timeout);
+    int available();
+    int read();
+    size_t write(uint8_t const* data, size_t size);
+    size_t println(char const* str);
+    size_t printf(char const* format, ...);
+};
+
+extern HardwareSerial Serial;
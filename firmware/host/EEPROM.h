@@ -0,0 +1,17 @@
+#pragma once
+
+//Host shim: an EEPROM that always reads back the default ADC VREF (1100mV) and doesn't keep writes
+
+#include <cstdint>
+#include <cstddef>
+
+class EEPROMClass
+{
+public:
+    bool begin(size_t size);
+    uint32_t readUInt(int address);
+    size_t writeUInt(int address, uint32_t value);
+    bool commit();
+};
+
+extern EEPROMClass EEPROM;
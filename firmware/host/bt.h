@@ -0,0 +1,13 @@
+#pragma once
+
+#include "esp_err.h"
+
+enum esp_bt_mode_t
+{
+    ESP_BT_MODE_IDLE = 0,
+    ESP_BT_MODE_BLE,
+    ESP_BT_MODE_CLASSIC_BT,
+    ESP_BT_MODE_BTDM,
+};
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode);
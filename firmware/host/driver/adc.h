@@ -0,0 +1,47 @@
+#pragma once
+
+#include "esp_err.h"
+
+enum adc_unit_t
+{
+    ADC_UNIT_1 = 1,
+    ADC_UNIT_2 = 2,
+};
+
+enum adc_bits_width_t
+{
+    ADC_WIDTH_BIT_9 = 0,
+    ADC_WIDTH_BIT_10 = 1,
+    ADC_WIDTH_BIT_11 = 2,
+    ADC_WIDTH_BIT_12 = 3,
+};
+
+enum adc_atten_t
+{
+    ADC_ATTEN_DB_0 = 0,
+    ADC_ATTEN_DB_2_5 = 1,
+    ADC_ATTEN_DB_6 = 2,
+    ADC_ATTEN_DB_11 = 3,
+};
+
+enum adc_channel_t
+{
+    ADC_CHANNEL_0 = 0,
+    ADC_CHANNEL_MAX = 10,
+};
+
+enum adc1_channel_t
+{
+    ADC1_CHANNEL_0 = 0,
+    ADC1_CHANNEL_1,
+    ADC1_CHANNEL_2,
+    ADC1_CHANNEL_3,
+    ADC1_CHANNEL_4,
+    ADC1_CHANNEL_5,
+    ADC1_CHANNEL_6,
+    ADC1_CHANNEL_7,
+    ADC1_CHANNEL_MAX,
+};
+
+esp_err_t adc1_config_width(adc_bits_width_t width_bit);
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten);
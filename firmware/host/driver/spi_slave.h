@@ -0,0 +1,52 @@
+#pragma once
+
+//Host shim for the SPI slave driver. The master side is Sim_Module::spi_transfer
+
+#include <cstdint>
+#include <cstddef>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+
+enum spi_host_device_t
+{
+    SPI_HOST = 0,
+    HSPI_HOST = 1,
+    VSPI_HOST = 2,
+};
+
+struct spi_bus_config_t
+{
+    int mosi_io_num;
+    int miso_io_num;
+    int sclk_io_num;
+    int quadwp_io_num;
+    int quadhd_io_num;
+    int max_transfer_sz;
+    uint32_t flags;
+};
+
+struct spi_slave_transaction_t
+{
+    size_t length;    //bits
+    size_t trans_len; //bits actually transferred
+    void const* tx_buffer;
+    void* rx_buffer;
+    void* user;
+};
+
+typedef void (*slave_transaction_cb_t)(spi_slave_transaction_t* trans);
+
+struct spi_slave_interface_config_t
+{
+    int spics_io_num;
+    uint32_t flags;
+    int queue_size;
+    uint8_t mode;
+    slave_transaction_cb_t post_setup_cb;
+    slave_transaction_cb_t post_trans_cb;
+};
+
+esp_err_t spi_slave_initialize(spi_host_device_t host, spi_bus_config_t const* bus_config, spi_slave_interface_config_t const* slave_config, int dma_chan);
+esp_err_t spi_slave_queue_trans(spi_host_device_t host, spi_slave_transaction_t const* trans_desc, TickType_t ticks_to_wait);
+esp_err_t spi_slave_get_trans_result(spi_host_device_t host, spi_slave_transaction_t** trans_desc, TickType_t ticks_to_wait);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include "driver/adc.h"
+
+enum esp_adc_cal_value_t
+{
+    ESP_ADC_CAL_VAL_EFUSE_VREF = 0,
+    ESP_ADC_CAL_VAL_EFUSE_TP = 1,
+    ESP_ADC_CAL_VAL_DEFAULT_VREF = 2,
+};
+
+struct esp_adc_cal_characteristics_t
+{
+    adc_unit_t adc_num;
+    adc_atten_t atten;
+    adc_bits_width_t bit_width;
+    uint32_t coeff_a;
+    uint32_t coeff_b;
+    uint32_t vref;
+};
+
+esp_adc_cal_value_t esp_adc_cal_characterize(adc_unit_t adc_num, adc_atten_t atten, adc_bits_width_t bit_width, uint32_t default_vref, esp_adc_cal_characteristics_t* chars);
+
+//The simulated module has nothing connected to its ADCs, they read 0mV
+esp_err_t esp_adc_cal_get_voltage(adc_channel_t channel, esp_adc_cal_characteristics_t const* chars, uint32_t* voltage);
@@ -0,0 +1,5 @@
+#pragma once
+
+//Host shim: there is no IRAM on the host
+#define IRAM_ATTR
+#define DRAM_ATTR
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "esp_err.h"
+
+struct system_event_t
+{
+    int event_id;
+};
+
+typedef esp_err_t (*system_event_cb_t)(void* ctx, system_event_t* event);
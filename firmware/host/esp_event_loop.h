@@ -0,0 +1,5 @@
+#pragma once
+
+#include "esp_event.h"
+
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void* ctx);
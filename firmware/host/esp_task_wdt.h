@@ -0,0 +1,11 @@
+#pragma once
+
+//Host shim: there is no watchdog. Feeding it is where a deleted task unwinds
+
+#include "esp_err.h"
+#include "freertos/task.h"
+
+esp_err_t esp_task_wdt_add(TaskHandle_t task);
+esp_err_t esp_task_wdt_delete(TaskHandle_t task);
+esp_err_t esp_task_wdt_reset();
+void esp_task_wdt_feed();
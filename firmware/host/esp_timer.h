@@ -0,0 +1,7 @@
+#pragma once
+
+//Host shim: the steady clock since its epoch, the same clock the host side of the simulation uses
+
+#include <cstdint>
+
+int64_t esp_timer_get_time();
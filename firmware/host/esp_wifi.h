@@ -0,0 +1,24 @@
+#pragma once
+
+//Host shim for the WiFi driver, backed by the radio model of Sim_Module.
+//esp_wifi_80211_tx and esp_wifi_internal_set_rate are declared by the firmware in wifi_raw.h
+
+#include <cstdint>
+#include "esp_err.h"
+#include "esp_wifi_types.h"
+
+struct wifi_init_config_t
+{
+    int magic;
+};
+#define WIFI_INIT_CONFIG_DEFAULT() { 0 }
+
+esp_err_t esp_wifi_init_internal(wifi_init_config_t const* config);
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage);
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode);
+esp_err_t esp_wifi_start();
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second);
+esp_err_t esp_wifi_set_max_tx_power(int8_t power);
+esp_err_t esp_wifi_set_promiscuous_filter(wifi_promiscuous_filter_t const* filter);
+esp_err_t esp_wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t cb);
+esp_err_t esp_wifi_set_promiscuous(bool enabled);
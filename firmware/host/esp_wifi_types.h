@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+
+enum wifi_interface_t
+{
+    ESP_IF_WIFI_STA = 0,
+    ESP_IF_WIFI_AP,
+    ESP_IF_ETH,
+};
+
+enum wifi_mode_t
+{
+    WIFI_MODE_NULL = 0,
+    WIFI_MODE_STA,
+    WIFI_MODE_AP,
+    WIFI_MODE_APSTA,
+};
+
+enum wifi_second_chan_t
+{
+    WIFI_SECOND_CHAN_NONE = 0,
+    WIFI_SECOND_CHAN_ABOVE,
+    WIFI_SECOND_CHAN_BELOW,
+};
+
+enum wifi_storage_t
+{
+    WIFI_STORAGE_FLASH,
+    WIFI_STORAGE_RAM,
+};
+
+enum wifi_promiscuous_pkt_type_t
+{
+    WIFI_PKT_MGMT,
+    WIFI_PKT_CTRL,
+    WIFI_PKT_DATA,
+    WIFI_PKT_MISC,
+};
+
+#define WIFI_PROMIS_FILTER_MASK_ALL (0xFFFFFFFF)
+#define WIFI_PROMIS_FILTER_MASK_MGMT (1)
+#define WIFI_PROMIS_FILTER_MASK_CTRL (1 << 1)
+#define WIFI_PROMIS_FILTER_MASK_DATA (1 << 2)
+
+struct wifi_promiscuous_filter_t
+{
+    uint32_t filter_mask;
+};
+
+//Only the fields the firmware reads
+struct wifi_pkt_rx_ctrl_t
+{
+    signed rssi : 8;
+    unsigned rate : 5;
+    unsigned sig_mode : 2; //0 for the legacy rates, then the rate is in mcs
+    unsigned mcs : 7;
+    unsigned channel : 4;
+    signed noise_floor : 8;
+    unsigned timestamp : 32;
+    unsigned sig_len : 12;
+};
+
+struct wifi_promiscuous_pkt_t
+{
+    wifi_pkt_rx_ctrl_t rx_ctrl;
+    uint8_t payload[0]; //sig_len bytes, including the 4 bytes of FCS at the end
+};
+
+typedef void (*wifi_promiscuous_cb_t)(void* buf, wifi_promiscuous_pkt_type_t type);
@@ -0,0 +1,2 @@
+//The firmware sketch, built for the host against the shims in this folder
+#include "../firmware.ino"
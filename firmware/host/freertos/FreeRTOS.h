@@ -0,0 +1,38 @@
+#pragma once
+
+//Host shim for the parts of FreeRTOS used by the firmware, implemented in host_shim.cpp.
+//The critical sections are spinlocks, like on the dual core ESP32.
+
+#include <cstdint>
+#include <cstddef>
+#include "esp_attr.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define errQUEUE_FULL pdFALSE
+#define errQUEUE_EMPTY pdFALSE
+
+#define portMAX_DELAY static_cast<TickType_t>(0xFFFFFFFF)
+#define portTICK_PERIOD_MS 1
+
+#define configMAX_PRIORITIES 25
+
+struct portMUX_TYPE
+{
+    uint32_t owner;
+};
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+
+void vPortEnterCritical(portMUX_TYPE* mux);
+void vPortExitCritical(portMUX_TYPE* mux);
+
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux) vPortExitCritical(mux)
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+struct Host_Task;
+typedef Host_Task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void* params);
+
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+//The stack size, priority and core are ignored, the tasks are plain threads
+BaseType_t xTaskCreate(TaskFunction_t function, char const* name, uint32_t stack_size, void* params, UBaseType_t priority, TaskHandle_t* task);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, char const* name, uint32_t stack_size, void* params, UBaseType_t priority, TaskHandle_t* task, BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+
+//Direct to task notifications, only as a counting semaphore
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* higher_priority_task_woken);
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait);
+
+void host_task_yield();
+#define taskYIELD() host_task_yield()
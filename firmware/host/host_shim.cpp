@@ -0,0 +1,542 @@
+#include "host_shim.h"
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "esp_task_wdt.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_event_loop.h"
+#include "nvs_flash.h"
+#include "bt.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <sched.h>
+#include <pthread.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static const Clock::time_point s_start_tp = Clock::now();
+static const std::chrono::milliseconds YIELD_WAIT_TIMEOUT(1);
+static const std::chrono::milliseconds BLOCKING_CHECK_PERIOD(1); //how often a blocked task checks if it was deleted
+static const size_t SPINS_BEFORE_YIELD = 100;
+
+//////////////////////////////////////////////////////////////////////////////
+//Tasks
+
+//Thrown in a deleted task to unwind it back to its thread function
+struct Host_Task_Exit
+{
+};
+
+struct Host_Task
+{
+    std::thread thread;
+    std::atomic_bool deleted{false};
+    std::atomic_bool exited{false};
+    bool yield_waits = false;
+
+    //the notification value, used as a counting semaphore
+    std::mutex notification_mutex;
+    std::condition_variable notification_cv;
+    uint32_t notification_count = 0;
+};
+
+static thread_local Host_Task* s_current_task = nullptr;
+
+static std::mutex s_tasks_mutex;
+static std::vector<Host_Task*> s_tasks;
+
+static std::mutex s_idle_mutex;
+static std::condition_variable s_idle_cv;
+static bool s_idle_wakeup = false;
+
+static std::atomic_bool s_uart_output{false};
+
+static void check_deleted()
+{
+    if (s_current_task && s_current_task->deleted)
+    {
+        throw Host_Task_Exit();
+    }
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, char const* name, uint32_t stack_size, void* params, UBaseType_t priority, TaskHandle_t* handle, BaseType_t core)
+{
+    Host_Task* task = new Host_Task;
+    {
+        std::lock_guard<std::mutex> lg(s_tasks_mutex);
+        s_tasks.push_back(task);
+    }
+    std::string thread_name = std::string("fw_") + (name ? name : "task");
+    thread_name.resize(std::min<size_t>(thread_name.size(), 15)); //the kernel limit, the names show in perf & top
+    task->thread = std::thread([task, function, params, thread_name]()
+    {
+        s_current_task = task;
+        pthread_setname_np(pthread_self(), thread_name.c_str());
+        try
+        {
+            function(params);
+        }
+        catch (Host_Task_Exit const&)
+        {
+        }
+        task->exited = true;
+    });
+    if (handle)
+    {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, char const* name, uint32_t stack_size, void* params, UBaseType_t priority, TaskHandle_t* handle)
+{
+    return xTaskCreatePinnedToCore(function, name, stack_size, params, priority, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (!task || task == s_current_task)
+    {
+        throw Host_Task_Exit();
+    }
+
+    task->deleted = true;
+    host_wake_idle_task();
+    if (task->thread.joinable())
+    {
+        task->thread.join();
+    }
+
+    std::lock_guard<std::mutex> lg(s_tasks_mutex);
+    for (auto it = s_tasks.begin(); it != s_tasks.end(); ++it)
+    {
+        if (*it == task)
+        {
+            s_tasks.erase(it);
+            delete task;
+            break;
+        }
+    }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    delay(ticks * portTICK_PERIOD_MS);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    {
+        std::lock_guard<std::mutex> lg(task->notification_mutex);
+        task->notification_count++;
+    }
+    task->notification_cv.notify_one();
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* higher_priority_task_woken)
+{
+    xTaskNotifyGive(task);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait)
+{
+    Host_Task* task = s_current_task;
+    if (!task)
+    {
+        return 0;
+    }
+
+    Clock::time_point deadline = ticks_to_wait == portMAX_DELAY ? Clock::time_point::max() : Clock::now() + std::chrono::milliseconds(ticks_to_wait * portTICK_PERIOD_MS);
+    std::unique_lock<std::mutex> lock(task->notification_mutex);
+    while (task->notification_count == 0)
+    {
+        check_deleted();
+        Clock::time_point now = Clock::now();
+        if (now >= deadline)
+        {
+            return 0;
+        }
+        task->notification_cv.wait_until(lock, std::min(deadline, now + BLOCKING_CHECK_PERIOD));
+    }
+    uint32_t count = task->notification_count;
+    task->notification_count = clear_count_on_exit ? 0 : count - 1;
+    return count;
+}
+
+void host_task_yield()
+{
+    check_deleted();
+    if (!s_current_task || !s_current_task->yield_waits)
+    {
+        std::this_thread::yield();
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(s_idle_mutex);
+    s_idle_cv.wait_for(lock, YIELD_WAIT_TIMEOUT, []() { return s_idle_wakeup; });
+    s_idle_wakeup = false;
+}
+
+void host_set_yield_waits()
+{
+    if (s_current_task)
+    {
+        s_current_task->yield_waits = true;
+    }
+}
+
+void host_wake_idle_task()
+{
+    {
+        std::lock_guard<std::mutex> lg(s_idle_mutex);
+        s_idle_wakeup = true;
+    }
+    s_idle_cv.notify_one();
+}
+
+void host_stop_all_tasks()
+{
+    //the tasks are not freed, the firmware might still have their handles
+    std::vector<Host_Task*> tasks;
+    {
+        std::lock_guard<std::mutex> lg(s_tasks_mutex);
+        tasks = s_tasks;
+    }
+    for (Host_Task* task: tasks)
+    {
+        task->deleted = true;
+    }
+    host_wake_idle_task();
+    for (Host_Task* task: tasks)
+    {
+        if (task->thread.joinable())
+        {
+            task->thread.join();
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//Critical sections
+
+void vPortEnterCritical(portMUX_TYPE* mux)
+{
+    size_t spins = 0;
+    while (__atomic_exchange_n(&mux->owner, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        if (++spins >= SPINS_BEFORE_YIELD)
+        {
+            sched_yield();
+            spins = 0;
+        }
+    }
+}
+
+void vPortExitCritical(portMUX_TYPE* mux)
+{
+    __atomic_store_n(&mux->owner, 0, __ATOMIC_RELEASE);
+
+    //the other tasks and the radio queue work for the loop inside critical sections
+    if (!s_current_task || !s_current_task->yield_waits)
+    {
+        host_wake_idle_task();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//Queues
+
+struct Host_Queue
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t item_size = 0;
+    size_t capacity = 0;
+    size_t head = 0;
+    size_t count = 0;
+    std::vector<uint8_t> items;
+};
+
+//Waits until the predicate is true or the ticks elapse. The lock is held when checking the predicate
+template<typename Predicate>
+static bool wait_for_queue(Host_Queue& queue, std::unique_lock<std::mutex>& lock, TickType_t ticks, Predicate predicate)
+{
+    if (predicate() || ticks == 0)
+    {
+        return predicate();
+    }
+
+    Clock::time_point deadline = ticks == portMAX_DELAY ? Clock::time_point::max() : Clock::now() + std::chrono::milliseconds(ticks * portTICK_PERIOD_MS);
+    while (!predicate())
+    {
+        check_deleted();
+        Clock::time_point now = Clock::now();
+        if (now >= deadline)
+        {
+            return false;
+        }
+        queue.cv.wait_until(lock, std::min(deadline, now + BLOCKING_CHECK_PERIOD));
+    }
+    return true;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    if (length == 0 || item_size == 0)
+    {
+        return nullptr;
+    }
+    Host_Queue* queue = new Host_Queue;
+    queue->item_size = item_size;
+    queue->capacity = length;
+    queue->items.resize(length * item_size);
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, void const* item, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!wait_for_queue(*queue, lock, ticks_to_wait, [queue]() { return queue->count < queue->capacity; }))
+    {
+        return errQUEUE_FULL;
+    }
+    size_t index = (queue->head + queue->count) % queue->capacity;
+    memcpy(queue->items.data() + index * queue->item_size, item, queue->item_size);
+    queue->count++;
+    lock.unlock();
+    queue->cv.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, void const* item, BaseType_t* higher_priority_task_woken)
+{
+    return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!wait_for_queue(*queue, lock, ticks_to_wait, [queue]() { return queue->count > 0; }))
+    {
+        return errQUEUE_EMPTY;
+    }
+    memcpy(item, queue->items.data() + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    lock.unlock();
+    queue->cv.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceiveFromISR(QueueHandle_t queue, void* item, BaseType_t* higher_priority_task_woken)
+{
+    return xQueueReceive(queue, item, 0);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lg(queue->mutex);
+    return queue->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lg(queue->mutex);
+    return queue->capacity - queue->count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//Watchdog
+
+esp_err_t esp_task_wdt_add(TaskHandle_t task)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_task_wdt_delete(TaskHandle_t task)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_task_wdt_reset()
+{
+    check_deleted();
+    return ESP_OK;
+}
+
+void esp_task_wdt_feed()
+{
+    check_deleted();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//Timer
+
+int64_t esp_timer_get_time()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//Arduino
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+
+unsigned long millis()
+{
+    return static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - s_start_tp).count());
+}
+
+unsigned long micros()
+{
+    return static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - s_start_tp).count());
+}
+
+void delay(uint32_t ms)
+{
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(ms);
+    while (Clock::now() < deadline)
+    {
+        check_deleted();
+        std::this_thread::sleep_for(std::min<Clock::duration>(deadline - Clock::now(), BLOCKING_CHECK_PERIOD));
+    }
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+}
+
+void HardwareSerial::setTimeout(unsigned long timeout)
+{
+}
+
+int HardwareSerial::available()
+{
+    return 0;
+}
+
+int HardwareSerial::read()
+{
+    return -1;
+}
+
+size_t HardwareSerial::write(uint8_t const* data, size_t size)
+{
+    if (s_uart_output)
+    {
+        fwrite(data, 1, size, stderr);
+    }
+    return size;
+}
+
+size_t HardwareSerial::println(char const* str)
+{
+    return printf("%s\n", str);
+}
+
+size_t HardwareSerial::printf(char const* format, ...)
+{
+    if (!s_uart_output)
+    {
+        return 0;
+    }
+    va_list args;
+    va_start(args, format);
+    int res = vfprintf(stderr, format, args);
+    va_end(args);
+    return res < 0 ? 0 : static_cast<size_t>(res);
+}
+
+void host_set_uart_output(bool enabled)
+{
+    s_uart_output = enabled;
+}
+
+bool EEPROMClass::begin(size_t size)
+{
+    return true;
+}
+
+uint32_t EEPROMClass::readUInt(int address)
+{
+    return 1100;
+}
+
+size_t EEPROMClass::writeUInt(int address, uint32_t value)
+{
+    return sizeof(uint32_t);
+}
+
+bool EEPROMClass::commit()
+{
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//System
+
+void* heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return malloc(size);
+}
+
+void heap_caps_free(void* ptr)
+{
+    free(ptr);
+}
+
+void heap_caps_print_heap_info(uint32_t caps)
+{
+}
+
+void esp_log_level_set(char const* tag, esp_log_level_t level)
+{
+}
+
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void* ctx)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_init()
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase()
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode)
+{
+    return ESP_OK;
+}
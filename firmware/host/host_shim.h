@@ -0,0 +1,19 @@
+#pragma once
+
+//Host side of the FreeRTOS & Arduino shims, for the code that runs the firmware on Linux (sim_module.cpp).
+//The tasks are threads. vTaskDelete on another task can't kill a thread so it flags the task and the task unwinds
+// the next time it blocks, yields or feeds the watchdog.
+
+//taskYIELD in the calling task waits (up to 1ms) until host_wake_idle_task is called, instead of spinning.
+//Meant for the loop() task, which would otherwise take a whole core polling for work.
+void host_set_yield_waits();
+
+//Wakes up the task waiting in taskYIELD. Called by the hardware models when there is new work for the firmware
+// and by the critical sections of the other tasks, as they are how the firmware queues work to the loop.
+void host_wake_idle_task();
+
+//Deletes all the tasks still running and waits for them to end
+void host_stop_all_tasks();
+
+//The firmware Serial output goes to stderr if enabled, otherwise it's discarded
+void host_set_uart_output(bool enabled);
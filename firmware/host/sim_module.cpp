@@ -0,0 +1,619 @@
+#include "sim_module.h"
+#include "host_shim.h"
+#include "driver/spi_slave.h"
+#include "driver/gpio.h"
+#include "driver/adc.h"
+#include "esp_adc_cal.h"
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "../wifi_raw.h"
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//the sketch, in firmware_host.cpp
+void setup();
+void loop();
+
+static const std::chrono::seconds START_TIMEOUT(1);
+static const size_t RADIO_TX_QUEUE_SIZE = 8; //frames buffered by the WiFi driver
+static const size_t RADIO_MAX_FRAME_SIZE = 1600;
+static const size_t RADIO_FCS_SIZE = 4;
+static const int8_t RADIO_NOISE_FLOOR = -95; //dBm, reported with every received frame
+static const std::chrono::microseconds RADIO_CHANNEL_ACCESS_TIME(100); //DIFS + average backoff on an idle channel
+static const std::chrono::milliseconds RADIO_LINK_EXIT_CHECK_PERIOD(100);
+
+//Bit rate & preamble of each ESP internal rate code (the values of s_rate_mapping in the firmware)
+struct Radio_Rate
+{
+    uint32_t kbps;
+    uint32_t preamble_us;
+};
+static const Radio_Rate s_radio_rates[32] =
+{
+    { 1000, 192 }, { 2000, 192 }, { 5500, 192 }, { 11000, 192 },                 //0 - 3: B, long preamble
+    { 1000, 192 }, { 2000, 96 }, { 5500, 96 }, { 11000, 96 },                    //4 - 7: B, short preamble
+    { 48000, 20 }, { 24000, 20 }, { 12000, 20 }, { 6000, 20 },                   //8 - 11: G
+    { 54000, 20 }, { 36000, 20 }, { 18000, 20 }, { 9000, 20 },                   //12 - 15: G
+    { 6500, 36 }, { 13000, 36 }, { 19500, 36 }, { 26000, 36 },                   //16 - 19: N MCS0 - 3
+    { 39000, 36 }, { 52000, 36 }, { 58500, 36 }, { 65000, 36 },                  //20 - 23: N MCS4 - 7
+    { 7200, 36 }, { 14400, 36 }, { 21700, 36 }, { 28900, 36 },                   //24 - 27: N MCS0 - 3 short GI
+    { 43300, 36 }, { 57800, 36 }, { 65000, 36 }, { 72200, 36 },                  //28 - 31: N MCS4 - 7 short GI
+};
+
+static Sim_Module::Clock::duration get_airtime(size_t size, uint8_t rate)
+{
+    Radio_Rate const& r = s_radio_rates[rate & 31];
+    uint64_t payload_ns = (size + RADIO_FCS_SIZE) * 8ull * 1000000ull / r.kbps;
+    return RADIO_CHANNEL_ACCESS_TIME + std::chrono::microseconds(r.preamble_us) + std::chrono::nanoseconds(payload_ns);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Sim_Module& Sim_Module::get_instance()
+{
+    static Sim_Module s_instance;
+    return s_instance;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Sim_Module::~Sim_Module()
+{
+    if (m_radio_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lg(m_radio_mutex);
+            m_radio_exit = true;
+        }
+        m_radio_cv.notify_all();
+        m_radio_thread.join();
+    }
+    if (m_radio_link_thread.joinable())
+    {
+        m_radio_link_thread.join();
+    }
+    if (m_radio_link_fd >= 0)
+    {
+        close(m_radio_link_fd);
+        unlink(m_radio_link_bind.c_str());
+    }
+    host_stop_all_tasks();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void firmware_task_proc(void*)
+{
+    host_set_yield_waits();
+    setup();
+    while (true)
+    {
+        loop();
+    }
+}
+
+bool Sim_Module::start(Descriptor const& descriptor)
+{
+    if (descriptor.radio_loss < 0.f || descriptor.radio_loss > 1.f)
+    {
+        std::cerr << "Invalid radio loss " << descriptor.radio_loss << "\n";
+        return false;
+    }
+    if (descriptor.radio_bind.empty() != descriptor.radio_peer.empty())
+    {
+        std::cerr << "The radio link needs both the bind and the peer paths\n";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lg(m_start_mutex);
+
+    host_set_uart_output(descriptor.uart_output);
+    {
+        std::lock_guard<std::mutex> spi_lg(m_spi_mutex);
+        m_spi_turnaround = descriptor.spi_turnaround;
+    }
+    {
+        std::lock_guard<std::mutex> radio_lg(m_radio_mutex);
+        m_radio_loss = descriptor.radio_loss;
+        m_radio_latency = descriptor.radio_latency;
+        m_radio_rssi = descriptor.radio_rssi;
+    }
+
+    if (!m_started)
+    {
+        if (!init_radio_link(descriptor))
+        {
+            return false;
+        }
+        m_started = true;
+        m_radio_thread = std::thread(&Sim_Module::radio_thread_proc, this);
+        if (m_radio_link_fd >= 0)
+        {
+            m_radio_link_thread = std::thread(&Sim_Module::radio_link_thread_proc, this);
+        }
+        xTaskCreate(&firmware_task_proc, "loop", 8192, nullptr, 1, nullptr);
+    }
+
+    //ready once setup() armed the first SPI transaction
+    std::unique_lock<std::mutex> lock(m_spi_mutex);
+    if (!m_spi_cv.wait_for(lock, START_TIMEOUT, [this]() { return m_spi_queued != nullptr || m_spi_result != nullptr; }))
+    {
+        std::cerr << "The simulated module didn't start\n";
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static bool make_unix_address(std::string const& path, sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Invalid unix socket path '" << path << "'\n";
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+bool Sim_Module::init_radio_link(Descriptor const& descriptor)
+{
+    if (descriptor.radio_bind.empty())
+    {
+        return true;
+    }
+
+    sockaddr_un bind_address;
+    if (!make_unix_address(descriptor.radio_bind, bind_address) ||
+        !make_unix_address(descriptor.radio_peer, m_radio_link_peer_address))
+    {
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        std::cerr << "Cannot create the radio link socket: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    unlink(descriptor.radio_bind.c_str()); //left over from a previous run
+    if (bind(fd, reinterpret_cast<sockaddr const*>(&bind_address), sizeof(bind_address)) < 0)
+    {
+        std::cerr << "Cannot bind the radio link to '" << descriptor.radio_bind << "': " << strerror(errno) << "\n";
+        close(fd);
+        return false;
+    }
+
+    //the link thread wakes up periodically to check for exit
+    timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = std::chrono::duration_cast<std::chrono::microseconds>(RADIO_LINK_EXIT_CHECK_PERIOD).count();
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    m_radio_link_fd = fd;
+    m_radio_link_bind = descriptor.radio_bind;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Sim_Module::spi_transfer(void const* tx_data, void* rx_data, size_t size, size_t speed)
+{
+    if (size == 0 || speed == 0)
+    {
+        return false;
+    }
+
+    Clock::time_point start_tp = Clock::now();
+    Clock::time_point end_tp = start_tp + std::chrono::nanoseconds(size * 8ull * 1000000000ull / speed);
+
+    spi_slave_transaction_t* transaction = nullptr;
+    {
+        std::lock_guard<std::mutex> lg(m_spi_mutex);
+        if (m_spi_queued && m_spi_armed_tp <= start_tp)
+        {
+            transaction = m_spi_queued;
+            m_spi_queued = nullptr;
+        }
+        else
+        {
+            m_spi_missed_count++;
+        }
+    }
+
+    //the data moves both ways at once, the slave sees it when the transaction is done
+    size_t transferred = 0;
+    if (transaction)
+    {
+        transferred = std::min(size, transaction->length / 8);
+        if (tx_data && transaction->rx_buffer)
+        {
+            memcpy(transaction->rx_buffer, tx_data, transferred);
+        }
+        if (rx_data && transaction->tx_buffer)
+        {
+            memcpy(rx_data, transaction->tx_buffer, transferred);
+        }
+        transaction->trans_len = transferred * 8;
+    }
+    if (rx_data && transferred < size)
+    {
+        memset(reinterpret_cast<uint8_t*>(rx_data) + transferred, 0, size - transferred);
+    }
+
+    m_spi_scheduler.sleep_until(end_tp);
+
+    if (transaction)
+    {
+        {
+            std::lock_guard<std::mutex> lg(m_spi_mutex);
+            m_spi_result = transaction;
+            m_spi_last_end_tp = end_tp;
+        }
+        host_wake_idle_task();
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Sim_Module::get_missed_transfer_count() const
+{
+    std::lock_guard<std::mutex> lg(m_spi_mutex);
+    return m_spi_missed_count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Sim_Module::queue_spi_transaction(spi_slave_transaction_t* transaction)
+{
+    {
+        std::lock_guard<std::mutex> lg(m_spi_mutex);
+        m_spi_queued = transaction;
+        m_spi_armed_tp = std::max(Clock::now(), m_spi_last_end_tp + m_spi_turnaround);
+    }
+    m_spi_cv.notify_all();
+}
+
+spi_slave_transaction_t* Sim_Module::take_spi_result()
+{
+    std::lock_guard<std::mutex> lg(m_spi_mutex);
+    spi_slave_transaction_t* transaction = m_spi_result;
+    m_spi_result = nullptr;
+    return transaction;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Sim_Module::set_radio_rx_callback(Radio_RX_Callback callback)
+{
+    std::lock_guard<std::mutex> lg(m_radio_mutex);
+    m_radio_rx_callback = callback;
+}
+
+void Sim_Module::set_radio_rate(uint8_t rate)
+{
+    std::lock_guard<std::mutex> lg(m_radio_mutex);
+    m_radio_rate = rate;
+}
+
+bool Sim_Module::radio_tx(void const* frame, size_t size)
+{
+    if (size > RADIO_MAX_FRAME_SIZE)
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lg(m_radio_mutex);
+        if (m_radio_tx_frames.size() >= RADIO_TX_QUEUE_SIZE)
+        {
+            return false;
+        }
+
+        Radio_Frame f;
+        if (!m_radio_free_buffers.empty())
+        {
+            f.data.swap(m_radio_free_buffers.back());
+            m_radio_free_buffers.pop_back();
+        }
+        f.data.assign(reinterpret_cast<uint8_t const*>(frame), reinterpret_cast<uint8_t const*>(frame) + size);
+        m_radio_tx_frames.push_back(std::move(f));
+    }
+    m_radio_cv.notify_all();
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Sim_Module::radio_thread_proc()
+{
+    pthread_setname_np(pthread_self(), "sim_radio");
+    prctl(PR_SET_TIMERSLACK, 1); //the airtimes are tens of us, the default 50us slack would dominate them
+
+    std::minstd_rand rng(std::random_device{}());
+    std::uniform_real_distribution<float> loss_distribution(0.f, 1.f);
+
+    std::unique_lock<std::mutex> lock(m_radio_mutex);
+    while (!m_radio_exit)
+    {
+        Clock::time_point now = Clock::now();
+
+        if (!m_radio_tx_frames.empty())
+        {
+            if (!m_radio_on_air)
+            {
+                //back to back with the previous frame if it was waiting. It takes the rate the radio is at now, so a rate
+                // change also applies to the frames queued before it. That's the worst case of the driver, which the firmware
+                // handles by draining it before switching
+                Radio_Frame& frame = m_radio_tx_frames.front();
+                frame.rate = m_radio_rate;
+                m_radio_air_end_tp = std::max(now, m_radio_air_end_tp) + get_airtime(frame.data.size(), frame.rate);
+                m_radio_on_air = true;
+            }
+            if (m_radio_air_end_tp <= now)
+            {
+                Radio_Frame frame = std::move(m_radio_tx_frames.front());
+                m_radio_tx_frames.pop_front();
+                m_radio_on_air = false;
+                host_wake_idle_task(); //room for the next frame
+
+                if (loss_distribution(rng) >= m_radio_loss)
+                {
+                    frame.tp = m_radio_air_end_tp + m_radio_latency;
+                    m_radio_rx_frames.push_back(std::move(frame));
+                }
+                else
+                {
+                    m_radio_free_buffers.push_back(std::move(frame.data));
+                }
+                continue;
+            }
+        }
+
+        if (!m_radio_rx_frames.empty() && m_radio_rx_frames.front().tp <= now)
+        {
+            Radio_Frame frame = std::move(m_radio_rx_frames.front());
+            m_radio_rx_frames.pop_front();
+            Radio_RX_Callback callback = m_radio_rx_callback;
+            int16_t rssi = m_radio_rssi;
+
+            lock.unlock();
+            if (m_radio_link_fd >= 0)
+            {
+                //dropped if the peer is not there or is not keeping up, like a frame lost in the air
+                sendto(m_radio_link_fd, frame.data.data(), frame.data.size(), MSG_DONTWAIT,
+                       reinterpret_cast<sockaddr const*>(&m_radio_link_peer_address), sizeof(m_radio_link_peer_address));
+            }
+            else if (callback)
+            {
+                callback(frame.data.data(), frame.data.size(), rssi, frame.rate);
+            }
+            lock.lock();
+
+            m_radio_free_buffers.push_back(std::move(frame.data));
+            continue;
+        }
+
+        Clock::time_point next_tp = Clock::time_point::max();
+        if (m_radio_on_air)
+        {
+            next_tp = m_radio_air_end_tp;
+        }
+        if (!m_radio_rx_frames.empty())
+        {
+            next_tp = std::min(next_tp, m_radio_rx_frames.front().tp);
+        }
+        if (next_tp == Clock::time_point::max())
+        {
+            m_radio_cv.wait(lock);
+        }
+        else
+        {
+            m_radio_cv.wait_until(lock, next_tp);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Sim_Module::radio_link_thread_proc()
+{
+    pthread_setname_np(pthread_self(), "sim_radio_link");
+    std::vector<uint8_t> buffer(RADIO_MAX_FRAME_SIZE);
+    while (true)
+    {
+        ssize_t size = recv(m_radio_link_fd, buffer.data(), buffer.size(), 0);
+
+        Radio_RX_Callback callback = nullptr;
+        int16_t rssi = 0;
+        uint8_t rate = 0;
+        {
+            std::lock_guard<std::mutex> lg(m_radio_mutex);
+            if (m_radio_exit)
+            {
+                break;
+            }
+            callback = m_radio_rx_callback;
+            rssi = m_radio_rssi;
+            rate = m_radio_rate; //the sender's rate doesn't go over the link, both sides are set up the same
+        }
+
+        //the loss and latency were applied by the sender
+        if (size > 0 && callback)
+        {
+            callback(buffer.data(), static_cast<size_t>(size), rssi, rate);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//ESP-IDF shims for the modelled hardware
+
+esp_err_t gpio_set_pull_mode(gpio_num_t gpio_num, gpio_pull_mode_t pull)
+{
+    return ESP_OK;
+}
+
+esp_err_t spi_slave_initialize(spi_host_device_t host, spi_bus_config_t const* bus_config, spi_slave_interface_config_t const* slave_config, int dma_chan)
+{
+    return ESP_OK;
+}
+
+esp_err_t spi_slave_queue_trans(spi_host_device_t host, spi_slave_transaction_t const* trans_desc, TickType_t ticks_to_wait)
+{
+    Sim_Module::get_instance().queue_spi_transaction(const_cast<spi_slave_transaction_t*>(trans_desc));
+    return ESP_OK;
+}
+
+esp_err_t spi_slave_get_trans_result(spi_host_device_t host, spi_slave_transaction_t** trans_desc, TickType_t ticks_to_wait)
+{
+    spi_slave_transaction_t* transaction = Sim_Module::get_instance().take_spi_result();
+    if (!transaction)
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+    *trans_desc = transaction;
+    return ESP_OK;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static std::atomic<wifi_promiscuous_cb_t> s_wifi_rx_cb{nullptr};
+static std::atomic_bool s_wifi_promiscuous{false};
+static std::atomic<uint8_t> s_wifi_channel{1};
+
+static void wifi_radio_rx_callback(void const* frame, size_t size, int16_t rssi, uint8_t rate)
+{
+    wifi_promiscuous_cb_t cb = s_wifi_rx_cb;
+    if (!s_wifi_promiscuous || !cb)
+    {
+        return;
+    }
+
+    //the driver hands the frame over with its FCS
+    thread_local std::vector<uint8_t> buffer;
+    buffer.resize(sizeof(wifi_promiscuous_pkt_t) + size + RADIO_FCS_SIZE);
+    wifi_promiscuous_pkt_t* pkt = reinterpret_cast<wifi_promiscuous_pkt_t*>(buffer.data());
+    memset(&pkt->rx_ctrl, 0, sizeof(pkt->rx_ctrl));
+    pkt->rx_ctrl.rssi = rssi;
+    //the codes from 16 are the MCS ones, see s_rate_mapping in the firmware
+    pkt->rx_ctrl.sig_mode = rate >= 16 ? 1 : 0;
+    pkt->rx_ctrl.rate = rate >= 16 ? 0 : rate;
+    pkt->rx_ctrl.mcs = rate >= 16 ? (rate & 7) : 0;
+    pkt->rx_ctrl.channel = s_wifi_channel;
+    pkt->rx_ctrl.noise_floor = RADIO_NOISE_FLOOR;
+    pkt->rx_ctrl.timestamp = static_cast<uint32_t>(esp_timer_get_time());
+    pkt->rx_ctrl.sig_len = size + RADIO_FCS_SIZE;
+    memcpy(pkt->payload, frame, size);
+    memset(pkt->payload + size, 0, RADIO_FCS_SIZE);
+    cb(pkt, WIFI_PKT_DATA);
+}
+
+esp_err_t esp_wifi_init_internal(wifi_init_config_t const* config)
+{
+    Sim_Module::get_instance().set_radio_rx_callback(&wifi_radio_rx_callback);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start()
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second)
+{
+    if (primary < 1 || primary > 14)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_wifi_channel = primary;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_max_tx_power(int8_t power)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous_filter(wifi_promiscuous_filter_t const* filter)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t cb)
+{
+    s_wifi_rx_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous(bool enabled)
+{
+    s_wifi_promiscuous = enabled;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_wifi_80211_tx(wifi_interface_t ifx, const void* buffer, int len, bool en_sys_seq)
+{
+    if (!buffer || len <= 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return Sim_Module::get_instance().radio_tx(buffer, static_cast<size_t>(len)) ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+extern "C" esp_err_t esp_wifi_internal_set_rate(int a, int b, int c, wifi_internal_rate_t* d)
+{
+    Sim_Module::get_instance().set_radio_rate(d->fix_rate);
+    return ESP_OK;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+esp_err_t adc1_config_width(adc_bits_width_t width_bit)
+{
+    return ESP_OK;
+}
+
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten)
+{
+    return ESP_OK;
+}
+
+esp_adc_cal_value_t esp_adc_cal_characterize(adc_unit_t adc_num, adc_atten_t atten, adc_bits_width_t bit_width, uint32_t default_vref, esp_adc_cal_characteristics_t* chars)
+{
+    memset(chars, 0, sizeof(esp_adc_cal_characteristics_t));
+    chars->adc_num = adc_num;
+    chars->atten = atten;
+    chars->bit_width = bit_width;
+    chars->vref = default_vref;
+    return ESP_ADC_CAL_VAL_DEFAULT_VREF;
+}
+
+esp_err_t esp_adc_cal_get_voltage(adc_channel_t channel, esp_adc_cal_characteristics_t const* chars, uint32_t* voltage)
+{
+    *voltage = 0;
+    return ESP_OK;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <sys/un.h>
+#include "Deadline_Scheduler.h"
+
+struct spi_slave_transaction_t;
+
+//The module firmware running in-process instead of on an ESP32, to measure the host side without the hardware.
+//firmware.ino, the WLAN queues and Fec_Codec are built against the shims in this folder, only the SPI bus and the
+// radio are models:
+// - SPI: a transfer takes size * 8 / speed. After a transaction the slave needs the turnaround time before the next
+//   one is armed, a transfer that comes sooner reads zeros and is lost like on the real bus.
+// - radio: frames take their airtime at the rate set by the firmware when they go on air, with a few frames of TX
+//   buffering in the driver. They are received with that rate.
+//   Each frame is lost with the loss probability or delivered after the latency. The frames are heard back by the
+//   module, as if a peer echoed them, unless the radio is linked to the module of another process.
+//   The link is a pair of unix datagram sockets, one per direction, so a transmitter and a receiver bridge can run
+//   end to end on one machine.
+//The firmware state is global so there is one module per process. It boots on the first start and keeps running
+// afterwards, like the real module when the host reconnects.
+//Sim_Module::Descriptor. Outside of the class so it can be forward declared
+struct Sim_Module_Descriptor
+{
+    typedef Deadline_Scheduler::Clock Clock;
+
+    Clock::duration spi_turnaround = std::chrono::microseconds(30);
+    float radio_loss = 0.f; //0 .. 1
+    Clock::duration radio_latency = Clock::duration::zero();
+    int16_t radio_rssi = -40;
+    bool uart_output = false; //the firmware Serial output goes to stderr
+
+    //Unix socket paths linking the radio to another simulated module, both empty for the loopback radio.
+    //The loss & latency apply to the frames sent. Only used on the first start
+    std::string radio_bind; //created to receive the peer frames
+    std::string radio_peer; //the bind path of the peer
+};
+
+class Sim_Module
+{
+public:
+    typedef Deadline_Scheduler::Clock Clock;
+    typedef Sim_Module_Descriptor Descriptor;
+
+    static Sim_Module& get_instance();
+    ~Sim_Module();
+
+    //Boots the firmware the first time and waits for it to be ready for SPI transfers. Later calls only change the models.
+    bool start(Descriptor const& descriptor);
+
+    //The master side of a transfer. Blocks for the duration of the transfer at 'speed' Hz. Either buffer can be null
+    bool spi_transfer(void const* tx_data, void* rx_data, size_t size, size_t speed);
+
+    //Transfers done while the slave had no transaction armed
+    size_t get_missed_transfer_count() const;
+
+    //Used by the ESP-IDF shims
+    void queue_spi_transaction(spi_slave_transaction_t* transaction);
+    spi_slave_transaction_t* take_spi_result();
+
+    typedef void (*Radio_RX_Callback)(void const* frame, size_t size, int16_t rssi, uint8_t rate);
+    void set_radio_rx_callback(Radio_RX_Callback callback);
+    void set_radio_rate(uint8_t rate); //the ESP internal rate code
+    bool radio_tx(void const* frame, size_t size); //false if the TX buffers are full
+
+private:
+    Sim_Module() = default;
+
+    bool init_radio_link(Descriptor const& descriptor);
+    void radio_thread_proc();
+    void radio_link_thread_proc();
+
+    std::mutex m_start_mutex;
+    bool m_started = false;
+
+    //SPI
+    mutable std::mutex m_spi_mutex;
+    std::condition_variable m_spi_cv;
+    spi_slave_transaction_t* m_spi_queued = nullptr;
+    Clock::time_point m_spi_armed_tp;
+    spi_slave_transaction_t* m_spi_result = nullptr;
+    Clock::time_point m_spi_last_end_tp;
+    Clock::duration m_spi_turnaround = Clock::duration::zero();
+    size_t m_spi_missed_count = 0;
+    Deadline_Scheduler m_spi_scheduler; //used only by the master thread
+
+    //Radio
+    struct Radio_Frame
+    {
+        std::vector<uint8_t> data;
+        uint8_t rate = 0; //the ESP internal rate code it went on air with
+        Clock::time_point tp; //when it's received
+    };
+
+    std::mutex m_radio_mutex;
+    std::condition_variable m_radio_cv;
+    std::thread m_radio_thread;
+    bool m_radio_exit = false;
+    std::deque<Radio_Frame> m_radio_tx_frames; //the front one is on air if m_radio_on_air
+    bool m_radio_on_air = false;
+    Clock::time_point m_radio_air_end_tp;
+    std::deque<Radio_Frame> m_radio_rx_frames;
+    std::vector<std::vector<uint8_t>> m_radio_free_buffers;
+    Radio_RX_Callback m_radio_rx_callback = nullptr;
+    uint8_t m_radio_rate = 0;
+    float m_radio_loss = 0.f;
+    Clock::duration m_radio_latency = Clock::duration::zero();
+    int16_t m_radio_rssi = 0;
+
+    //Link to another process
+    int m_radio_link_fd = -1;
+    std::string m_radio_link_bind;
+    sockaddr_un m_radio_link_peer_address;
+    std::thread m_radio_link_thread;
+};
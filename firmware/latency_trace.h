@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+//Optional latency tracing: a trailer at the end of the packet payload that each stage of the pipeline stamps with its
+// monotonic clock in microseconds (esp_timer on the modules, CLOCK_MONOTONIC on the host). 0 means not stamped.
+//The host adds the trailer and takes it off at the other end. The traced packets are marked with the latency_traced
+// bit of the headers they travel with (SPI_Req_Packet_Header, Wlan_Packet_Header, SPI_Rx_Info) and only those are
+// stamped and stripped. The magic is just a sanity check, a user payload that happens to end with it is left alone.
+//With FEC there are no stamps between the encoder and the decoder: the packets recovered from the FEC packets would get
+// garbage stamps if the payloads changed after the FEC packets were computed.
+enum class Latency_Trace_Stage : uint8_t
+{
+    HOST_SEND,          //queued in the Phy
+    HOST_SPI_TX,        //the Phy transfer that takes it to the module
+    MODULE_SPI_RX,      //process_spi_transaction
+    MODULE_FEC_ENCODED, //fec_encoded_cb, FEC only
+    MODULE_WLAN_TX,     //esp_wifi_80211_tx, no FEC only
+    MODULE_WLAN_RX,     //packet_received_cb, no FEC only
+    MODULE_FEC_DECODED, //fec_decoded_cb, FEC only
+    MODULE_SPI_TX,      //put in the SPI response
+    HOST_SPI_RX,        //the Phy transfer that brings it from the module
+    HOST_RECEIVE,       //taken from the Phy
+
+    COUNT
+};
+
+static constexpr uint32_t LATENCY_TRACE_MAGIC = 0x3154414c; //"LAT1"
+
+#pragma pack(push, 1)
+struct Latency_Trace
+{
+    uint32_t stamps[static_cast<size_t>(Latency_Trace_Stage::COUNT)];
+    uint32_t magic;
+};
+#pragma pack(pop)
+
+//The trailer is not aligned, so it's accessed with memcpy. Only for packets marked as traced
+inline bool has_latency_trace(const void* payload, size_t size)
+{
+    if (size < sizeof(Latency_Trace))
+    {
+        return false;
+    }
+    uint32_t magic;
+    memcpy(&magic, reinterpret_cast<const uint8_t*>(payload) + size - sizeof(uint32_t), sizeof(magic));
+    return magic == LATENCY_TRACE_MAGIC;
+}
+
+inline void stamp_latency_trace(void* payload, size_t size, bool traced, Latency_Trace_Stage stage, uint32_t us)
+{
+    if (traced && has_latency_trace(payload, size))
+    {
+        uint8_t* stamp = reinterpret_cast<uint8_t*>(payload) + size - sizeof(Latency_Trace) + static_cast<size_t>(stage) * sizeof(uint32_t);
+        memcpy(stamp, &us, sizeof(us));
+    }
+}
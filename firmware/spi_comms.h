@@ -1,6 +1,7 @@
 #pragma once
 
 static constexpr size_t MAX_SPI_BUFFER_SIZE = 1600; //has to be multiple of 16
+static constexpr size_t MAX_SPI_COMMAND_SECTION_SIZE = 64; //max size of the commands riding along a packet transfer
 
 enum class SPI_Req : uint8_t
 {
@@ -14,6 +15,11 @@ enum class SPI_Req : uint8_t
     GET_POWER = 8,
     SETUP_ADC = 9,
     GET_ADC = 10,
+    GET_STATS = 11,
+    SET_OUTGOING_QUEUE_POLICY = 12,
+    SET_PACKING = 13,
+    SET_TX_CLASS_RATES = 14,
+    SET_LINK_IDS = 15,
 };
 
 enum class SPI_Res : uint8_t
@@ -28,6 +34,11 @@ enum class SPI_Res : uint8_t
     GET_POWER = 8,
     SETUP_ADC = 9,
     GET_ADC = 10,
+    GET_STATS = 11,
+    SET_OUTGOING_QUEUE_POLICY = 12,
+    SET_PACKING = 13,
+    SET_TX_CLASS_RATES = 14,
+    SET_LINK_IDS = 15,
 };
 
 #pragma pack(push, 1) // exact fit - no padding
@@ -56,33 +67,77 @@ struct SPI_Res_Base_Header
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
+//The outgoing WLAN lane of a packet without FEC. The FEC packets have their own lane
+enum class SPI_Packet_Priority : uint8_t
+{
+    NORMAL = 0,  //shares the air with the FEC packets
+    CONTROL = 1, //goes before all the others. For small control & telemetry packets, the lane is small
+};
+
 struct SPI_Req_Packet_Header : public SPI_Req_Base_Header
 {
     uint16_t packet_size : 11;
     uint16_t use_fec : 1;
+    uint16_t priority : 1; //SPI_Packet_Priority, ignored with FEC
+    uint16_t hold_rx_packet : 1; //the host has no room for the packet of the response, the module keeps it for later
+    uint16_t latency_traced : 1; //the packet ends with a latency trace (see latency_trace.h)
+    uint8_t command_size; //size of the command section that follows the packet data
+    uint8_t command_crc; //crc of the command section
     //... data follows
+    //... commands follow
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
+//What the module radio saw for a received packet.
+//For the FEC packets it's for the packets of their block received until it was decoded: the lowest RSSI & bitrate, the
+// highest noise floor and the time of the first one.
+static constexpr uint8_t SPI_RX_RATE_MCS = 0x80;
+struct SPI_Rx_Info
+{
+    int8_t rssi;          //dBm
+    int8_t noise_floor;   //dBm
+    uint8_t rate;         //a legacy rate as the radio reports it, or SPI_RX_RATE_MCS | the MCS index
+    uint8_t channel;
+    uint32_t time_us;     //module clock, when the radio handed it over
+    uint8_t packet_count : 7;   //the received packets of the FEC block, 1 without FEC
+    uint8_t latency_traced : 1; //the packet ends with a latency trace (see latency_trace.h)
+};
+
 struct SPI_Res_Packet_Header : public SPI_Res_Base_Header
 {
-    int16_t rssi;
+    SPI_Rx_Info rx_info; //of the packet in this transfer
     uint16_t packet_id : 5; //it repeats every 32
     uint16_t packet_size : 11;
+    uint8_t command_size; //size of the command response section that follows the packet data
+    uint8_t command_crc; //crc of the command response section
+    //... data follows
+    //... command responses follow
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+//Commands are TLV entries in the command section of a PACKET transfer.
+//The request type is a SPI_Req, the response type a SPI_Res. The response echoes the seq
+// of the request and arrives in one of the following transfers.
+
+struct SPI_Command_Header
+{
+    uint8_t type;
+    uint8_t seq;
+    uint8_t size; //size of the data that follows
     //... data follows
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
-struct SPI_Req_Setup_Fec_Codec_Header : public SPI_Req_Base_Header
+struct SPI_Req_Setup_Fec_Codec
 {
     uint32_t fec_coding_k : 5;
     uint32_t fec_coding_n : 5;
     uint32_t fec_mtu : 11;
 };
 
-struct SPI_Res_Setup_Fec_Codec_Header : public SPI_Res_Base_Header
+struct SPI_Res_Setup_Fec_Codec
 {
     uint32_t fec_coding_k : 5;
     uint32_t fec_coding_n : 5;
@@ -91,76 +146,64 @@ struct SPI_Res_Setup_Fec_Codec_Header : public SPI_Res_Base_Header
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
-struct SPI_Req_Set_Channel_Header : public SPI_Req_Base_Header
+struct SPI_Req_Set_Channel
 {
     uint8_t channel;
 };
 
-struct SPI_Res_Set_Channel_Header : public SPI_Res_Base_Header
+struct SPI_Res_Set_Channel
 {
     uint8_t channel;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
-struct SPI_Req_Get_Channel_Header : public SPI_Req_Base_Header
-{
-};
-
-struct SPI_Res_Get_Channel_Header : public SPI_Res_Base_Header
+struct SPI_Res_Get_Channel
 {
     uint8_t channel;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
-struct SPI_Req_Set_Power_Header : public SPI_Req_Base_Header
+struct SPI_Req_Set_Power
 {
     int16_t power; // power * 10 dbm
 };
 
-struct SPI_Res_Set_Power_Header : public SPI_Res_Base_Header
+struct SPI_Res_Set_Power
 {
     int16_t power; // power * 10 dbm
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
-struct SPI_Req_Get_Power_Header : public SPI_Req_Base_Header
-{
-};
-
-struct SPI_Res_Get_Power_Header : public SPI_Res_Base_Header
+struct SPI_Res_Get_Power
 {
     int16_t power; // power * 10 dbm
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
-struct SPI_Req_Set_Rate_Header : public SPI_Req_Base_Header
+struct SPI_Req_Set_Rate
 {
     uint8_t rate;
 };
 
-struct SPI_Res_Set_Rate_Header : public SPI_Res_Base_Header
+struct SPI_Res_Set_Rate
 {
     uint8_t rate;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
-struct SPI_Req_Get_Rate_Header : public SPI_Req_Base_Header
-{
-};
-
-struct SPI_Res_Get_Rate_Header : public SPI_Res_Base_Header
+struct SPI_Res_Get_Rate
 {
     uint8_t rate;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
-struct SPI_Req_Setup_ADC_Header : public SPI_Req_Base_Header
+struct SPI_Req_Setup_ADC
 {
     //ADC1
     //Channel 0 - GPIO36
@@ -189,17 +232,9 @@ struct SPI_Req_Setup_ADC_Header : public SPI_Req_Base_Header
     uint32_t adc_attenuation : 2; 
 };
 
-struct SPI_Res_Setup_ADC_Header : public SPI_Res_Base_Header
-{
-};
-
 ///////////////////////////////////////////////////////////////////////////////////////
 
-struct SPI_Req_Get_ADC_Header : public SPI_Req_Base_Header
-{
-};
-
-struct SPI_Res_Get_ADC_Header : public SPI_Res_Base_Header
+struct SPI_Res_Get_ADC
 {
     uint32_t adc0_sample_count : 16;
     uint32_t adc0_average : 16;
@@ -228,5 +263,141 @@ struct SPI_Res_Get_ADC_Header : public SPI_Res_Base_Header
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
+//Cumulative counters of the module since it started. They never reset, so rates come from the difference of 2 samples.
+//They don't fit in one command response so GET_STATS returns them in pages of SPI_STATS_PAGE_SIZE bytes. Page 0 takes
+// a snapshot of the counters and the other pages come from it.
+struct SPI_Stats
+{
+    uint64_t wlan_data_sent = 0;                //payload bytes
+    uint64_t wlan_packets_sent = 0;
+    uint64_t wlan_tx_failures = 0;              //esp_wifi_80211_tx errors, the packet is retried if the driver was out of buffers, dropped otherwise
+    uint64_t wlan_outgoing_packets_dropped = 0; //the outgoing queue was full
+    uint64_t wlan_data_received = 0;            //payload bytes
+    uint64_t wlan_packets_received = 0;
+    uint64_t wlan_error_count = 0;              //malformed frames
+    uint64_t wlan_received_packets_dropped = 0; //the incoming queue or the FEC decoder was full
+    uint64_t spi_data_sent = 0;                 //packet bytes delivered to the host
+    uint64_t spi_packets_sent = 0;
+    uint64_t spi_data_received = 0;             //packet bytes received from the host
+    uint64_t spi_packets_received = 0;
+    uint64_t spi_error_count = 0;               //all SPI errors, including the CRC ones
+    uint64_t spi_crc_error_count = 0;
+    uint64_t fec_encoder_packets_dropped = 0;   //the FEC encoder was busy
+    uint64_t fec_blocks_recovered = 0;          //blocks completed with FEC packets
+    uint64_t fec_blocks_lost = 0;               //blocks that could not be completed
+    uint64_t wlan_outgoing_queue_high_water = 0; //bytes
+    uint64_t wlan_incoming_queue_high_water = 0; //bytes
+    uint64_t wlan_outgoing_packets_expired = 0; //older than the max age of the outgoing queue policy
+    uint64_t wlan_outgoing_packets_evicted = 0; //dropped to make room or with the rest of their FEC block
+    uint64_t wlan_packets_packed = 0;           //sent packed with others, wlan_packets_sent counts their frames
+    uint64_t wlan_tx_rate_switches = 0;         //between frames of classes with different rates
+    uint64_t wlan_frames_filtered = 0;          //data frames of other links or networks, dropped on arrival
+};
+
+static constexpr size_t SPI_STATS_PAGE_SIZE = 48;
+static constexpr size_t SPI_STATS_PAGE_COUNT = (sizeof(SPI_Stats) + SPI_STATS_PAGE_SIZE - 1) / SPI_STATS_PAGE_SIZE;
+
+struct SPI_Req_Get_Stats
+{
+    uint8_t page;
+};
+
+struct SPI_Res_Get_Stats
+{
+    uint8_t page;
+    uint8_t page_count;
+    uint64_t time_us; //module clock when the snapshot was taken, the same for all its pages
+    uint8_t data[SPI_STATS_PAGE_SIZE]; //bytes [page * SPI_STATS_PAGE_SIZE, ...) of SPI_Stats, zero padded
+};
+static_assert(sizeof(SPI_Command_Header) + sizeof(SPI_Res_Get_Stats) <= MAX_SPI_COMMAND_SECTION_SIZE, "Stats page too big");
+
+///////////////////////////////////////////////////////////////////////////////////////
+
+//What happens to the outgoing WLAN packets when the module can't send them as fast as they come
+enum class SPI_Outgoing_Queue_Policy : uint8_t
+{
+    DROP_NEWEST = 0,    //the queue fills up and the new packets are dropped
+    DROP_OLDEST = 1,    //the oldest packets are dropped to keep room for the new ones
+    DROP_FEC_BLOCK = 2, //like DROP_OLDEST, but a FEC packet takes the rest of its block with it
+};
+
+struct SPI_Req_Set_Outgoing_Queue_Policy
+{
+    uint8_t policy; //SPI_Outgoing_Queue_Policy
+    uint16_t max_age_ms; //older packets are dropped before they are sent. 0 means no limit
+};
+
+struct SPI_Res_Set_Outgoing_Queue_Policy
+{
+    uint8_t policy;
+    uint16_t max_age_ms;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+
+//Small packets without FEC are packed several per WLAN frame so they share the preamble, the IEEE header and the
+// interframe spacing. A frame is sent when it's full or there are no more packets in its lane, or with a max delay
+// the normal lane waits up to that long for more packets. Enabled by default, with no delay
+struct SPI_Req_Set_Packing
+{
+    uint8_t enabled;
+    uint16_t max_delay_ms;
+};
+
+struct SPI_Res_Set_Packing
+{
+    uint8_t enabled;
+    uint16_t max_delay_ms;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+
+//The traffic classes of the outgoing packets, each can go at its own rate
+enum class SPI_Tx_Class : uint8_t
+{
+    CONTROL = 0,    //the CONTROL priority packets
+    NORMAL = 1,     //the other packets without FEC
+    FEC_DATA = 2,   //the FEC packets carrying data
+    FEC_PARITY = 3, //the FEC packets computed from them
+};
+static constexpr size_t SPI_TX_CLASS_COUNT = 4;
+static constexpr uint8_t SPI_TX_CLASS_RATE_DEFAULT = 0xFF; //the class goes at the SET_RATE rate
+
+//The rate of each class, indexed by SPI_Tx_Class, as in SPI_Req_Set_Rate or SPI_TX_CLASS_RATE_DEFAULT.
+//The module switches the radio rate between frames of classes with different rates, so consecutive frames of a class
+// (the data packets of a FEC block, then its parity) share a switch. All the classes default to the SET_RATE rate
+struct SPI_Req_Set_Tx_Class_Rates
+{
+    uint8_t rates[SPI_TX_CLASS_COUNT];
+};
+
+struct SPI_Res_Set_Tx_Class_Rates
+{
+    uint8_t rates[SPI_TX_CLASS_COUNT];
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+
+static constexpr size_t SPI_MAX_RX_LINK_IDS = 4;
+static constexpr uint16_t SPI_DEFAULT_LINK_ID = 0x5566;
+
+//Bridges sharing a channel use different link IDs. The module sends its frames with the TX link ID and drops the
+// received ones without one of the RX link IDs as they arrive. Both default to SPI_DEFAULT_LINK_ID
+struct SPI_Req_Set_Link_Ids
+{
+    uint16_t tx_link_id;
+    uint8_t rx_link_id_count; //1 to SPI_MAX_RX_LINK_IDS
+    uint16_t rx_link_ids[SPI_MAX_RX_LINK_IDS];
+};
+
+struct SPI_Res_Set_Link_Ids
+{
+    uint16_t tx_link_id;
+    uint8_t rx_link_id_count;
+    uint16_t rx_link_ids[SPI_MAX_RX_LINK_IDS];
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+
 #pragma pack(pop)
 
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "esp_attr.h"
+
+//Wait-free single producer / single consumer queue of variable size packets, in a caller provided buffer.
+//Each packet is its 32 bit size followed by the data, padded to 4 bytes. Packets are never split: one that doesn't fit
+// before the end of the buffer goes to the start and a wrap marker in its place sends the reader there too.
+//The producer can write several packets at once, they are published in order (see start_writing).
+//The producer owns the write offset and the consumer the read offset. Each side publishes its offset with release
+// and reads the other one with acquire, so they never wait for each other and can run on different cores, one of
+// them in an ISR, without a critical section. One byte is always left free so a full queue doesn't look empty.
+//NOTE: there has to be a single producer and a single consumer (any threads, as long as it's one of each)
+class SPSC_Queue
+{
+public:
+    //The capacity has to be a multiple of 4 and the buffer 4 bytes aligned
+    SPSC_Queue(uint8_t* buffer, size_t capacity)
+        : m_buffer(buffer)
+        , m_capacity(capacity)
+    {
+    }
+
+    //Packets in the queue. Exact from the producer & consumer, approximate from anywhere else
+    IRAM_ATTR inline size_t count() const
+    {
+        return m_write_count.load(std::memory_order_acquire) - m_read_count.load(std::memory_order_acquire);
+    }
+
+    //Bytes used, including the sizes and the padding
+    IRAM_ATTR inline size_t size() const
+    {
+        size_t write_offset = m_write_offset.load(std::memory_order_acquire);
+        size_t read_offset = m_read_offset.load(std::memory_order_acquire);
+        return write_offset >= read_offset ? write_offset - read_offset : m_capacity - read_offset + write_offset;
+    }
+
+    IRAM_ATTR inline size_t capacity() const
+    {
+        return m_capacity;
+    }
+
+    //Producer side. Reserves space for a packet and returns where to write it, or nullptr if it doesn't fit or there
+    // are already MAX_RESERVATIONS packets being written.
+    //Several packets can be written at the same time and ended or canceled in any order, but they become visible to
+    // the consumer in the order they were started: an ended packet waits for all the ones started before it.
+    IRAM_ATTR inline uint8_t* start_writing(size_t size) __attribute__((always_inline))
+    {
+        if (m_reservation_count >= MAX_RESERVATIONS)
+        {
+            return nullptr;
+        }
+
+        size_t needed = get_record_size(size);
+        size_t reserve_offset = m_reserve_offset;
+        size_t read_offset = m_read_offset.load(std::memory_order_acquire);
+        size_t start = reserve_offset;
+        if (reserve_offset >= read_offset)
+        {
+            size_t to_end = m_capacity - reserve_offset;
+            if (needed < to_end || (needed == to_end && read_offset > 0))
+            {
+                start = reserve_offset;
+            }
+            else if (needed < read_offset)
+            {
+                start = 0;
+            }
+            else
+            {
+                return nullptr;
+            }
+        }
+        else if (needed >= read_offset - reserve_offset)
+        {
+            return nullptr;
+        }
+
+        //the reader doesn't see any of this until the write offset moves past it
+        if (start != reserve_offset)
+        {
+            write_u32(reserve_offset, WRAP_MARKER);
+        }
+        write_u32(start, static_cast<uint32_t>(size));
+
+        Reservation& reservation = m_reservations[(m_reservation_first + m_reservation_count) % MAX_RESERVATIONS];
+        reservation.previous_offset = reserve_offset;
+        reservation.start = start;
+        reservation.end = (start + needed == m_capacity) ? 0 : start + needed;
+        reservation.state = Reservation::State::WRITING;
+        m_reservation_count++;
+
+        m_reserve_offset = reservation.end;
+        return m_buffer + start + sizeof(uint32_t);
+    }
+
+    //Pass the pointer returned by start_writing
+    IRAM_ATTR inline void end_writing(uint8_t* data) __attribute__((always_inline))
+    {
+        Reservation* reservation = find_reservation(data);
+        if (!reservation)
+        {
+            return;
+        }
+        reservation->state = Reservation::State::DONE;
+        publish();
+    }
+    IRAM_ATTR inline void cancel_writing(uint8_t* data) __attribute__((always_inline))
+    {
+        Reservation* reservation = find_reservation(data);
+        if (!reservation)
+        {
+            return;
+        }
+        reservation->state = Reservation::State::CANCELED;
+
+        //the newest ones give their space back, the others become gaps the reader skips
+        while (m_reservation_count > 0)
+        {
+            Reservation& last = m_reservations[(m_reservation_first + m_reservation_count - 1) % MAX_RESERVATIONS];
+            if (last.state != Reservation::State::CANCELED)
+            {
+                break;
+            }
+            m_reserve_offset = last.previous_offset;
+            m_reservation_count--;
+        }
+        if (reservation_index(*reservation) < m_reservation_count)
+        {
+            write_u32(reservation->start, SKIP_FLAG | read_u32(reservation->start));
+        }
+        publish();
+    }
+
+    //How many packets are being written
+    IRAM_ATTR inline size_t get_reservation_count() const
+    {
+        return m_reservation_count;
+    }
+
+    //Consumer side. Returns nullptr if the queue is empty or a packet is already being read
+    IRAM_ATTR inline uint8_t* start_reading(size_t& size) __attribute__((always_inline))
+    {
+        if (m_reading)
+        {
+            return nullptr;
+        }
+
+        size_t read_offset = m_read_offset.load(std::memory_order_relaxed);
+        size_t write_offset = m_write_offset.load(std::memory_order_acquire);
+        if (read_offset == write_offset)
+        {
+            size = 0;
+            return nullptr;
+        }
+
+        //skip the wrap marker and the packets canceled while others were being written
+        uint32_t value = read_u32(read_offset);
+        while (value == WRAP_MARKER || (value & SKIP_FLAG))
+        {
+            if (value == WRAP_MARKER)
+            {
+                read_offset = 0;
+            }
+            else
+            {
+                read_offset += get_record_size(value & ~SKIP_FLAG);
+                read_offset = (read_offset == m_capacity) ? 0 : read_offset;
+                m_read_offset.store(read_offset, std::memory_order_release);
+                if (read_offset == write_offset)
+                {
+                    size = 0;
+                    return nullptr;
+                }
+            }
+            value = read_u32(read_offset);
+        }
+        size = value;
+        size_t end = read_offset + get_record_size(size);
+        m_pending_read_offset = (end == m_capacity) ? 0 : end;
+        m_reading = true;
+        return m_buffer + read_offset + sizeof(uint32_t);
+    }
+
+    IRAM_ATTR inline void end_reading() __attribute__((always_inline))
+    {
+        if (!m_reading)
+        {
+            return;
+        }
+        m_reading = false;
+        m_read_offset.store(m_pending_read_offset, std::memory_order_release);
+        m_read_count.store(m_read_count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    IRAM_ATTR inline void cancel_reading() __attribute__((always_inline))
+    {
+        m_reading = false;
+    }
+
+private:
+    static constexpr size_t MAX_RESERVATIONS = 8;
+    static constexpr uint32_t WRAP_MARKER = 0xFFFFFFFF;
+    static constexpr uint32_t SKIP_FLAG = 0x80000000; //on the size of a canceled packet
+
+    struct Reservation
+    {
+        enum class State : uint8_t
+        {
+            WRITING,
+            DONE,
+            CANCELED
+        };
+
+        size_t previous_offset = 0; //the reserve offset before it, where the wrap marker is if it wrapped
+        size_t start = 0;
+        size_t end = 0;
+        State state = State::WRITING;
+    };
+
+    IRAM_ATTR inline size_t reservation_index(Reservation const& reservation) const __attribute__((always_inline))
+    {
+        return (&reservation - m_reservations + MAX_RESERVATIONS - m_reservation_first) % MAX_RESERVATIONS;
+    }
+
+    IRAM_ATTR inline Reservation* find_reservation(uint8_t* data) __attribute__((always_inline))
+    {
+        for (size_t i = 0; i < m_reservation_count; i++)
+        {
+            Reservation& reservation = m_reservations[(m_reservation_first + i) % MAX_RESERVATIONS];
+            if (m_buffer + reservation.start + sizeof(uint32_t) == data && reservation.state == Reservation::State::WRITING)
+            {
+                return &reservation;
+            }
+        }
+        return nullptr;
+    }
+
+    //Moves the write offset past the oldest packets that are not being written anymore
+    IRAM_ATTR inline void publish() __attribute__((always_inline))
+    {
+        size_t write_offset = m_write_offset.load(std::memory_order_relaxed);
+        size_t done = 0;
+        bool moved = false;
+        while (m_reservation_count > 0)
+        {
+            Reservation& first = m_reservations[m_reservation_first];
+            if (first.state == Reservation::State::WRITING)
+            {
+                break;
+            }
+            done += (first.state == Reservation::State::DONE) ? 1 : 0;
+            write_offset = first.end;
+            moved = true;
+            m_reservation_first = (m_reservation_first + 1) % MAX_RESERVATIONS;
+            m_reservation_count--;
+        }
+        if (moved)
+        {
+            m_write_offset.store(write_offset, std::memory_order_release);
+            m_write_count.store(m_write_count.load(std::memory_order_relaxed) + done, std::memory_order_release);
+        }
+    }
+
+    IRAM_ATTR static inline size_t get_record_size(size_t size) __attribute__((always_inline))
+    {
+        return (sizeof(uint32_t) + size + 3) & ~size_t(3);
+    }
+    IRAM_ATTR inline void write_u32(size_t offset, uint32_t value) __attribute__((always_inline))
+    {
+        memcpy(m_buffer + offset, &value, sizeof(value));
+    }
+    IRAM_ATTR inline uint32_t read_u32(size_t offset) const __attribute__((always_inline))
+    {
+        uint32_t value;
+        memcpy(&value, m_buffer + offset, sizeof(value));
+        return value;
+    }
+
+    uint8_t* m_buffer = nullptr;
+    size_t m_capacity = 0;
+
+    //written by the producer
+    std::atomic<size_t> m_write_offset{0};
+    std::atomic<size_t> m_write_count{0};
+    size_t m_reserve_offset = 0; //where the next packet starts, past the ones being written
+    Reservation m_reservations[MAX_RESERVATIONS];
+    size_t m_reservation_first = 0;
+    size_t m_reservation_count = 0;
+
+    //written by the consumer
+    std::atomic<size_t> m_read_offset{0};
+    std::atomic<size_t> m_read_count{0};
+    size_t m_pending_read_offset = 0;
+    bool m_reading = false;
+};
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include "spi_comms.h"
+#include "spsc_queue.h"
 
 constexpr uint8_t s_wlan_ieee_header[] =
 {
@@ -17,320 +21,426 @@ constexpr size_t WLAN_MAX_PAYLOAD_SIZE = WLAN_MAX_PACKET_SIZE - WLAN_IEEE_HEADER
 
 static_assert(WLAN_IEEE_HEADER_SIZE == 24, "");
 
+//The link ID goes in the last 2 bytes of the source address and of the BSSID, see SPI_Req_Set_Link_Ids. The rest of
+// the source address is the same for all the links
+constexpr size_t WLAN_LINK_PREFIX_OFFSET = 10;
+constexpr size_t WLAN_LINK_ID_OFFSET = 14;
+constexpr size_t WLAN_LINK_ID_BSSID_OFFSET = 20;
+static_assert(SPI_DEFAULT_LINK_ID == ((s_wlan_ieee_header[WLAN_LINK_ID_OFFSET] << 8) | s_wlan_ieee_header[WLAN_LINK_ID_OFFSET + 1]), 
+              "the default link ID has to be the one of the header");
+
+IRAM_ATTR inline void set_wlan_link_id(uint8_t* ieee_header, uint16_t link_id)
+{
+  ieee_header[WLAN_LINK_ID_OFFSET] = static_cast<uint8_t>(link_id >> 8);
+  ieee_header[WLAN_LINK_ID_OFFSET + 1] = static_cast<uint8_t>(link_id);
+  ieee_header[WLAN_LINK_ID_BSSID_OFFSET] = static_cast<uint8_t>(link_id >> 8);
+  ieee_header[WLAN_LINK_ID_BSSID_OFFSET + 1] = static_cast<uint8_t>(link_id);
+}
+
+//What a 16 bit load of the link ID from a header gives, so the RX filter compares without byte swapping
+IRAM_ATTR inline uint16_t get_wlan_link_id_key(uint16_t link_id)
+{
+  uint8_t bytes[2] = { static_cast<uint8_t>(link_id >> 8), static_cast<uint8_t>(link_id) };
+  uint16_t key;
+  memcpy(&key, bytes, sizeof(key));
+  return key;
+}
+
+constexpr size_t WLAN_INCOMING_BUFFER_SIZE = 20000;
+constexpr size_t WLAN_OUTGOING_BUFFER_SIZE = 20000;
+constexpr size_t WLAN_OUTGOING_HIGH_PRIORITY_BUFFER_SIZE = 6000; //for small control & telemetry packets
+
+constexpr size_t WLAN_RX_FRAME_BUFFER_SIZE = 12000;
+constexpr size_t WLAN_MAX_RX_FRAME_SIZE = WLAN_MAX_PACKET_SIZE + 4; //with the FCS
+
+typedef SPSC_Queue Wlan_Incoming_Queue;
+typedef SPSC_Queue Wlan_Outgoing_Queue;
+
 struct Wlan_Outgoing_Packet
 {
+  Wlan_Outgoing_Queue* queue = nullptr;
   uint8_t* ptr = nullptr;
   uint8_t* payload_ptr = nullptr;
   uint16_t size = 0;
   uint16_t offset = 0;
+  uint32_t time_us = 0; //when it was queued, for the max age of the outgoing queue policy
 };
 
 struct Wlan_Incoming_Packet
 {
+  Wlan_Incoming_Queue* queue = nullptr;
   uint8_t* ptr = nullptr;
+  uint8_t* payload_ptr = nullptr;
   uint16_t size = 0;
   uint16_t offset = 0;
+  SPI_Rx_Info info = {};
+};
+
+//A frame as the WLAN RX callback got it, followed by its data
+struct Wlan_Rx_Frame
+{
+  SPI_Rx_Info info = {};
+  uint16_t len = 0; //the length the driver reported. The data is truncated to WLAN_MAX_RX_FRAME_SIZE
 };
 
 struct Wlan_Packet_Header
 {
   uint8_t uses_fec : 1;
+  uint8_t packed : 1; //the payload is several packets without FEC, each after a Wlan_Packed_Header
+  uint8_t latency_traced : 1; //the payload ends with a latency trace, all the packed packets do. FEC blocks are traced as a whole
+};
+
+struct Wlan_Packed_Header
+{
+  uint16_t size;
 };
 
 /////////////////////////////////////////////////////////////////////////
+//Every queue has a single producer so they need no locks (see SPSC_Queue):
+// - outgoing: the main loop (SPI packets without FEC, UART) and the FEC encoder task. The WLAN TX task sends from them
+// - incoming: the WLAN RX task (packets without FEC) and the FEC decoder task. The SPI responses take from both
+// - RX frames: the WLAN RX callback, which only copies the received frames. The WLAN RX task takes from it
+//The packets without FEC have 2 priority lanes (see SPI_Packet_Priority). The high priority one always goes first and
+// the others share the air by bytes with a deficit round robin, so neither starves the other.
+//The incoming queues alternate.
+
+alignas(uint32_t) uint8_t s_wlan_rx_frame_buffer[WLAN_RX_FRAME_BUFFER_SIZE];
+SPSC_Queue s_wlan_rx_frame_queue(s_wlan_rx_frame_buffer, WLAN_RX_FRAME_BUFFER_SIZE);
 
-constexpr size_t WLAN_INCOMING_BUFFER_SIZE = 30000;
 alignas(uint32_t) uint8_t s_wlan_incoming_buffer[WLAN_INCOMING_BUFFER_SIZE];
+alignas(uint32_t) uint8_t s_wlan_incoming_fec_buffer[WLAN_INCOMING_BUFFER_SIZE];
+Wlan_Incoming_Queue s_wlan_incoming_queue(s_wlan_incoming_buffer, WLAN_INCOMING_BUFFER_SIZE);
+Wlan_Incoming_Queue s_wlan_incoming_fec_queue(s_wlan_incoming_fec_buffer, WLAN_INCOMING_BUFFER_SIZE);
+bool s_wlan_incoming_fec_read_last = false;
 
-constexpr size_t WLAN_OUTGOING_BUFFER_SIZE = 30000;
+alignas(uint32_t) uint8_t s_wlan_outgoing_high_priority_buffer[WLAN_OUTGOING_HIGH_PRIORITY_BUFFER_SIZE];
 alignas(uint32_t) uint8_t s_wlan_outgoing_buffer[WLAN_OUTGOING_BUFFER_SIZE];
-
-
-template<size_t N>
-struct Queue
+alignas(uint32_t) uint8_t s_wlan_outgoing_fec_buffer[WLAN_OUTGOING_BUFFER_SIZE];
+Wlan_Outgoing_Queue s_wlan_outgoing_high_priority_queue(s_wlan_outgoing_high_priority_buffer, WLAN_OUTGOING_HIGH_PRIORITY_BUFFER_SIZE);
+Wlan_Outgoing_Queue s_wlan_outgoing_queue(s_wlan_outgoing_buffer, WLAN_OUTGOING_BUFFER_SIZE);
+Wlan_Outgoing_Queue s_wlan_outgoing_fec_queue(s_wlan_outgoing_fec_buffer, WLAN_OUTGOING_BUFFER_SIZE);
+
+//deficit round robin between the normal and the FEC queue. Every turn adds a max packet, so each turn sends at least one
+constexpr int32_t WLAN_OUTGOING_QUANTUM = WLAN_MAX_PACKET_SIZE;
+Wlan_Outgoing_Queue* s_wlan_outgoing_shared_queues[2] = { &s_wlan_outgoing_queue, &s_wlan_outgoing_fec_queue };
+int32_t s_wlan_outgoing_deficits[2] = { 0, 0 };
+size_t s_wlan_outgoing_turn = 0;
+
+IRAM_ATTR inline size_t get_wlan_incoming_count()
 {
-  Queue(uint8_t* buffer)
-    : m_buffer(buffer)
-  {
-    //memset(m_buffer, 0, N);
-  }
-
-  IRAM_ATTR inline size_t count() const
-  {
-    return m_count;
-  }
-
-  IRAM_ATTR inline size_t next_reading_size()
-  {
-    if (m_read_start != m_read_end)
-    {
-      return 0;
-    }
-    if (m_read_start == m_write_start)
-    {
-      return 0;
-    }
-    size_t size;
-    memcpy(&size, m_buffer + m_read_start, sizeof(uint32_t)); //read the size
-    return size;
-  }
-
-  IRAM_ATTR inline size_t size() const
-  {
-    if (m_read_start == m_write_start)
-    {
-      return 0;
-    }
-    if (m_write_start > m_read_start) //no wrap
-    {
-      return m_write_end - m_read_start;
-    }
-    if (m_write_start < m_read_start) //wrap
-    {
-      return (N - m_read_start) + m_write_end;
-    }
-    return 0;
-  }
-
-  IRAM_ATTR inline size_t capacity() const
-  {
-    return N;
-  }
-
-  IRAM_ATTR inline uint8_t* start_writing(size_t size) __attribute__((always_inline))
-  {
-    if (m_write_start != m_write_end)
-    {
-      return nullptr;
-    }
-    
-    //size_t aligned_size = (size + (CHUNK_SIZE - 1)) & ~CHUNK_MASK; //align the size
-    size_t end = m_write_start + sizeof(uint32_t) + size;
-    if (end <= N) //no wrap
-    {
-      //check read collisions
-      if (m_write_start < m_read_start && end >= m_read_start)
-      {
-//        Serial.printf("\tf1: %d < %d && %d >= %d\n", start, m_read_start, end, m_read_start);
-        return nullptr;
-      }
-
-//      Serial.printf("\tw1: %d, %d, %d, %d\n", start, end, m_read_start, m_read_end);
-      memcpy(m_buffer + m_write_start, &size, sizeof(uint32_t)); //write the size before wrapping
-      m_write_end = end;
-      return m_buffer + m_write_start + sizeof(uint32_t);
-    }
-    else //wrap
-    {
-      //check read collisions
-      if (m_read_start > m_write_start) //if the read offset is between start and the end of the buffer
-      {
-//        Serial.printf("\tf2: %d > %d\n", m_read_start, start);
-        return nullptr;
-      }
-      end = size;
-      //check read collisions
-      if (end >= m_read_start)
-      {
-//        Serial.printf("\tf3: %d >= %d\n", end, m_read_start);
-        return nullptr;
-      }
-
-//      Serial.printf("\tw2: %d, %d, %d, %d\n", start, end, m_read_start, m_read_end);
-      memcpy(m_buffer + m_write_start, &size, sizeof(uint32_t)); //write the size before wrapping
-      m_write_end = end;
-      return m_buffer;
-    }
-  }
-
-  IRAM_ATTR inline void end_writing() __attribute__((always_inline))
-  {
-    m_write_start = m_write_end;
-    m_count++;
-  }
-  IRAM_ATTR inline void cancel_writing() __attribute__((always_inline))
-  {
-    m_write_end = m_write_start;
-  }
-
-  IRAM_ATTR inline uint8_t* start_reading(size_t& size) __attribute__((always_inline))
-  {
-    if (m_read_start != m_read_end)
-    {
-      return nullptr;
-    }
-    if (m_read_start == m_write_start)
-    {
-//      Serial.printf("\tf4: %d == %d\n", m_read_start, m_write_start);
-      size = 0;
-      return nullptr;
-    }
-    size_t start = m_read_start;
-    memcpy(&size, m_buffer + start, sizeof(uint32_t)); //read the size
-    //size_t aligned_size = (size + (CHUNK_SIZE - 1)) & ~CHUNK_MASK; //align the size
-    size_t end = start + sizeof(uint32_t) + size;
-    if (end <= N)
-    {
-      m_read_end = end;
-      return m_buffer + start + sizeof(uint32_t);
-    }
-    else
-    {
-      //m_read_start = 0;
-      m_read_end = size;
-      return m_buffer;
-    }
-  }
-
-  IRAM_ATTR inline void end_reading() __attribute__((always_inline))
-  {
-    m_read_start = m_read_end;
-    assert(m_count > 0);
-    m_count--;
-  }
-  IRAM_ATTR inline void cancel_reading()  __attribute__((always_inline))
-  {
-    m_read_end = m_read_start;
-  }
-  
-private:
-  uint8_t* m_buffer = nullptr;
-  size_t m_write_start = 0;
-  size_t m_write_end = 0;
-  size_t m_read_start = 0;
-  size_t m_read_end = 0;
-  size_t m_count = 0;
-};
-
-////////////////////////////////////////////////////////////////////////////////////
-
-Queue<WLAN_INCOMING_BUFFER_SIZE> s_wlan_incoming_queue(s_wlan_incoming_buffer);
-portMUX_TYPE s_wlan_incoming_mux = portMUX_INITIALIZER_UNLOCKED;
+  return s_wlan_incoming_queue.count() + s_wlan_incoming_fec_queue.count();
+}
+IRAM_ATTR inline size_t get_wlan_incoming_size()
+{
+  return s_wlan_incoming_queue.size() + s_wlan_incoming_fec_queue.size();
+}
+IRAM_ATTR inline size_t get_wlan_incoming_capacity()
+{
+  return s_wlan_incoming_queue.capacity() + s_wlan_incoming_fec_queue.capacity();
+}
 
-Queue<WLAN_OUTGOING_BUFFER_SIZE> s_wlan_outgoing_queue(s_wlan_outgoing_buffer);
-portMUX_TYPE s_wlan_outgoing_mux = portMUX_INITIALIZER_UNLOCKED;
+IRAM_ATTR inline size_t get_wlan_outgoing_size()
+{
+  return s_wlan_outgoing_high_priority_queue.size() + s_wlan_outgoing_queue.size() + s_wlan_outgoing_fec_queue.size();
+}
+IRAM_ATTR inline size_t get_wlan_outgoing_capacity()
+{
+  return s_wlan_outgoing_high_priority_queue.capacity() + s_wlan_outgoing_queue.capacity() + s_wlan_outgoing_fec_queue.capacity();
+}
 
 ////////////////////////////////////////////////////////////////////////////////////
 
-IRAM_ATTR bool start_writing_wlan_outgoing_packet(Wlan_Outgoing_Packet& packet, size_t size)
+//The IEEE header is filled in just before the packet is sent, until then its space holds the time the packet was queued
+IRAM_ATTR bool start_writing_wlan_outgoing_packet(Wlan_Outgoing_Queue& queue, Wlan_Outgoing_Packet& packet, size_t size, uint32_t time_us)
 {
   size_t real_size = WLAN_IEEE_HEADER_SIZE + size;
-  uint8_t* buffer = s_wlan_outgoing_queue.start_writing(real_size);
+  uint8_t* buffer = queue.start_writing(real_size);
   if (!buffer)
   {
     packet.ptr = nullptr;
     return false;
   }
+  packet.queue = &queue;
   packet.offset = 0;
   packet.size = size;
   packet.ptr = buffer;
   packet.payload_ptr = buffer + WLAN_IEEE_HEADER_SIZE;
+  packet.time_us = time_us;
+  memcpy(buffer, &time_us, sizeof(time_us));
   return true;
 }
 IRAM_ATTR void end_writing_wlan_outgoing_packet(Wlan_Outgoing_Packet& packet)
 {
-  s_wlan_outgoing_queue.end_writing();
+  packet.queue->end_writing(packet.ptr);
   packet.ptr = nullptr;
 }
 IRAM_ATTR void cancel_writing_wlan_outgoing_packet(Wlan_Outgoing_Packet& packet)
 {
-  s_wlan_outgoing_queue.cancel_writing();
+  packet.queue->cancel_writing(packet.ptr);
   packet.ptr = nullptr;
 }
 
-IRAM_ATTR bool start_reading_wlan_outgoing_packet(Wlan_Outgoing_Packet& packet)
+IRAM_ATTR bool start_reading_wlan_outgoing_packet(Wlan_Outgoing_Queue& queue, Wlan_Outgoing_Packet& packet)
 {
   size_t real_size = 0;
-  uint8_t* buffer = s_wlan_outgoing_queue.start_reading(real_size);
+  uint8_t* buffer = queue.start_reading(real_size);
   if (!buffer)
   {
     packet.ptr = nullptr;
     return false;
   }
+  packet.queue = &queue;
   packet.offset = 0;
   packet.size = real_size - WLAN_IEEE_HEADER_SIZE;
   packet.ptr = buffer;
   packet.payload_ptr = buffer + WLAN_IEEE_HEADER_SIZE;
+  memcpy(&packet.time_us, buffer, sizeof(packet.time_us));
   return true;
 }
+
+//Picks the next packet to send from all the queues
+IRAM_ATTR bool start_reading_wlan_outgoing_packet(Wlan_Outgoing_Packet& packet)
+{
+  if (start_reading_wlan_outgoing_packet(s_wlan_outgoing_high_priority_queue, packet))
+  {
+    return true;
+  }
+
+  //a turn that can't afford its packet passes to the other one, which then can afford any packet. So 3 turns at most
+  for (size_t i = 0; i < 4; i++)
+  {
+    size_t turn = s_wlan_outgoing_turn;
+    if (start_reading_wlan_outgoing_packet(*s_wlan_outgoing_shared_queues[turn], packet))
+    {
+      int32_t size = static_cast<int32_t>(packet.size + WLAN_IEEE_HEADER_SIZE);
+      if (s_wlan_outgoing_deficits[turn] >= size)
+      {
+        s_wlan_outgoing_deficits[turn] -= size;
+        return true;
+      }
+      s_wlan_outgoing_shared_queues[turn]->cancel_reading();
+    }
+    else
+    {
+      s_wlan_outgoing_deficits[turn] = 0; //an empty queue doesn't save up for later
+    }
+    s_wlan_outgoing_turn = 1 - turn;
+    s_wlan_outgoing_deficits[s_wlan_outgoing_turn] += WLAN_OUTGOING_QUANTUM;
+  }
+  packet.ptr = nullptr;
+  return false;
+}
+
+//Packets read out of turn from a shared queue (packed with the one of its turn) are paid from its deficit. It doesn't
+// go below zero so the other queue still gets its turn within the 3 above
+IRAM_ATTR void charge_wlan_outgoing_packet(const Wlan_Outgoing_Packet& packet)
+{
+  for (size_t i = 0; i < 2; i++)
+  {
+    if (s_wlan_outgoing_shared_queues[i] == packet.queue)
+    {
+      int32_t size = static_cast<int32_t>(packet.size + sizeof(Wlan_Packed_Header));
+      s_wlan_outgoing_deficits[i] = std::max<int32_t>(s_wlan_outgoing_deficits[i] - size, 0);
+    }
+  }
+}
 IRAM_ATTR void end_reading_wlan_outgoing_packet(Wlan_Outgoing_Packet& packet)
 {
-  s_wlan_outgoing_queue.end_reading();
+  packet.queue->end_reading();
   packet.ptr = nullptr;
 }
 IRAM_ATTR void cancel_reading_wlan_outgoing_packet(Wlan_Outgoing_Packet& packet)
 {
-  s_wlan_outgoing_queue.cancel_reading();
+  packet.queue->cancel_reading();
   packet.ptr = nullptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
 
-IRAM_ATTR bool start_writing_wlan_incoming_packet(Wlan_Incoming_Packet& packet, size_t size)
+//The radio info goes before the payload
+IRAM_ATTR bool start_writing_wlan_incoming_packet(Wlan_Incoming_Queue& queue, Wlan_Incoming_Packet& packet, size_t size, const SPI_Rx_Info& info)
 {
-  uint8_t* buffer = s_wlan_incoming_queue.start_writing(size);
+  uint8_t* buffer = queue.start_writing(sizeof(SPI_Rx_Info) + size);
   if (!buffer)
   {
     packet.ptr = nullptr;
     return false;
   }
+  packet.queue = &queue;
   packet.offset = 0;
   packet.size = size;
   packet.ptr = buffer;
+  packet.payload_ptr = buffer + sizeof(SPI_Rx_Info);
+  packet.info = info;
+  memcpy(buffer, &info, sizeof(info));
   return true;
 }
 IRAM_ATTR void end_writing_wlan_incoming_packet(Wlan_Incoming_Packet& packet)
 {
-  s_wlan_incoming_queue.end_writing();
+  packet.queue->end_writing(packet.ptr);
   packet.ptr = nullptr;
 }
 IRAM_ATTR void cancel_writing_wlan_incoming_packet(Wlan_Incoming_Packet& packet)
 {
-  s_wlan_incoming_queue.cancel_writing();
+  packet.queue->cancel_writing(packet.ptr);
   packet.ptr = nullptr;
 }
 
 IRAM_ATTR bool start_reading_wlan_incoming_packet(Wlan_Incoming_Packet& packet)
 {
-  size_t size = 0;
-  uint8_t* buffer = s_wlan_incoming_queue.start_reading(size);
-  if (!buffer)
+  Wlan_Incoming_Queue* queues[2] = { &s_wlan_incoming_fec_queue, &s_wlan_incoming_queue };
+  if (s_wlan_incoming_fec_read_last)
   {
-    packet.ptr = nullptr;
-    return false;
+    std::swap(queues[0], queues[1]);
   }
-  packet.offset = 0;
-  packet.size = size;
-  packet.ptr = buffer;
-  return true;
+  for (Wlan_Incoming_Queue* queue: queues)
+  {
+    size_t size = 0;
+    uint8_t* buffer = queue->start_reading(size);
+    if (buffer)
+    {
+      s_wlan_incoming_fec_read_last = queue == &s_wlan_incoming_fec_queue;
+      packet.queue = queue;
+      packet.offset = 0;
+      packet.size = size - sizeof(SPI_Rx_Info);
+      packet.ptr = buffer;
+      packet.payload_ptr = buffer + sizeof(SPI_Rx_Info);
+      memcpy(&packet.info, buffer, sizeof(packet.info));
+      return true;
+    }
+  }
+  packet.ptr = nullptr;
+  return false;
 }
 IRAM_ATTR void end_reading_wlan_incoming_packet(Wlan_Incoming_Packet& packet)
 {
-  s_wlan_incoming_queue.end_reading();
+  packet.queue->end_reading();
   packet.ptr = nullptr;
 }
 IRAM_ATTR void cancel_reading_wlan_incoming_packet(Wlan_Incoming_Packet& packet)
 {
-  s_wlan_incoming_queue.cancel_reading();
+  packet.queue->cancel_reading();
   packet.ptr = nullptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
 
-struct Stats
+//A counter with a single writer, updated without any lock. It's 32 bit so the other core always reads it whole, the
+// increments are folded into the 64 bit SPI_Stats by loop() (see fold_stat)
+struct Stat_Counter
 {
-    uint32_t wlan_data_sent = 0;
-    uint32_t wlan_data_received = 0;
-    uint16_t wlan_error_count = 0;
-    uint16_t wlan_received_packets_dropped = 0;
-    uint32_t spi_data_sent = 0;
-    uint32_t spi_data_received = 0;
-    uint16_t spi_error_count = 0;
-    uint16_t spi_received_packets_dropped = 0;
+  std::atomic<uint32_t> value{0};
+  uint32_t folded = 0; //the part of value already in s_stats, belongs to loop()
 };
-static_assert(sizeof(Stats) == 6 * 4, "Stats too big");
 
-Stats s_stats;
+IRAM_ATTR inline void add_stat(Stat_Counter& counter, uint32_t value = 1)
+{
+  counter.value.store(counter.value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+IRAM_ATTR inline void update_high_water(Stat_Counter& high_water, size_t value)
+{
+  if (value > high_water.value.load(std::memory_order_relaxed))
+  {
+    high_water.value.store(static_cast<uint32_t>(value), std::memory_order_relaxed);
+  }
+}
+
+//The counters of SPI_Stats updated by one task or callback. The FEC block counters come from Fec_Codec instead
+struct Stats_Block
+{
+  Stat_Counter wlan_data_sent;
+  Stat_Counter wlan_packets_sent;
+  Stat_Counter wlan_tx_failures;
+  Stat_Counter wlan_outgoing_packets_dropped;
+  Stat_Counter wlan_data_received;
+  Stat_Counter wlan_packets_received;
+  Stat_Counter wlan_error_count;
+  Stat_Counter wlan_received_packets_dropped;
+  Stat_Counter spi_data_sent;
+  Stat_Counter spi_packets_sent;
+  Stat_Counter spi_data_received;
+  Stat_Counter spi_packets_received;
+  Stat_Counter spi_error_count;
+  Stat_Counter spi_crc_error_count;
+  Stat_Counter fec_encoder_packets_dropped;
+  Stat_Counter wlan_outgoing_queue_high_water;
+  Stat_Counter wlan_incoming_queue_high_water;
+  Stat_Counter wlan_outgoing_packets_expired;
+  Stat_Counter wlan_outgoing_packets_evicted;
+  Stat_Counter wlan_packets_packed;
+  Stat_Counter wlan_tx_rate_switches;
+  Stat_Counter wlan_frames_filtered;
+};
+
+//One block per writer, so the WiFi callback, the WLAN & FEC tasks and loop() never contend on the stats
+Stats_Block s_loop_stats;
+Stats_Block s_wlan_rx_cb_stats;   //the WiFi promiscuous callback
+Stats_Block s_wlan_rx_stats;      //the WLAN RX task
+Stats_Block s_wlan_tx_stats;      //the WLAN TX task
+Stats_Block s_fec_encoder_stats;  //fec_encoded_cb
+Stats_Block s_fec_decoder_stats;  //fec_decoded_cb
+Stats_Block* const s_stats_blocks[] = { &s_loop_stats, &s_wlan_rx_cb_stats, &s_wlan_rx_stats, &s_wlan_tx_stats, 
+                                        &s_fec_encoder_stats, &s_fec_decoder_stats };
+
+//Cumulative, see SPI_Stats. The UART report prints the difference to the last one.
+//Only loop() touches these. The blocks are folded in at least every STATS_FOLD_PERIOD_MS, far too often for a 32 bit
+// counter to go all the way around in between
+SPI_Stats s_stats;
+SPI_Stats s_stats_last_report;
+SPI_Stats s_stats_snapshot; //for the GET_STATS pages
+int64_t s_stats_snapshot_time_us = 0;
+constexpr uint32_t STATS_FOLD_PERIOD_MS = 1000;
+uint32_t s_stats_fold_tp = 0;
+
+inline void fold_stat(uint64_t& stat, Stat_Counter& counter)
+{
+  uint32_t value = counter.value.load(std::memory_order_relaxed);
+  stat += static_cast<uint32_t>(value - counter.folded);
+  counter.folded = value;
+}
+
+inline void fold_high_water(uint64_t& high_water, Stat_Counter& counter)
+{
+  high_water = std::max<uint64_t>(high_water, counter.value.load(std::memory_order_relaxed));
+}
+
+inline void fold_stats(Stats_Block& block)
+{
+  fold_stat(s_stats.wlan_data_sent, block.wlan_data_sent);
+  fold_stat(s_stats.wlan_packets_sent, block.wlan_packets_sent);
+  fold_stat(s_stats.wlan_tx_failures, block.wlan_tx_failures);
+  fold_stat(s_stats.wlan_outgoing_packets_dropped, block.wlan_outgoing_packets_dropped);
+  fold_stat(s_stats.wlan_data_received, block.wlan_data_received);
+  fold_stat(s_stats.wlan_packets_received, block.wlan_packets_received);
+  fold_stat(s_stats.wlan_error_count, block.wlan_error_count);
+  fold_stat(s_stats.wlan_received_packets_dropped, block.wlan_received_packets_dropped);
+  fold_stat(s_stats.spi_data_sent, block.spi_data_sent);
+  fold_stat(s_stats.spi_packets_sent, block.spi_packets_sent);
+  fold_stat(s_stats.spi_data_received, block.spi_data_received);
+  fold_stat(s_stats.spi_packets_received, block.spi_packets_received);
+  fold_stat(s_stats.spi_error_count, block.spi_error_count);
+  fold_stat(s_stats.spi_crc_error_count, block.spi_crc_error_count);
+  fold_stat(s_stats.fec_encoder_packets_dropped, block.fec_encoder_packets_dropped);
+  fold_high_water(s_stats.wlan_outgoing_queue_high_water, block.wlan_outgoing_queue_high_water);
+  fold_high_water(s_stats.wlan_incoming_queue_high_water, block.wlan_incoming_queue_high_water);
+  fold_stat(s_stats.wlan_outgoing_packets_expired, block.wlan_outgoing_packets_expired);
+  fold_stat(s_stats.wlan_outgoing_packets_evicted, block.wlan_outgoing_packets_evicted);
+  fold_stat(s_stats.wlan_packets_packed, block.wlan_packets_packed);
+  fold_stat(s_stats.wlan_tx_rate_switches, block.wlan_tx_rate_switches);
+  fold_stat(s_stats.wlan_frames_filtered, block.wlan_frames_filtered);
+}
+
+//Called by loop() only
+inline const SPI_Stats& get_stats()
+{
+  for (Stats_Block* block: s_stats_blocks)
+  {
+    fold_stats(*block);
+  }
+  s_stats_fold_tp = millis();
+  return s_stats;
+}
 
 
 struct ADC_Data
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+//The CRC-8 (polynomial 0x07) of the SPI headers and command sections, same as on the module
+inline std::array<uint8_t, 256> const& get_crc8_table()
+{
+    static const std::array<uint8_t, 256> s_table = []()
+    {
+        static constexpr uint8_t DI = 0x07;
+        std::array<uint8_t, 256> table;
+        for (uint16_t i = 0; i < 256; i++)
+        {
+            uint8_t crc = (uint8_t)i;
+            for (uint8_t j = 0; j < 8; j++)
+            {
+                crc = (crc << 1) ^ ((crc & 0x80) ? DI : 0);
+            }
+            table[i] = crc & 0xFF;
+        }
+        return table;
+    }();
+    return s_table;
+}
+
+inline uint8_t crc8(uint8_t crc, const void *c_ptr, size_t len)
+{
+    std::array<uint8_t, 256> const& table = get_crc8_table();
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(c_ptr);
+    size_t n = (len + 7) >> 3;
+    switch (len & 7)
+    {
+    case 0: do { crc = table[crc ^ (*c++)];
+    case 7:      crc = table[crc ^ (*c++)];
+    case 6:      crc = table[crc ^ (*c++)];
+    case 5:      crc = table[crc ^ (*c++)];
+    case 4:      crc = table[crc ^ (*c++)];
+    case 3:      crc = table[crc ^ (*c++)];
+    case 2:      crc = table[crc ^ (*c++)];
+    case 1:      crc = table[crc ^ (*c++)];
+            } while (--n > 0);
+    }
+    return crc;
+}
@@ -0,0 +1,67 @@
+#include "Deadline_Scheduler.h"
+#include <time.h>
+#include <sys/prctl.h>
+#include <errno.h>
+#include <algorithm>
+
+//////////////////////////////////////////////////////////////////////////////
+
+Deadline_Scheduler::Deadline_Scheduler(std::chrono::microseconds spin_time)
+    : m_spin_time(spin_time)
+{
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Deadline_Scheduler::set_spin_time(std::chrono::microseconds spin_time)
+{
+    m_spin_time = spin_time;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Deadline_Scheduler::sleep_until(Clock::time_point deadline)
+{
+    if (!m_timer_slack_set)
+    {
+        //the default timer slack adds 50us to every sleep of normal threads. It's per thread so it's set by the sleeping one
+        m_timer_slack_set = true;
+        prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+    }
+
+    Clock::time_point wakeup_tp = deadline - m_spin_time;
+    if (Clock::now() < wakeup_tp)
+    {
+        //steady_clock is CLOCK_MONOTONIC on linux so the time points can be given straight to the kernel
+        std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wakeup_tp.time_since_epoch());
+        timespec ts;
+        ts.tv_sec = static_cast<time_t>(ns.count() / 1000000000);
+        ts.tv_nsec = static_cast<long>(ns.count() % 1000000000);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        {
+        }
+    }
+
+    Clock::time_point now = Clock::now();
+    while (now < deadline)
+    {
+        now = Clock::now();
+    }
+
+    int64_t overshoot = std::chrono::duration_cast<std::chrono::microseconds>(now - deadline).count();
+    m_overshoot_histogram.add(static_cast<uint32_t>(std::max<int64_t>(overshoot, 0)));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Deadline_Scheduler::sleep_for(Clock::duration duration)
+{
+    sleep_until(Clock::now() + duration);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Histogram const& Deadline_Scheduler::get_overshoot_histogram() const
+{
+    return m_overshoot_histogram;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <chrono>
+#include "Histogram.h"
+
+//Sleeps until absolute deadlines with clock_nanosleep(TIMER_ABSTIME) on CLOCK_MONOTONIC.
+//The kernel sleep ends spin_time early and the rest is spent spinning, which takes the wakeup latency of the
+// scheduler out of the picture for the last few microseconds.
+//It keeps a histogram of how late each deadline was met (in microseconds).
+//Not thread safe, each thread that sleeps needs its own.
+class Deadline_Scheduler
+{
+public:
+    typedef std::chrono::steady_clock Clock; //CLOCK_MONOTONIC
+
+    Deadline_Scheduler(std::chrono::microseconds spin_time = std::chrono::microseconds(20));
+
+    void set_spin_time(std::chrono::microseconds spin_time);
+
+    //Returns right away if the deadline is in the past. It still counts as overshoot though
+    void sleep_until(Clock::time_point deadline);
+    void sleep_for(Clock::duration duration);
+
+    Histogram const& get_overshoot_histogram() const;
+
+private:
+    std::chrono::microseconds m_spin_time;
+    bool m_timer_slack_set = false;
+    Histogram m_overshoot_histogram;
+};
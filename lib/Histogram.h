@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+//Histogram of durations in microseconds, used to look at latency & jitter.
+//The buckets are powers of 2: [0, 1), [1, 2), [2, 4), [4, 8) ... and the last one takes everything bigger.
+//One thread adds values, any other thread can read them. The reads are approximate while values are added.
+class Histogram
+{
+public:
+    static const size_t BUCKET_COUNT = 24; //the last bucket starts at ~4s
+
+    Histogram()
+    {
+        reset();
+    }
+
+    void add(uint32_t us)
+    {
+        size_t bucket = 0;
+        while (bucket + 1 < BUCKET_COUNT && us >= get_bucket_end(bucket))
+        {
+            bucket++;
+        }
+        m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        if (us > m_max.load(std::memory_order_relaxed))
+        {
+            m_max.store(us, std::memory_order_relaxed);
+        }
+    }
+
+    void reset()
+    {
+        for (std::atomic<uint32_t>& bucket: m_buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        m_count.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+    uint32_t get_count() const
+    {
+        return m_count.load(std::memory_order_relaxed);
+    }
+    uint32_t get_max() const
+    {
+        return m_max.load(std::memory_order_relaxed);
+    }
+
+    //Returns the end of the bucket that contains the percentile (0 .. 1), or the max if that's smaller, so the real
+    // value is not bigger
+    uint32_t get_percentile(float percentile) const
+    {
+        uint32_t count = get_count();
+        if (count == 0)
+        {
+            return 0;
+        }
+        uint64_t target = static_cast<uint64_t>(static_cast<double>(count) * percentile);
+        uint64_t accumulated = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; i++)
+        {
+            accumulated += m_buckets[i].load(std::memory_order_relaxed);
+            if (accumulated > target)
+            {
+                return i + 1 < BUCKET_COUNT ? std::min(get_bucket_end(i), get_max()) : get_max();
+            }
+        }
+        return get_max();
+    }
+
+    //One line summary: count, percentiles and max
+    std::string to_string() const
+    {
+        return "count " + std::to_string(get_count()) +
+                ", p50 <= " + std::to_string(get_percentile(0.5f)) +
+                "us, p99 <= " + std::to_string(get_percentile(0.99f)) +
+                "us, p99.9 <= " + std::to_string(get_percentile(0.999f)) +
+                "us, max " + std::to_string(get_max()) + "us";
+    }
+
+    //All the non empty buckets, one per line
+    std::string to_bucket_string() const
+    {
+        std::string str;
+        for (size_t i = 0; i < BUCKET_COUNT; i++)
+        {
+            uint32_t value = m_buckets[i].load(std::memory_order_relaxed);
+            if (value > 0)
+            {
+                str += "\t[" + std::to_string(get_bucket_start(i)) + ", " +
+                        (i + 1 < BUCKET_COUNT ? std::to_string(get_bucket_end(i)) + ")" : std::string("...)")) +
+                        "us: " + std::to_string(value) + "\n";
+            }
+        }
+        return str;
+    }
+
+private:
+    static uint32_t get_bucket_start(size_t bucket)
+    {
+        return bucket == 0 ? 0 : 1u << (bucket - 1);
+    }
+    static uint32_t get_bucket_end(size_t bucket)
+    {
+        return 1u << bucket;
+    }
+
+    std::array<std::atomic<uint32_t>, BUCKET_COUNT> m_buckets;
+    std::atomic<uint32_t> m_count;
+    std::atomic<uint32_t> m_max;
+};
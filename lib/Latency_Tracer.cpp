@@ -0,0 +1,112 @@
+#include "Latency_Tracer.h"
+
+const size_t Latency_Tracer::STAGE_COUNT;
+
+//////////////////////////////////////////////////////////////////////////////
+
+uint32_t Latency_Tracer::get_stamp(Clock::time_point tp)
+{
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(tp.time_since_epoch()).count());
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+char const* Latency_Tracer::get_stage_name(Latency_Trace_Stage stage)
+{
+    switch (stage)
+    {
+    case Latency_Trace_Stage::HOST_SEND: return "host send";
+    case Latency_Trace_Stage::HOST_SPI_TX: return "host SPI TX";
+    case Latency_Trace_Stage::MODULE_SPI_RX: return "module SPI RX";
+    case Latency_Trace_Stage::MODULE_FEC_ENCODED: return "module FEC encoded";
+    case Latency_Trace_Stage::MODULE_WLAN_TX: return "module WLAN TX";
+    case Latency_Trace_Stage::MODULE_WLAN_RX: return "module WLAN RX";
+    case Latency_Trace_Stage::MODULE_FEC_DECODED: return "module FEC decoded";
+    case Latency_Trace_Stage::MODULE_SPI_TX: return "module SPI TX";
+    case Latency_Trace_Stage::HOST_SPI_RX: return "host SPI RX";
+    case Latency_Trace_Stage::HOST_RECEIVE: return "host receive";
+    default: return "unknown";
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Latency_Tracer::get_clock_index(size_t stage)
+{
+    switch (static_cast<Latency_Trace_Stage>(stage))
+    {
+    case Latency_Trace_Stage::HOST_SEND:
+    case Latency_Trace_Stage::HOST_SPI_TX:
+        return 0;
+    case Latency_Trace_Stage::MODULE_SPI_RX:
+    case Latency_Trace_Stage::MODULE_FEC_ENCODED:
+    case Latency_Trace_Stage::MODULE_WLAN_TX:
+        return 1;
+    case Latency_Trace_Stage::MODULE_WLAN_RX:
+    case Latency_Trace_Stage::MODULE_FEC_DECODED:
+    case Latency_Trace_Stage::MODULE_SPI_TX:
+        return 2;
+    default:
+        return 3;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Latency_Tracer::set_single_clock(bool single_clock)
+{
+    m_single_clock = single_clock;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Latency_Tracer::add(Latency_Trace const& trace)
+{
+    //the differences wrap around with the 32 bit stamps, so only the order of the stages matters
+    size_t first = STAGE_COUNT;
+    size_t last = STAGE_COUNT;
+    for (size_t stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        if (trace.stamps[stage] == 0)
+        {
+            continue;
+        }
+        if (last < STAGE_COUNT && (m_single_clock || get_clock_index(last) == get_clock_index(stage)))
+        {
+            m_segments[last * STAGE_COUNT + stage].add(trace.stamps[stage] - trace.stamps[last]);
+        }
+        if (first == STAGE_COUNT)
+        {
+            first = stage;
+        }
+        last = stage;
+    }
+    if (m_single_clock && first < last)
+    {
+        m_end_to_end.add(trace.stamps[last] - trace.stamps[first]);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+std::string Latency_Tracer::to_string() const
+{
+    std::string str;
+    for (size_t from = 0; from < STAGE_COUNT; from++)
+    {
+        for (size_t to = from + 1; to < STAGE_COUNT; to++)
+        {
+            Histogram const& histogram = m_segments[from * STAGE_COUNT + to];
+            if (histogram.get_count() > 0)
+            {
+                str += std::string("\t") + get_stage_name(static_cast<Latency_Trace_Stage>(from)) + " -> " +
+                        get_stage_name(static_cast<Latency_Trace_Stage>(to)) + ": " + histogram.to_string() + "\n";
+            }
+        }
+    }
+    if (m_end_to_end.get_count() > 0)
+    {
+        str += "\tend to end: " + m_end_to_end.to_string() + "\n";
+    }
+    return str;
+}
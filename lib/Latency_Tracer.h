@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include "Histogram.h"
+#include "../firmware/latency_trace.h"
+
+//Collects the latency traces of the received packets (see latency_trace.h) into histograms, one for each pair of
+// consecutive stages a packet was stamped at and one for the whole trip.
+//The stamps come from 4 clocks: the sending host, its module, the receiving module and the receiving host. Only
+// the segments between stamps of the same clock are measured, unless the clocks are all the same one (the simulated
+// module in one or more processes on the same machine, see Sim_Module).
+//One thread adds traces, any other thread can read them.
+class Latency_Tracer
+{
+public:
+    typedef std::chrono::steady_clock Clock; //CLOCK_MONOTONIC, same as esp_timer_get_time in the simulated module
+
+    //The stamp of a time point, microseconds truncated to 32 bits
+    static uint32_t get_stamp(Clock::time_point tp);
+
+    static char const* get_stage_name(Latency_Trace_Stage stage);
+
+    void set_single_clock(bool single_clock);
+
+    void add(Latency_Trace const& trace);
+
+    //One line per non empty segment
+    std::string to_string() const;
+
+private:
+    static const size_t STAGE_COUNT = static_cast<size_t>(Latency_Trace_Stage::COUNT);
+
+    static size_t get_clock_index(size_t stage);
+
+    bool m_single_clock = false;
+    std::array<Histogram, STAGE_COUNT * STAGE_COUNT> m_segments; //indexed by from * STAGE_COUNT + to
+    Histogram m_end_to_end;
+};
@@ -10,10 +10,18 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <cassert>
+#include <algorithm>
+#include <limits>
 #include <thread>
 #include <stdio.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include "../firmware/spi_comms.h"
+#include "../firmware/host/sim_module.h"
+#include "CRC8.h"
 
 const size_t Phy::MAX_ADC_CHANNELS;
 const uint32_t Phy::MIN_ADC_RATE;
@@ -22,9 +30,31 @@ const uint32_t Phy::MAX_ADC_RATE;
 static const size_t CHUNK_SIZE = 1024;
 
 const size_t Phy::MAX_PAYLOAD_SIZE;
+const size_t Phy::MAX_COMMAND_DATA_SIZE;
+const size_t Phy::TX_RING_CAPACITY;
+const size_t Phy::TX_HIGH_PRIORITY_RING_CAPACITY;
+const size_t Phy::RX_SLOT_COUNT;
+const size_t Phy::MAX_TRANSFER_SIZE;
+const size_t Phy::LATENCY_TRACE_SIZE;
+const uint8_t Phy::RX_RATE_MCS;
+const std::chrono::milliseconds Phy::MAX_TX_QUEUE_MAX_AGE(std::numeric_limits<uint16_t>::max());
+const std::chrono::milliseconds Phy::MAX_PACKING_MAX_DELAY(100);
+const size_t Phy::MAX_RX_LINK_IDS = SPI_MAX_RX_LINK_IDS;
+const uint16_t Phy::DEFAULT_LINK_ID = SPI_DEFAULT_LINK_ID;
 static const size_t MAX_PACKET_SIZE = Phy::MAX_PAYLOAD_SIZE + 2; //crc
 
-static const uint32_t COMMAND_DELAY_US = 5000;
+static const std::chrono::milliseconds COMMAND_TIMEOUT(20);
+static const size_t MAX_COMMAND_ATTEMPTS = 5;
+//How long the blocking commands wait. Past the last retry of all the commands one of them chains (the stats pages),
+// in case the I/O thread is stuck
+static const std::chrono::seconds COMMAND_WAIT_TIMEOUT(2);
+
+static const std::chrono::milliseconds RX_POLL_PERIOD(1); //how often to poll for received packets when idle
+static const std::chrono::microseconds COMMAND_POLL_PERIOD(500); //how often to poll for command responses
+static const std::chrono::microseconds TX_TRANSFER_GAP(200); //how long the esp needs after a transfer with a packet
+static const std::chrono::microseconds POLL_TRANSFER_GAP(50); //how long the esp needs after a transfer without a packet
+
+static const size_t PREFAULT_STACK_SIZE = 64 * 1024;
 
 
 static const uint16_t s_crc16_table[256] =
@@ -73,65 +103,338 @@ static uint16_t crc16(uint16_t crc, const void *c_ptr, size_t len)
     return crc;
 }
 
-static uint8_t s_crc8_table[256];     /* 8-bit table */
-static void init_crc8_table()
+void log(const char* format, const char* file, int line, ...)
+{
+    char dest[1024 * 16];
+    va_list argptr;
+    va_start(argptr, format);
+    vsprintf(dest, format, argptr);
+    va_end(argptr);
+    printf("%s(%d): %s\n", file, line, dest);
+}
+
+//#define LOG(format, ...) log(format, __FILE__, __LINE__, ##__VA_ARGS__)
+#define LOG(format, ...)
+
+//////////////////////////////////////////////////////////////////////////////
+
+Phy::Phy()
+    : m_tx_buffer(MAX_TRANSFER_SIZE)
+    , m_rx_buffer(MAX_TRANSFER_SIZE)
+    , m_tx_ring(TX_RING_CAPACITY)
+    , m_tx_high_priority_ring(TX_HIGH_PRIORITY_RING_CAPACITY)
+    , m_rx_slab(RX_SLOT_COUNT * MAX_TRANSFER_SIZE)
+    , m_rx_ring(RX_SLOT_COUNT)
+    , m_rx_free_slots(RX_SLOT_COUNT)
+{
+    static_assert(MAX_TRANSFER_SIZE == MAX_SPI_BUFFER_SIZE, "Keep in sync with the module");
+    static_assert(RX_RATE_MCS == SPI_RX_RATE_MCS, "Keep in sync with the module");
+    static_assert(sizeof(SPI_Req_Packet_Header) + MAX_PAYLOAD_SIZE + MAX_SPI_COMMAND_SECTION_SIZE + 3 <= MAX_TRANSFER_SIZE, "Transfers don't fit");
+    static_assert(sizeof(SPI_Res_Packet_Header) + MAX_PAYLOAD_SIZE + MAX_SPI_COMMAND_SECTION_SIZE + 3 <= MAX_TRANSFER_SIZE, "Transfers don't fit");
+
+    get_crc8_table(); //built before the I/O thread needs it
+
+    m_rx_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_tx_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_io_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_rx_event_fd < 0 || m_tx_event_fd < 0 || m_io_wakeup_fd < 0)
+    {
+        std::cerr << "Cannot create eventfds: " << strerror(errno) << "\n";
+    }
+
+    //all slots start free. No thread is running yet so this can't race with anything
+    for (size_t i = 0; i < RX_SLOT_COUNT; i++)
+    {
+        *m_rx_free_slots.start_writing() = static_cast<uint16_t>(i);
+        m_rx_free_slots.end_writing();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Phy::~Phy()
+{
+    stop_io_thread();
+
+    if (m_rx_event_fd >= 0)
+    {
+        ::close(m_rx_event_fd);
+    }
+    if (m_tx_event_fd >= 0)
+    {
+        ::close(m_tx_event_fd);
+    }
+    if (m_io_wakeup_fd >= 0)
+    {
+        ::close(m_io_wakeup_fd);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::start_io_thread()
+{
+    m_io_thread_exit = false;
+    m_io_thread = std::thread(&Phy::io_thread_proc, this);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::stop_io_thread()
+{
+    if (m_io_thread.joinable())
+    {
+        m_io_thread_exit = true;
+        signal_event(m_io_wakeup_fd);
+        m_io_thread.join();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::set_realtime(int priority, int cpu)
+{
+    if (m_io_thread.joinable())
+    {
+        std::cerr << "The realtime mode has to be set before init\n";
+        return;
+    }
+    m_realtime_priority = std::min(std::max(priority, 1), 99);
+    m_realtime_cpu = cpu;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void prefault_stack()
+{
+    //touch the stack upfront so the I/O loop doesn't page fault on it later
+    volatile uint8_t stack[PREFAULT_STACK_SIZE];
+    for (size_t i = 0; i < PREFAULT_STACK_SIZE; i += 1024)
+    {
+        stack[i] = 0;
+    }
+    (void)stack;
+}
+
+void Phy::apply_realtime()
 {
-    static constexpr uint8_t DI = 0x07;
-    for (uint16_t i = 0; i < 256; i++)
+    if (m_realtime_priority <= 0)
+    {
+        return;
+    }
+
+    if (m_realtime_cpu >= 0)
     {
-        uint8_t crc = (uint8_t)i;
-        for (uint8_t j = 0; j < 8; j++)
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(m_realtime_cpu, &cpu_set);
+        int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+        if (res != 0)
         {
-            crc = (crc << 1) ^ ((crc & 0x80) ? DI : 0);
+            std::cerr << "Cannot pin the I/O thread to cpu " << std::to_string(m_realtime_cpu) << ": " << strerror(res) << "\n";
         }
-        s_crc8_table[i] = crc & 0xFF;
     }
+
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = m_realtime_priority;
+    int res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (res != 0)
+    {
+        std::cerr << "Cannot set SCHED_FIFO priority " << std::to_string(m_realtime_priority) << " for the I/O thread: " << strerror(res) << "\n";
+    }
+
+    prefault_stack();
 }
 
-static uint8_t crc8(uint8_t crc, const void *c_ptr, size_t len)
+//////////////////////////////////////////////////////////////////////////////
+
+int Phy::get_rx_event_fd() const
 {
-    const uint8_t* c = reinterpret_cast<const uint8_t*>(c_ptr);
-    size_t n = (len + 7) >> 3;
-    switch (len & 7)
-    {
-    case 0: do { crc = s_crc8_table[crc ^ (*c++)];
-    case 7:      crc = s_crc8_table[crc ^ (*c++)];
-    case 6:      crc = s_crc8_table[crc ^ (*c++)];
-    case 5:      crc = s_crc8_table[crc ^ (*c++)];
-    case 4:      crc = s_crc8_table[crc ^ (*c++)];
-    case 3:      crc = s_crc8_table[crc ^ (*c++)];
-    case 2:      crc = s_crc8_table[crc ^ (*c++)];
-    case 1:      crc = s_crc8_table[crc ^ (*c++)];
-            } while (--n > 0);
+    return m_rx_event_fd;
+}
+
+int Phy::get_tx_event_fd() const
+{
+    return m_tx_event_fd;
+}
+
+void Phy::clear_rx_event()
+{
+    clear_event(m_rx_event_fd);
+}
+
+void Phy::clear_tx_event()
+{
+    clear_event(m_tx_event_fd);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::signal_event(int fd)
+{
+    uint64_t value = 1;
+    if (fd >= 0 && ::write(fd, &value, sizeof(value)) < 0)
+    {
+        LOG("cannot signal event: %s", strerror(errno));
     }
-    return crc;
 }
 
-void log(const char* format, const char* file, int line, ...)
+void Phy::clear_event(int fd)
 {
-    char dest[1024 * 16];
-    va_list argptr;
-    va_start(argptr, format);
-    vsprintf(dest, format, argptr);
-    va_end(argptr);
-    printf("%s(%d): %s\n", file, line, dest);
+    uint64_t value = 0;
+    if (fd >= 0 && ::read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        LOG("cannot clear event: %s", strerror(errno));
+    }
 }
 
-//#define LOG(format, ...) log(format, __FILE__, __LINE__, ##__VA_ARGS__)
-#define LOG(format, ...)
+//////////////////////////////////////////////////////////////////////////////
+
+//The sender raises the flag and checks the ring again, the I/O thread frees a slot and checks the flag.
+//With the fences in between, at least one of them sees what the other did, so a wakeup can't be missed.
+void Phy::want_tx_event()
+{
+    m_tx_event_wanted.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Phy::signal_tx_event()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_tx_event_wanted.load(std::memory_order_relaxed) && m_tx_event_wanted.exchange(false))
+    {
+        signal_event(m_tx_event_fd);
+    }
+}
+
+//Same handshake for the I/O thread: it raises the flag before looking at the rings and the commands, the other
+// threads change them and then check the flag.
+void Phy::want_io_wakeup()
+{
+    m_io_wakeup_wanted.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Phy::wake_io_thread()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_io_wakeup_wanted.load(std::memory_order_relaxed) && m_io_wakeup_wanted.exchange(false))
+    {
+        signal_event(m_io_wakeup_fd);
+    }
+}
+
+//Returns when woken up or at the deadline, which can be Clock::time_point::max()
+void Phy::wait_io_wakeup(Clock::time_point deadline)
+{
+    timespec timeout = {};
+    timespec* timeout_ptr = nullptr;
+    if (deadline != Clock::time_point::max())
+    {
+        Clock::duration left = std::max(deadline - Clock::now(), Clock::duration::zero());
+        std::chrono::seconds sec = std::chrono::duration_cast<std::chrono::seconds>(left);
+        timeout.tv_sec = static_cast<time_t>(sec.count());
+        timeout.tv_nsec = static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(left - sec).count());
+        timeout_ptr = &timeout;
+    }
+    pollfd fd = { m_io_wakeup_fd, POLLIN, 0 };
+    if (::ppoll(&fd, 1, timeout_ptr, nullptr) < 0 && errno != EINTR)
+    {
+        LOG("cannot wait for the I/O thread wakeup: %s", strerror(errno));
+    }
+    m_io_wakeup_wanted.store(false, std::memory_order_relaxed);
+    clear_event(m_io_wakeup_fd);
+}
 
 //////////////////////////////////////////////////////////////////////////////
 
-Phy::Phy()
+Histogram const& Phy::get_io_wakeup_histogram() const
 {
-    init_crc8_table();
+    return m_scheduler.get_overshoot_histogram();
+}
+
+Histogram const& Phy::get_transfer_histogram() const
+{
+    return m_transfer_histogram;
+}
+
+Latency_Tracer const& Phy::get_latency_tracer() const
+{
+    return m_latency_tracer;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::io_thread_proc()
+{
+    apply_realtime();
+
+    while (!m_io_thread_exit)
+    {
+        //packets to send go first, as soon as the module is ready. The high priority ones before the others
+        SPSC_Ring<TX_Packet>* tx_ring = &m_tx_high_priority_ring;
+        TX_Packet* tx_packet = tx_ring->start_reading();
+        if (!tx_packet)
+        {
+            tx_ring = &m_tx_ring;
+            tx_packet = tx_ring->start_reading();
+        }
+        if (tx_packet)
+        {
+            m_scheduler.sleep_until(m_next_transfer_tp);
+            transfer(tx_packet->buffer.data(), tx_packet->size, tx_packet->use_fec, tx_packet->priority);
+            tx_ring->end_reading();
+            signal_tx_event();
+            continue;
+        }
+
+        //nothing to send. Ask to be woken up first and check again, so a send from now on can't be missed
+        want_io_wakeup();
+        if (!m_tx_high_priority_ring.empty() || !m_tx_ring.empty())
+        {
+            continue;
+        }
+
+        //plan the next poll transfer: right away (once the module is ready) if there are packets pending or commands
+        // to send, otherwise periodically to find new packets and command responses
+        Clock::time_point now = Clock::now();
+        Clock::time_point poll_tp = Clock::time_point::max();
+
+        //poll for received packets, but only when there is room for them or the policy is to drop them
+        bool rx_room = !m_rx_free_slots.empty() || m_rx_overflow_policy == RX_Overflow_Policy::DROP_NEWEST;
+        if (rx_room)
+        {
+            poll_tp = m_pending_packets > 0 ? m_next_transfer_tp : m_last_transfer_tp + RX_POLL_PERIOD;
+        }
+        if (has_commands_to_send())
+        {
+            poll_tp = m_next_transfer_tp;
+        }
+        else if (has_commands_in_flight())
+        {
+            poll_tp = std::min(poll_tp, m_last_transfer_tp + COMMAND_POLL_PERIOD);
+        }
+        poll_tp = std::max(poll_tp, m_next_transfer_tp);
+
+        //a poll that waits only for the module to be ready is a transfer deadline, for the scheduler. The periodic ones
+        // block until they are due or until a send, a command or a freed RX slot wakes the thread
+        if (poll_tp <= std::max(now, m_next_transfer_tp))
+        {
+            m_scheduler.sleep_until(poll_tp);
+            transfer(m_tx_buffer.data(), 0, false, Priority::NORMAL);
+            continue;
+        }
+
+        wait_io_wakeup(poll_tp);
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
 Phy::Init_Result Phy::init_pigpio(size_t port, size_t channel, size_t speed, size_t comms_delay)
 {
-    if (m_pigpio_fd >= 0 || m_dev_fd >= 0)
+    if (m_pigpio_fd >= 0 || m_dev_fd >= 0 || m_sim)
     {
         std::cerr << "Already initialized\n";
         return Init_Result::ALREADY_INITIALIZED;
@@ -173,6 +476,8 @@ Phy::Init_Result Phy::init_pigpio(size_t port, size_t channel, size_t speed, siz
         return Init_Result::HW_FAILURE;
     }
 
+    start_io_thread();
+
     return Init_Result::OK;
 }
 
@@ -180,7 +485,7 @@ Phy::Init_Result Phy::init_pigpio(size_t port, size_t channel, size_t speed, siz
 
 Phy::Init_Result Phy::init_dev(const char* device, size_t speed, size_t comms_delay)
 {
-    if (m_pigpio_fd >= 0 || m_dev_fd >= 0)
+    if (m_pigpio_fd >= 0 || m_dev_fd >= 0 || m_sim)
     {
         std::cerr << "Already initialized\n";
         return Init_Result::ALREADY_INITIALIZED;
@@ -228,6 +533,40 @@ Phy::Init_Result Phy::init_dev(const char* device, size_t speed, size_t comms_de
         memset(&spi_transfer, 0, sizeof(spi_ioc_transfer));
     }
 
+    start_io_thread();
+
+    return Init_Result::OK;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Phy::Init_Result Phy::init_sim(Sim_Module_Descriptor const& descriptor, size_t speed, size_t comms_delay)
+{
+    if (m_pigpio_fd >= 0 || m_dev_fd >= 0 || m_sim)
+    {
+        std::cerr << "Already initialized\n";
+        return Init_Result::ALREADY_INITIALIZED;
+    }
+
+    if (speed == 0)
+    {
+        std::cerr << "Invalid speed " << std::to_string(speed) << "\n";
+        return Init_Result::BAD_PARAMS;
+    }
+
+    Sim_Module& sim = Sim_Module::get_instance();
+    if (!sim.start(descriptor))
+    {
+        return Init_Result::HW_FAILURE;
+    }
+
+    m_sim = &sim;
+    m_speed = speed;
+    m_latency_tracer.set_single_clock(true);
+    m_comms_delay = comms_delay;
+
+    start_io_thread();
+
     return Init_Result::OK;
 }
 
@@ -241,7 +580,19 @@ bool Phy::spi_transfer(void const* tx_data, void* rx_data, size_t size)
         return false;
     }
 
-    if (m_pigpio_fd >= 0)
+    if (m_sim)
+    {
+        if (!m_sim->spi_transfer(tx_data, rx_data, size, m_speed))
+        {
+            LOG("Transfer error");
+            return false;
+        }
+        if (m_comms_delay > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(m_comms_delay));
+        }
+    }
+    else if (m_pigpio_fd >= 0)
     {
         int result = 0;
         if (tx_data && rx_data)
@@ -289,65 +640,153 @@ bool Phy::spi_transfer(void const* tx_data, void* rx_data, size_t size)
 
 //////////////////////////////////////////////////////////////////////////////
 
-void Phy::prepare_transfer_buffers(size_t size)
+bool Phy::start_recording(std::string const& path, size_t capacity)
+{
+    if (m_io_thread.joinable())
+    {
+        std::cerr << "The recording has to start before the init\n";
+        return false;
+    }
+    return m_recorder.open(path, capacity);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::set_latency_tracing(bool enabled)
+{
+    if (m_io_thread.joinable())
+    {
+        std::cerr << "The latency tracing has to be set before the init\n";
+        return;
+    }
+    m_latency_tracing = enabled;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Phy::get_max_data_size() const
+{
+    return m_latency_tracing ? MAX_PAYLOAD_SIZE - LATENCY_TRACE_SIZE : MAX_PAYLOAD_SIZE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::add_latency_trace(uint8_t* data, size_t size)
+{
+    Latency_Trace trace;
+    memset(&trace, 0, sizeof(trace));
+    trace.stamps[static_cast<size_t>(Latency_Trace_Stage::HOST_SEND)] = Latency_Tracer::get_stamp(Clock::now());
+    trace.magic = LATENCY_TRACE_MAGIC;
+    memcpy(data + size, &trace, sizeof(trace));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Phy::take_latency_trace(uint8_t* data, size_t size)
+{
+    //only called for the packets marked as traced, a broken trace is passed as it is
+    if (!has_latency_trace(data, size))
+    {
+        return size;
+    }
+    stamp_latency_trace(data, size, true, Latency_Trace_Stage::HOST_RECEIVE, Latency_Tracer::get_stamp(Clock::now()));
+    size -= sizeof(Latency_Trace);
+    Latency_Trace trace;
+    memcpy(&trace, data + size, sizeof(trace));
+    m_latency_tracer.add(trace);
+    return size;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Phy::get_transfer_size(size_t size) const
 {
     //From the ESP32 api docs:
     //  Warning: Due to a design peculiarity in the ESP32, if the amount of bytes sent by the master or the length of the
     //  transmission queues in the slave driver, in bytes, is not both larger than eight and dividable by four, the SPI
     //  hardware can fail to write the last one to seven bytes to the receive buffer.
 
-    size = std::max(size, 8u);
+    size = std::max<size_t>(size, 8u);
     size_t padding = size & 3;
     if (padding > 0)
     {
         size += 4 - padding;
     }
-    m_tx_buffer.resize(size);
-    m_rx_buffer.resize(size);
+    assert(size <= MAX_TRANSFER_SIZE);
+    return size;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::transfer(void const* data, size_t size, bool use_fec)
+bool Phy::transfer(uint8_t* tx_buffer, size_t size, bool use_fec, Priority priority)
 {
-    if (size > MAX_PAYLOAD_SIZE)
+    if (!tx_buffer || size > MAX_PAYLOAD_SIZE)
     {
         assert(false);
         LOG("bad arg");
         return false;
     }
 
-    m_last_transfer_tp = std::chrono::high_resolution_clock::now();
+    m_last_transfer_tp = Clock::now();
+
+    process_command_timeouts();
 
     //uint8_t seq = static_cast<uint8_t>((++m_seq) & 0x7F);
     {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header) + size, sizeof(SPI_Res_Packet_Header) + m_next_packet_size));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
+        //the commands go right after the packet data
+        uint8_t* commands = tx_buffer + sizeof(SPI_Req_Packet_Header) + size;
+        size_t command_size = write_commands(commands, MAX_SPI_COMMAND_SECTION_SIZE);
+
+        //leave room for the command responses while there are commands in flight
+        size_t response_command_size = 0;
+        {
+            std::lock_guard<std::mutex> lg(m_command_mutex);
+            response_command_size = m_commands_in_flight.empty() ? 0 : MAX_SPI_COMMAND_SECTION_SIZE;
+        }
+
+        //receive straight into a free RX slot. Without one, the module is told to keep the packet unless the policy is
+        // to drop it. The packet is still clocked out while there are command responses to get, they come after it
+        uint16_t* rx_slot = m_rx_free_slots.start_reading();
+        uint8_t* rx_buffer = rx_slot ? get_rx_slot_buffer(*rx_slot) : m_rx_buffer.data();
+        bool hold_rx_packet = !rx_slot && m_rx_overflow_policy == RX_Overflow_Policy::KEEP_ON_MODULE;
+        size_t rx_packet_size = (!hold_rx_packet || response_command_size > 0) ? m_next_packet_size : 0;
+
+        size_t transfer_size = get_transfer_size(std::max(sizeof(SPI_Req_Packet_Header) + size + command_size,
+                                                          sizeof(SPI_Res_Packet_Header) + rx_packet_size + response_command_size));
+        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(tx_buffer);
         memset(&header, 0, sizeof(header));
         header.req = static_cast<uint8_t>(SPI_Req::PACKET);
         header.seq = (++m_seq) & 0x7F;
         header.packet_size = static_cast<uint16_t>(size);
         header.use_fec = use_fec ? 1 : 0;
+        header.priority = static_cast<uint8_t>(priority == Priority::HIGH ? SPI_Packet_Priority::CONTROL : SPI_Packet_Priority::NORMAL);
+        header.hold_rx_packet = hold_rx_packet ? 1 : 0;
+        header.latency_traced = m_latency_tracing && size > 0 ? 1 : 0;
+        header.command_size = static_cast<uint8_t>(command_size);
+        header.command_crc = command_size > 0 ? crc8(0, commands, command_size) : 0;
         header.crc = crc8(0, &header, sizeof(header));
-        if (size > 0 && data)
+        Clock::time_point transfer_start_tp = Clock::now();
+        stamp_latency_trace(tx_buffer + sizeof(SPI_Req_Packet_Header), size, header.latency_traced, Latency_Trace_Stage::HOST_SPI_TX, 
+                            Latency_Tracer::get_stamp(transfer_start_tp));
+        bool transfer_ok = spi_transfer(tx_buffer, rx_buffer, transfer_size);
+        Clock::time_point transfer_end_tp = Clock::now();
+        m_transfer_histogram.add(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(transfer_end_tp - transfer_start_tp).count()));
+        if (m_recorder.is_open())
         {
-            memcpy(m_tx_buffer.data() + sizeof(header), data, size);
+            m_recorder.add(SPI_Recorder::make_record(tx_buffer, rx_buffer, transfer_size, transfer_start_tp, transfer_end_tp,
+                                                     transfer_ok, MAX_PAYLOAD_SIZE));
         }
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+
+        //the esp needs some time before the next transfer to avoid spi errors. The I/O loop waits for this deadline
+        m_next_transfer_tp = transfer_end_tp + (size > 0 ? TX_TRANSFER_GAP : POLL_TRANSFER_GAP);
+
+        if (!transfer_ok)
         {
             LOG("transfer failed");
             return false;
         }
-        if (size > 0)
-        {
-            std::this_thread::sleep_for(std::chrono::microseconds(200)); //needed to avoid spi errors due to the esp not being ready quickly enough
-        }
-        else
-        {
-            std::this_thread::sleep_for(std::chrono::microseconds(50)); //needed to avoid spi errors due to the esp not being ready quickly enough
-        }
 
-        SPI_Res_Packet_Header& response = *reinterpret_cast<SPI_Res_Packet_Header*>(m_rx_buffer.data());
+        SPI_Res_Packet_Header& response = *reinterpret_cast<SPI_Res_Packet_Header*>(rx_buffer);
         uint8_t response_crc = response.crc;
         response.crc = 0;
         uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
@@ -364,30 +803,59 @@ bool Phy::transfer(void const* data, size_t size, bool use_fec)
         m_pending_packets = response.pending_packets;
         m_next_packet_size = response.next_packet_size;
 
-        if (m_rx_buffer.size() < response.packet_size + sizeof(SPI_Res_Packet_Header))
+        if (!hold_rx_packet && transfer_size < response.packet_size + sizeof(SPI_Res_Packet_Header))
         {
-            LOG("insuficient data: got %d, expected %d", (int)m_rx_buffer.size(), (int)response.packet_size + sizeof(SPI_Res_Packet_Header));
+            LOG("insuficient data: got %d, expected %d", (int)transfer_size, (int)response.packet_size + sizeof(SPI_Res_Packet_Header));
             return false;
         }
-        if (response.packet_size > 0)
+
+        //the command responses have to be processed before the slot is handed to the reader
+        if (response.command_size > 0)
         {
-            if (m_rx_packet_pool.empty())
+            size_t offset = sizeof(SPI_Res_Packet_Header) + response.packet_size;
+            if (transfer_size < offset + response.command_size)
+            {
+                //the module keeps the responses until a transfer is big enough to get them
+                LOG("insuficient command data: got %d, expected %d", (int)transfer_size, (int)(offset + response.command_size));
+            }
+            else if (crc8(0, rx_buffer + offset, response.command_size) != response.command_crc)
             {
-                m_rx_packets.emplace_back();
+                LOG("mismatched command crc");
             }
             else
             {
-                m_rx_packets.emplace_back(std::move(m_rx_packet_pool.back()));
-                m_rx_packet_pool.pop_back();
+                process_command_responses(rx_buffer + offset, response.command_size);
+            }
+        }
+
+        if (response.packet_size > 0 && !hold_rx_packet)
+        {
+            //the module considers the packet delivered (it was not held), so if there's no slot it's lost
+            RX_Packet* packet = rx_slot ? m_rx_ring.start_writing() : nullptr;
+            if (packet)
+            {
+                SPI_Rx_Info const& rx_info = response.rx_info;
+                packet->latency_traced = m_latency_tracing && rx_info.latency_traced;
+                stamp_latency_trace(rx_buffer + sizeof(SPI_Res_Packet_Header), response.packet_size, packet->latency_traced, 
+                                    Latency_Trace_Stage::HOST_SPI_RX, Latency_Tracer::get_stamp(transfer_end_tp));
+                packet->slot = *rx_slot;
+                packet->size = static_cast<uint16_t>(response.packet_size);
+                packet->info.rssi = rx_info.rssi;
+                packet->info.noise_floor = rx_info.noise_floor;
+                packet->info.rate = rx_info.rate;
+                packet->info.channel = rx_info.channel;
+                packet->info.time_us = rx_info.time_us;
+                packet->info.packet_count = rx_info.packet_count;
+                m_rx_free_slots.end_reading();
+                m_rx_ring.end_writing();
+                signal_event(m_rx_event_fd);
+                LOG("received packet id %d, size %d", (int)response.packet_id, (int)response.packet_size);
             }
-            RX_Packet& packet = m_rx_packets.back();
-            packet.rssi = response.rssi;
-            packet.data.resize(response.packet_size);
-            if (response.packet_size > 0)
+            else
             {
-                memcpy(packet.data.data(), m_rx_buffer.data() + sizeof(SPI_Res_Packet_Header), response.packet_size);
+                LOG("no free rx slot, dropping packet id %d", (int)response.packet_id);
+                m_rx_packets_dropped++;
             }
-            LOG("received packet id %d, size %d", (int)response.packet_id, (int)response.packet_size);
         }
     }
     return true;
@@ -395,23 +863,81 @@ bool Phy::transfer(void const* data, size_t size, bool use_fec)
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::send_data(void const* data, size_t size, bool use_fec)
+bool Phy::send_data(void const* data, size_t size, bool use_fec, Priority priority)
 {
-    if (!data || size > MAX_PAYLOAD_SIZE)
+    if (!data)
     {
         assert(false);
         LOG("bad arg");
         return false;
     }
 
-    std::lock_guard<std::mutex> lg(m_mutex);
-
-    return transfer(data, size, use_fec);
+    void* buffer = reserve_tx(size, use_fec, priority);
+    if (!buffer)
+    {
+        return false;
+    }
+    memcpy(buffer, data, size);
+    commit_tx();
+    return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::receive_data(void* data, size_t& size, int16_t& rssi)
+void* Phy::reserve_tx(size_t size, bool use_fec, Priority priority)
+{
+    if (size > get_max_data_size())
+    {
+        assert(false);
+        LOG("bad arg");
+        return nullptr;
+    }
+    assert(!m_tx_reserved);
+
+    SPSC_Ring<TX_Packet>& ring = get_tx_ring(use_fec, priority);
+    TX_Packet* packet = ring.start_writing();
+    if (!packet)
+    {
+        want_tx_event();
+        //the I/O thread might have made room before seeing the request
+        packet = ring.start_writing();
+        if (!packet)
+        {
+            return nullptr;
+        }
+    }
+    packet->size = size;
+    packet->use_fec = use_fec;
+    packet->priority = priority;
+    m_tx_reserved = true;
+    m_tx_reserved_ring = &ring;
+    return packet->buffer.data() + sizeof(SPI_Req_Packet_Header);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::commit_tx()
+{
+    if (!m_tx_reserved)
+    {
+        assert(false);
+        LOG("nothing reserved");
+        return;
+    }
+    m_tx_reserved = false;
+    if (m_latency_tracing)
+    {
+        TX_Packet* packet = m_tx_reserved_ring->start_writing();
+        add_latency_trace(packet->buffer.data() + sizeof(SPI_Req_Packet_Header), packet->size);
+        packet->size += LATENCY_TRACE_SIZE;
+    }
+    m_tx_reserved_ring->end_writing();
+    wake_io_thread();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Phy::receive_data(void* data, size_t& size, RX_Info& info)
 {
     if (!data)
     {
@@ -420,582 +946,841 @@ bool Phy::receive_data(void* data, size_t& size, int16_t& rssi)
         return false;
     }
 
-    std::lock_guard<std::mutex> lg(m_mutex);
+    void const* packet_data = peek_rx(size, info);
+    if (!packet_data)
+    {
+        return false;
+    }
+    memcpy(data, packet_data, size);
+    release_rx();
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
 
-    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
-    if (now - m_last_transfer_tp >= std::chrono::milliseconds(3))
+void const* Phy::peek_rx(size_t& size, RX_Info& info)
+{
+    RX_Packet* packet = m_rx_ring.start_reading();
+    if (!packet)
     {
-        size_t rounds = 5;
-        do
-        {
-            transfer(nullptr, 0, false);
-            rounds--;
-        } while (m_pending_packets > 1 && rounds > 0);
+        return nullptr;
+    }
+    uint8_t* data = get_rx_slot_buffer(packet->slot) + sizeof(SPI_Res_Packet_Header);
+    if (packet->latency_traced)
+    {
+        //the trace is taken off once, the next peeks see the shorter packet
+        packet->size = static_cast<uint16_t>(take_latency_trace(data, packet->size));
+        packet->latency_traced = false;
+    }
+    size = packet->size;
+    info = packet->info;
+    m_rx_peeked = true;
+    return data;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::release_rx()
+{
+    RX_Packet* packet = m_rx_ring.start_reading();
+    if (!packet || !m_rx_peeked)
+    {
+        assert(false);
+        LOG("nothing peeked");
+        return;
     }
+    m_rx_peeked = false;
+
+    //the free ring can hold all the slots so this never fails
+    *m_rx_free_slots.start_writing() = packet->slot;
+    m_rx_free_slots.end_writing();
+    m_rx_ring.end_reading();
+    wake_io_thread();
+}
+
+//////////////////////////////////////////////////////////////////////////////
 
-    if (!m_rx_packets.empty())
+size_t Phy::send_batch(iovec const* packets, size_t count, bool use_fec, Priority priority)
+{
+    if (!packets)
     {
-        RX_Packet& packet = m_rx_packets.front();
-        rssi = packet.rssi;
-        size = packet.data.size();
-        if (size > 0)
+        assert(false);
+        LOG("bad arg");
+        return 0;
+    }
+    assert(!m_tx_reserved);
+
+    SPSC_Ring<TX_Packet>& ring = get_tx_ring(use_fec, priority);
+    size_t requested_count = count;
+    count = ring.start_writing(requested_count);
+    if (count < requested_count)
+    {
+        want_tx_event();
+        count = ring.start_writing(requested_count);
+    }
+    size_t i = 0;
+    for (; i < count; i++)
+    {
+        iovec const& src = packets[i];
+        if (!src.iov_base || src.iov_len > get_max_data_size())
         {
-            memcpy(data, packet.data.data(), size);
+            LOG("bad arg");
+            break;
         }
-        m_rx_packet_pool.push_back(std::move(packet));
-        m_rx_packets.pop_front();
-        return true;
+        TX_Packet& packet = ring.writing_element(i);
+        memcpy(packet.buffer.data() + sizeof(SPI_Req_Packet_Header), src.iov_base, src.iov_len);
+        packet.size = src.iov_len;
+        packet.use_fec = use_fec;
+        packet.priority = priority;
+        if (m_latency_tracing)
+        {
+            add_latency_trace(packet.buffer.data() + sizeof(SPI_Req_Packet_Header), packet.size);
+            packet.size += LATENCY_TRACE_SIZE;
+        }
+    }
+    if (i > 0)
+    {
+        ring.end_writing(i);
+        wake_io_thread();
     }
+    return i;
+}
 
-    return false;
+//////////////////////////////////////////////////////////////////////////////
+
+SPSC_Ring<Phy::TX_Packet>& Phy::get_tx_ring(bool use_fec, Priority priority)
+{
+    return (!use_fec && priority == Priority::HIGH) ? m_tx_high_priority_ring : m_tx_ring;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::set_rate(Rate rate)
+size_t Phy::receive_batch(RX_Batch_Packet* packets, size_t max_count)
 {
-    std::lock_guard<std::mutex> lg(m_mutex);
+    if (!packets)
+    {
+        assert(false);
+        LOG("bad arg");
+        return 0;
+    }
+    assert(!m_rx_peeked);
 
-    uint8_t seq = (++m_seq) & 0x7F;
+    size_t count = m_rx_ring.start_reading(max_count);
+    size_t free_count = m_rx_free_slots.start_writing(count);
+    assert(free_count == count);
+    for (size_t i = 0; i < count; i++)
     {
-        prepare_transfer_buffers(sizeof(SPI_Req_Set_Rate_Header));
-        SPI_Req_Set_Rate_Header& header = *reinterpret_cast<SPI_Req_Set_Rate_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::SET_RATE);
-        header.seq = seq;
-        header.rate = static_cast<uint8_t>(rate);
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        RX_Packet& src = m_rx_ring.reading_element(i);
+        RX_Batch_Packet& dst = packets[i];
+        uint8_t* data = get_rx_slot_buffer(src.slot) + sizeof(SPI_Res_Packet_Header);
+        dst.size = src.latency_traced ? take_latency_trace(data, src.size) : src.size;
+        dst.info = src.info;
+        memcpy(dst.data, data, dst.size);
+        m_rx_free_slots.writing_element(i) = src.slot;
+    }
+    if (count > 0)
+    {
+        m_rx_free_slots.end_writing(count);
+        m_rx_ring.end_reading(count);
+        wake_io_thread();
+    }
+    return count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+uint8_t* Phy::get_rx_slot_buffer(uint16_t slot)
+{
+    assert(slot < RX_SLOT_COUNT);
+    return m_rx_slab.data() + slot * MAX_TRANSFER_SIZE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::set_rx_overflow_policy(RX_Overflow_Policy policy)
+{
+    m_rx_overflow_policy = policy;
+    wake_io_thread();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Phy::get_rx_packets_dropped() const
+{
+    return m_rx_packets_dropped;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::send_command(uint8_t type, void const* data, size_t size, Command_Callback callback)
+{
+    if (size > MAX_COMMAND_DATA_SIZE)
+    {
+        LOG("command %d too big: %d", (int)type, (int)size);
+        if (callback)
         {
-            LOG("transfer failed");
-            return false;
+            callback(false, nullptr, 0);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        return;
     }
+
     {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header), sizeof(SPI_Res_Set_Rate_Header)));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::PACKET);
-        header.seq = (++m_seq) & 0x7F;
-        header.packet_size = 0;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        std::lock_guard<std::mutex> lg(m_command_mutex);
+
+        m_commands_to_send.emplace_back();
+        Command& command = m_commands_to_send.back();
+        command.type = type;
+        command.seq = ++m_command_seq;
+        command.size = static_cast<uint8_t>(size);
+        if (command.size > 0)
         {
-            LOG("transfer failed");
-            return false;
+            memcpy(command.data.data(), data, command.size);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        command.callback = std::move(callback);
+    }
+    wake_io_thread();
+}
 
-        SPI_Res_Set_Rate_Header& response = *reinterpret_cast<SPI_Res_Set_Rate_Header*>(m_rx_buffer.data());
-        uint8_t response_crc = response.crc;
-        response.crc = 0;
-        uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
-        if (response_crc != response_computed_crc)
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Phy::write_commands(uint8_t* dst, size_t max_size)
+{
+    std::lock_guard<std::mutex> lg(m_command_mutex);
+
+    Clock::time_point now = Clock::now();
+    size_t size = 0;
+    while (!m_commands_to_send.empty())
+    {
+        Command& command = m_commands_to_send.front();
+        if (size + sizeof(SPI_Command_Header) + command.size > max_size)
+        {
+            break;
+        }
+        SPI_Command_Header& header = *reinterpret_cast<SPI_Command_Header*>(dst + size);
+        header.type = command.type;
+        header.seq = command.seq;
+        header.size = command.size;
+        memcpy(dst + size + sizeof(SPI_Command_Header), command.data.data(), command.size);
+        size += sizeof(SPI_Command_Header) + command.size;
+
+        command.attempts++;
+        command.sent_tp = now;
+        m_commands_in_flight.push_back(std::move(command));
+        m_commands_to_send.pop_front();
+    }
+    return size;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::process_command_responses(uint8_t const* src, size_t size)
+{
+    while (size >= sizeof(SPI_Command_Header))
+    {
+        SPI_Command_Header const& header = *reinterpret_cast<SPI_Command_Header const*>(src);
+        if (sizeof(SPI_Command_Header) + header.size > size)
         {
-            LOG("mismatched crc: got %d, expected %d", (int)response_crc, (int)response_computed_crc);
-            return false;
+            LOG("truncated command response");
+            return;
         }
-        if (response.seq != seq)
+
+        Command_Callback callback;
         {
-            LOG("invalid seq: got %d, expected %d", (int)response.seq, (int)seq);
-            return false;
+            std::lock_guard<std::mutex> lg(m_command_mutex);
+            auto it = std::find_if(m_commands_in_flight.begin(), m_commands_in_flight.end(), [&header](Command const& command)
+            {
+                return command.seq == header.seq && command.type == header.type;
+            });
+            if (it != m_commands_in_flight.end())
+            {
+                callback = std::move(it->callback);
+                m_commands_in_flight.erase(it);
+            }
+            else
+            {
+                LOG("unexpected command response: type %d, seq %d", (int)header.type, (int)header.seq);
+            }
         }
-        if (response.rate != static_cast<uint8_t>(rate))
+        if (callback)
         {
-            LOG("command failed: got %d, expected %d", (int)response.rate, (int)rate);
-            return false;
+            callback(true, src + sizeof(SPI_Command_Header), header.size);
         }
-        m_pending_packets = response.pending_packets;
-        m_next_packet_size = response.next_packet_size;
+
+        src += sizeof(SPI_Command_Header) + header.size;
+        size -= sizeof(SPI_Command_Header) + header.size;
     }
-    return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::get_rate(Rate& rate)
+void Phy::process_command_timeouts()
 {
-    std::lock_guard<std::mutex> lg(m_mutex);
-
-    uint8_t seq = (++m_seq) & 0x7F;
+    std::vector<Command_Callback> failed;
     {
-        prepare_transfer_buffers(sizeof(SPI_Req_Get_Rate_Header));
-        SPI_Req_Get_Rate_Header& header = *reinterpret_cast<SPI_Req_Get_Rate_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::GET_RATE);
-        header.seq = seq;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        std::lock_guard<std::mutex> lg(m_command_mutex);
+
+        Clock::time_point now = Clock::now();
+        for (auto it = m_commands_in_flight.begin(); it != m_commands_in_flight.end();)
         {
-            LOG("transfer failed");
-            return false;
+            if (now - it->sent_tp < COMMAND_TIMEOUT)
+            {
+                ++it;
+                continue;
+            }
+            if (it->attempts < MAX_COMMAND_ATTEMPTS)
+            {
+                LOG("command %d timed out, retrying", (int)it->type);
+                m_commands_to_send.push_back(std::move(*it));
+            }
+            else
+            {
+                LOG("command %d failed", (int)it->type);
+                failed.push_back(std::move(it->callback));
+            }
+            it = m_commands_in_flight.erase(it);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
     }
+    for (Command_Callback& callback: failed)
     {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header), sizeof(SPI_Res_Get_Rate_Header)));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::PACKET);
-        header.seq = (++m_seq) & 0x7F;
-        header.packet_size = 0;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        if (callback)
         {
-            LOG("transfer failed");
-            return false;
+            callback(false, nullptr, 0);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
 
-        SPI_Res_Get_Rate_Header& response = *reinterpret_cast<SPI_Res_Get_Rate_Header*>(m_rx_buffer.data());
-        uint8_t response_crc = response.crc;
-        response.crc = 0;
-        uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
-        if (response_crc != response_computed_crc)
+//////////////////////////////////////////////////////////////////////////////
+
+bool Phy::has_commands_to_send()
+{
+    std::lock_guard<std::mutex> lg(m_command_mutex);
+    return !m_commands_to_send.empty();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Phy::has_commands_in_flight()
+{
+    std::lock_guard<std::mutex> lg(m_command_mutex);
+    return !m_commands_in_flight.empty();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Phy::wait_for_command(std::future<bool>& future)
+{
+    if (!m_io_thread.joinable())
+    {
+        LOG("not initialized");
+        return false;
+    }
+
+    //commands always complete, either with a response or after the last retry times out. The results are shared
+    // with the callback, so it can still complete after giving up here
+    if (future.wait_for(COMMAND_WAIT_TIMEOUT) != std::future_status::ready)
+    {
+        LOG("command wait timed out");
+        return false;
+    }
+    return future.get();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::set_rate_async(Rate rate, Result_Callback callback)
+{
+    SPI_Req_Set_Rate req;
+    req.rate = static_cast<uint8_t>(rate);
+    send_command(static_cast<uint8_t>(SPI_Req::SET_RATE), &req, sizeof(req), [rate, callback](bool success, void const* data, size_t size)
+    {
+        if (success && size >= sizeof(SPI_Res_Set_Rate))
         {
-            LOG("mismatched crc: got %d, expected %d", (int)response_crc, (int)response_computed_crc);
-            return false;
+            SPI_Res_Set_Rate const& response = *reinterpret_cast<SPI_Res_Set_Rate const*>(data);
+            if (response.rate != static_cast<uint8_t>(rate))
+            {
+                LOG("command failed: got %d, expected %d", (int)response.rate, (int)rate);
+                success = false;
+            }
         }
-        if (response.seq != seq)
+        else
         {
-            LOG("invalid seq: got %d, expected %d", (int)response.seq, (int)seq);
-            return false;
+            success = false;
         }
-        rate = static_cast<Rate>(response.rate);
-        m_pending_packets = response.pending_packets;
-        m_next_packet_size = response.next_packet_size;
-    }
-    return true;
+        if (callback)
+        {
+            callback(success);
+        }
+    });
+}
+
+bool Phy::set_rate(Rate rate)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    set_rate_async(rate, [promise](bool success) { promise->set_value(success); });
+    return wait_for_command(future);
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::set_channel(uint8_t channel)
+void Phy::set_tx_class_rates_async(TX_Class_Rates const& rates, Result_Callback callback)
 {
-    std::lock_guard<std::mutex> lg(m_mutex);
+    static_assert(size_t(TX_Class::COUNT) == SPI_TX_CLASS_COUNT, "");
+    static_assert(size_t(TX_Class::FEC_PARITY) == size_t(SPI_Tx_Class::FEC_PARITY), "");
 
-    if (channel < 1 || channel > 11)
+    SPI_Req_Set_Tx_Class_Rates req;
+    for (size_t i = 0; i < rates.size(); i++)
     {
-        LOG("bad arg");
-        return false;
+        req.rates[i] = rates[i].is_set ? static_cast<uint8_t>(rates[i].rate) : SPI_TX_CLASS_RATE_DEFAULT;
     }
+    send_command(static_cast<uint8_t>(SPI_Req::SET_TX_CLASS_RATES), &req, sizeof(req), [req, callback](bool success, void const* data, size_t size)
+    {
+        if (success && size >= sizeof(SPI_Res_Set_Tx_Class_Rates))
+        {
+            SPI_Res_Set_Tx_Class_Rates const& response = *reinterpret_cast<SPI_Res_Set_Tx_Class_Rates const*>(data);
+            if (memcmp(response.rates, req.rates, sizeof(req.rates)) != 0)
+            {
+                LOG("command failed: got %d/%d/%d/%d, expected %d/%d/%d/%d", 
+                    (int)response.rates[0], (int)response.rates[1], (int)response.rates[2], (int)response.rates[3],
+                    (int)req.rates[0], (int)req.rates[1], (int)req.rates[2], (int)req.rates[3]);
+                success = false;
+            }
+        }
+        else
+        {
+            success = false;
+        }
+        if (callback)
+        {
+            callback(success);
+        }
+    });
+}
 
-    uint8_t seq = (++m_seq) & 0x7F;
+bool Phy::set_tx_class_rates(TX_Class_Rates const& rates)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    set_tx_class_rates_async(rates, [promise](bool success) { promise->set_value(success); });
+    return wait_for_command(future);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::set_link_ids_async(uint16_t tx_link_id, std::vector<uint16_t> const& rx_link_ids, Result_Callback callback)
+{
+    if (rx_link_ids.empty() || rx_link_ids.size() > MAX_RX_LINK_IDS)
     {
-        prepare_transfer_buffers(sizeof(SPI_Req_Set_Channel_Header));
-        SPI_Req_Set_Channel_Header& header = *reinterpret_cast<SPI_Req_Set_Channel_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::SET_CHANNEL);
-        header.seq = seq;
-        header.channel = channel;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        LOG("bad arg");
+        if (callback)
         {
-            LOG("transfer failed");
-            return false;
+            callback(false);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        return;
     }
+
+    static_assert(sizeof(SPI_Req_Set_Link_Ids) <= MAX_COMMAND_DATA_SIZE, "");
+    SPI_Req_Set_Link_Ids req;
+    memset(&req, 0, sizeof(req));
+    req.tx_link_id = tx_link_id;
+    req.rx_link_id_count = static_cast<uint8_t>(rx_link_ids.size());
+    memcpy(req.rx_link_ids, rx_link_ids.data(), rx_link_ids.size() * sizeof(uint16_t));
+    send_command(static_cast<uint8_t>(SPI_Req::SET_LINK_IDS), &req, sizeof(req), [req, callback](bool success, void const* data, size_t size)
     {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header), sizeof(SPI_Res_Set_Channel_Header)));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::PACKET);
-        header.seq = (++m_seq) & 0x7F;
-        header.packet_size = 0;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        if (success && size >= sizeof(SPI_Res_Set_Link_Ids))
         {
-            LOG("transfer failed");
-            return false;
+            SPI_Res_Set_Link_Ids const& response = *reinterpret_cast<SPI_Res_Set_Link_Ids const*>(data);
+            if (response.tx_link_id != req.tx_link_id || response.rx_link_id_count != req.rx_link_id_count ||
+                memcmp(response.rx_link_ids, req.rx_link_ids, sizeof(req.rx_link_ids)) != 0)
+            {
+                LOG("command failed: got TX %d & %d RX, expected TX %d & %d RX", (int)response.tx_link_id, (int)response.rx_link_id_count, (int)req.tx_link_id, (int)req.rx_link_id_count);
+                success = false;
+            }
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        else
+        {
+            success = false;
+        }
+        if (callback)
+        {
+            callback(success);
+        }
+    });
+}
 
-        SPI_Res_Set_Channel_Header& response = *reinterpret_cast<SPI_Res_Set_Channel_Header*>(m_rx_buffer.data());
-        uint8_t response_crc = response.crc;
-        response.crc = 0;
-        uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
-        if (response_crc != response_computed_crc)
+bool Phy::set_link_ids(uint16_t tx_link_id, std::vector<uint16_t> const& rx_link_ids)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    set_link_ids_async(tx_link_id, rx_link_ids, [promise](bool success) { promise->set_value(success); });
+    return wait_for_command(future);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::get_rate_async(std::function<void(bool success, Rate rate)> callback)
+{
+    send_command(static_cast<uint8_t>(SPI_Req::GET_RATE), nullptr, 0, [callback](bool success, void const* data, size_t size)
+    {
+        Rate rate = Rate::COUNT;
+        if (success && size >= sizeof(SPI_Res_Get_Rate))
         {
-            LOG("mismatched crc: got %d, expected %d", (int)response_crc, (int)response_computed_crc);
-            return false;
+            rate = static_cast<Rate>(reinterpret_cast<SPI_Res_Get_Rate const*>(data)->rate);
         }
-        if (response.seq != seq)
+        else
         {
-            LOG("invalid seq: got %d, expected %d", (int)response.seq, (int)seq);
-            return false;
+            success = false;
         }
-        if (response.channel != channel)
+        if (callback)
         {
-            LOG("command failed: got %d, expected %d", (int)response.channel, (int)channel);
-            return false;
+            callback(success, rate);
         }
-        m_pending_packets = response.pending_packets;
-        m_next_packet_size = response.next_packet_size;
+    });
+}
+
+bool Phy::get_rate(Rate& rate)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::shared_ptr<Rate> result = std::make_shared<Rate>();
+    std::future<bool> future = promise->get_future();
+    get_rate_async([promise, result](bool success, Rate rate) { *result = rate; promise->set_value(success); });
+    if (!wait_for_command(future))
+    {
+        return false;
     }
+    rate = *result;
     return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::get_channel(uint8_t& channel)
+void Phy::set_channel_async(uint8_t channel, Result_Callback callback)
 {
-    std::lock_guard<std::mutex> lg(m_mutex);
-
     if (channel < 1 || channel > 11)
     {
-        return false;
+        LOG("bad arg");
+        if (callback)
+        {
+            callback(false);
+        }
+        return;
     }
 
-    uint8_t seq = (++m_seq) & 0x7F;
+    SPI_Req_Set_Channel req;
+    req.channel = channel;
+    send_command(static_cast<uint8_t>(SPI_Req::SET_CHANNEL), &req, sizeof(req), [channel, callback](bool success, void const* data, size_t size)
     {
-        prepare_transfer_buffers(sizeof(SPI_Req_Get_Channel_Header));
-        SPI_Req_Get_Channel_Header& header = *reinterpret_cast<SPI_Req_Get_Channel_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::GET_CHANNEL);
-        header.seq = seq;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        if (success && size >= sizeof(SPI_Res_Set_Channel))
         {
-            LOG("transfer failed");
-            return false;
+            SPI_Res_Set_Channel const& response = *reinterpret_cast<SPI_Res_Set_Channel const*>(data);
+            if (response.channel != channel)
+            {
+                LOG("command failed: got %d, expected %d", (int)response.channel, (int)channel);
+                success = false;
+            }
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
-    }
+        else
+        {
+            success = false;
+        }
+        if (callback)
+        {
+            callback(success);
+        }
+    });
+}
+
+bool Phy::set_channel(uint8_t channel)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    set_channel_async(channel, [promise](bool success) { promise->set_value(success); });
+    return wait_for_command(future);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::get_channel_async(std::function<void(bool success, uint8_t channel)> callback)
+{
+    send_command(static_cast<uint8_t>(SPI_Req::GET_CHANNEL), nullptr, 0, [callback](bool success, void const* data, size_t size)
     {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header), sizeof(SPI_Res_Get_Channel_Header)));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::PACKET);
-        header.seq = (++m_seq) & 0x7F;
-        header.packet_size = 0;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        uint8_t channel = 0;
+        if (success && size >= sizeof(SPI_Res_Get_Channel))
         {
-            LOG("transfer failed");
-            return false;
+            channel = reinterpret_cast<SPI_Res_Get_Channel const*>(data)->channel;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-        SPI_Res_Get_Channel_Header& response = *reinterpret_cast<SPI_Res_Get_Channel_Header*>(m_rx_buffer.data());
-        uint8_t response_crc = response.crc;
-        response.crc = 0;
-        uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
-        if (response_crc != response_computed_crc)
+        else
         {
-            LOG("mismatched crc: got %d, expected %d", (int)response_crc, (int)response_computed_crc);
-            return false;
+            success = false;
         }
-        if (response.seq != seq)
+        if (callback)
         {
-            LOG("invalid seq: got %d, expected %d", (int)response.seq, (int)seq);
-            return false;
+            callback(success, channel);
         }
-        channel = response.channel;
-        m_pending_packets = response.pending_packets;
-        m_next_packet_size = response.next_packet_size;
+    });
+}
+
+bool Phy::get_channel(uint8_t& channel)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::shared_ptr<uint8_t> result = std::make_shared<uint8_t>(0);
+    std::future<bool> future = promise->get_future();
+    get_channel_async([promise, result](bool success, uint8_t channel) { *result = channel; promise->set_value(success); });
+    if (!wait_for_command(future))
+    {
+        return false;
     }
+    channel = *result;
     return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::set_power(float dBm)
+void Phy::set_power_async(float dBm, Result_Callback callback)
 {
-    std::lock_guard<std::mutex> lg(m_mutex);
-
     dBm = std::max(std::min(dBm, 100.f), -100.f);
 
-    uint8_t seq = (++m_seq) & 0x7F;
+    SPI_Req_Set_Power req;
+    req.power = static_cast<int16_t>(dBm * 10.f);
+    send_command(static_cast<uint8_t>(SPI_Req::SET_POWER), &req, sizeof(req), [callback](bool success, void const* data, size_t size)
     {
-        prepare_transfer_buffers(sizeof(SPI_Req_Set_Power_Header));
-        SPI_Req_Set_Power_Header& header = *reinterpret_cast<SPI_Req_Set_Power_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::SET_POWER);
-        header.seq = seq;
-        header.power = static_cast<int16_t>(dBm * 10.f);
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        success = success && size >= sizeof(SPI_Res_Set_Power);
+        if (callback)
         {
-            LOG("transfer failed");
-            return false;
+            callback(success);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
-    }
+    });
+}
+
+bool Phy::set_power(float dBm)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    set_power_async(dBm, [promise](bool success) { promise->set_value(success); });
+    return wait_for_command(future);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::get_power_async(std::function<void(bool success, float power_dBm)> callback)
+{
+    send_command(static_cast<uint8_t>(SPI_Req::GET_POWER), nullptr, 0, [callback](bool success, void const* data, size_t size)
     {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header), sizeof(SPI_Res_Set_Power_Header)));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::PACKET);
-        header.seq = (++m_seq) & 0x7F;
-        header.packet_size = 0;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        float dBm = 0;
+        if (success && size >= sizeof(SPI_Res_Get_Power))
         {
-            LOG("transfer failed");
-            return false;
+            dBm = static_cast<float>(reinterpret_cast<SPI_Res_Get_Power const*>(data)->power) / 10.f;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-        SPI_Res_Set_Power_Header& response = *reinterpret_cast<SPI_Res_Set_Power_Header*>(m_rx_buffer.data());
-        uint8_t response_crc = response.crc;
-        response.crc = 0;
-        uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
-        if (response_crc != response_computed_crc)
+        else
         {
-            LOG("mismatched crc: got %d, expected %d", (int)response_crc, (int)response_computed_crc);
-            return false;
+            success = false;
         }
-        if (response.seq != seq)
+        if (callback)
         {
-            LOG("invalid seq: got %d, expected %d", (int)response.seq, (int)seq);
-            return false;
+            callback(success, dBm);
         }
-        m_pending_packets = response.pending_packets;
-        m_next_packet_size = response.next_packet_size;
+    });
+}
+
+bool Phy::get_power(float& dBm)
+{
+    dBm = 0;
+
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::shared_ptr<float> result = std::make_shared<float>(0.f);
+    std::future<bool> future = promise->get_future();
+    get_power_async([promise, result](bool success, float dBm) { *result = dBm; promise->set_value(success); });
+    if (!wait_for_command(future))
+    {
+        return false;
     }
+    dBm = *result;
     return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::get_power(float& dBm)
+void Phy::set_tx_queue_policy_async(TX_Queue_Policy policy, std::chrono::milliseconds max_age, Result_Callback callback)
 {
-    std::lock_guard<std::mutex> lg(m_mutex);
-
-    dBm = 0;
-
-    uint8_t seq = (++m_seq) & 0x7F;
+    if (max_age.count() < 0 || max_age > MAX_TX_QUEUE_MAX_AGE)
     {
-        prepare_transfer_buffers(sizeof(SPI_Req_Get_Power_Header));
-        SPI_Req_Get_Power_Header& header = *reinterpret_cast<SPI_Req_Get_Power_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::GET_POWER);
-        header.seq = seq;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        LOG("bad arg");
+        if (callback)
         {
-            LOG("transfer failed");
-            return false;
+            callback(false);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        return;
     }
+
+    SPI_Req_Set_Outgoing_Queue_Policy req;
+    req.policy = static_cast<uint8_t>(policy);
+    req.max_age_ms = static_cast<uint16_t>(max_age.count());
+    send_command(static_cast<uint8_t>(SPI_Req::SET_OUTGOING_QUEUE_POLICY), &req, sizeof(req), [req, callback](bool success, void const* data, size_t size)
     {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header), sizeof(SPI_Res_Get_Power_Header)));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::PACKET);
-        header.seq = (++m_seq) & 0x7F;
-        header.packet_size = 0;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        if (success && size >= sizeof(SPI_Res_Set_Outgoing_Queue_Policy))
         {
-            LOG("transfer failed");
-            return false;
+            SPI_Res_Set_Outgoing_Queue_Policy const& response = *reinterpret_cast<SPI_Res_Set_Outgoing_Queue_Policy const*>(data);
+            if (response.policy != req.policy || response.max_age_ms != req.max_age_ms)
+            {
+                LOG("command failed: got %d/%dms, expected %d/%dms", (int)response.policy, (int)response.max_age_ms, (int)req.policy, (int)req.max_age_ms);
+                success = false;
+            }
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-        SPI_Res_Get_Power_Header& response = *reinterpret_cast<SPI_Res_Get_Power_Header*>(m_rx_buffer.data());
-        uint8_t response_crc = response.crc;
-        response.crc = 0;
-        uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
-        if (response_crc != response_computed_crc)
+        else
         {
-            LOG("mismatched crc: got %d, expected %d", (int)response_crc, (int)response_computed_crc);
-            return false;
+            success = false;
         }
-        if (response.seq != seq)
+        if (callback)
         {
-            LOG("invalid seq: got %d, expected %d", (int)response.seq, (int)seq);
-            return false;
+            callback(success);
         }
-        dBm = static_cast<float>(response.power) / 10.f;
-        m_pending_packets = response.pending_packets;
-        m_next_packet_size = response.next_packet_size;
-    }
-    return true;
+    });
+}
+
+bool Phy::set_tx_queue_policy(TX_Queue_Policy policy, std::chrono::milliseconds max_age)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    set_tx_queue_policy_async(policy, max_age, [promise](bool success) { promise->set_value(success); });
+    return wait_for_command(future);
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::setup_fec_channel(size_t coding_k, size_t coding_n, size_t mtu)
+void Phy::set_packing_async(bool enabled, std::chrono::milliseconds max_delay, Result_Callback callback)
 {
-    std::lock_guard<std::mutex> lg(m_mutex);
-
-    uint8_t seq = (++m_seq) & 0x7F;
+    if (max_delay.count() < 0 || max_delay > MAX_PACKING_MAX_DELAY)
     {
-        prepare_transfer_buffers(sizeof(SPI_Req_Setup_Fec_Codec_Header));
-        SPI_Req_Setup_Fec_Codec_Header& header = *reinterpret_cast<SPI_Req_Setup_Fec_Codec_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::SETUP_FEC_CODEC);
-        header.seq = seq;
-        header.fec_coding_k = coding_k;
-        header.fec_coding_n = coding_n;
-        header.fec_mtu = mtu;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        LOG("bad arg");
+        if (callback)
         {
-            LOG("transfer failed");
-            return false;
+            callback(false);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        return;
     }
-    {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header), sizeof(SPI_Res_Setup_Fec_Codec_Header)));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::PACKET);
-        header.seq = (++m_seq) & 0x7F;
-        header.packet_size = 0;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
-        {
-            LOG("transfer failed");
-            return false;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
 
-        SPI_Res_Setup_Fec_Codec_Header& response = *reinterpret_cast<SPI_Res_Setup_Fec_Codec_Header*>(m_rx_buffer.data());
-        uint8_t response_crc = response.crc;
-        response.crc = 0;
-        uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
-        if (response_crc != response_computed_crc)
+    SPI_Req_Set_Packing req;
+    req.enabled = enabled ? 1 : 0;
+    req.max_delay_ms = static_cast<uint16_t>(max_delay.count());
+    send_command(static_cast<uint8_t>(SPI_Req::SET_PACKING), &req, sizeof(req), [req, callback](bool success, void const* data, size_t size)
+    {
+        if (success && size >= sizeof(SPI_Res_Set_Packing))
         {
-            LOG("mismatched crc: got %d, expected %d", (int)response_crc, (int)response_computed_crc);
-            return false;
+            SPI_Res_Set_Packing const& response = *reinterpret_cast<SPI_Res_Set_Packing const*>(data);
+            if (response.enabled != req.enabled || response.max_delay_ms != req.max_delay_ms)
+            {
+                LOG("command failed: got %d/%dms, expected %d/%dms", (int)response.enabled, (int)response.max_delay_ms, (int)req.enabled, (int)req.max_delay_ms);
+                success = false;
+            }
         }
-        if (response.seq != seq)
+        else
         {
-            LOG("invalid seq: got %d, expected %d", (int)response.seq, (int)seq);
-            return false;
+            success = false;
         }
-        if (response.fec_coding_k != coding_k ||
-                response.fec_coding_n != coding_n ||
-                response.fec_mtu != mtu)
+        if (callback)
         {
-            LOG("command failed");
-            return false;
+            callback(success);
         }
-        m_pending_packets = response.pending_packets;
-        m_next_packet_size = response.next_packet_size;
-    }
-    return true;
+    });
 }
 
-//////////////////////////////////////////////////////////////////////////////
-
-bool Phy::setup_adc(uint8_t channels_enabled, ADC_Width width, ADC_Full_Scale full_scale, uint32_t rate)
+bool Phy::set_packing(bool enabled, std::chrono::milliseconds max_delay)
 {
-    std::lock_guard<std::mutex> lg(m_mutex);
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    set_packing_async(enabled, max_delay, [promise](bool success) { promise->set_value(success); });
+    return wait_for_command(future);
+}
 
-    m_adc_read_period = std::chrono::microseconds(1000000 / rate);
+//////////////////////////////////////////////////////////////////////////////
 
-    uint8_t seq = (++m_seq) & 0x7F;
-    {
-        prepare_transfer_buffers(sizeof(SPI_Req_Setup_ADC_Header));
-        SPI_Req_Setup_ADC_Header& header = *reinterpret_cast<SPI_Req_Setup_ADC_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::SETUP_ADC);
-        header.seq = seq;
-        header.adc_enabled = channels_enabled;
-        header.adc_width = uint32_t(width);
-        header.adc_rate = std::min(std::max(rate, MIN_ADC_RATE), MAX_ADC_RATE);
-        header.adc_attenuation = uint32_t(full_scale);
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
-        {
-            LOG("transfer failed");
-            return false;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
-    }
+void Phy::setup_fec_channel_async(size_t coding_k, size_t coding_n, size_t mtu, Result_Callback callback)
+{
+    SPI_Req_Setup_Fec_Codec req;
+    memset(&req, 0, sizeof(req));
+    req.fec_coding_k = coding_k;
+    req.fec_coding_n = coding_n;
+    req.fec_mtu = mtu;
+    send_command(static_cast<uint8_t>(SPI_Req::SETUP_FEC_CODEC), &req, sizeof(req), [coding_k, coding_n, mtu, callback](bool success, void const* data, size_t size)
     {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header), sizeof(SPI_Res_Setup_Fec_Codec_Header)));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::PACKET);
-        header.seq = (++m_seq) & 0x7F;
-        header.packet_size = 0;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        if (success && size >= sizeof(SPI_Res_Setup_Fec_Codec))
         {
-            LOG("transfer failed");
-            return false;
+            SPI_Res_Setup_Fec_Codec const& response = *reinterpret_cast<SPI_Res_Setup_Fec_Codec const*>(data);
+            if (response.fec_coding_k != coding_k ||
+                    response.fec_coding_n != coding_n ||
+                    response.fec_mtu != mtu)
+            {
+                LOG("command failed");
+                success = false;
+            }
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-        SPI_Res_Setup_ADC_Header& response = *reinterpret_cast<SPI_Res_Setup_ADC_Header*>(m_rx_buffer.data());
-        uint8_t response_crc = response.crc;
-        response.crc = 0;
-        uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
-        if (response_crc != response_computed_crc)
+        else
         {
-            LOG("mismatched crc: got %d, expected %d", (int)response_crc, (int)response_computed_crc);
-            return false;
+            success = false;
         }
-        if (response.seq != seq)
+        if (callback)
         {
-            LOG("invalid seq: got %d, expected %d", (int)response.seq, (int)seq);
-            return false;
+            callback(success);
         }
-        m_pending_packets = response.pending_packets;
-        m_next_packet_size = response.next_packet_size;
-    }
-    return true;
+    });
+}
+
+bool Phy::setup_fec_channel(size_t coding_k, size_t coding_n, size_t mtu)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    setup_fec_channel_async(coding_k, coding_n, mtu, [promise](bool success) { promise->set_value(success); });
+    return wait_for_command(future);
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-bool Phy::read_adcs()
+void Phy::setup_adc_async(uint8_t channels_enabled, ADC_Width width, ADC_Full_Scale full_scale, uint32_t rate, Result_Callback callback)
 {
-    std::lock_guard<std::mutex> lg(m_mutex);
-
-    m_last_adc_read_tp = std::chrono::high_resolution_clock::now();
+    rate = std::min(std::max(rate, MIN_ADC_RATE), MAX_ADC_RATE);
 
-    uint8_t seq = (++m_seq) & 0x7F;
     {
-        prepare_transfer_buffers(sizeof(SPI_Req_Get_ADC_Header));
-        SPI_Req_Get_ADC_Header& header = *reinterpret_cast<SPI_Req_Get_ADC_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::GET_ADC);
-        header.seq = seq;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
-        {
-            LOG("transfer failed");
-            return false;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(3));
+        std::lock_guard<std::mutex> lg(m_adc_mutex);
+        m_adc_read_period = std::chrono::microseconds(1000000 / rate);
     }
+
+    SPI_Req_Setup_ADC req;
+    memset(&req, 0, sizeof(req));
+    req.adc_enabled = channels_enabled;
+    req.adc_width = uint32_t(width);
+    req.adc_rate = rate;
+    req.adc_attenuation = uint32_t(full_scale);
+    send_command(static_cast<uint8_t>(SPI_Req::SETUP_ADC), &req, sizeof(req), [callback](bool success, void const* data, size_t size)
     {
-        prepare_transfer_buffers(std::max(sizeof(SPI_Req_Packet_Header), sizeof(SPI_Res_Get_ADC_Header)));
-        SPI_Req_Packet_Header& header = *reinterpret_cast<SPI_Req_Packet_Header*>(m_tx_buffer.data());
-        memset(&header, 0, sizeof(header));
-        header.req = static_cast<uint8_t>(SPI_Req::PACKET);
-        header.seq = (++m_seq) & 0x7F;
-        header.packet_size = 0;
-        header.crc = crc8(0, &header, sizeof(header));
-        if (!spi_transfer(m_tx_buffer.data(), m_rx_buffer.data(), m_tx_buffer.size()))
+        if (callback)
         {
-            LOG("transfer failed");
-            return false;
+            callback(success);
         }
+    });
+}
 
-        SPI_Res_Get_ADC_Header& response = *reinterpret_cast<SPI_Res_Get_ADC_Header*>(m_rx_buffer.data());
-        uint8_t response_crc = response.crc;
-        response.crc = 0;
-        uint8_t response_computed_crc = crc8(0, &response, sizeof(response));
-        if (response_crc != response_computed_crc)
-        {
-            LOG("mismatched crc: got %d, expected %d", (int)response_crc, (int)response_computed_crc);
-            return false;
-        }
-        if (response.seq != seq)
+bool Phy::setup_adc(uint8_t channels_enabled, ADC_Width width, ADC_Full_Scale full_scale, uint32_t rate)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    setup_adc_async(channels_enabled, width, full_scale, rate, [promise](bool success) { promise->set_value(success); });
+    return wait_for_command(future);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::request_adcs()
+{
+    send_command(static_cast<uint8_t>(SPI_Req::GET_ADC), nullptr, 0, [this](bool success, void const* data, size_t size)
+    {
+        std::lock_guard<std::mutex> lg(m_adc_mutex);
+        m_adc_request_in_flight = false;
+        if (!success || size < sizeof(SPI_Res_Get_ADC))
         {
-            LOG("invalid seq: got %d, expected %d", (int)response.seq, (int)seq);
-            return false;
+            return;
         }
+
+        SPI_Res_Get_ADC const& response = *reinterpret_cast<SPI_Res_Get_ADC const*>(data);
         {
             ADC_Value& adc = m_adc[0];
             adc.average_value = float(response.adc0_average) / 1000.f;
@@ -1036,102 +1821,123 @@ bool Phy::read_adcs()
             adc.average_value = float(response.adc7_average) / 1000.f;
             adc.sample_count = response.adc7_sample_count;
         }
-
-        m_pending_packets = response.pending_packets;
-        m_next_packet_size = response.next_packet_size;
-    }
-    return true;
+    });
 }
 
 bool Phy::get_adc(uint8_t channel_index, ADC_Value& value)
 {
-    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
-    if (now - m_last_adc_read_tp >= m_adc_read_period)
-    {
-        if (!read_adcs())
-        {
-            return false;
-        }
-    }
     if (channel_index >= MAX_ADC_CHANNELS)
     {
         assert(false);
         return false;
     }
 
-    std::lock_guard<std::mutex> lg(m_mutex);
+    std::lock_guard<std::mutex> lg(m_adc_mutex);
+
+    Clock::time_point now = Clock::now();
+    if (!m_adc_request_in_flight && now - m_last_adc_read_tp >= m_adc_read_period)
+    {
+        m_last_adc_read_tp = now;
+        m_adc_request_in_flight = true;
+        request_adcs();
+    }
+
     value = m_adc[channel_index];
     m_adc[channel_index] = ADC_Value();
     return true;
 }
 
-void Phy::process()
-{
-    //    static std::chrono::high_resolution_clock::time_point start_tp = std::chrono::high_resolution_clock::now();
-
-    //    set_rate(Rate::RATE_G_54M_ODFM);
-    //    //set_channel(7);
-    //    set_power(21.f);
-    //    setup_fec_channel(4, 6, MAX_PAYLOAD_SIZE);
-
-    //    std::array<uint8_t, MAX_PAYLOAD_SIZE> tx_data;
-    ////    send_data(tx_data.data(), tx_data.size());
-
-    //    int accumulated_rssi = 0;
-    //    size_t accumulated_rx_size = 0;
-    //    size_t rx_packets = 0;
-    //    std::array<uint8_t, MAX_PAYLOAD_SIZE> rx_data;
-
-    //    size_t count = 0;
-    //    while (true)
-    //    {
-    //        count++;
-
-    //        send_data(tx_data.data(), tx_data.size());
-    //        //std::this_thread::sleep_for(std::chrono::milliseconds(2000));
-
-    //        std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
-    //        if (now - m_last_transfer_tp >= std::chrono::milliseconds(2))
-    //        {
-    //            std::lock_guard<std::mutex> lg(m_mutex);
-    //            size_t rounds = 5;
-    //            do
-    //            {
-    //                transfer(nullptr, 0);
-    //                rounds--;
-    //            } while (m_pending_packets > 1 && rounds > 0);
-    //        }
-
-    //        size_t rx_size = 0;
-    //        int rssi = 0;
-    //        if (receive_data(rx_data.data(), rx_size, rssi))
-    //        {
-    //            rx_packets++;
-    //            accumulated_rx_size += rx_size;
-    //            accumulated_rssi += rssi;
-    //        }
-
-    //        //gpioDelay(2000);
-    //        //std::this_thread::sleep_for(std::chrono::milliseconds(200));
-
-    //        //exit(1);
-
-    //        if (std::chrono::high_resolution_clock::now() - start_tp >= std::chrono::milliseconds(1000))
-    //        {
-    //            start_tp = std::chrono::high_resolution_clock::now();
-    //            std::cout << "TX: " << std::to_string(count) <<
-    //                         ", RX: " << std::to_string(rx_packets) <<
-    //                         ", RX size: " << std::to_string(accumulated_rx_size / std::max(rx_packets, 1u)) <<
-    //                         ", RX rssi: " << std::to_string(accumulated_rssi / int(std::max(rx_packets, 1u))) <<
-    //                         "\n";
-    //            std::flush(std::cout);
-    //            std::flush(std::cerr);
-    //            count = 0;
-    //            rx_packets = 0;
-    //            accumulated_rx_size = 0;
-    //            accumulated_rssi = 0;
-    //        }
-    //    }
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::request_stats_page(uint8_t page, std::shared_ptr<Stats> stats, std::function<void(bool success, Stats const& stats)> callback)
+{
+    SPI_Req_Get_Stats req;
+    req.page = page;
+    send_command(static_cast<uint8_t>(SPI_Req::GET_STATS), &req, sizeof(req), [this, page, stats, callback](bool success, void const* data, size_t size)
+    {
+        if (success && size >= sizeof(SPI_Res_Get_Stats))
+        {
+            SPI_Res_Get_Stats response;
+            memcpy(&response, data, sizeof(response));
+
+            //all the pages have to come from the snapshot taken with page 0
+            if (response.page != page || response.page_count != SPI_STATS_PAGE_COUNT || (page > 0 && response.time_us != stats->module_time_us))
+            {
+                LOG("mismatched stats page %d", (int)response.page);
+                success = false;
+            }
+            else
+            {
+                stats->module_time_us = response.time_us;
+                size_t offset = page * SPI_STATS_PAGE_SIZE;
+                memcpy(reinterpret_cast<uint8_t*>(static_cast<SPI_Stats*>(stats.get())) + offset, response.data,
+                       std::min(SPI_STATS_PAGE_SIZE, sizeof(SPI_Stats) - offset));
+                if (static_cast<size_t>(page) + 1 < SPI_STATS_PAGE_COUNT)
+                {
+                    request_stats_page(page + 1, stats, callback);
+                    return;
+                }
+            }
+        }
+        else
+        {
+            success = false;
+        }
+        if (callback)
+        {
+            callback(success, *stats);
+        }
+    });
+}
+
+void Phy::get_stats_async(std::function<void(bool success, Stats const& stats)> callback)
+{
+    request_stats_page(0, std::make_shared<Stats>(), callback);
+}
+
+bool Phy::get_stats(Stats& stats)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::shared_ptr<Stats> result = std::make_shared<Stats>();
+    std::future<bool> future = promise->get_future();
+    get_stats_async([promise, result](bool success, Stats const& stats) { *result = stats; promise->set_value(success); });
+    if (!wait_for_command(future))
+    {
+        return false;
+    }
+    stats = *result;
+    return true;
+}
+
+bool Phy::compute_stats_rates(Stats const& previous, Stats const& current, Stats_Rates& rates)
+{
+    //no previous sample, the module restarted or it's the same sample
+    if (previous.module_time_us == 0 || current.module_time_us <= previous.module_time_us)
+    {
+        return false;
+    }
+
+    double duration = static_cast<double>(current.module_time_us - previous.module_time_us) / 1000000.0;
+    auto rate = [duration](uint64_t previous, uint64_t current)
+    {
+        return current >= previous ? static_cast<double>(current - previous) / duration : 0.0;
+    };
+
+    rates.wlan_data_sent = rate(previous.wlan_data_sent, current.wlan_data_sent);
+    rates.wlan_packets_sent = rate(previous.wlan_packets_sent, current.wlan_packets_sent);
+    rates.wlan_data_received = rate(previous.wlan_data_received, current.wlan_data_received);
+    rates.wlan_packets_received = rate(previous.wlan_packets_received, current.wlan_packets_received);
+    rates.spi_data_sent = rate(previous.spi_data_sent, current.spi_data_sent);
+    rates.spi_data_received = rate(previous.spi_data_received, current.spi_data_received);
+    rates.packets_dropped = rate(previous.wlan_outgoing_packets_dropped + previous.wlan_received_packets_dropped + previous.fec_encoder_packets_dropped +
+                                     previous.wlan_outgoing_packets_expired + previous.wlan_outgoing_packets_evicted,
+                                 current.wlan_outgoing_packets_dropped + current.wlan_received_packets_dropped + current.fec_encoder_packets_dropped +
+                                     current.wlan_outgoing_packets_expired + current.wlan_outgoing_packets_evicted);
+    rates.errors = rate(previous.wlan_error_count + previous.wlan_tx_failures + previous.spi_error_count,
+                        current.wlan_error_count + current.wlan_tx_failures + current.spi_error_count);
+    rates.fec_blocks_recovered = rate(previous.fec_blocks_recovered, current.fec_blocks_recovered);
+    rates.fec_blocks_lost = rate(previous.fec_blocks_lost, current.fec_blocks_lost);
+    return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -6,14 +6,29 @@
 #include <deque>
 #include <array>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <sys/uio.h>
 #include <linux/spi/spidev.h>
+#include "SPSC_Ring.h"
+#include "Histogram.h"
+#include "Deadline_Scheduler.h"
+#include "SPI_Recorder.h"
+#include "Latency_Tracer.h"
+#include "../firmware/spi_comms.h"
+#include "../firmware/latency_trace.h"
 
-class SPI_Query_Response_Header;
+class Sim_Module;
+struct Sim_Module_Descriptor;
 
 class Phy
 {
 public:
     Phy();
+    ~Phy();
 
     enum class Init_Result
     {
@@ -23,17 +38,110 @@ public:
         HW_FAILURE
     };
 
+    //Real-time mode for the I/O thread: SCHED_FIFO with the given priority (1 - 99) and pinned to 'cpu' if it's >= 0.
+    //Has to be called before the init functions. It needs root or CAP_SYS_NICE, failures are reported but not fatal.
+    //Locking the memory (mlockall) is process wide so it's left to the application.
+    void set_realtime(int priority, int cpu);
+
+    //Records every SPI transaction (timing, headers, commands, result) in a ring file of 'capacity' records, see
+    // SPI_Recorder. Has to be called before the init functions.
+    bool start_recording(std::string const& path, size_t capacity = SPI_Recorder::DEFAULT_CAPACITY);
+
+    //Adds a latency trace (see latency_trace.h) to the end of every sent packet and takes it off the received ones marked
+    // as traced, which then go to the latency tracer. The packets can be LATENCY_TRACE_SIZE bytes smaller than MAX_PAYLOAD_SIZE.
+    //Both sides have to enable it. Has to be called before the init functions.
+    //With FEC the module splits the data in packets of the FEC mtu, so the sent packets have to be exactly that size
+    // for the traces to stay at the end of the packets.
+    void set_latency_tracing(bool enabled);
+    static const size_t LATENCY_TRACE_SIZE = sizeof(Latency_Trace);
+
     Init_Result init_pigpio(size_t port, size_t channel, size_t speed = 8000000, size_t comms_delay = 25);
     Init_Result init_dev(const char* device, size_t speed = 8000000, size_t comms_delay = 20);
 
-    void process();
+    //Talks to the module firmware running in-process (see Sim_Module) instead of real hardware, with the same SPI
+    // speed & delay semantics as init_dev
+    Init_Result init_sim(Sim_Module_Descriptor const& descriptor, size_t speed = 8000000, size_t comms_delay = 20);
 
     static const size_t MAX_PAYLOAD_SIZE = 1374;
 
-    bool send_data(void const* data, size_t size, bool use_fec);
-    bool receive_data(void* data, size_t& size, int16_t& rssi);
+    //All SPI work is done by an I/O thread started by the init functions.
+    //These just move packets in/out of the TX/RX rings and never block. send_data returns false if the TX ring is full
+    // and receive_data returns false if there is nothing received.
+    //NOTE: each of them has to be called from a single thread only (any thread, as long as it's just one)
+    //HIGH priority packets have their own TX ring of TX_HIGH_PRIORITY_RING_CAPACITY, sent before the other one, and skip
+    // ahead of the packets queued on the module (see SPI_Packet_Priority). They are meant for small control & telemetry
+    // packets. The priority applies to packets without FEC only, the FEC ones are queued with the NORMAL ones.
+    enum class Priority
+    {
+        NORMAL,
+        HIGH,
+    };
+    //What the module radio saw for a received packet.
+    //For the FEC packets it's for the packets of their block received until it was decoded: the lowest RSSI & bitrate,
+    // the highest noise floor and the time of the first one.
+    struct RX_Info
+    {
+        int16_t rssi = 0;        //dBm
+        int16_t noise_floor = 0; //dBm
+        uint8_t rate = 0;        //a legacy rate as the radio reports it, or RX_RATE_MCS | the MCS index
+        uint8_t channel = 0;
+        uint32_t time_us = 0;    //module clock, when the radio handed it over
+        uint8_t packet_count = 0; //the received packets of the FEC block, 1 without FEC
+    };
+    static const uint8_t RX_RATE_MCS = 0x80;
+
+    bool send_data(void const* data, size_t size, bool use_fec, Priority priority = Priority::NORMAL);
+    bool receive_data(void* data, size_t& size, RX_Info& info);
+
+    //Batch versions, the ring is synchronized once per call instead of once per packet.
+    //send_batch returns how many packets were queued, in order. Packets bigger than MAX_PAYLOAD_SIZE stop the batch.
+    size_t send_batch(iovec const* packets, size_t count, bool use_fec, Priority priority = Priority::NORMAL);
+
+    struct RX_Batch_Packet
+    {
+        void* data = nullptr; //caller provided, has to fit MAX_PAYLOAD_SIZE bytes
+        size_t size = 0;
+        RX_Info info;
+    };
+    //Fills up to max_count packets and returns how many were received
+    size_t receive_batch(RX_Batch_Packet* packets, size_t max_count);
+
+    //Zero copy versions, the SPI transfers go straight from/to these buffers.
+    //reserve_tx returns a buffer of 'size' bytes to fill in place, or nullptr if the TX ring is full. commit_tx queues it.
+    //peek_rx returns the oldest received packet in place, or nullptr if there is none. It stays valid until release_rx.
+    //They follow the same threading rules as send_data/receive_data and a reservation or peek has to be finished
+    // before calling any other send/receive function.
+    void* reserve_tx(size_t size, bool use_fec, Priority priority = Priority::NORMAL);
+    void commit_tx();
+    void const* peek_rx(size_t& size, RX_Info& info);
+    void release_rx();
+
+    //eventfds for event loops (epoll, poll, select). Both are non blocking and level triggered:
+    // - the RX one is readable when packets were received since the last clear_rx_event
+    // - the TX one is readable when there is room in the TX ring again, after a send function found it full
+    //Clear them before draining the RX ring / retrying the send so no wakeup is missed
+    int get_rx_event_fd() const;
+    int get_tx_event_fd() const;
+    void clear_rx_event();
+    void clear_tx_event();
+
+    //Received packets wait in RX_SLOT_COUNT fixed size slots until they are read.
+    //This is what happens when all of them are taken because the packets are not read quickly enough
+    enum class RX_Overflow_Policy
+    {
+        KEEP_ON_MODULE, //stop polling and leave the packets on the module. When its queue is full, the module drops the new ones
+        DROP_NEWEST,    //keep polling the module and drop the packets that don't fit
+    };
+    void set_rx_overflow_policy(RX_Overflow_Policy policy);
+    size_t get_rx_packets_dropped() const;
+
+    //Commands are sent asynchronously, riding along the packet transfers done by the I/O thread.
+    //The callbacks are called from the I/O thread, once the response arrives or the command times out.
+    //The blocking versions wait for the callback.
+    typedef std::function<void(bool success)> Result_Callback;
 
     bool setup_fec_channel(size_t coding_k, size_t coding_n, size_t mtu);
+    void setup_fec_channel_async(size_t coding_k, size_t coding_n, size_t mtu, Result_Callback callback);
 
     enum class Rate
     {
@@ -75,13 +183,72 @@ public:
     };
 
     bool set_rate(Rate rate);
+    void set_rate_async(Rate rate, Result_Callback callback);
     bool get_rate(Rate& rate);
+    void get_rate_async(std::function<void(bool success, Rate rate)> callback);
+
+    //The traffic classes of the outgoing packets. Each can go at its own rate, for example the FEC parity packets at a
+    // more robust rate than the data ones, or the control packets at the most robust one
+    enum class TX_Class
+    {
+        CONTROL,    //the Priority::HIGH packets
+        NORMAL,     //the other packets without FEC
+        FEC_DATA,
+        FEC_PARITY,
+
+        COUNT
+    };
+    struct TX_Class_Rate
+    {
+        bool is_set = false; //otherwise the class goes at the set_rate rate
+        Rate rate = Rate::RATE_G_6M_ODFM;
+    };
+    typedef std::array<TX_Class_Rate, size_t(TX_Class::COUNT)> TX_Class_Rates;
+
+    //The module switches the radio rate only between frames of classes with different rates
+    bool set_tx_class_rates(TX_Class_Rates const& rates);
+    void set_tx_class_rates_async(TX_Class_Rates const& rates, Result_Callback callback);
+
+    //Bridges sharing a channel use different link IDs, carried in the MAC addresses of their frames. The module sends
+    // with tx_link_id and drops the received frames without one of the rx_link_ids as soon as they arrive.
+    //All default to DEFAULT_LINK_ID
+    static const size_t MAX_RX_LINK_IDS;
+    static const uint16_t DEFAULT_LINK_ID;
+
+    bool set_link_ids(uint16_t tx_link_id, std::vector<uint16_t> const& rx_link_ids);
+    void set_link_ids_async(uint16_t tx_link_id, std::vector<uint16_t> const& rx_link_ids, Result_Callback callback);
 
     bool set_channel(uint8_t channel);
+    void set_channel_async(uint8_t channel, Result_Callback callback);
     bool get_channel(uint8_t& channel);
+    void get_channel_async(std::function<void(bool success, uint8_t channel)> callback);
 
     bool set_power(float power_dBm);
+    void set_power_async(float power_dBm, Result_Callback callback);
     bool get_power(float& power_dBm);
+    void get_power_async(std::function<void(bool success, float power_dBm)> callback);
+
+    //What the module does with the packets it can't send as fast as they come. Live data wants the freshest packets
+    // on air: DROP_OLDEST keeps room for the new ones and DROP_FEC_BLOCK drops whole FEC blocks instead of single packets.
+    //Packets queued for longer than max_age are dropped with any policy, 0 means no limit
+    enum class TX_Queue_Policy
+    {
+        DROP_NEWEST,    //the default
+        DROP_OLDEST,
+        DROP_FEC_BLOCK,
+    };
+    static const std::chrono::milliseconds MAX_TX_QUEUE_MAX_AGE;
+
+    bool set_tx_queue_policy(TX_Queue_Policy policy, std::chrono::milliseconds max_age);
+    void set_tx_queue_policy_async(TX_Queue_Policy policy, std::chrono::milliseconds max_age, Result_Callback callback);
+
+    //The module packs the small packets without FEC several per frame, to save the per frame airtime. It does that
+    // when more of them are queued and, with a max delay, the normal priority ones wait up to that long for more.
+    //Enabled by default with no delay
+    static const std::chrono::milliseconds MAX_PACKING_MAX_DELAY;
+
+    bool set_packing(bool enabled, std::chrono::milliseconds max_delay);
+    void set_packing_async(bool enabled, std::chrono::milliseconds max_delay, Result_Callback callback);
 
     enum class ADC_Width
     {
@@ -112,39 +279,127 @@ public:
     static const uint32_t MAX_ADC_RATE = 100;
 
     bool setup_adc(uint8_t channels_enabled, ADC_Width width, ADC_Full_Scale full_scale, uint32_t rate);
+    void setup_adc_async(uint8_t channels_enabled, ADC_Width width, ADC_Full_Scale full_scale, uint32_t rate, Result_Callback callback);
 
     struct ADC_Value
     {
         uint32_t sample_count = 0;
         float average_value = 0.f; // 0 .. 1
     };
+    //Returns the last values received from the module. New values are requested in the background at the setup_adc rate
     bool get_adc(uint8_t channel_index, ADC_Value& value);
 
-    struct Stats
+    //The module counters (see SPI_Stats), cumulative since it started
+    struct Stats : public SPI_Stats
     {
-        uint32_t wlan_data_sent = 0;
-        uint32_t wlan_data_received = 0;
-        uint16_t wlan_error_count = 0;
-        uint16_t wlan_received_packets_dropped = 0;
-        uint32_t spi_data_sent = 0;
-        uint32_t spi_data_received = 0;
-        uint16_t spi_error_count = 0;
-        uint16_t spi_received_packets_dropped = 0;
+        uint64_t module_time_us = 0; //when the module sampled them, on its clock
     };
 
     bool get_stats(Stats& stats);
+    void get_stats_async(std::function<void(bool success, Stats const& stats)> callback);
+
+    //Per second rates between two samples, over the module clock
+    struct Stats_Rates
+    {
+        double wlan_data_sent = 0;        //bytes
+        double wlan_packets_sent = 0;
+        double wlan_data_received = 0;    //bytes
+        double wlan_packets_received = 0;
+        double spi_data_sent = 0;         //bytes, module to host
+        double spi_data_received = 0;     //bytes, host to module
+        double packets_dropped = 0;       //all the module queues
+        double errors = 0;                //WLAN & SPI errors, WLAN TX failures
+        double fec_blocks_recovered = 0;
+        double fec_blocks_lost = 0;
+    };
+    static bool compute_stats_rates(Stats const& previous, Stats const& current, Stats_Rates& rates);
+
+    //Jitter of the I/O thread, in microseconds: how late it wakes up for its transfer deadlines and how long the SPI transfers take
+    Histogram const& get_io_wakeup_histogram() const;
+    Histogram const& get_transfer_histogram() const;
+
+    Latency_Tracer const& get_latency_tracer() const;
 
 private:
-    bool transfer(void const* data, size_t size, bool use_fec);
+    typedef Deadline_Scheduler::Clock Clock;
 
-    void prepare_transfer_buffers(size_t payload_size);
+    void start_io_thread();
+    void stop_io_thread();
+    void io_thread_proc();
+
+    //tx_buffer is MAX_TRANSFER_SIZE bytes, with the packet data (if any) already in place after the header
+    bool transfer(uint8_t* tx_buffer, size_t size, bool use_fec, Priority priority);
+
+    size_t get_transfer_size(size_t size) const;
     bool spi_transfer(void const* tx_data, void* rx_data, size_t size);
-    bool read_adcs();
+    size_t get_max_data_size() const;
+    void add_latency_trace(uint8_t* data, size_t size);
+    size_t take_latency_trace(uint8_t* data, size_t size);
+    void request_adcs();
+    void request_stats_page(uint8_t page, std::shared_ptr<Stats> stats, std::function<void(bool success, Stats const& stats)> callback);
+
+    typedef std::function<void(bool success, void const* data, size_t size)> Command_Callback;
+    //A command with more than MAX_COMMAND_DATA_SIZE bytes fails right away, its callback is called before returning
+    void send_command(uint8_t type, void const* data, size_t size, Command_Callback callback);
+    //False if the command failed or didn't complete within COMMAND_WAIT_TIMEOUT
+    bool wait_for_command(std::future<bool>& future);
+
+    size_t write_commands(uint8_t* dst, size_t max_size);
+    void process_command_responses(uint8_t const* src, size_t size);
+    void process_command_timeouts();
+    bool has_commands_to_send();
+    bool has_commands_in_flight();
+
+    void apply_realtime();
+
+    void signal_event(int fd);
+    void clear_event(int fd);
+    void want_tx_event();
+    void signal_tx_event();
+    void want_io_wakeup();
+    void wake_io_thread();
+    void wait_io_wakeup(Clock::time_point deadline);
+
+    int m_rx_event_fd = -1;
+    int m_tx_event_fd = -1;
+    std::atomic_bool m_tx_event_wanted{false}; //a send found the TX ring full
+    int m_io_wakeup_fd = -1; //the I/O thread waits on it when it has nothing to transfer yet
+    std::atomic_bool m_io_wakeup_wanted{false};
+
+    std::thread m_io_thread;
+    std::atomic_bool m_io_thread_exit{false};
+
+    int m_realtime_priority = 0;
+    int m_realtime_cpu = -1;
+
+    Deadline_Scheduler m_scheduler; //used only by the I/O thread
+    Histogram m_transfer_histogram;
+    SPI_Recorder m_recorder; //used only by the I/O thread once it started
+    bool m_latency_tracing = false;
+    Latency_Tracer m_latency_tracer; //added to by the receiving thread
+
+    static const size_t MAX_COMMAND_DATA_SIZE = 16;
+
+    struct Command
+    {
+        uint8_t type = 0;
+        uint8_t seq = 0;
+        uint8_t size = 0;
+        std::array<uint8_t, MAX_COMMAND_DATA_SIZE> data;
+        size_t attempts = 0;
+        Clock::time_point sent_tp;
+        Command_Callback callback;
+    };
 
-    bool query(SPI_Query_Response_Header& query);
+    std::mutex m_command_mutex;
+    uint8_t m_command_seq = 0;
+    std::deque<Command> m_commands_to_send;
+    std::deque<Command> m_commands_in_flight;
 
-    std::mutex m_mutex;
+    //same as MAX_SPI_BUFFER_SIZE on the module, enough for a header + MAX_PAYLOAD_SIZE + the command section
+    static const size_t MAX_TRANSFER_SIZE = 1600;
 
+    //used when there is no TX packet / no free RX slot to transfer from / to
     std::vector<uint8_t> m_tx_buffer;
     std::vector<uint8_t> m_rx_buffer;
     uint8_t m_seq = 0;
@@ -154,28 +409,62 @@ private:
 
     int m_pigpio_fd = -1;
     int m_dev_fd = -1;
+    Sim_Module* m_sim = nullptr;
 
     uint32_t m_pending_packets = 0;
     uint32_t m_next_packet_size = 0;
 
+    static const size_t TX_RING_CAPACITY = 64;
+    static const size_t TX_HIGH_PRIORITY_RING_CAPACITY = 16;
+    static const size_t RX_SLOT_COUNT = 64;
+
+    //The buffer is a whole SPI transfer so the header and commands are written around the data in place
+    //Zero initialized (like the RX slab) so all the pages are touched before the I/O thread starts
+    struct TX_Packet
+    {
+        std::array<uint8_t, MAX_TRANSFER_SIZE> buffer = {};
+        size_t size = 0;
+        bool use_fec = false;
+        Priority priority = Priority::NORMAL;
+    };
+    SPSC_Ring<TX_Packet> m_tx_ring;
+    SPSC_Ring<TX_Packet> m_tx_high_priority_ring;
+    SPSC_Ring<TX_Packet>& get_tx_ring(bool use_fec, Priority priority);
+    bool m_tx_reserved = false;
+    SPSC_Ring<TX_Packet>* m_tx_reserved_ring = nullptr;
+    bool m_rx_peeked = false;
+
+    //The received data lives in a slab of RX_SLOT_COUNT * MAX_TRANSFER_SIZE bytes allocated once.
+    //The I/O thread takes a slot from m_rx_free_slots, does the SPI transfer straight into it and passes it on
+    // through m_rx_ring. The reader gives it back to m_rx_free_slots once it's done with the data.
     struct RX_Packet
     {
-        std::vector<uint8_t> data;
-        int16_t rssi = 0;
+        uint16_t slot = 0;
+        uint16_t size = 0;
+        bool latency_traced = false; //marked by the module and tracing is enabled, the trace is still on
+        RX_Info info;
     };
-    std::vector<RX_Packet> m_rx_packet_pool;
-    std::deque<RX_Packet> m_rx_packets;
+    uint8_t* get_rx_slot_buffer(uint16_t slot);
+
+    std::vector<uint8_t> m_rx_slab;
+    SPSC_Ring<RX_Packet> m_rx_ring;
+    SPSC_Ring<uint16_t> m_rx_free_slots;
+    std::atomic<RX_Overflow_Policy> m_rx_overflow_policy{RX_Overflow_Policy::KEEP_ON_MODULE};
+    std::atomic<size_t> m_rx_packets_dropped{0};
 
     static const size_t MAX_TRANSFERS = 64;
 
     std::array<std::vector<uint8_t>, MAX_TRANSFERS> m_spi_transfers_data;
     std::array<spi_ioc_transfer, MAX_TRANSFERS> m_spi_transfers;
 
-    std::chrono::high_resolution_clock::time_point m_last_transfer_tp = std::chrono::high_resolution_clock::now();
+    Clock::time_point m_last_transfer_tp = Clock::now();
+    Clock::time_point m_next_transfer_tp = Clock::now(); //when the module is ready for the next transfer
 
+    std::mutex m_adc_mutex;
     ADC_Value m_adc[MAX_ADC_CHANNELS];
+    bool m_adc_request_in_flight = false;
 
-    std::chrono::high_resolution_clock::time_point m_last_adc_read_tp = std::chrono::high_resolution_clock::now();
-    std::chrono::high_resolution_clock::duration m_adc_read_period = std::chrono::hours(99999999999);
+    Clock::time_point m_last_adc_read_tp = Clock::now();
+    Clock::duration m_adc_read_period = Clock::duration::max();
 };
 
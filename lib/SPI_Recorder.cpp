@@ -0,0 +1,211 @@
+#include "SPI_Recorder.h"
+#include "CRC8.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const size_t SPI_Recorder::DEFAULT_CAPACITY;
+
+static const uint32_t MAGIC = 0x52495053; //"SPIR"
+static const uint16_t VERSION = 1;
+
+//////////////////////////////////////////////////////////////////////////////
+
+SPI_Recorder::~SPI_Recorder()
+{
+    close();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool SPI_Recorder::open(std::string const& path, size_t capacity)
+{
+    close();
+
+    if (capacity == 0)
+    {
+        std::cerr << "Invalid SPI recording capacity\n";
+        return false;
+    }
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Cannot create the SPI recording '" << path << "': " << strerror(errno) << "\n";
+        return false;
+    }
+
+    size_t map_size = sizeof(File_Header) + capacity * sizeof(Record);
+    if (ftruncate(fd, static_cast<off_t>(map_size)) < 0)
+    {
+        std::cerr << "Cannot size the SPI recording '" << path << "': " << strerror(errno) << "\n";
+        ::close(fd);
+        return false;
+    }
+
+    void* map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        std::cerr << "Cannot map the SPI recording '" << path << "': " << strerror(errno) << "\n";
+        ::close(fd);
+        return false;
+    }
+
+    //touch all the pages now instead of when recording
+    memset(map, 0, map_size);
+
+    m_fd = fd;
+    m_map = map;
+    m_map_size = map_size;
+    m_header = reinterpret_cast<File_Header*>(map);
+    m_records = reinterpret_cast<Record*>(reinterpret_cast<uint8_t*>(map) + sizeof(File_Header));
+    m_capacity = capacity;
+    m_count = 0;
+
+    File_Header header;
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.record_size = sizeof(Record);
+    header.capacity = capacity;
+    header.count = 0;
+    *m_header = header;
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void SPI_Recorder::close()
+{
+    if (m_map)
+    {
+        munmap(m_map, m_map_size);
+        m_map = nullptr;
+        m_header = nullptr;
+        m_records = nullptr;
+    }
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool SPI_Recorder::is_open() const
+{
+    return m_map != nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void SPI_Recorder::add(Record const& record)
+{
+    if (!m_map)
+    {
+        return;
+    }
+    memcpy(&m_records[m_count % m_capacity], &record, sizeof(Record));
+    m_count++;
+    __atomic_store_n(&m_header->count, m_count, __ATOMIC_RELEASE); //readers of a live recording see whole records
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool SPI_Recorder::load(std::string const& path, std::vector<Record>& records)
+{
+    records.clear();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cerr << "Cannot open the SPI recording '" << path << "': " << strerror(errno) << "\n";
+        return false;
+    }
+
+    File_Header header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != MAGIC || header.version != VERSION || header.record_size != sizeof(Record) || header.capacity == 0)
+    {
+        std::cerr << "'" << path << "' is not a SPI recording of this version\n";
+        ::close(fd);
+        return false;
+    }
+
+    //the oldest record is right after the newest one once the ring wrapped
+    uint64_t count = std::min<uint64_t>(header.count, header.capacity);
+    uint64_t first = header.count > header.capacity ? header.count % header.capacity : 0;
+    records.resize(count);
+    size_t size = count * sizeof(Record);
+    if (pread(fd, records.data(), size, sizeof(File_Header)) != static_cast<ssize_t>(size))
+    {
+        std::cerr << "The SPI recording '" << path << "' is truncated\n";
+        records.clear();
+        ::close(fd);
+        return false;
+    }
+    std::rotate(records.begin(), records.begin() + first, records.end());
+
+    ::close(fd);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static SPI_Recorder::Result get_response_result(SPI_Res_Packet_Header const& response, size_t transfer_size, size_t max_packet_size)
+{
+    typedef SPI_Recorder::Result Result;
+
+    SPI_Res_Packet_Header header = response;
+    header.crc = 0;
+    if (crc8(0, &header, sizeof(header)) != response.crc)
+    {
+        return Result::BAD_RESPONSE_CRC;
+    }
+    if (response.next_packet_size > max_packet_size ||
+        transfer_size < response.packet_size + sizeof(SPI_Res_Packet_Header))
+    {
+        return Result::BAD_RESPONSE;
+    }
+    return Result::OK;
+}
+
+SPI_Recorder::Record SPI_Recorder::make_record(void const* tx_data, void const* rx_data, size_t transfer_size,
+                                               std::chrono::steady_clock::time_point start_tp, std::chrono::steady_clock::time_point end_tp,
+                                               bool transfer_ok, size_t max_packet_size)
+{
+    uint8_t const* tx = reinterpret_cast<uint8_t const*>(tx_data);
+
+    Record record;
+    record.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start_tp.time_since_epoch()).count();
+    record.duration_ns = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end_tp - start_tp).count());
+    record.transfer_size = static_cast<uint16_t>(transfer_size);
+    memcpy(&record.request, tx, sizeof(record.request));
+    memcpy(&record.response, rx_data, sizeof(record.response));
+    if (sizeof(SPI_Req_Packet_Header) + record.request.packet_size + record.request.command_size <= transfer_size)
+    {
+        memcpy(record.commands, tx + sizeof(SPI_Req_Packet_Header) + record.request.packet_size, record.request.command_size);
+    }
+    record.result = transfer_ok ? get_response_result(record.response, transfer_size, max_packet_size) : Result::TRANSFER_FAILED;
+    return record;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+char const* SPI_Recorder::get_result_name(Result result)
+{
+    switch (result)
+    {
+    case Result::OK: return "ok";
+    case Result::TRANSFER_FAILED: return "transfer failed";
+    case Result::BAD_RESPONSE_CRC: return "bad response crc";
+    case Result::BAD_RESPONSE: return "bad response";
+    }
+    return "unknown";
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "../firmware/spi_comms.h"
+
+//Records SPI transactions into a ring file, to look at them after the fact or replay them (see SPI_Replay in the app).
+//The file is a header followed by a fixed number of fixed size records. Once full, the oldest records are overwritten
+// so it always has the last 'capacity' transactions.
+//The file is mapped in memory and the pages are touched when it's opened, so adding a record is a copy without syscalls
+// and what was recorded is in the file even if the process dies.
+//One thread adds records.
+class SPI_Recorder
+{
+public:
+    SPI_Recorder() = default;
+    ~SPI_Recorder();
+
+    SPI_Recorder(SPI_Recorder const&) = delete;
+    SPI_Recorder& operator=(SPI_Recorder const&) = delete;
+
+    static const size_t DEFAULT_CAPACITY = 65536; //about a minute of transfers, ~7MB
+
+    enum class Result : uint8_t
+    {
+        OK,
+        TRANSFER_FAILED,  //the SPI driver failed, the response is garbage
+        BAD_RESPONSE_CRC,
+        BAD_RESPONSE,     //invalid sizes in the response header
+    };
+
+    struct Record
+    {
+        uint64_t start_ns = 0;     //steady clock
+        uint32_t duration_ns = 0;
+        uint16_t transfer_size = 0;
+        Result result = Result::OK;
+        uint8_t reserved = 0;
+        SPI_Req_Packet_Header request = {};
+        SPI_Res_Packet_Header response = {};
+        uint8_t commands[MAX_SPI_COMMAND_SECTION_SIZE] = {}; //request.command_size bytes of request commands
+    };
+
+    //Creates or truncates the file
+    bool open(std::string const& path, size_t capacity = DEFAULT_CAPACITY);
+    void close();
+    bool is_open() const;
+
+    void add(Record const& record);
+
+    //Reads a recording, oldest record first
+    static bool load(std::string const& path, std::vector<Record>& records);
+
+    //Makes the record of a transfer from its buffers. The response is checked like the Phy does, max_packet_size is
+    // the biggest packet the module sends
+    static Record make_record(void const* tx_data, void const* rx_data, size_t transfer_size,
+                              std::chrono::steady_clock::time_point start_tp, std::chrono::steady_clock::time_point end_tp,
+                              bool transfer_ok, size_t max_packet_size);
+
+    static char const* get_result_name(Result result);
+
+private:
+    struct File_Header
+    {
+        uint32_t magic = 0;
+        uint16_t version = 0;
+        uint16_t record_size = 0;
+        uint64_t capacity = 0;
+        uint64_t count = 0; //records added so far, the newest one is at (count - 1) % capacity
+    };
+
+    int m_fd = -1;
+    void* m_map = nullptr;
+    size_t m_map_size = 0;
+    File_Header* m_header = nullptr;
+    Record* m_records = nullptr;
+    size_t m_capacity = 0;
+    uint64_t m_count = 0;
+};
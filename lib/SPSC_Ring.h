@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+//Wait-free single producer / single consumer ring.
+//The elements are constructed once and reused, so both sides work in place:
+//  producer: start_writing -> fill the element -> end_writing
+//  consumer: start_reading -> use the element -> end_reading
+//The batch versions work on several consecutive elements and publish them all at once.
+//The producer and the consumer can be different threads, but there can be only one of each.
+template<typename T>
+class SPSC_Ring
+{
+public:
+    SPSC_Ring(size_t capacity)
+    {
+        //round up to a power of 2 so indices can be masked
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        m_elements.resize(size);
+        m_mask = size - 1;
+    }
+
+    size_t capacity() const
+    {
+        return m_elements.size();
+    }
+
+    //Approximate when called from a thread that is not the producer or the consumer
+    size_t size() const
+    {
+        return m_write_index.load(std::memory_order_acquire) - m_read_index.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    bool full() const
+    {
+        return size() >= capacity();
+    }
+
+    ////////////////////////////////////////////////////////////////
+    //producer side
+
+    //Returns nullptr if the ring is full
+    T* start_writing()
+    {
+        size_t write_index = m_write_index.load(std::memory_order_relaxed);
+        if (write_index - m_read_index.load(std::memory_order_acquire) >= m_elements.size())
+        {
+            return nullptr;
+        }
+        return &m_elements[write_index & m_mask];
+    }
+    void end_writing()
+    {
+        end_writing(1);
+    }
+
+    //Returns how many elements (up to max_count) can be written. Access them with writing_element
+    size_t start_writing(size_t max_count)
+    {
+        size_t write_index = m_write_index.load(std::memory_order_relaxed);
+        size_t free_count = m_elements.size() - (write_index - m_read_index.load(std::memory_order_acquire));
+        return free_count < max_count ? free_count : max_count;
+    }
+    T& writing_element(size_t i)
+    {
+        return m_elements[(m_write_index.load(std::memory_order_relaxed) + i) & m_mask];
+    }
+    void end_writing(size_t count)
+    {
+        size_t write_index = m_write_index.load(std::memory_order_relaxed);
+        assert(write_index + count - m_read_index.load(std::memory_order_acquire) <= m_elements.size());
+        m_write_index.store(write_index + count, std::memory_order_release);
+    }
+
+    ////////////////////////////////////////////////////////////////
+    //consumer side
+
+    //Returns nullptr if the ring is empty
+    T* start_reading()
+    {
+        size_t read_index = m_read_index.load(std::memory_order_relaxed);
+        if (read_index == m_write_index.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        return &m_elements[read_index & m_mask];
+    }
+    void end_reading()
+    {
+        end_reading(1);
+    }
+
+    //Returns how many elements (up to max_count) can be read. Access them with reading_element
+    size_t start_reading(size_t max_count)
+    {
+        size_t read_index = m_read_index.load(std::memory_order_relaxed);
+        size_t count = m_write_index.load(std::memory_order_acquire) - read_index;
+        return count < max_count ? count : max_count;
+    }
+    T& reading_element(size_t i)
+    {
+        return m_elements[(m_read_index.load(std::memory_order_relaxed) + i) & m_mask];
+    }
+    void end_reading(size_t count)
+    {
+        size_t read_index = m_read_index.load(std::memory_order_relaxed);
+        assert(m_write_index.load(std::memory_order_acquire) - read_index >= count);
+        m_read_index.store(read_index + count, std::memory_order_release);
+    }
+
+private:
+    std::vector<T> m_elements;
+    size_t m_mask = 0;
+
+    //keep the indices on different cache lines so the two sides don't fight over them
+    std::atomic<size_t> m_write_index{0};
+    uint8_t m_padding[64];
+    std::atomic<size_t> m_read_index{0};
+};